@@ -101,6 +101,15 @@
 
 #define SMC_BITMAP_USE_THRESHOLD 10
 
+/* Once a page with a code bitmap has seen this many writes that do not
+ * touch any translated code, it is considered a data page: its TBs are
+ * invalidated so that it can be unprotected and written at full speed.
+ * The threshold doubles every time the same page is given up on, so that
+ * pages really mixing hot code and data are not retranslated endlessly.
+ */
+#define SMC_DATA_PAGE_THRESHOLD 64
+#define SMC_DATA_PAGE_MAX_SHIFT 10
+
 typedef struct PageDesc {
     /* list of TBs intersecting this ram page */
     uintptr_t first_tb;
@@ -109,6 +118,10 @@ typedef struct PageDesc {
        of lookups we do to a given page to use a bitmap */
     unsigned long *code_bitmap;
     unsigned int code_write_count;
+    /* writes that missed the code bitmap, and how many times the page
+       has been given up on as a data page */
+    unsigned int data_write_count;
+    unsigned int data_page_count;
 #else
     unsigned long flags;
 #endif
@@ -1182,6 +1195,7 @@ static inline void invalidate_page_bitmap(PageDesc *p)
     g_free(p->code_bitmap);
     p->code_bitmap = NULL;
     p->code_write_count = 0;
+    p->data_write_count = 0;
 #endif
 }
 
@@ -1274,6 +1288,56 @@ void tb_flush(CPUState *cpu)
     }
 }
 
+static gboolean tb_evict_iter(gpointer key, gpointer value, gpointer data)
+{
+    TranslationBlock *tb = value;
+
+    tb_phys_invalidate(tb, -1);
+    return false;
+}
+
+/*
+ * Make room in the code buffer by retiring the oldest regions: their TBs
+ * are removed from the hash table, page lists and jump lists, and the
+ * space is reused; everything else survives.  Fall back to a full flush
+ * if no region can be evicted.
+ */
+static void do_tb_evict(CPUState *cpu, run_on_cpu_data tb_evict_count)
+{
+    size_t n;
+
+    mmap_lock();
+    /* If it is already been done on request of another CPU,
+     * just retry.
+     */
+    if (tb_ctx.tb_evict_count != tb_evict_count.host_int) {
+        mmap_unlock();
+        return;
+    }
+
+    n = tcg_region_evict(tb_evict_iter, NULL);
+    if (DEBUG_TB_FLUSH_GATE) {
+        printf("qemu: evicted %zu regions, code_size=%zu nb_tbs=%zu\n",
+               n, tcg_code_size(), tcg_nb_tbs());
+    }
+    atomic_set(&tb_ctx.tb_evict_regions, tb_ctx.tb_evict_regions + n);
+    atomic_mb_set(&tb_ctx.tb_evict_count, tb_ctx.tb_evict_count + 1);
+    mmap_unlock();
+
+    if (n == 0) {
+        do_tb_flush(cpu, RUN_ON_CPU_HOST_INT(tb_ctx.tb_flush_count));
+    }
+}
+
+/* The code buffer is full: evict old translations to make room.  */
+static void tb_evict(CPUState *cpu)
+{
+    unsigned tb_evict_count = atomic_mb_read(&tb_ctx.tb_evict_count);
+
+    async_safe_run_on_cpu(cpu, do_tb_evict,
+                          RUN_ON_CPU_HOST_INT(tb_evict_count));
+}
+
 /*
  * Formerly ifdef DEBUG_TB_CHECK. These debug functions are user-mode-only,
  * so in order to prevent bit rot we compile them unconditionally in user-mode,
@@ -1449,15 +1513,16 @@ static void do_tb_phys_invalidate(TranslationBlock *tb, bool rm_from_page_list)
         return;
     }
 
-    /* remove the TB from the page list */
+    /* remove the TB from the page list.  The code bitmap is left alone:
+       the bits of a removed TB may be shared with other TBs, so they are
+       only dropped when a stale hit makes tb_invalidate_phys_page_fast
+       rebuild the bitmap.  */
     if (rm_from_page_list) {
         p = page_find(tb->page_addr[0] >> TARGET_PAGE_BITS);
         tb_page_remove(p, tb);
-        invalidate_page_bitmap(p);
         if (tb->page_addr[1] != -1) {
             p = page_find(tb->page_addr[1] >> TARGET_PAGE_BITS);
             tb_page_remove(p, tb);
-            invalidate_page_bitmap(p);
         }
     }
 
@@ -1501,30 +1566,43 @@ void tb_phys_invalidate(TranslationBlock *tb, tb_page_addr_t page_addr)
 }
 
 #ifdef CONFIG_SOFTMMU
+/* call with @p->lock held */
+static void page_bitmap_add_tb(PageDesc *p, TranslationBlock *tb,
+                               unsigned int n)
+{
+    int tb_start, tb_end;
+
+    /* NOTE: this is subtle as a TB may span two physical pages */
+    if (n == 0) {
+        /* NOTE: tb_end may be after the end of the page, but
+           it is not a problem */
+        tb_start = tb->pc & ~TARGET_PAGE_MASK;
+        tb_end = tb_start + tb->size;
+        if (tb_end > TARGET_PAGE_SIZE) {
+            tb_end = TARGET_PAGE_SIZE;
+        }
+    } else {
+        tb_start = 0;
+        tb_end = ((tb->pc + tb->size) & ~TARGET_PAGE_MASK);
+    }
+    bitmap_set(p->code_bitmap, tb_start, tb_end - tb_start);
+}
+
 /* call with @p->lock held */
 static void build_page_bitmap(PageDesc *p)
 {
-    int n, tb_start, tb_end;
     TranslationBlock *tb;
+    int n;
 
     assert_page_locked(p);
-    p->code_bitmap = bitmap_new(TARGET_PAGE_SIZE);
+    if (p->code_bitmap) {
+        bitmap_zero(p->code_bitmap, TARGET_PAGE_SIZE);
+    } else {
+        p->code_bitmap = bitmap_new(TARGET_PAGE_SIZE);
+    }
 
     PAGE_FOR_EACH_TB(p, tb, n) {
-        /* NOTE: this is subtle as a TB may span two physical pages */
-        if (n == 0) {
-            /* NOTE: tb_end may be after the end of the page, but
-               it is not a problem */
-            tb_start = tb->pc & ~TARGET_PAGE_MASK;
-            tb_end = tb_start + tb->size;
-            if (tb_end > TARGET_PAGE_SIZE) {
-                tb_end = TARGET_PAGE_SIZE;
-             }
-        } else {
-            tb_start = 0;
-            tb_end = ((tb->pc + tb->size) & ~TARGET_PAGE_MASK);
-        }
-        bitmap_set(p->code_bitmap, tb_start, tb_end - tb_start);
+        page_bitmap_add_tb(p, tb, n);
     }
 }
 #endif
@@ -1549,7 +1627,12 @@ static inline void tb_page_add(PageDesc *p, TranslationBlock *tb,
     page_already_protected = p->first_tb != (uintptr_t)NULL;
 #endif
     p->first_tb = (uintptr_t)tb | n;
-    invalidate_page_bitmap(p);
+#ifdef CONFIG_SOFTMMU
+    /* keep the bitmap instead of rebuilding it, JITs add code often */
+    if (p->code_bitmap) {
+        page_bitmap_add_tb(p, tb, n);
+    }
+#endif
 
 #if defined(CONFIG_USER_ONLY)
     if (p->flags & PAGE_WRITE) {
@@ -1603,6 +1686,10 @@ tb_link_page(TranslationBlock *tb, tb_page_addr_t phys_pc,
 {
     PageDesc *p;
     PageDesc *p2 = NULL;
+#ifdef CONFIG_PROFILER
+    TCGProfile *prof = &tcg_ctx->prof;
+    int64_t ti;
+#endif
 
     assert_memory_lock();
 
@@ -1625,7 +1712,13 @@ tb_link_page(TranslationBlock *tb, tb_page_addr_t phys_pc,
      * Note that inserting into the hash table first isn't an option, since
      * we can only insert TBs that are fully initialized.
      */
+#ifdef CONFIG_PROFILER
+    ti = profile_getclock();
+#endif
     page_lock_pair(&p, phys_pc, &p2, phys_page2, 1);
+#ifdef CONFIG_PROFILER
+    atomic_set(&prof->lock_time, prof->lock_time + profile_getclock() - ti);
+#endif
     tb_page_add(p, tb, 0, phys_pc & TARGET_PAGE_MASK);
     if (p2) {
         tb_page_add(p2, tb, 1, phys_page2);
@@ -1695,8 +1788,8 @@ TranslationBlock *tb_gen_code(CPUState *cpu,
  buffer_overflow:
     tb = tb_alloc(pc);
     if (unlikely(!tb)) {
-        /* flush must be done */
-        tb_flush(cpu);
+        /* eviction (or flush) must be done */
+        tb_evict(cpu);
         mmap_unlock();
         /* Make the execution loop process the flush as soon as possible.  */
         cpu->exception_index = EXCP_INTERRUPT;
@@ -1835,6 +1928,8 @@ TranslationBlock *tb_gen_code(CPUState *cpu,
 
         orig_aligned -= ROUND_UP(sizeof(*tb), qemu_icache_linesize);
         atomic_set(&tcg_ctx->code_gen_ptr, (void *)orig_aligned);
+        atomic_set(&tcg_ctx->tb_discard_count,
+                   tcg_ctx->tb_discard_count + 1);
         return existing_tb;
     }
     tcg_tb_insert(tb);
@@ -1845,8 +1940,10 @@ TranslationBlock *tb_gen_code(CPUState *cpu,
  * @p must be non-NULL.
  * user-mode: call with mmap_lock held.
  * !user-mode: call with all @pages locked.
+ *
+ * Returns the number of TBs invalidated.
  */
-static void
+static int
 tb_invalidate_phys_page_range__locked(struct page_collection *pages,
                                       PageDesc *p, tb_page_addr_t start,
                                       tb_page_addr_t end,
@@ -1854,7 +1951,7 @@ tb_invalidate_phys_page_range__locked(struct page_collection *pages,
 {
     TranslationBlock *tb;
     tb_page_addr_t tb_start, tb_end;
-    int n;
+    int n, count = 0;
 #ifdef TARGET_HAS_PRECISE_SMC
     CPUState *cpu = current_cpu;
     CPUArchState *env = NULL;
@@ -1915,8 +2012,12 @@ tb_invalidate_phys_page_range__locked(struct page_collection *pages,
             }
 #endif /* TARGET_HAS_PRECISE_SMC */
             tb_phys_invalidate__locked(tb);
+            count++;
         }
     }
+    if (count && is_cpu_write_access) {
+        atomic_set(&tcg_ctx->smc_hit_count, tcg_ctx->smc_hit_count + 1);
+    }
 #if !defined(CONFIG_USER_ONLY)
     /* if no code remaining, no need to continue to use slow writes */
     if (!p->first_tb) {
@@ -1933,6 +2034,7 @@ tb_invalidate_phys_page_range__locked(struct page_collection *pages,
         cpu_loop_exit_noexc(cpu);
     }
 #endif
+    return count;
 }
 
 /*
@@ -2008,6 +2110,8 @@ void tb_invalidate_phys_page_fast(struct page_collection *pages,
                                   tb_page_addr_t start, int len)
 {
     PageDesc *p;
+    unsigned int nr, shift;
+    unsigned long b;
 
     assert_memory_lock();
 
@@ -2017,22 +2121,37 @@ void tb_invalidate_phys_page_fast(struct page_collection *pages,
     }
 
     assert_page_locked(p);
+    atomic_set(&tcg_ctx->smc_write_count, tcg_ctx->smc_write_count + 1);
     if (!p->code_bitmap &&
         ++p->code_write_count >= SMC_BITMAP_USE_THRESHOLD) {
         build_page_bitmap(p);
     }
-    if (p->code_bitmap) {
-        unsigned int nr;
-        unsigned long b;
+    if (!p->code_bitmap || !p->first_tb) {
+        tb_invalidate_phys_page_range__locked(pages, p, start, start + len, 1);
+        return;
+    }
 
-        nr = start & ~TARGET_PAGE_MASK;
-        b = p->code_bitmap[BIT_WORD(nr)] >> (nr & (BITS_PER_LONG - 1));
-        if (b & ((1 << len) - 1)) {
-            goto do_invalidate;
+    nr = start & ~TARGET_PAGE_MASK;
+    b = p->code_bitmap[BIT_WORD(nr)] >> (nr & (BITS_PER_LONG - 1));
+    if (b & ((1 << len) - 1)) {
+        if (!tb_invalidate_phys_page_range__locked(pages, p, start,
+                                                   start + len, 1)) {
+            /* the bits came from TBs that have since been removed */
+            build_page_bitmap(p);
         }
-    } else {
-    do_invalidate:
-        tb_invalidate_phys_page_range__locked(pages, p, start, start + len, 1);
+        return;
+    }
+
+    shift = MIN(p->data_page_count, SMC_DATA_PAGE_MAX_SHIFT);
+    if (++p->data_write_count >= SMC_DATA_PAGE_THRESHOLD << shift) {
+        start &= TARGET_PAGE_MASK;
+        p->data_page_count++;
+        /* Not a cpu write access as far as TBs go: the write does not
+           touch any of them, so the current TB may complete.  */
+        tb_invalidate_phys_page_range__locked(pages, p, start,
+                                              start + TARGET_PAGE_SIZE, 0);
+        atomic_set(&tcg_ctx->smc_data_page_count,
+                   tcg_ctx->smc_data_page_count + 1);
     }
 }
 #else
@@ -2074,6 +2193,10 @@ static bool tb_invalidate_phys_page(tb_page_addr_t addr, uintptr_t pc)
     }
 #endif
     assert_page_locked(p);
+    atomic_set(&tcg_ctx->smc_write_count, tcg_ctx->smc_write_count + 1);
+    if (p->first_tb) {
+        atomic_set(&tcg_ctx->smc_hit_count, tcg_ctx->smc_hit_count + 1);
+    }
     PAGE_FOR_EACH_TB(p, tb, n) {
 #ifdef TARGET_HAS_PRECISE_SMC
         if (current_tb == tb &&
@@ -2291,6 +2414,7 @@ void dump_exec_info(FILE *f, fprintf_function cpu_fprintf)
     struct tb_tree_stats tst = {};
     struct qht_stats hst;
     size_t nb_tbs, flush_full, flush_part, flush_elide;
+    size_t smc_writes, smc_hits, smc_data_pages;
 
     tcg_tb_foreach(tb_tree_stats_iter, &tst);
     nb_tbs = tst.nb_tbs;
@@ -2325,7 +2449,14 @@ void dump_exec_info(FILE *f, fprintf_function cpu_fprintf)
     cpu_fprintf(f, "\nStatistics:\n");
     cpu_fprintf(f, "TB flush count      %u\n",
                 atomic_read(&tb_ctx.tb_flush_count));
+    cpu_fprintf(f, "TB evict count      %u (%zu regions)\n",
+                atomic_read(&tb_ctx.tb_evict_count),
+                atomic_read(&tb_ctx.tb_evict_regions));
     cpu_fprintf(f, "TB invalidate count %zu\n", tcg_tb_phys_invalidate_count());
+    cpu_fprintf(f, "TB discard count    %zu\n", tcg_tb_discard_count());
+    tcg_smc_counts(&smc_writes, &smc_hits, &smc_data_pages);
+    cpu_fprintf(f, "SMC writes          %zu (%zu hit code, %zu data pages)\n",
+                smc_writes, smc_hits, smc_data_pages);
 
     tlb_flush_counts(&flush_full, &flush_part, &flush_elide);
     cpu_fprintf(f, "TLB full flushes    %zu\n", flush_full);
@@ -2460,6 +2591,145 @@ void page_dump(FILE *f)
     walk_memory_regions(f, dump_region);
 }
 
+/*
+ * Index of the guest address ranges whose pages have non-zero flags, kept
+ * as a sorted array of disjoint, non-adjacent [start, last] ranges so that
+ * free space can be found without probing every page.  Lookups are a
+ * binary search; updates move at most the tail of the array, which stays
+ * small because neighbouring mappings are merged.  Protected by mmap_lock.
+ *
+ * It is only kept when the guest has a reserved address space.  Without
+ * one, guest addresses are host addresses, host mappings that are not
+ * guest pages block them too, and mmap_find_vma has to ask the host.
+ */
+typedef struct PageRange {
+    target_ulong start;
+    target_ulong last;
+} PageRange;
+
+static GArray *page_ranges;
+
+/* Return the index of the first range ending at or after @addr.  */
+static guint page_range_index(target_ulong addr)
+{
+    guint lo = 0, hi = page_ranges->len;
+
+    while (lo < hi) {
+        guint mid = lo + (hi - lo) / 2;
+
+        if (g_array_index(page_ranges, PageRange, mid).last < addr) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+static void page_range_set(target_ulong start, target_ulong last, bool used)
+{
+    PageRange pieces[2];
+    guint i, j, n = 0;
+
+    if (!page_ranges) {
+        page_ranges = g_array_new(false, false, sizeof(PageRange));
+    }
+
+    if (used) {
+        /* Merge with every range overlapping or adjacent to [start, last] */
+        i = j = page_range_index(start ? start - 1 : 0);
+        for (; j < page_ranges->len; j++) {
+            PageRange *r = &g_array_index(page_ranges, PageRange, j);
+
+            if (last != (target_ulong)-1 && r->start > last + 1) {
+                break;
+            }
+            start = MIN(start, r->start);
+            last = MAX(last, r->last);
+        }
+        pieces[n++] = (PageRange) { start, last };
+    } else {
+        /* Keep only the parts of the overlapping ranges outside the hole */
+        i = j = page_range_index(start);
+        for (; j < page_ranges->len; j++) {
+            PageRange *r = &g_array_index(page_ranges, PageRange, j);
+
+            if (r->start > last) {
+                break;
+            }
+            if (r->start < start) {
+                pieces[n++] = (PageRange) { r->start, start - 1 };
+            }
+            if (r->last > last) {
+                pieces[n++] = (PageRange) { last + 1, r->last };
+            }
+        }
+    }
+
+    if (j > i) {
+        g_array_remove_range(page_ranges, i, j - i);
+    }
+    if (n) {
+        g_array_insert_vals(page_ranges, i, pieces, n);
+    }
+}
+
+/*
+ * Return the highest address, aligned to @align, of a range of @len bytes
+ * within [@min, @max] that contains no page with non-zero flags, or -1 if
+ * there is none.  @align must be a power of 2.  Only for guests with a
+ * reserved address space; call with mmap_lock held.
+ */
+target_ulong page_find_range_empty(target_ulong min, target_ulong max,
+                                   target_ulong len, target_ulong align)
+{
+    target_ulong ceiling = max, floor, addr;
+    guint i;
+
+    assert_memory_lock();
+    assert(reserved_va);
+    if (len == 0 || min > max) {
+        return -1;
+    }
+
+    i = page_ranges ? page_range_index(max) : 0;
+    if (page_ranges && i < page_ranges->len) {
+        PageRange *r = &g_array_index(page_ranges, PageRange, i);
+
+        if (r->start <= max) {
+            if (r->start <= min) {
+                return -1;
+            }
+            ceiling = r->start - 1;
+        }
+    }
+
+    /* Walk the gaps downwards from @max; ranges[i - 1] is below ceiling */
+    for (;;) {
+        floor = min;
+        if (i > 0) {
+            PageRange *r = &g_array_index(page_ranges, PageRange, i - 1);
+
+            floor = MAX(floor, r->last + 1);
+        }
+        if (ceiling >= floor && ceiling - floor >= len - 1) {
+            addr = (ceiling - (len - 1)) & -align;
+            if (addr >= floor) {
+                return addr;
+            }
+        }
+        if (i == 0) {
+            return -1;
+        }
+        i--;
+        addr = g_array_index(page_ranges, PageRange, i).start;
+        if (addr <= min) {
+            return -1;
+        }
+        ceiling = addr - 1;
+    }
+}
+
 int page_get_flags(target_ulong address)
 {
     PageDesc *p;
@@ -2508,6 +2778,9 @@ void page_set_flags(target_ulong start, target_ulong end, int flags)
         }
         p->flags = flags;
     }
+    if (reserved_va) {
+        page_range_set(start, end - 1, flags != 0);
+    }
 }
 
 int page_check_range(target_ulong start, target_ulong len, int flags)
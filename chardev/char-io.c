@@ -23,6 +23,7 @@
  */
 #include "qemu/osdep.h"
 #include "chardev/char-io.h"
+#include "qemu/iov.h"
 
 typedef struct IOWatchPoll {
     GSource parent;
@@ -109,38 +110,61 @@ void remove_fd_in_watch(Chardev *chr)
     }
 }
 
-int io_channel_send_full(QIOChannel *ioc,
-                         const void *buf, size_t len,
-                         int *fds, size_t nfds)
+int io_channel_sendv_full(QIOChannel *ioc,
+                          const struct iovec *iov, size_t niov,
+                          int *fds, size_t nfds)
 {
+    size_t len = iov_size(iov, niov);
     size_t offset = 0;
+    struct iovec *local = NULL;
+    struct iovec *cur = (struct iovec *)iov;
+    unsigned int ncur = niov;
 
     while (offset < len) {
         ssize_t ret = 0;
-        struct iovec iov = { .iov_base = (char *)buf + offset,
-                             .iov_len = len - offset };
 
         ret = qio_channel_writev_full(
-            ioc, &iov, 1,
+            ioc, cur, ncur,
             fds, nfds, NULL);
         if (ret == QIO_CHANNEL_ERR_BLOCK) {
             if (offset) {
-                return offset;
+                break;
             }
 
+            g_free(local);
             errno = EAGAIN;
             return -1;
         } else if (ret < 0) {
+            g_free(local);
             errno = EINVAL;
             return -1;
         }
 
         offset += ret;
+        if (offset < len) {
+            /* Short write: only now take a copy of the vector to trim */
+            if (!local) {
+                local = g_memdup(cur, ncur * sizeof(*cur));
+                cur = local;
+            }
+            iov_discard_front(&cur, &ncur, ret);
+        }
     }
 
+    g_free(local);
     return offset;
 }
 
+int io_channel_send_full(QIOChannel *ioc,
+                         const void *buf, size_t len,
+                         int *fds, size_t nfds)
+{
+    struct iovec iov = { .iov_base = (char *)buf,
+                         .iov_len = len };
+
+    return io_channel_sendv_full(ioc, &iov, 1, fds, nfds);
+}
+
 int io_channel_send(QIOChannel *ioc, const void *buf, size_t len)
 {
     return io_channel_send_full(ioc, buf, len, NULL, 0);
@@ -30,6 +30,7 @@
 #include "io/net-listener.h"
 #include "qemu/error-report.h"
 #include "qemu/option.h"
+#include "qemu/iov.h"
 #include "qapi/error.h"
 #include "qapi/clone-visitor.h"
 #include "qapi/qapi-visit-sockets.h"
@@ -127,14 +128,14 @@ static int tcp_chr_read_poll(void *opaque);
 static void tcp_chr_disconnect(Chardev *chr);
 
 /* Called with chr_write_lock held.  */
-static int tcp_chr_write(Chardev *chr, const uint8_t *buf, int len)
+static int tcp_chr_writev(Chardev *chr, const struct iovec *iov, int iovcnt)
 {
     SocketChardev *s = SOCKET_CHARDEV(chr);
 
     if (s->connected) {
-        int ret =  io_channel_send_full(s->ioc, buf, len,
-                                        s->write_msgfds,
-                                        s->write_msgfds_num);
+        int ret =  io_channel_sendv_full(s->ioc, iov, iovcnt,
+                                         s->write_msgfds,
+                                         s->write_msgfds_num);
 
         /* free the written msgfds in any cases
          * other than ret < 0 && errno == EAGAIN
@@ -149,17 +150,28 @@ static int tcp_chr_write(Chardev *chr, const uint8_t *buf, int len)
         if (ret < 0 && errno != EAGAIN) {
             if (tcp_chr_read_poll(chr) <= 0) {
                 tcp_chr_disconnect(chr);
-                return len;
+                return iov_size(iov, iovcnt);
             } /* else let the read handler finish it properly */
         }
 
         return ret;
     } else {
         /* XXX: indicate an error ? */
-        return len;
+        return iov_size(iov, iovcnt);
     }
 }
 
+/* Called with chr_write_lock held.  */
+static int tcp_chr_write(Chardev *chr, const uint8_t *buf, int len)
+{
+    struct iovec iov = {
+        .iov_base = (uint8_t *)buf,
+        .iov_len = len,
+    };
+
+    return tcp_chr_writev(chr, &iov, 1);
+}
+
 static int tcp_chr_read_poll(void *opaque)
 {
     Chardev *chr = CHARDEV(opaque);
@@ -1234,6 +1246,7 @@ static void char_socket_class_init(ObjectClass *oc, void *data)
     cc->open = qmp_chardev_open_socket;
     cc->chr_wait_connected = tcp_chr_wait_connected;
     cc->chr_write = tcp_chr_write;
+    cc->chr_writev = tcp_chr_writev;
     cc->chr_sync_read = tcp_chr_sync_read;
     cc->chr_disconnect = tcp_chr_disconnect;
     cc->get_msgfds = tcp_get_msgfds;
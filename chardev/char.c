@@ -35,6 +35,7 @@
 #include "sysemu/replay.h"
 #include "qemu/help_option.h"
 #include "qemu/option.h"
+#include "qemu/iov.h"
 
 #include "chardev/char-mux.h"
 
@@ -156,6 +157,97 @@ int qemu_chr_write(Chardev *s, const uint8_t *buf, int len, bool write_all)
     return offset;
 }
 
+static void qemu_chr_writev_log(Chardev *s, const struct iovec *iov,
+                                int iovcnt, size_t len)
+{
+    int i;
+
+    for (i = 0; i < iovcnt && len; i++) {
+        size_t n = MIN(len, iov[i].iov_len);
+
+        qemu_chr_write_log(s, iov[i].iov_base, n);
+        len -= n;
+    }
+}
+
+static int qemu_chr_writev_buffer(Chardev *s,
+                                  const struct iovec *iov, int iovcnt,
+                                  size_t *offset, bool write_all)
+{
+    ChardevClass *cc = CHARDEV_GET_CLASS(s);
+    size_t len = iov_size(iov, iovcnt);
+    struct iovec *local = NULL;
+    struct iovec *cur = (struct iovec *)iov;
+    unsigned int ncur = iovcnt;
+    int res = 0;
+    *offset = 0;
+
+    qemu_mutex_lock(&s->chr_write_lock);
+    while (*offset < len) {
+        while (!cur->iov_len) {
+            cur++;
+            ncur--;
+        }
+    retry:
+        if (cc->chr_writev) {
+            res = cc->chr_writev(s, cur, ncur);
+        } else {
+            res = cc->chr_write(s, cur->iov_base, MIN(cur->iov_len, INT_MAX));
+        }
+        if (res < 0 && errno == EAGAIN && write_all) {
+            g_usleep(100);
+            goto retry;
+        }
+
+        if (res <= 0) {
+            break;
+        }
+
+        *offset += res;
+        if (!write_all) {
+            break;
+        }
+        if (*offset < len) {
+            if (!local) {
+                local = g_memdup(cur, ncur * sizeof(*cur));
+                cur = local;
+            }
+            iov_discard_front(&cur, &ncur, res);
+        }
+    }
+    if (*offset > 0) {
+        qemu_chr_writev_log(s, iov, iovcnt, *offset);
+    }
+    qemu_mutex_unlock(&s->chr_write_lock);
+    g_free(local);
+
+    return res;
+}
+
+int qemu_chr_writev(Chardev *s, const struct iovec *iov, int iovcnt,
+                    bool write_all)
+{
+    size_t offset = 0;
+    int res;
+
+    if (qemu_chr_replay(s)) {
+        /* The replay log records flat buffers */
+        size_t len = iov_size(iov, iovcnt);
+        uint8_t *buf = g_malloc(len);
+
+        iov_to_buf(iov, iovcnt, 0, buf, len);
+        res = qemu_chr_write(s, buf, len, write_all);
+        g_free(buf);
+        return res;
+    }
+
+    res = qemu_chr_writev_buffer(s, iov, iovcnt, &offset, write_all);
+    if (res < 0) {
+        return res;
+    }
+    return offset;
+}
+
 int qemu_chr_be_can_write(Chardev *s)
 {
     CharBackend *be = s->be;
@@ -175,6 +175,40 @@ qva_to_va(VuDev *dev, uint64_t qemu_addr)
     return NULL;
 }
 
+static inline
+bool has_feature(uint64_t features, unsigned int fbit)
+{
+    assert(fbit < 64);
+    return !!(features & (1ULL << fbit));
+}
+
+static inline
+bool vu_has_feature(VuDev *dev,
+                    unsigned int fbit)
+{
+    return has_feature(dev->features, fbit);
+}
+
+/* Translate our virtual address to guest physical address.  */
+static uint64_t
+va_to_gpa(VuDev *dev, void *addr)
+{
+    uint64_t va = (uintptr_t)addr;
+    int i;
+
+    /* Find matching memory region.  */
+    for (i = 0; i < dev->nregions; i++) {
+        VuDevRegion *r = &dev->regions[i];
+        uint64_t start = r->mmap_addr + r->mmap_offset;
+
+        if ((va >= start) && (va < (start + r->size))) {
+            return va - start + r->gpa;
+        }
+    }
+
+    return 0;
+}
+
 static void
 vmsg_close_fds(VhostUserMsg *vmsg)
 {
@@ -811,6 +845,11 @@ vu_set_vring_addr_exec(VuDev *dev, VhostUserMsg *vmsg)
         return false;
     }
 
+    if (vu_has_feature(dev, VIRTIO_F_RING_PACKED)) {
+        /* There is no used index in memory, it came with the vring base */
+        return false;
+    }
+
     vq->used_idx = vq->vring.used->idx;
 
     if (vq->last_avail_idx != vq->used_idx) {
@@ -829,15 +868,30 @@ vu_set_vring_addr_exec(VuDev *dev, VhostUserMsg *vmsg)
     return false;
 }
 
+/* For a packed ring, the vring base holds last_avail_idx in the low 16 bits
+ * and used_idx in the high 16 bits, each with its wrap counter in the top
+ * bit.
+ */
 static bool
 vu_set_vring_base_exec(VuDev *dev, VhostUserMsg *vmsg)
 {
     unsigned int index = vmsg->payload.state.index;
     unsigned int num = vmsg->payload.state.num;
+    VuVirtq *vq = &dev->vq[index];
 
     DPRINT("State.index: %d\n", index);
     DPRINT("State.num:   %d\n", num);
-    dev->vq[index].shadow_avail_idx = dev->vq[index].last_avail_idx = num;
+
+    if (!vu_has_feature(dev, VIRTIO_F_RING_PACKED)) {
+        vq->shadow_avail_idx = vq->last_avail_idx = num;
+        return false;
+    }
+
+    vq->shadow_avail_idx = vq->last_avail_idx = num & 0x7fff;
+    vq->last_avail_wrap_counter = !!(num & 0x8000);
+    vq->used_idx = (num >> 16) & 0x7fff;
+    vq->used_wrap_counter = !!(num & 0x80000000);
+    vq->pop_count = 0;
 
     return false;
 }
@@ -846,9 +900,15 @@ static bool
 vu_get_vring_base_exec(VuDev *dev, VhostUserMsg *vmsg)
 {
     unsigned int index = vmsg->payload.state.index;
+    VuVirtq *vq = &dev->vq[index];
 
     DPRINT("State.index: %d\n", index);
-    vmsg->payload.state.num = dev->vq[index].last_avail_idx;
+    vmsg->payload.state.num = vq->last_avail_idx;
+    if (vu_has_feature(dev, VIRTIO_F_RING_PACKED)) {
+        vmsg->payload.state.num |= vq->last_avail_wrap_counter << 15 |
+                                   vq->used_idx << 16 |
+                                   vq->used_wrap_counter << 31;
+    }
     vmsg->size = sizeof(vmsg->payload.state);
 
     dev->vq[index].started = false;
@@ -1547,6 +1607,138 @@ virtqueue_read_next_desc(VuDev *dev, struct vring_desc *desc,
     return VIRTQUEUE_READ_DESC_MORE;
 }
 
+static inline struct vring_packed_desc *
+vring_packed_desc(VuVirtq *vq)
+{
+    return (struct vring_packed_desc *)vq->vring.desc;
+}
+
+static inline bool
+is_desc_avail(uint16_t flags, bool wrap_counter)
+{
+    bool avail = !!(flags & (1 << VRING_PACKED_DESC_F_AVAIL));
+    bool used = !!(flags & (1 << VRING_PACKED_DESC_F_USED));
+
+    return avail != used && avail == wrap_counter;
+}
+
+/* Map the indirect table of a packed ring descriptor, copying it to
+ * @desc_buf if it is not contiguous in our address space.
+ */
+static struct vring_packed_desc *
+virtqueue_packed_map_indirect(VuDev *dev, struct vring_packed_desc *desc,
+                              struct vring_packed_desc *desc_buf,
+                              unsigned int *max)
+{
+    struct vring_packed_desc *table;
+    uint64_t read_len = desc->len;
+
+    if (desc->len % sizeof(struct vring_packed_desc)) {
+        vu_panic(dev, "Invalid size for indirect buffer table");
+        return NULL;
+    }
+
+    table = vu_gpa_to_va(dev, &read_len, desc->addr);
+    if (unlikely(table && read_len != desc->len)) {
+        /* Failed to use zero copy */
+        table = NULL;
+        if (!virtqueue_read_indirect_desc(dev, (struct vring_desc *)desc_buf,
+                                          desc->addr, desc->len)) {
+            table = desc_buf;
+        }
+    }
+    if (!table) {
+        vu_panic(dev, "Invalid indirect buffer table");
+        return NULL;
+    }
+
+    *max = desc->len / sizeof(struct vring_packed_desc);
+    return table;
+}
+
+static void
+vu_queue_packed_get_avail_bytes(VuDev *dev, VuVirtq *vq,
+                                unsigned int *in_bytes,
+                                unsigned int *out_bytes,
+                                unsigned max_in_bytes, unsigned max_out_bytes)
+{
+    struct vring_packed_desc desc_buf[VIRTQUEUE_MAX_SIZE];
+    unsigned int idx, total_bufs, in_total, out_total;
+    bool wrap_counter;
+
+    idx = vq->last_avail_idx;
+    wrap_counter = vq->last_avail_wrap_counter;
+    total_bufs = in_total = out_total = 0;
+
+    while (is_desc_avail(vring_packed_desc(vq)[idx].flags, wrap_counter)) {
+        struct vring_packed_desc *desc = vring_packed_desc(vq);
+        unsigned int i = idx, max = vq->vring.num, num_bufs = 0;
+        bool indirect = false;
+
+        /* Read the descriptor only after seeing its flags */
+        smp_rmb();
+
+        if (desc[i].flags & VRING_DESC_F_INDIRECT) {
+            desc = virtqueue_packed_map_indirect(dev, &desc[i], desc_buf,
+                                                 &max);
+            if (!desc) {
+                goto err;
+            }
+            indirect = true;
+            i = 0;
+        }
+
+        for (;;) {
+            uint16_t flags = desc[i].flags;
+
+            /* If we've got too many, that implies a descriptor loop. */
+            if (++num_bufs + total_bufs > vq->vring.num + indirect * max) {
+                vu_panic(dev, "Looped descriptor");
+                goto err;
+            }
+
+            if (flags & VRING_DESC_F_WRITE) {
+                in_total += desc[i].len;
+            } else {
+                out_total += desc[i].len;
+            }
+            if (in_total >= max_in_bytes && out_total >= max_out_bytes) {
+                goto done;
+            }
+
+            if (indirect) {
+                if (++i == max) {
+                    break;
+                }
+            } else {
+                if (!(flags & VRING_DESC_F_NEXT)) {
+                    break;
+                }
+                if (++i == vq->vring.num) {
+                    i = 0;
+                }
+            }
+        }
+
+        num_bufs = indirect ? 1 : num_bufs;
+        total_bufs += num_bufs;
+        idx += num_bufs;
+        if (idx >= vq->vring.num) {
+            idx -= vq->vring.num;
+            wrap_counter ^= 1;
+        }
+    }
+
+done:
+    *in_bytes = in_total;
+    *out_bytes = out_total;
+    return;
+
+err:
+    in_total = out_total = 0;
+    goto done;
+}
+
 void
 vu_queue_get_avail_bytes(VuDev *dev, VuVirtq *vq, unsigned int *in_bytes,
                          unsigned int *out_bytes,
@@ -1564,6 +1756,12 @@ vu_queue_get_avail_bytes(VuDev *dev, VuVirtq *vq, unsigned int *in_bytes,
         goto done;
     }
 
+    if (vu_has_feature(dev, VIRTIO_F_RING_PACKED)) {
+        vu_queue_packed_get_avail_bytes(dev, vq, &in_total, &out_total,
+                                        max_in_bytes, max_out_bytes);
+        goto done;
+    }
+
     while ((rc = virtqueue_num_heads(dev, vq, idx)) > 0) {
         unsigned int max, desc_len, num_bufs, indirect = 0;
         uint64_t desc_addr, read_len;
@@ -1680,6 +1878,11 @@ vu_queue_empty(VuDev *dev, VuVirtq *vq)
         return true;
     }
 
+    if (vu_has_feature(dev, VIRTIO_F_RING_PACKED)) {
+        return !is_desc_avail(vring_packed_desc(vq)[vq->last_avail_idx].flags,
+                              vq->last_avail_wrap_counter);
+    }
+
     if (vq->shadow_avail_idx != vq->last_avail_idx) {
         return false;
     }
@@ -1687,18 +1890,37 @@ vu_queue_empty(VuDev *dev, VuVirtq *vq)
     return vring_avail_idx(vq) == vq->last_avail_idx;
 }
 
-static inline
-bool has_feature(uint64_t features, unsigned int fbit)
+static bool
+vring_packed_notify(VuDev *dev, VuVirtq *vq)
 {
-    assert(fbit < 64);
-    return !!(features & (1ULL << fbit));
-}
+    struct vring_packed_desc_event *e =
+        (struct vring_packed_desc_event *)vq->vring.avail;
+    uint16_t old, new, flags, off_wrap;
+    int off;
+    bool v;
 
-static inline
-bool vu_has_feature(VuDev *dev,
-                    unsigned int fbit)
-{
-    return has_feature(dev->features, fbit);
+    flags = e->flags;
+    /* Make sure the flags are seen before off_wrap */
+    smp_rmb();
+    off_wrap = e->off_wrap;
+
+    v = vq->signalled_used_valid;
+    vq->signalled_used_valid = true;
+    old = vq->signalled_used;
+    new = vq->signalled_used = vq->used_idx;
+
+    if (flags == VRING_PACKED_EVENT_FLAG_DISABLE) {
+        return false;
+    } else if (flags == VRING_PACKED_EVENT_FLAG_ENABLE) {
+        return true;
+    }
+
+    /* Bring the event offset in the same lap as used_idx */
+    off = off_wrap & ~(1 << VRING_PACKED_EVENT_F_WRAP_CTR);
+    if (vq->used_wrap_counter != off_wrap >> VRING_PACKED_EVENT_F_WRAP_CTR) {
+        off -= vq->vring.num;
+    }
+    return !v || vring_need_event(off, new, old);
 }
 
 static bool
@@ -1716,6 +1938,10 @@ vring_notify(VuDev *dev, VuVirtq *vq)
         return true;
     }
 
+    if (vu_has_feature(dev, VIRTIO_F_RING_PACKED)) {
+        return vring_packed_notify(dev, vq);
+    }
+
     if (!vu_has_feature(dev, VIRTIO_RING_F_EVENT_IDX)) {
         return !(vring_avail_flags(vq) & VRING_AVAIL_F_NO_INTERRUPT);
     }
@@ -1775,11 +2001,32 @@ vring_set_avail_event(VuVirtq *vq, uint16_t val)
     *((uint16_t *) &vq->vring.used->ring[vq->vring.num]) = val;
 }
 
+static void
+vu_queue_packed_set_notification(VuDev *dev, VuVirtq *vq, int enable)
+{
+    struct vring_packed_desc_event *e =
+        (struct vring_packed_desc_event *)vq->vring.used;
+
+    if (!enable) {
+        e->flags = VRING_PACKED_EVENT_FLAG_DISABLE;
+    } else if (vu_has_feature(dev, VIRTIO_RING_F_EVENT_IDX)) {
+        e->off_wrap = vq->last_avail_idx |
+            vq->last_avail_wrap_counter << VRING_PACKED_EVENT_F_WRAP_CTR;
+        /* Make sure off_wrap is written before the flags */
+        smp_wmb();
+        e->flags = VRING_PACKED_EVENT_FLAG_DESC;
+    } else {
+        e->flags = VRING_PACKED_EVENT_FLAG_ENABLE;
+    }
+}
+
 void
 vu_queue_set_notification(VuDev *dev, VuVirtq *vq, int enable)
 {
     vq->notification = enable;
-    if (vu_has_feature(dev, VIRTIO_RING_F_EVENT_IDX)) {
+    if (vu_has_feature(dev, VIRTIO_F_RING_PACKED)) {
+        vu_queue_packed_set_notification(dev, vq, enable);
+    } else if (vu_has_feature(dev, VIRTIO_RING_F_EVENT_IDX)) {
         vring_set_avail_event(vq, vring_avail_idx(vq));
     } else if (enable) {
         vring_used_flags_unset_bit(vq, VRING_USED_F_NO_NOTIFY);
@@ -1853,6 +2100,110 @@ virtqueue_alloc_element(size_t sz,
     return elem;
 }
 
+static void
+vu_queue_packed_log_pop(VuVirtq *vq)
+{
+    vq->pop_log[vq->pop_count++ % vq->vring.num] = vq->last_avail_idx |
+        vq->last_avail_wrap_counter << VRING_PACKED_EVENT_F_WRAP_CTR;
+}
+
+static void *
+vu_queue_packed_pop(VuDev *dev, VuVirtq *vq, size_t sz)
+{
+    struct vring_packed_desc desc_buf[VIRTQUEUE_MAX_SIZE];
+    struct vring_packed_desc *desc;
+    struct iovec iov[VIRTQUEUE_MAX_SIZE];
+    unsigned int i, max, ndescs = 0;
+    unsigned out_num = 0, in_num = 0;
+    VuVirtqElement *elem;
+    bool indirect = false;
+    uint16_t id;
+
+    if (vu_queue_empty(dev, vq)) {
+        return NULL;
+    }
+    /* Read the descriptor only after seeing its flags */
+    smp_rmb();
+
+    if (vq->inuse >= vq->vring.num) {
+        vu_panic(dev, "Virtqueue size exceeded");
+        return NULL;
+    }
+
+    max = vq->vring.num;
+    i = vq->last_avail_idx;
+    desc = vring_packed_desc(vq);
+    id = desc[i].id;
+    if (desc[i].flags & VRING_DESC_F_INDIRECT) {
+        desc = virtqueue_packed_map_indirect(dev, &desc[i], desc_buf, &max);
+        if (!desc) {
+            return NULL;
+        }
+        indirect = true;
+        i = 0;
+    }
+
+    /* Collect all the descriptors */
+    for (;;) {
+        uint16_t flags = desc[i].flags;
+
+        if (flags & VRING_DESC_F_WRITE) {
+            virtqueue_map_desc(dev, &in_num, iov + out_num,
+                               VIRTQUEUE_MAX_SIZE - out_num, true,
+                               desc[i].addr, desc[i].len);
+        } else {
+            if (in_num) {
+                vu_panic(dev, "Incorrect order for descriptors");
+                return NULL;
+            }
+            virtqueue_map_desc(dev, &out_num, iov,
+                               VIRTQUEUE_MAX_SIZE, false,
+                               desc[i].addr, desc[i].len);
+        }
+
+        /* If we've got too many, that implies a descriptor loop. */
+        if (++ndescs > max) {
+            vu_panic(dev, "Looped descriptor");
+            return NULL;
+        }
+
+        if (indirect) {
+            if (++i == max) {
+                break;
+            }
+        } else {
+            if (!(flags & VRING_DESC_F_NEXT)) {
+                break;
+            }
+            if (++i == vq->vring.num) {
+                i = 0;
+            }
+        }
+    }
+
+    /* Now copy what we have collected and mapped */
+    elem = virtqueue_alloc_element(sz, out_num, in_num);
+    elem->index = id;
+    elem->ndescs = indirect ? 1 : ndescs;
+    for (i = 0; i < out_num; i++) {
+        elem->out_sg[i] = iov[i];
+    }
+    for (i = 0; i < in_num; i++) {
+        elem->in_sg[i] = iov[out_num + i];
+    }
+
+    vu_queue_packed_log_pop(vq);
+    vq->inuse++;
+    vq->last_avail_idx += elem->ndescs;
+    if (vq->last_avail_idx >= vq->vring.num) {
+        vq->last_avail_idx -= vq->vring.num;
+        vq->last_avail_wrap_counter ^= 1;
+    }
+    vq->shadow_avail_idx = vq->last_avail_idx;
+
+    return elem;
+}
+
 void *
 vu_queue_pop(VuDev *dev, VuVirtq *vq, size_t sz)
 {
@@ -1870,6 +2221,10 @@ vu_queue_pop(VuDev *dev, VuVirtq *vq, size_t sz)
         return NULL;
     }
 
+    if (vu_has_feature(dev, VIRTIO_F_RING_PACKED)) {
+        return vu_queue_packed_pop(dev, vq, sz);
+    }
+
     if (vu_queue_empty(dev, vq)) {
         return NULL;
     }
@@ -1953,6 +2308,7 @@ vu_queue_pop(VuDev *dev, VuVirtq *vq, size_t sz)
     /* Now copy what we have collected and mapped */
     elem = virtqueue_alloc_element(sz, out_num, in_num);
     elem->index = head;
+    elem->ndescs = 1;
     for (i = 0; i < out_num; i++) {
         elem->out_sg[i] = iov[i];
     }
@@ -1971,7 +2327,17 @@ vu_queue_rewind(VuDev *dev, VuVirtq *vq, unsigned int num)
     if (num > vq->inuse) {
         return false;
     }
-    vq->last_avail_idx -= num;
+    if (vu_has_feature(dev, VIRTIO_F_RING_PACKED)) {
+        uint16_t pos;
+
+        vq->pop_count -= num;
+        pos = vq->pop_log[vq->pop_count % vq->vring.num];
+        vq->last_avail_idx = pos & ~(1 << VRING_PACKED_EVENT_F_WRAP_CTR);
+        vq->last_avail_wrap_counter = pos >> VRING_PACKED_EVENT_F_WRAP_CTR;
+        vq->shadow_avail_idx = vq->last_avail_idx;
+    } else {
+        vq->last_avail_idx -= num;
+    }
     vq->inuse -= num;
     return true;
 }
@@ -2047,6 +2413,73 @@ vu_log_queue_fill(VuDev *dev, VuVirtq *vq,
               == VIRTQUEUE_READ_DESC_MORE));
 }
 
+/* The descriptors are gone once the buffer is popped from a packed ring,
+ * log the guest pages through the mapped buffers instead.
+ */
+static void
+vu_log_queue_packed_fill(VuDev *dev, const VuVirtqElement *elem,
+                         unsigned int len)
+{
+    unsigned int i, min;
+
+    if (!(dev->features & (1ULL << VHOST_F_LOG_ALL)) || !dev->log_table) {
+        return;
+    }
+
+    for (i = 0; i < elem->in_num && len > 0; i++) {
+        min = MIN(elem->in_sg[i].iov_len, (size_t)len);
+        vu_log_write(dev, va_to_gpa(dev, elem->in_sg[i].iov_base), min);
+        len -= min;
+    }
+}
+
+static void
+vring_packed_used_write(VuDev *dev, VuVirtq *vq,
+                        const struct vring_packed_desc *uelem,
+                        unsigned int offset)
+{
+    unsigned int head = vq->used_idx + offset;
+    bool wrap_counter = vq->used_wrap_counter;
+    struct vring_packed_desc *desc;
+
+    if (head >= vq->vring.num) {
+        head -= vq->vring.num;
+        wrap_counter ^= 1;
+    }
+
+    desc = &vring_packed_desc(vq)[head];
+    desc->id = uelem->id;
+    desc->len = uelem->len;
+    /* The flags hand the descriptor over to the driver, write them last */
+    smp_wmb();
+    desc->flags = wrap_counter ? (1 << VRING_PACKED_DESC_F_AVAIL) |
+                                 (1 << VRING_PACKED_DESC_F_USED) : 0;
+    vu_log_write(dev, va_to_gpa(dev, desc), sizeof(*desc));
+}
+
+/* The first used descriptor of a batch is written by vu_queue_flush(), so
+ * that the driver sees the whole batch at once.
+ */
+static void
+vu_queue_packed_fill(VuDev *dev, VuVirtq *vq, const VuVirtqElement *elem,
+                     unsigned int len, unsigned int idx)
+{
+    struct vring_packed_desc uelem = {
+        .id = elem->index,
+        .len = len,
+    };
+
+    vu_log_queue_packed_fill(dev, elem, len);
+
+    if (idx == 0) {
+        vq->first_used = uelem;
+        vq->fill_ndescs = 0;
+    } else {
+        vring_packed_used_write(dev, vq, &uelem, vq->fill_ndescs);
+    }
+    vq->fill_ndescs += elem->ndescs;
+}
+
 void
 vu_queue_fill(VuDev *dev, VuVirtq *vq,
               const VuVirtqElement *elem,
@@ -2059,6 +2492,11 @@ vu_queue_fill(VuDev *dev, VuVirtq *vq,
         return;
     }
 
+    if (vu_has_feature(dev, VIRTIO_F_RING_PACKED)) {
+        vu_queue_packed_fill(dev, vq, elem, len, idx);
+        return;
+    }
+
     vu_log_queue_fill(dev, vq, elem, len);
 
     idx = (idx + vq->used_idx) % vq->vring.num;
@@ -2089,6 +2527,20 @@ vu_queue_flush(VuDev *dev, VuVirtq *vq, unsigned int count)
         return;
     }
 
+    if (vu_has_feature(dev, VIRTIO_F_RING_PACKED)) {
+        if (!count) {
+            return;
+        }
+        vring_packed_used_write(dev, vq, &vq->first_used, 0);
+        vq->inuse -= count;
+        vq->used_idx += vq->fill_ndescs;
+        if (vq->used_idx >= vq->vring.num) {
+            vq->used_idx -= vq->vring.num;
+            vq->used_wrap_counter ^= 1;
+        }
+        return;
+    }
+
     /* Make sure buffer is written before we update index. */
     smp_wmb();
 
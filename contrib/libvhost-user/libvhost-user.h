@@ -227,6 +227,9 @@ typedef void (*vu_queue_handler_cb) (VuDev *dev, int qidx);
 
 typedef struct VuRing {
     unsigned int num;
+    /* With VIRTIO_F_RING_PACKED, desc points to struct vring_packed_desc
+     * and avail/used to the driver/device struct vring_packed_desc_event.
+     */
     struct vring_desc *desc;
     struct vring_avail *avail;
     struct vring_used *used;
@@ -239,11 +242,25 @@ typedef struct VuVirtq {
 
     /* Next head to pop */
     uint16_t last_avail_idx;
+    bool last_avail_wrap_counter;
 
     /* Last avail_idx read from VQ. */
     uint16_t shadow_avail_idx;
 
     uint16_t used_idx;
+    bool used_wrap_counter;
+
+    /* Packed ring: first buffer of the batch being filled, which is only
+     * made visible by vu_queue_flush(), and the descriptors of the batch.
+     */
+    struct vring_packed_desc first_used;
+    unsigned int fill_ndescs;
+
+    /* Packed ring: position before each of the last pops, with the wrap
+     * counter in the top bit, for vu_queue_rewind().
+     */
+    uint16_t pop_log[VIRTQUEUE_MAX_SIZE];
+    unsigned int pop_count;
 
     /* Last used index value we have signalled on */
     uint16_t signalled_used;
@@ -311,6 +328,8 @@ struct VuDev {
 
 typedef struct VuVirtqElement {
     unsigned int index;
+    /* Number of descriptors the buffer took in a packed ring */
+    unsigned int ndescs;
     unsigned int out_num;
     unsigned int in_num;
     struct iovec *in_sg;
@@ -480,7 +499,8 @@ bool vu_queue_rewind(VuDev *dev, VuVirtq *vq, unsigned int num);
  * @len: length in bytes to write
  * @idx: optional offset for the used ring index (0 in general)
  *
- * Fill the used ring with @elem element.
+ * Fill the used ring with @elem element.  With a packed ring, the elements
+ * of a batch must be filled in increasing @idx order.
  */
 void vu_queue_fill(VuDev *dev, VuVirtq *vq,
                    const VuVirtqElement *elem,
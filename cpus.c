@@ -49,6 +49,7 @@
 #include "qemu/option.h"
 #include "qemu/bitmap.h"
 #include "qemu/seqlock.h"
+#include "qemu/stats64.h"
 #include "tcg.h"
 #include "hw/nmi.h"
 #include "sysemu/replay.h"
@@ -1828,6 +1829,11 @@ bool qemu_in_vcpu_thread(void)
 
 static __thread bool iothread_locked = false;
 
+/* BQL acquisitions, and how many of them had to wait for the lock */
+static Stat64 bql_acquired;
+static Stat64 bql_contended;
+static Stat64 bql_wait_ns;
+
 bool qemu_mutex_iothread_locked(void)
 {
     return iothread_locked;
@@ -1842,15 +1848,28 @@ void qemu_mutex_lock_iothread_impl(const char *file, int line)
     QemuMutexLockFunc bql_lock = atomic_read(&qemu_bql_mutex_lock_func);
 
     g_assert(!qemu_mutex_iothread_locked());
-    bql_lock(&qemu_global_mutex, file, line);
+    /* The sync profiler wants to see every acquisition, so only try the
+     * uncontended fast path when it is not enabled.
+     */
+    if (bql_lock != qemu_mutex_lock_impl ||
+        qemu_mutex_trylock_impl(&qemu_global_mutex, file, line)) {
+        int64_t t0 = get_clock();
+
+        bql_lock(&qemu_global_mutex, file, line);
+        stat64_add(&bql_contended, 1);
+        stat64_add(&bql_wait_ns, get_clock() - t0);
+    }
+    stat64_add(&bql_acquired, 1);
     iothread_locked = true;
 }
 
 void qemu_mutex_unlock_iothread(void)
 {
+    QemuMutexUnlockFunc bql_unlock = atomic_read(&qemu_bql_mutex_unlock_func);
+
     g_assert(qemu_mutex_iothread_locked());
     iothread_locked = false;
-    qemu_mutex_unlock(&qemu_global_mutex);
+    bql_unlock(&qemu_global_mutex, __FILE__, __LINE__);
 }
 
 static bool all_vcpus_paused(void)
@@ -2448,6 +2467,21 @@ void qmp_inject_nmi(Error **errp)
     nmi_monitor_handle(monitor_get_cpu_index(), errp);
 }
 
+void dump_bql_info(FILE *f, fprintf_function cpu_fprintf)
+{
+    uint64_t acquired = stat64_get(&bql_acquired);
+    uint64_t contended = stat64_get(&bql_contended);
+    uint64_t wait_ns = stat64_get(&bql_wait_ns);
+
+    cpu_fprintf(f, "BQL acquisitions    %" PRIu64 "\n", acquired);
+    cpu_fprintf(f, "Contended           %" PRIu64 " (%.1f%%)%s\n", contended,
+                acquired ? (double)contended * 100 / acquired : 0,
+                qsp_is_enabled() ? " [all, sync profiling enabled]" : "");
+    cpu_fprintf(f, "Total wait time     %" PRIu64 " us\n", wait_ns / SCALE_US);
+    cpu_fprintf(f, "Avg wait time       %" PRIu64 " ns\n",
+                contended ? wait_ns / contended : 0);
+}
+
 void dump_drift_info(FILE *f, fprintf_function cpu_fprintf)
 {
     if (!use_icount) {
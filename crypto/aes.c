@@ -1651,3 +1651,72 @@ void AES_cbc_encrypt(const unsigned char *in, unsigned char *out,
 		}
 	}
 }
+
+bool aes_host_accel;
+
+#ifdef CONFIG_HOST_CRYPTO_OPT
+#include "qemu/cpuid.h"
+
+#pragma GCC push_options
+#pragma GCC target("sse2,aes")
+#include <wmmintrin.h>
+
+void aes_host_enc_round(void *out, const void *st, const void *rk, bool last)
+{
+    __m128i s = _mm_loadu_si128(st);
+    __m128i k = _mm_loadu_si128(rk);
+
+    s = last ? _mm_aesenclast_si128(s, k) : _mm_aesenc_si128(s, k);
+    _mm_storeu_si128(out, s);
+}
+
+void aes_host_dec_round(void *out, const void *st, const void *rk, bool last)
+{
+    __m128i s = _mm_loadu_si128(st);
+    __m128i k = _mm_loadu_si128(rk);
+
+    s = last ? _mm_aesdeclast_si128(s, k) : _mm_aesdec_si128(s, k);
+    _mm_storeu_si128(out, s);
+}
+
+void aes_host_mixcolumns(void *out, const void *in, bool inv)
+{
+    __m128i s = _mm_loadu_si128(in);
+    __m128i z = _mm_setzero_si128();
+
+    if (inv) {
+        s = _mm_aesimc_si128(s);
+    } else {
+        /* There is no bare MixColumns instruction: undo ShiftRows and
+           SubBytes with AESDECLAST so that AESENC only leaves MixColumns.  */
+        s = _mm_aesenc_si128(_mm_aesdeclast_si128(s, z), z);
+    }
+    _mm_storeu_si128(out, s);
+}
+
+#pragma GCC pop_options
+
+static void __attribute__((constructor)) aes_host_init(void)
+{
+    unsigned a, b, c, d;
+
+    if (__get_cpuid(1, &a, &b, &c, &d) && (c & bit_AES)) {
+        aes_host_accel = true;
+    }
+}
+#else
+void aes_host_enc_round(void *out, const void *st, const void *rk, bool last)
+{
+    abort();
+}
+
+void aes_host_dec_round(void *out, const void *st, const void *rk, bool last)
+{
+    abort();
+}
+
+void aes_host_mixcolumns(void *out, const void *in, bool inv)
+{
+    abort();
+}
+#endif /* CONFIG_HOST_CRYPTO_OPT */
@@ -170,7 +170,8 @@ typedef struct PhysPageMap {
 } PhysPageMap;
 
 struct AddressSpaceDispatch {
-    MemoryRegionSection *mru_section;
+    /* Distinguishes this dispatch from earlier ones at the same address */
+    unsigned gen;
     /* This is a multi-level map on the physical address space.
      * The bottom level has pointers to MemoryRegionSections.
      */
@@ -382,18 +383,70 @@ static MemoryRegionSection *phys_page_find(AddressSpaceDispatch *d, hwaddr addr)
     }
 }
 
+/* Each thread remembers the sections it used last, so that repeated
+ * accesses to the same few regions (device registers being polled,
+ * DMA to a buffer) skip the walk in phys_page_find.  Being per-thread,
+ * the cache needs no atomics and vCPUs do not evict each other's entries.
+ * An entry is valid only while its dispatch is: the generation check
+ * catches a new dispatch allocated at the address of a freed one.
+ */
+#define DISPATCH_MRU_SIZE 4
+
+typedef struct DispatchMRUEntry {
+    AddressSpaceDispatch *d;
+    unsigned gen;
+    MemoryRegionSection *section;
+} DispatchMRUEntry;
+
+static __thread DispatchMRUEntry dispatch_mru[DISPATCH_MRU_SIZE];
+static unsigned dispatch_gen;
+
+static MemoryRegionSection *dispatch_mru_find(AddressSpaceDispatch *d,
+                                              hwaddr addr)
+{
+    DispatchMRUEntry hit;
+    int i;
+
+    for (i = 0; i < DISPATCH_MRU_SIZE; i++) {
+        DispatchMRUEntry *e = &dispatch_mru[i];
+
+        if (e->d == d && e->gen == d->gen &&
+            section_covers_addr(e->section, addr)) {
+            if (i) {
+                hit = *e;
+                memmove(&dispatch_mru[1], &dispatch_mru[0], i * sizeof(hit));
+                dispatch_mru[0] = hit;
+            }
+            return dispatch_mru[0].section;
+        }
+    }
+    return NULL;
+}
+
+static void dispatch_mru_add(AddressSpaceDispatch *d,
+                             MemoryRegionSection *section)
+{
+    memmove(&dispatch_mru[1], &dispatch_mru[0],
+            (DISPATCH_MRU_SIZE - 1) * sizeof(DispatchMRUEntry));
+    dispatch_mru[0] = (DispatchMRUEntry) {
+        .d = d, .gen = d->gen, .section = section,
+    };
+}
+
 /* Called from RCU critical section */
 static MemoryRegionSection *address_space_lookup_region(AddressSpaceDispatch *d,
                                                         hwaddr addr,
                                                         bool resolve_subpage)
 {
-    MemoryRegionSection *section = atomic_read(&d->mru_section);
+    MemoryRegionSection *section = dispatch_mru_find(d, addr);
     subpage_t *subpage;
 
-    if (!section || section == &d->map.sections[PHYS_SECTION_UNASSIGNED] ||
-        !section_covers_addr(section, addr)) {
+    if (!section) {
         section = phys_page_find(d, addr);
-        atomic_set(&d->mru_section, section);
+        /* The unassigned section covers everything, never cache it */
+        if (section != &d->map.sections[PHYS_SECTION_UNASSIGNED]) {
+            dispatch_mru_add(d, section);
+        }
     }
     if (resolve_subpage && section->mr->subpage) {
         subpage = container_of(section->mr, subpage_t, iomem);
@@ -3032,6 +3085,8 @@ AddressSpaceDispatch *address_space_dispatch_new(FlatView *fv)
     AddressSpaceDispatch *d = g_new0(AddressSpaceDispatch, 1);
     uint16_t n;
 
+    d->gen = atomic_fetch_inc(&dispatch_gen) + 1;
+
     n = dummy_section(&d->map, fv, &io_mem_unassigned);
     assert(n == PHYS_SECTION_UNASSIGNED);
     n = dummy_section(&d->map, fv, &io_mem_notdirty);
@@ -3448,53 +3503,55 @@ void cpu_flush_icache_range(hwaddr start, int len)
                                            start, NULL, len, FLUSH_CACHE);
 }
 
-typedef struct {
+/* Bounce buffers are allocated on demand, and the total size of those in
+ * use at any time is limited by the address space's max_bounce_buffer_size.
+ * The data follows the header, aligned so that it can be used for O_DIRECT.
+ */
+#define BOUNCE_BUFFER_ALIGN     4096
+
+typedef struct BounceBuffer {
     MemoryRegion *mr;
-    void *buffer;
     hwaddr addr;
-    hwaddr len;
-    bool in_use;
+    size_t len;
+    QLIST_ENTRY(BounceBuffer) link;
+    uint8_t buffer[] QEMU_ALIGNED(BOUNCE_BUFFER_ALIGN);
 } BounceBuffer;
 
-static BounceBuffer bounce;
-
 typedef struct MapClient {
     QEMUBH *bh;
     QLIST_ENTRY(MapClient) link;
 } MapClient;
 
-QemuMutex map_client_list_lock;
-static QLIST_HEAD(map_client_list, MapClient) map_client_list
-    = QLIST_HEAD_INITIALIZER(map_client_list);
-
-static void cpu_unregister_map_client_do(MapClient *client)
+static void address_space_unregister_map_client_do(MapClient *client)
 {
     QLIST_REMOVE(client, link);
     g_free(client);
 }
 
-static void cpu_notify_map_clients_locked(void)
+static void address_space_notify_map_clients_locked(AddressSpace *as)
 {
     MapClient *client;
 
-    while (!QLIST_EMPTY(&map_client_list)) {
-        client = QLIST_FIRST(&map_client_list);
+    while (!QLIST_EMPTY(&as->map_client_list)) {
+        client = QLIST_FIRST(&as->map_client_list);
         qemu_bh_schedule(client->bh);
-        cpu_unregister_map_client_do(client);
+        address_space_unregister_map_client_do(client);
     }
 }
 
-void cpu_register_map_client(QEMUBH *bh)
+void address_space_register_map_client(AddressSpace *as, QEMUBH *bh)
 {
     MapClient *client = g_malloc(sizeof(*client));
 
-    qemu_mutex_lock(&map_client_list_lock);
+    qemu_mutex_lock(&as->map_client_list_lock);
     client->bh = bh;
-    QLIST_INSERT_HEAD(&map_client_list, client, link);
-    if (!atomic_read(&bounce.in_use)) {
-        cpu_notify_map_clients_locked();
+    QLIST_INSERT_HEAD(&as->map_client_list, client, link);
+    /* Write map_client_list before reading bounce_buffer_size.  */
+    smp_mb();
+    if (atomic_read(&as->bounce_buffer_size) < as->max_bounce_buffer_size) {
+        address_space_notify_map_clients_locked(as);
     }
-    qemu_mutex_unlock(&map_client_list_lock);
+    qemu_mutex_unlock(&as->map_client_list_lock);
 }
 
 void cpu_exec_init_all(void)
@@ -3510,28 +3567,27 @@ void cpu_exec_init_all(void)
     finalize_target_page_bits();
     io_mem_init();
     memory_map_init();
-    qemu_mutex_init(&map_client_list_lock);
 }
 
-void cpu_unregister_map_client(QEMUBH *bh)
+void address_space_unregister_map_client(AddressSpace *as, QEMUBH *bh)
 {
     MapClient *client;
 
-    qemu_mutex_lock(&map_client_list_lock);
-    QLIST_FOREACH(client, &map_client_list, link) {
+    qemu_mutex_lock(&as->map_client_list_lock);
+    QLIST_FOREACH(client, &as->map_client_list, link) {
         if (client->bh == bh) {
-            cpu_unregister_map_client_do(client);
+            address_space_unregister_map_client_do(client);
             break;
         }
     }
-    qemu_mutex_unlock(&map_client_list_lock);
+    qemu_mutex_unlock(&as->map_client_list_lock);
 }
 
-static void cpu_notify_map_clients(void)
+static void address_space_notify_map_clients(AddressSpace *as)
 {
-    qemu_mutex_lock(&map_client_list_lock);
-    cpu_notify_map_clients_locked();
-    qemu_mutex_unlock(&map_client_list_lock);
+    qemu_mutex_lock(&as->map_client_list_lock);
+    address_space_notify_map_clients_locked(as);
+    qemu_mutex_unlock(&as->map_client_list_lock);
 }
 
 static bool flatview_access_valid(FlatView *fv, hwaddr addr, int len,
@@ -3601,8 +3657,8 @@ flatview_extend_translation(FlatView *fv, hwaddr addr,
  * May map a subset of the requested range, given by and returned in *plen.
  * May return NULL if resources needed to perform the mapping are exhausted.
  * Use only for reads OR writes - not for read-modify-write operations.
- * Use cpu_register_map_client() to know when retrying the map operation is
- * likely to succeed.
+ * Use address_space_register_map_client() to know when retrying the map
+ * operation is likely to succeed.
  */
 void *address_space_map(AddressSpace *as,
                         hwaddr addr,
@@ -3626,29 +3682,51 @@ void *address_space_map(AddressSpace *as,
     mr = flatview_translate(fv, addr, &xlat, &l, is_write, attrs);
 
     if (!memory_access_is_direct(mr, is_write)) {
-        if (atomic_xchg(&bounce.in_use, true)) {
-            rcu_read_unlock();
-            return NULL;
+        size_t used = atomic_read(&as->bounce_buffer_size);
+        BounceBuffer *bounce;
+
+        /* Reserve space for the buffer, trimming the request to whatever
+         * is left under the cap.  Avoid unbounded allocations by never
+         * bouncing more than the cap in one go.
+         */
+        for (;;) {
+            hwaddr alloc = MIN(as->max_bounce_buffer_size - used, l);
+            size_t old;
+
+            if (alloc == 0) {
+                stat64_add(&as->bounce_retry_count, 1);
+                rcu_read_unlock();
+                return NULL;
+            }
+            old = atomic_cmpxchg(&as->bounce_buffer_size, used, used + alloc);
+            if (old == used) {
+                l = alloc;
+                break;
+            }
+            used = old;
         }
-        /* Avoid unbounded allocations */
-        l = MIN(l, TARGET_PAGE_SIZE);
-        bounce.buffer = qemu_memalign(TARGET_PAGE_SIZE, l);
-        bounce.addr = addr;
-        bounce.len = l;
+        stat64_add(&as->bounce_map_count, 1);
+
+        bounce = qemu_memalign(BOUNCE_BUFFER_ALIGN, sizeof(*bounce) + l);
+        bounce->addr = addr;
+        bounce->len = l;
 
         memory_region_ref(mr);
-        bounce.mr = mr;
+        bounce->mr = mr;
         if (!is_write) {
             flatview_read(fv, addr, MEMTXATTRS_UNSPECIFIED,
-                               bounce.buffer, l);
+                          bounce->buffer, l);
         }
 
+        qemu_mutex_lock(&as->bounce_buffer_lock);
+        QLIST_INSERT_HEAD(&as->bounce_buffers, bounce, link);
+        qemu_mutex_unlock(&as->bounce_buffer_lock);
+
         rcu_read_unlock();
         *plen = l;
-        return bounce.buffer;
+        return bounce->buffer;
     }
 
-
     memory_region_ref(mr);
     *plen = flatview_extend_translation(fv, addr, len, mr, xlat,
                                         l, is_write, attrs);
@@ -3665,10 +3743,22 @@ void *address_space_map(AddressSpace *as,
 void address_space_unmap(AddressSpace *as, void *buffer, hwaddr len,
                          int is_write, hwaddr access_len)
 {
-    if (buffer != bounce.buffer) {
-        MemoryRegion *mr;
-        ram_addr_t addr1;
+    BounceBuffer *bounce = NULL;
+    MemoryRegion *mr;
+    ram_addr_t addr1;
+
+    if (atomic_read(&as->bounce_buffer_size)) {
+        qemu_mutex_lock(&as->bounce_buffer_lock);
+        QLIST_FOREACH(bounce, &as->bounce_buffers, link) {
+            if (bounce->buffer == buffer) {
+                QLIST_REMOVE(bounce, link);
+                break;
+            }
+        }
+        qemu_mutex_unlock(&as->bounce_buffer_lock);
+    }
 
+    if (!bounce) {
         mr = memory_region_from_host(buffer, &addr1);
         assert(mr != NULL);
         if (is_write) {
@@ -3680,15 +3770,17 @@ void address_space_unmap(AddressSpace *as, void *buffer, hwaddr len,
         memory_region_unref(mr);
         return;
     }
+
     if (is_write) {
-        address_space_write(as, bounce.addr, MEMTXATTRS_UNSPECIFIED,
-                            bounce.buffer, access_len);
+        address_space_write(as, bounce->addr, MEMTXATTRS_UNSPECIFIED,
+                            bounce->buffer, access_len);
     }
-    qemu_vfree(bounce.buffer);
-    bounce.buffer = NULL;
-    memory_region_unref(bounce.mr);
-    atomic_mb_set(&bounce.in_use, false);
-    cpu_notify_map_clients();
+    memory_region_unref(bounce->mr);
+    /* Write bounce_buffer_size before reading map_client_list.  */
+    atomic_sub(&as->bounce_buffer_size, bounce->len);
+    smp_mb();
+    qemu_vfree(bounce);
+    address_space_notify_map_clients(as);
 }
 
 void *cpu_physical_memory_map(hwaddr addr,
@@ -4122,14 +4214,13 @@ void mtree_print_dispatch(fprintf_function mon, void *f,
         const char *names[] = { " [unassigned]", " [not dirty]",
                                 " [ROM]", " [watch]" };
 
-        mon(f, "      #%d @" TARGET_FMT_plx ".." TARGET_FMT_plx " %s%s%s%s%s",
+        mon(f, "      #%d @" TARGET_FMT_plx ".." TARGET_FMT_plx " %s%s%s%s",
             i,
             s->offset_within_address_space,
             s->offset_within_address_space + MR_SIZE(s->mr->size),
             s->mr->name ? s->mr->name : "(noname)",
             i < ARRAY_SIZE(names) ? names[i] : "",
             s->mr == root ? " [ROOT]" : "",
-            s == d->mru_section ? " [MRU]" : "",
             s->mr->is_iommu ? " [iommu]" : "");
 
         if (s->mr->alias) {
@@ -301,24 +301,42 @@ ETEXI
 
     {
         .name       = "sync-profile",
-        .args_type  = "mean:-m,no_coalesce:-n,max:i?",
-        .params     = "[-m] [-n] [max]",
+        .args_type  = "mean:-m,hold:-t,no_coalesce:-n,max:i?",
+        .params     = "[-m] [-t] [-n] [max]",
         .help       = "show synchronization profiling info, up to max entries "
                       "(default: 10), sorted by total wait time. (-m: sort by "
-                      "mean wait time; -n: do not coalesce objects with the "
-                      "same call site)",
+                      "mean wait time; -t: sort by total hold time; -n: do "
+                      "not coalesce objects with the same call site)",
         .cmd        = hmp_info_sync_profile,
     },
 
 STEXI
-@item info sync-profile [-m|-n] [@var{max}]
+@item info sync-profile [-m|-t|-n] [@var{max}]
 @findex info sync-profile
 Show synchronization profiling info, up to @var{max} entries (default: 10),
 sorted by total wait time.
         -m: sort by mean wait time
+        -t: sort by total hold time
         -n: do not coalesce objects with the same call site
 When different objects that share the same call site are coalesced, the "Object"
 field shows---enclosed in brackets---the number of objects being coalesced.
+Hold times are only tracked for the BQL and recursive mutexes (i.e. AioContext
+locks); they are attributed to the call site that acquired the lock.
+ETEXI
+
+    {
+        .name       = "bql",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show contention statistics for the global mutex",
+        .cmd        = hmp_info_bql,
+    },
+
+STEXI
+@item info bql
+@findex info bql
+Show how often the global mutex (BQL) was taken, how often it had to be
+waited for and the total time spent waiting.
 ETEXI
 
     {
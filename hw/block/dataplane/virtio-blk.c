@@ -42,6 +42,7 @@ struct VirtIOBlockDataPlane {
      */
     IOThread *iothread;
     AioContext *ctx;
+    VirtIONotifyGroup *notify_group; /* shared host notifier, if any */
 };
 
 /* Raise an interrupt to signal guest, if necessary */
@@ -164,6 +165,38 @@ static bool virtio_blk_data_plane_handle_output(VirtIODevice *vdev,
     return virtio_blk_handle_vq(s, vq);
 }
 
+/* Let all queues share a single host notifier */
+static void virtio_blk_data_plane_join_notify_group(VirtIOBlockDataPlane *s)
+{
+    unsigned i;
+
+    s->notify_group = virtio_notify_group_new(s->vdev);
+    if (!s->notify_group) {
+        return;
+    }
+    for (i = 0; i < s->conf->num_queues; i++) {
+        VirtQueue *vq = virtio_get_queue(s->vdev, i);
+
+        virtio_queue_set_notify_group(vq, s->notify_group);
+    }
+}
+
+static void virtio_blk_data_plane_leave_notify_group(VirtIOBlockDataPlane *s)
+{
+    unsigned i;
+
+    if (!s->notify_group) {
+        return;
+    }
+    for (i = 0; i < s->conf->num_queues; i++) {
+        VirtQueue *vq = virtio_get_queue(s->vdev, i);
+
+        virtio_queue_set_notify_group(vq, NULL);
+    }
+    virtio_notify_group_free(s->notify_group);
+    s->notify_group = NULL;
+}
+
 /* Context: QEMU global mutex held */
 int virtio_blk_data_plane_start(VirtIODevice *vdev)
 {
@@ -195,6 +228,10 @@ int virtio_blk_data_plane_start(VirtIODevice *vdev)
         goto fail_guest_notifiers;
     }
 
+    if (s->conf->notify_group && nvqs > 1) {
+        virtio_blk_data_plane_join_notify_group(s);
+    }
+
     /* Set up virtqueue notify */
     for (i = 0; i < nvqs; i++) {
         r = virtio_bus_set_host_notifier(VIRTIO_BUS(qbus), i, true);
@@ -233,6 +270,7 @@ int virtio_blk_data_plane_start(VirtIODevice *vdev)
     return 0;
 
   fail_guest_notifiers:
+    virtio_blk_data_plane_leave_notify_group(s);
     vblk->dataplane_disabled = true;
     s->starting = false;
     vblk->dataplane_started = true;
@@ -290,6 +328,7 @@ void virtio_blk_data_plane_stop(VirtIODevice *vdev)
         virtio_bus_set_host_notifier(VIRTIO_BUS(qbus), i, false);
         virtio_bus_cleanup_host_notifier(VIRTIO_BUS(qbus), i);
     }
+    virtio_blk_data_plane_leave_notify_group(s);
 
     /* Clean up guest notifier (irq) */
     k->set_guest_notifiers(qbus->parent, nvqs, false);
@@ -72,11 +72,13 @@ static int nvme_check_cqid(NvmeCtrl *n, uint16_t cqid)
 
 static void nvme_inc_cq_tail(NvmeCQueue *cq)
 {
-    cq->tail++;
-    if (cq->tail >= cq->size) {
-        cq->tail = 0;
+    uint32_t tail = cq->tail + 1;
+
+    if (tail >= cq->size) {
+        tail = 0;
         cq->phase = !cq->phase;
     }
+    atomic_set(&cq->tail, tail);
 }
 
 static void nvme_inc_sq_head(NvmeSQueue *sq)
@@ -84,14 +86,17 @@ static void nvme_inc_sq_head(NvmeSQueue *sq)
     sq->head = (sq->head + 1) % sq->size;
 }
 
+/* The doorbells update cq->head and sq->tail without the BQL, see
+ * nvme_process_db.
+ */
 static uint8_t nvme_cq_full(NvmeCQueue *cq)
 {
-    return (cq->tail + 1) % cq->size == cq->head;
+    return (atomic_read(&cq->tail) + 1) % cq->size == atomic_read(&cq->head);
 }
 
 static uint8_t nvme_sq_empty(NvmeSQueue *sq)
 {
-    return sq->head == sq->tail;
+    return sq->head == atomic_read(&sq->tail);
 }
 
 static void nvme_irq_check(NvmeCtrl *n)
@@ -414,9 +419,11 @@ static uint16_t nvme_io_cmd(NvmeCtrl *n, NvmeCmd *cmd, NvmeRequest *req)
 
 static void nvme_free_sq(NvmeSQueue *sq, NvmeCtrl *n)
 {
+    qemu_mutex_lock(&n->db_lock);
     n->sq[sq->sqid] = NULL;
     timer_del(sq->timer);
     timer_free(sq->timer);
+    qemu_mutex_unlock(&n->db_lock);
     g_free(sq->io_req);
     if (sq->sqid) {
         g_free(sq);
@@ -446,7 +453,9 @@ static uint16_t nvme_del_sq(NvmeCtrl *n, NvmeCmd *cmd)
     }
     if (!nvme_check_cqid(n, sq->cqid)) {
         cq = n->cq[sq->cqid];
+        qemu_mutex_lock(&n->db_lock);
         QTAILQ_REMOVE(&cq->sq_list, sq, entry);
+        qemu_mutex_unlock(&n->db_lock);
 
         nvme_post_cqes(cq);
         QTAILQ_FOREACH_SAFE(req, &cq->req_list, entry, next) {
@@ -485,8 +494,10 @@ static void nvme_init_sq(NvmeSQueue *sq, NvmeCtrl *n, uint64_t dma_addr,
 
     assert(n->cq[cqid]);
     cq = n->cq[cqid];
+    qemu_mutex_lock(&n->db_lock);
     QTAILQ_INSERT_TAIL(&(cq->sq_list), sq, entry);
     n->sq[sqid] = sq;
+    qemu_mutex_unlock(&n->db_lock);
 }
 
 static uint16_t nvme_create_sq(NvmeCtrl *n, NvmeCmd *cmd)
@@ -529,9 +540,11 @@ static uint16_t nvme_create_sq(NvmeCtrl *n, NvmeCmd *cmd)
 
 static void nvme_free_cq(NvmeCQueue *cq, NvmeCtrl *n)
 {
+    qemu_mutex_lock(&n->db_lock);
     n->cq[cq->cqid] = NULL;
     timer_del(cq->timer);
     timer_free(cq->timer);
+    qemu_mutex_unlock(&n->db_lock);
     msix_vector_unuse(&n->parent_obj, cq->vector);
     if (cq->cqid) {
         g_free(cq);
@@ -573,8 +586,10 @@ static void nvme_init_cq(NvmeCQueue *cq, NvmeCtrl *n, uint64_t dma_addr,
     QTAILQ_INIT(&cq->req_list);
     QTAILQ_INIT(&cq->sq_list);
     msix_vector_use(&n->parent_obj, cq->vector);
-    n->cq[cqid] = cq;
     cq->timer = timer_new_ns(QEMU_CLOCK_VIRTUAL, nvme_post_cqes, cq);
+    qemu_mutex_lock(&n->db_lock);
+    n->cq[cqid] = cq;
+    qemu_mutex_unlock(&n->db_lock);
 }
 
 static uint16_t nvme_create_cq(NvmeCtrl *n, NvmeCmd *cmd)
@@ -1070,6 +1085,7 @@ static uint64_t nvme_mmio_read(void *opaque, hwaddr addr, unsigned size)
     return val;
 }
 
+/* Called with db_lock held, and possibly without the BQL.  */
 static void nvme_process_db(NvmeCtrl *n, hwaddr addr, int val)
 {
     uint32_t qid;
@@ -1108,7 +1124,7 @@ static void nvme_process_db(NvmeCtrl *n, hwaddr addr, int val)
         }
 
         start_sqs = nvme_cq_full(cq) ? 1 : 0;
-        cq->head = new_head;
+        atomic_set(&cq->head, new_head);
         if (start_sqs) {
             NvmeSQueue *sq;
             QTAILQ_FOREACH(sq, &cq->sq_list, entry) {
@@ -1117,8 +1133,20 @@ static void nvme_process_db(NvmeCtrl *n, hwaddr addr, int val)
             timer_mod(cq->timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) + 500);
         }
 
-        if (cq->tail == cq->head) {
-            nvme_irq_deassert(n, cq);
+        if (atomic_read(&cq->tail) == new_head && cq->irq_enabled &&
+            !msix_enabled(&n->parent_obj)) {
+            /* Pin interrupts need the BQL.  Completions may have been
+             * posted, or the queue deleted, while db_lock was dropped.
+             */
+            bool unlock = memory_region_lock_iothread(&n->db_iomem);
+
+            if (!nvme_check_cqid(n, qid) && n->cq[qid] == cq &&
+                cq->tail == cq->head) {
+                nvme_irq_deassert(n, cq);
+            }
+            if (unlock) {
+                qemu_mutex_unlock_iothread();
+            }
         }
     } else {
         /* Submission queue doorbell write */
@@ -1145,7 +1173,7 @@ static void nvme_process_db(NvmeCtrl *n, hwaddr addr, int val)
             return;
         }
 
-        sq->tail = new_tail;
+        atomic_set(&sq->tail, new_tail);
         timer_mod(sq->timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) + 500);
     }
 }
@@ -1156,11 +1184,25 @@ static void nvme_mmio_write(void *opaque, hwaddr addr, uint64_t data,
     NvmeCtrl *n = (NvmeCtrl *)opaque;
     if (addr < sizeof(n->bar)) {
         nvme_write_bar(n, addr, data, size);
-    } else if (addr >= 0x1000) {
-        nvme_process_db(n, addr, data);
     }
 }
 
+static uint64_t nvme_db_read(void *opaque, hwaddr addr, unsigned size)
+{
+    NVME_GUEST_ERR(nvme_ub_mmiord_invalid_ofs,
+                   "MMIO read beyond last register,"
+                   " offset=0x%"PRIx64", returning 0", addr + 0x1000);
+    return 0;
+}
+
+static void nvme_db_write(void *opaque, hwaddr addr, uint64_t data,
+    unsigned size)
+{
+    NvmeCtrl *n = (NvmeCtrl *)opaque;
+
+    nvme_process_db(n, addr + 0x1000, data);
+}
+
 static const MemoryRegionOps nvme_mmio_ops = {
     .read = nvme_mmio_read,
     .write = nvme_mmio_write,
@@ -1171,6 +1213,16 @@ static const MemoryRegionOps nvme_mmio_ops = {
     },
 };
 
+static const MemoryRegionOps nvme_db_ops = {
+    .read = nvme_db_read,
+    .write = nvme_db_write,
+    .endianness = DEVICE_LITTLE_ENDIAN,
+    .impl = {
+        .min_access_size = 2,
+        .max_access_size = 8,
+    },
+};
+
 static void nvme_cmb_write(void *opaque, hwaddr addr, uint64_t data,
     unsigned size)
 {
@@ -1243,6 +1295,12 @@ static void nvme_realize(PCIDevice *pci_dev, Error **errp)
 
     memory_region_init_io(&n->iomem, OBJECT(n), &nvme_mmio_ops, n,
                           "nvme", n->reg_size);
+    /* Doorbells are written for every command, keep them off the BQL */
+    qemu_mutex_init(&n->db_lock);
+    memory_region_init_io(&n->db_iomem, OBJECT(n), &nvme_db_ops, n,
+                          "nvme-doorbell", n->reg_size - 0x1000);
+    memory_region_set_lock(&n->db_iomem, &n->db_lock);
+    memory_region_add_subregion(&n->iomem, 0x1000, &n->db_iomem);
     pci_register_bar(&n->parent_obj, 0,
         PCI_BASE_ADDRESS_SPACE_MEMORY | PCI_BASE_ADDRESS_MEM_TYPE_64,
         &n->iomem);
@@ -1328,6 +1386,7 @@ static void nvme_exit(PCIDevice *pci_dev)
     NvmeCtrl *n = NVME(pci_dev);
 
     nvme_clear_ctrl(n);
+    qemu_mutex_destroy(&n->db_lock);
     g_free(n->namespaces);
     g_free(n->cq);
     g_free(n->sq);
@@ -60,6 +60,7 @@ typedef struct NvmeNamespace {
 typedef struct NvmeCtrl {
     PCIDevice    parent_obj;
     MemoryRegion iomem;
+    MemoryRegion db_iomem;
     MemoryRegion ctrl_mem;
     NvmeBar      bar;
     BlockConf    conf;
@@ -79,6 +80,8 @@ typedef struct NvmeCtrl {
     uint32_t    cmbloc;
     uint8_t     *cmbuf;
     uint64_t    irq_status;
+    /* Protects the queue arrays, sq->tail, cq->head and cq->sq_list */
+    QemuMutex   db_lock;
 
     char            *serial;
     NvmeNamespace   *namespaces;
@@ -28,6 +28,15 @@
 #include "hw/virtio/virtio-bus.h"
 #include "hw/virtio/virtio-access.h"
 
+/* Requests popped from a virtqueue at once */
+#define VIRTIO_BLK_POP_BATCH 32
+
+/* Segments that fit in a preallocated request.  A typical request is made of
+ * the header, one or two data segments and the status byte; larger ones are
+ * allocated on the heap.
+ */
+#define VIRTIO_BLK_REQ_POOL_SG 8
+
 static void virtio_blk_init_request(VirtIOBlock *s, VirtQueue *vq,
                                     VirtIOBlockReq *req)
 {
@@ -41,7 +50,16 @@ static void virtio_blk_init_request(VirtIOBlock *s, VirtQueue *vq,
 
 static void virtio_blk_free_request(VirtIOBlockReq *req)
 {
-    g_free(req);
+    virtqueue_element_free(&req->elem);
+}
+
+static void virtio_blk_notify(VirtIOBlock *s, VirtQueue *vq)
+{
+    if (s->dataplane_started && !s->dataplane_disabled) {
+        virtio_blk_data_plane_notify(s->dataplane, vq);
+    } else {
+        virtio_notify(VIRTIO_DEVICE(s), vq);
+    }
 }
 
 static void virtio_blk_req_complete(VirtIOBlockReq *req, unsigned char status)
@@ -53,10 +71,35 @@ static void virtio_blk_req_complete(VirtIOBlockReq *req, unsigned char status)
 
     stb_p(&req->in->status, status);
     virtqueue_push(req->vq, &req->elem, req->in_len);
-    if (s->dataplane_started && !s->dataplane_disabled) {
-        virtio_blk_data_plane_notify(s->dataplane, req->vq);
-    } else {
-        virtio_notify(vdev, req->vq);
+    virtio_blk_notify(s, req->vq);
+}
+
+/* Complete successful requests, giving each run of requests from the same
+ * virtqueue back to the driver at once.
+ */
+static void virtio_blk_req_complete_batch(VirtIOBlockReq **reqs,
+                                          unsigned int count)
+{
+    VirtQueueElement *elems[VIRTIO_BLK_MAX_MERGE_REQS];
+    unsigned int lens[VIRTIO_BLK_MAX_MERGE_REQS];
+    unsigned int i, n = 0;
+
+    assert(count <= VIRTIO_BLK_MAX_MERGE_REQS);
+    for (i = 0; i < count; i++) {
+        VirtIOBlockReq *req = reqs[i];
+
+        trace_virtio_blk_req_complete(VIRTIO_DEVICE(req->dev), req,
+                                      VIRTIO_BLK_S_OK);
+        stb_p(&req->in->status, VIRTIO_BLK_S_OK);
+        elems[n] = &req->elem;
+        lens[n] = req->in_len;
+        n++;
+
+        if (i + 1 == count || reqs[i + 1]->vq != req->vq) {
+            virtqueue_fill_batch(req->vq, elems, lens, n);
+            virtio_blk_notify(req->dev, req->vq);
+            n = 0;
+        }
     }
 }
 
@@ -88,6 +131,8 @@ static void virtio_blk_rw_complete(void *opaque, int ret)
     VirtIOBlockReq *next = opaque;
     VirtIOBlock *s = next->dev;
     VirtIODevice *vdev = VIRTIO_DEVICE(s);
+    VirtIOBlockReq *done[VIRTIO_BLK_MAX_MERGE_REQS];
+    unsigned int i, num_done = 0;
 
     aio_context_acquire(blk_get_aio_context(s->conf.conf.blk));
     while (next) {
@@ -118,9 +163,13 @@ static void virtio_blk_rw_complete(void *opaque, int ret)
             }
         }
 
-        virtio_blk_req_complete(req, VIRTIO_BLK_S_OK);
-        block_acct_done(blk_get_stats(req->dev->blk), &req->acct);
-        virtio_blk_free_request(req);
+        done[num_done++] = req;
+    }
+
+    virtio_blk_req_complete_batch(done, num_done);
+    for (i = 0; i < num_done; i++) {
+        block_acct_done(blk_get_stats(s->blk), &done[i]->acct);
+        virtio_blk_free_request(done[i]);
     }
     aio_context_release(blk_get_aio_context(s->conf.conf.blk));
 }
@@ -198,14 +247,20 @@ out:
 
 #endif
 
-static VirtIOBlockReq *virtio_blk_get_request(VirtIOBlock *s, VirtQueue *vq)
+static unsigned int virtio_blk_get_requests(VirtIOBlock *s, VirtQueue *vq,
+                                            VirtIOBlockReq **reqs,
+                                            unsigned int max)
 {
-    VirtIOBlockReq *req = virtqueue_pop(vq, sizeof(VirtIOBlockReq));
-
-    if (req) {
-        virtio_blk_init_request(s, vq, req);
+    VirtQueueElement *elems[VIRTIO_BLK_POP_BATCH];
+    unsigned int i, n;
+
+    n = virtqueue_pop_batch(vq, s->req_pool, elems,
+                            MIN(max, ARRAY_SIZE(elems)));
+    for (i = 0; i < n; i++) {
+        reqs[i] = container_of(elems[i], VirtIOBlockReq, elem);
+        virtio_blk_init_request(s, vq, reqs[i]);
     }
-    return req;
+    return n;
 }
 
 static int virtio_blk_handle_scsi_req(VirtIOBlockReq *req)
@@ -593,9 +648,10 @@ static int virtio_blk_handle_request(VirtIOBlockReq *req, MultiReqBuffer *mrb)
 
 bool virtio_blk_handle_vq(VirtIOBlock *s, VirtQueue *vq)
 {
-    VirtIOBlockReq *req;
+    VirtIOBlockReq *reqs[VIRTIO_BLK_POP_BATCH];
     MultiReqBuffer mrb = {};
     bool progress = false;
+    unsigned int i, n;
 
     aio_context_acquire(blk_get_aio_context(s->blk));
     blk_io_plug(s->blk);
@@ -603,11 +659,19 @@ bool virtio_blk_handle_vq(VirtIOBlock *s, VirtQueue *vq)
     do {
         virtio_queue_set_notification(vq, 0);
 
-        while ((req = virtio_blk_get_request(s, vq))) {
+        while ((n = virtio_blk_get_requests(s, vq, reqs, ARRAY_SIZE(reqs)))) {
             progress = true;
-            if (virtio_blk_handle_request(req, &mrb)) {
-                virtqueue_detach_element(req->vq, &req->elem, 0);
-                virtio_blk_free_request(req);
+            for (i = 0; i < n; i++) {
+                if (virtio_blk_handle_request(reqs[i], &mrb)) {
+                    break;
+                }
+            }
+            if (i < n) {
+                /* Drop the failed request and the rest of the batch */
+                for (; i < n; i++) {
+                    virtqueue_detach_element(vq, &reqs[i]->elem, 0);
+                    virtio_blk_free_request(reqs[i]);
+                }
                 break;
             }
         }
@@ -861,7 +925,7 @@ static void virtio_blk_save_device(VirtIODevice *vdev, QEMUFile *f)
             qemu_put_be32(f, virtio_get_queue_index(req->vq));
         }
 
-        qemu_put_virtqueue_element(f, &req->elem);
+        qemu_put_virtqueue_element(vdev, f, &req->elem);
         req = req->next;
     }
     qemu_put_sbyte(f, 0);
@@ -970,6 +1034,10 @@ static void virtio_blk_device_realize(DeviceState *dev, Error **errp)
         virtio_cleanup(vdev);
         return;
     }
+    s->req_pool = virtqueue_element_pool_new(sizeof(VirtIOBlockReq),
+                                             VIRTIO_BLK_REQ_POOL_SG,
+                                             conf->num_queues *
+                                             conf->queue_size);
 
     s->change = qemu_add_vm_change_state_handler(virtio_blk_dma_restart_cb, s);
     blk_set_dev_ops(s->blk, &virtio_block_ops, s);
@@ -988,6 +1056,8 @@ static void virtio_blk_device_unrealize(DeviceState *dev, Error **errp)
     qemu_del_vm_change_state_handler(s->change);
     blockdev_mark_auto_del(s->blk);
     virtio_cleanup(vdev);
+    virtqueue_element_pool_free(s->req_pool);
+    s->req_pool = NULL;
 }
 
 static void virtio_blk_instance_init(Object *obj)
@@ -1022,6 +1092,7 @@ static Property virtio_blk_properties[] = {
                     true),
     DEFINE_PROP_UINT16("num-queues", VirtIOBlock, conf.num_queues, 1),
     DEFINE_PROP_UINT16("queue-size", VirtIOBlock, conf.queue_size, 128),
+    DEFINE_PROP_BOOL("x-notify-group", VirtIOBlock, conf.notify_group, false),
     DEFINE_PROP_LINK("iothread", VirtIOBlock, conf.iothread, TYPE_IOTHREAD,
                      IOThread *),
     DEFINE_PROP_END_OF_LIST(),
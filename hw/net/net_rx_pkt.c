@@ -20,6 +20,8 @@
 #include "net_rx_pkt.h"
 #include "net/checksum.h"
 #include "net/tap.h"
+#include "qemu/timer.h"
+#include "block/aio.h"
 
 struct NetRxPkt {
     struct virtio_net_hdr virt_hdr;
@@ -307,6 +309,20 @@ _net_rx_rss_prepare_tcp(uint8_t *rss_input,
                           &tcphdr->th_dport, sizeof(uint16_t));
 }
 
+static inline void
+_net_rx_rss_prepare_udp(uint8_t *rss_input,
+                        struct NetRxPkt *pkt,
+                        size_t *bytes_written)
+{
+    struct udp_header *udphdr = &pkt->l4hdr_info.hdr.udp;
+
+    _net_rx_rss_add_chunk(rss_input, bytes_written,
+                          &udphdr->uh_sport, sizeof(uint16_t));
+
+    _net_rx_rss_add_chunk(rss_input, bytes_written,
+                          &udphdr->uh_dport, sizeof(uint16_t));
+}
+
 uint32_t
 net_rx_pkt_calc_rss_hash(struct NetRxPkt *pkt,
                          NetRxPktRssType type,
@@ -334,7 +350,7 @@ net_rx_pkt_calc_rss_hash(struct NetRxPkt *pkt,
         assert(pkt->isip6);
         assert(pkt->istcp);
         trace_net_rx_pkt_rss_ip6_tcp();
-        _net_rx_rss_prepare_ip6(&rss_input[0], pkt, true, &rss_length);
+        _net_rx_rss_prepare_ip6(&rss_input[0], pkt, false, &rss_length);
         _net_rx_rss_prepare_tcp(&rss_input[0], pkt, &rss_length);
         break;
     case NetPktRssIpV6:
@@ -347,6 +363,34 @@ net_rx_pkt_calc_rss_hash(struct NetRxPkt *pkt,
         trace_net_rx_pkt_rss_ip6_ex();
         _net_rx_rss_prepare_ip6(&rss_input[0], pkt, true, &rss_length);
         break;
+    case NetPktRssIpV6TcpEx:
+        assert(pkt->isip6);
+        assert(pkt->istcp);
+        trace_net_rx_pkt_rss_ip6_ex_tcp();
+        _net_rx_rss_prepare_ip6(&rss_input[0], pkt, true, &rss_length);
+        _net_rx_rss_prepare_tcp(&rss_input[0], pkt, &rss_length);
+        break;
+    case NetPktRssIpV4Udp:
+        assert(pkt->isip4);
+        assert(pkt->isudp);
+        trace_net_rx_pkt_rss_ip4_udp();
+        _net_rx_rss_prepare_ip4(&rss_input[0], pkt, &rss_length);
+        _net_rx_rss_prepare_udp(&rss_input[0], pkt, &rss_length);
+        break;
+    case NetPktRssIpV6Udp:
+        assert(pkt->isip6);
+        assert(pkt->isudp);
+        trace_net_rx_pkt_rss_ip6_udp();
+        _net_rx_rss_prepare_ip6(&rss_input[0], pkt, false, &rss_length);
+        _net_rx_rss_prepare_udp(&rss_input[0], pkt, &rss_length);
+        break;
+    case NetPktRssIpV6UdpEx:
+        assert(pkt->isip6);
+        assert(pkt->isudp);
+        trace_net_rx_pkt_rss_ip6_ex_udp();
+        _net_rx_rss_prepare_ip6(&rss_input[0], pkt, true, &rss_length);
+        _net_rx_rss_prepare_udp(&rss_input[0], pkt, &rss_length);
+        break;
     default:
         assert(false);
         break;
@@ -599,3 +643,419 @@ bool net_rx_pkt_fix_l4_csum(struct NetRxPkt *pkt)
 
     return true;
 }
+
+/* Receive segment coalescing */
+
+#define NET_RX_RSC_FLOWS        8
+#define NET_RX_RSC_MAX_HDR      64
+#define NET_RX_RSC_MAX_IP_LEN   0xffff
+#define NET_RX_RSC_BUF_SIZE     (NET_RX_RSC_MAX_HDR + ETH_HLEN + \
+                                 sizeof(struct ip6_header) + \
+                                 NET_RX_RSC_MAX_IP_LEN)
+
+/* Offsets within the TCP header */
+#define NET_RX_RSC_TCP_SEQ      4
+#define NET_RX_RSC_TCP_ACK      8
+#define NET_RX_RSC_TCP_OFF      12
+#define NET_RX_RSC_TCP_FLAGS    13
+#define NET_RX_RSC_TCP_WIN      14
+
+typedef struct NetRxRscFlow {
+    uint8_t *buf;           /* caller's header, then the frame */
+    size_t size;
+    size_t hdr_len;
+    size_t l4_off;          /* offsets within the frame */
+    size_t data_off;
+    uint32_t next_seq;
+    uint16_t segments;      /* 0 if the flow is unused */
+    uint16_t mss;
+    bool ipv6;
+} NetRxRscFlow;
+
+struct NetRxRsc {
+    NetRxRscFlow flows[NET_RX_RSC_FLOWS];
+    NetRxRscDeliver *deliver;
+    void *opaque;
+    int64_t timeout;
+    QEMUTimer *timer;
+    AioContext *ctx;
+    bool ipv4;
+    bool ipv6;
+};
+
+/* A TCP segment over IPv4 without options or IPv6 without extension
+ * headers, whose length does not include the Ethernet padding.
+ */
+typedef struct NetRxRscSeg {
+    const uint8_t *frame;
+    size_t len;
+    size_t l4_off;
+    size_t data_off;
+    bool ipv6;
+} NetRxRscSeg;
+
+static bool net_rx_rsc_parse(NetRxRsc *rsc, const uint8_t *frame,
+                             size_t size, NetRxRscSeg *seg)
+{
+    const uint8_t *l3 = frame + ETH_HLEN;
+    size_t l3_len, l4_len, ip_len;
+
+    if (size < ETH_HLEN) {
+        return false;
+    }
+
+    switch (lduw_be_p(&PKT_GET_ETH_HDR(frame)->h_proto)) {
+    case ETH_P_IP:
+        l3_len = sizeof(struct ip_header);
+        if (!rsc->ipv4 || size < ETH_HLEN + l3_len ||
+            l3[0] != ((IP_HEADER_VERSION_4 << 4) | (l3_len >> 2)) ||
+            l3[offsetof(struct ip_header, ip_p)] != IP_PROTO_TCP ||
+            (lduw_be_p(l3 + offsetof(struct ip_header, ip_off)) &
+             (IP_OFFMASK | IP_MF))) {
+            return false;
+        }
+        ip_len = lduw_be_p(l3 + offsetof(struct ip_header, ip_len));
+        seg->ipv6 = false;
+        break;
+    case ETH_P_IPV6:
+        l3_len = sizeof(struct ip6_header);
+        if (!rsc->ipv6 || size < ETH_HLEN + l3_len ||
+            (l3[0] >> 4) != IP_HEADER_VERSION_6 ||
+            ((struct ip6_header *)l3)->ip6_nxt != IP_PROTO_TCP) {
+            return false;
+        }
+        ip_len = l3_len + lduw_be_p(l3 + 4);
+        seg->ipv6 = true;
+        break;
+    default:
+        return false;
+    }
+
+    if (ip_len < l3_len + sizeof(struct tcp_header) ||
+        ETH_HLEN + ip_len > size) {
+        return false;
+    }
+    l4_len = (l3[l3_len + NET_RX_RSC_TCP_OFF] >> 4) << 2;
+    if (l4_len < sizeof(struct tcp_header) || l3_len + l4_len > ip_len) {
+        return false;
+    }
+
+    seg->frame = frame;
+    seg->len = ETH_HLEN + ip_len;
+    seg->l4_off = ETH_HLEN + l3_len;
+    seg->data_off = seg->l4_off + l4_len;
+    return true;
+}
+
+/* Only segments that carry data and nothing else can be merged */
+static bool net_rx_rsc_mergeable(const NetRxRscSeg *seg, int flags)
+{
+    uint8_t *l3 = (uint8_t *)seg->frame + ETH_HLEN;
+    uint8_t *tcp = (uint8_t *)seg->frame + seg->l4_off;
+    size_t l4_len = seg->len - seg->l4_off;
+    uint32_t csum, cso;
+
+    if ((flags & NET_RX_RSC_NO_MERGE) || seg->data_off == seg->len ||
+        (tcp[NET_RX_RSC_TCP_FLAGS] & ~TH_PUSH) != TH_ACK) {
+        return false;
+    }
+
+    /* The IPv4 header of a merged frame gets a new checksum */
+    if (!seg->ipv6 && net_raw_checksum(l3, sizeof(struct ip_header))) {
+        return false;
+    }
+    if (flags & NET_RX_RSC_CSUM_VALID) {
+        return true;
+    }
+
+    if (seg->ipv6) {
+        csum = eth_calc_ip6_pseudo_hdr_csum((struct ip6_header *)l3, l4_len,
+                                            IP_PROTO_TCP, &cso);
+    } else {
+        csum = eth_calc_ip4_pseudo_hdr_csum((struct ip_header *)l3, l4_len,
+                                            &cso);
+    }
+    csum += net_checksum_add(l4_len, tcp);
+    return net_checksum_finish(csum) == 0;
+}
+
+static NetRxRscFlow *net_rx_rsc_lookup(NetRxRsc *rsc, const NetRxRscSeg *seg)
+{
+    /* Source and destination addresses */
+    size_t addr_off = ETH_HLEN + (seg->ipv6 ? 8 : 12);
+    size_t addr_len = seg->ipv6 ? 32 : 8;
+    int i;
+
+    for (i = 0; i < NET_RX_RSC_FLOWS; i++) {
+        NetRxRscFlow *flow = &rsc->flows[i];
+        const uint8_t *frame = flow->buf + flow->hdr_len;
+
+        if (flow->segments && flow->ipv6 == seg->ipv6 &&
+            !memcmp(frame, seg->frame, 2 * ETH_ALEN) &&
+            !memcmp(frame + addr_off, seg->frame + addr_off, addr_len) &&
+            !memcmp(frame + flow->l4_off, seg->frame + seg->l4_off, 4)) {
+            return flow;
+        }
+    }
+    return NULL;
+}
+
+/* Like GRO, accept the next segment in sequence with the same ACK number,
+ * TCP options and IP header fields, that is not longer than the first one.
+ */
+static bool net_rx_rsc_can_append(NetRxRscFlow *flow, const NetRxRscSeg *seg)
+{
+    const uint8_t *frame = flow->buf + flow->hdr_len;
+    const uint8_t *l3 = frame + ETH_HLEN;
+    const uint8_t *seg_l3 = seg->frame + ETH_HLEN;
+    const uint8_t *tcp = frame + flow->l4_off;
+    const uint8_t *seg_tcp = seg->frame + seg->l4_off;
+    size_t tcp_len = seg->data_off - seg->l4_off;
+    size_t data_len = seg->len - seg->data_off;
+    size_t ip_len = flow->size - flow->hdr_len - ETH_HLEN + data_len;
+
+    if (flow->ipv6) {
+        ip_len -= sizeof(struct ip6_header);
+    }
+    if (ldl_be_p(seg_tcp + NET_RX_RSC_TCP_SEQ) != flow->next_seq ||
+        data_len > flow->mss || ip_len > NET_RX_RSC_MAX_IP_LEN ||
+        flow->segments == UINT16_MAX) {
+        return false;
+    }
+
+    if (flow->data_off - flow->l4_off != tcp_len ||
+        memcmp(tcp + NET_RX_RSC_TCP_ACK, seg_tcp + NET_RX_RSC_TCP_ACK, 4) ||
+        memcmp(tcp + sizeof(struct tcp_header),
+               seg_tcp + sizeof(struct tcp_header),
+               tcp_len - sizeof(struct tcp_header))) {
+        return false;
+    }
+
+    if (flow->ipv6) {
+        /* Traffic class, flow label and hop limit */
+        return !memcmp(l3, seg_l3, 4) && l3[7] == seg_l3[7];
+    }
+    /* ToS, flags and TTL */
+    return l3[1] == seg_l3[1] && !memcmp(l3 + 6, seg_l3 + 6, 3);
+}
+
+static void net_rx_rsc_append(NetRxRscFlow *flow, const NetRxRscSeg *seg)
+{
+    uint8_t *tcp = flow->buf + flow->hdr_len + flow->l4_off;
+    const uint8_t *seg_tcp = seg->frame + seg->l4_off;
+    size_t data_len = seg->len - seg->data_off;
+
+    memcpy(flow->buf + flow->size, seg->frame + seg->data_off, data_len);
+    flow->size += data_len;
+    flow->next_seq += data_len;
+    flow->segments++;
+
+    /* The merged segment has the latest window, and PSH if any had it */
+    memcpy(tcp + NET_RX_RSC_TCP_WIN, seg_tcp + NET_RX_RSC_TCP_WIN, 2);
+    tcp[NET_RX_RSC_TCP_FLAGS] |= seg_tcp[NET_RX_RSC_TCP_FLAGS] & TH_PUSH;
+}
+
+static void net_rx_rsc_start(NetRxRsc *rsc, NetRxRscFlow *flow,
+                             const uint8_t *buf, size_t hdr_len,
+                             const NetRxRscSeg *seg)
+{
+    size_t data_len = seg->len - seg->data_off;
+
+    if (!flow->buf) {
+        flow->buf = g_malloc(NET_RX_RSC_BUF_SIZE);
+    }
+    memcpy(flow->buf, buf, hdr_len + seg->len);
+    flow->size = hdr_len + seg->len;
+    flow->hdr_len = hdr_len;
+    flow->l4_off = seg->l4_off;
+    flow->data_off = seg->data_off;
+    flow->next_seq = ldl_be_p(seg->frame + seg->l4_off + NET_RX_RSC_TCP_SEQ) +
+                     data_len;
+    flow->segments = 1;
+    flow->mss = data_len;
+    flow->ipv6 = seg->ipv6;
+
+    if (!timer_pending(rsc->timer)) {
+        timer_mod(rsc->timer,
+                  qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) + rsc->timeout);
+    }
+}
+
+/* Returns 0 if the flow must be kept for another try */
+static ssize_t net_rx_rsc_drain(NetRxRsc *rsc, NetRxRscFlow *flow)
+{
+    uint8_t *l3 = flow->buf + flow->hdr_len + ETH_HLEN;
+    size_t ip_len = flow->size - flow->hdr_len - ETH_HLEN;
+    NetRxRscInfo info;
+    ssize_t ret;
+
+    if (flow->segments == 1) {
+        ret = rsc->deliver(rsc->opaque, flow->buf, flow->size, NULL);
+    } else {
+        if (flow->ipv6) {
+            stw_be_p(l3 + 4, ip_len - sizeof(struct ip6_header));
+        } else {
+            stw_be_p(l3 + offsetof(struct ip_header, ip_len), ip_len);
+            eth_fix_ip4_checksum(l3, sizeof(struct ip_header));
+        }
+        info.segments = flow->segments;
+        info.mss = flow->mss;
+        info.hdr_len = flow->data_off;
+        info.ipv6 = flow->ipv6;
+        ret = rsc->deliver(rsc->opaque, flow->buf, flow->size, &info);
+    }
+
+    if (ret != 0) {
+        flow->segments = 0;
+    }
+    return ret;
+}
+
+ssize_t net_rx_rsc_receive(NetRxRsc *rsc, const uint8_t *buf, size_t size,
+                           size_t hdr_len, int flags)
+{
+    NetRxRscFlow *flow;
+    NetRxRscSeg seg;
+    bool mergeable;
+    int i;
+
+    assert(hdr_len <= NET_RX_RSC_MAX_HDR);
+    if (size < hdr_len ||
+        !net_rx_rsc_parse(rsc, buf + hdr_len, size - hdr_len, &seg)) {
+        return -1;
+    }
+
+    mergeable = net_rx_rsc_mergeable(&seg, flags);
+    flow = net_rx_rsc_lookup(rsc, &seg);
+    if (flow) {
+        if (mergeable && flow->hdr_len == hdr_len &&
+            net_rx_rsc_can_append(flow, &seg)) {
+            net_rx_rsc_append(flow, &seg);
+
+            /* A short segment or PSH ends the burst */
+            if (seg.len - seg.data_off < flow->mss ||
+                (seg.frame[seg.l4_off + NET_RX_RSC_TCP_FLAGS] & TH_PUSH)) {
+                net_rx_rsc_drain(rsc, flow);
+            }
+            return size;
+        }
+
+        /* What the flow holds goes first */
+        if (net_rx_rsc_drain(rsc, flow) == 0) {
+            return 0;
+        }
+    }
+
+    if (!mergeable ||
+        (seg.frame[seg.l4_off + NET_RX_RSC_TCP_FLAGS] & TH_PUSH)) {
+        return -1;
+    }
+
+    for (i = 0; i < NET_RX_RSC_FLOWS; i++) {
+        if (!rsc->flows[i].segments) {
+            net_rx_rsc_start(rsc, &rsc->flows[i], buf, hdr_len, &seg);
+            return size;
+        }
+    }
+    return -1;
+}
+
+void net_rx_rsc_flush(NetRxRsc *rsc)
+{
+    bool pending = false;
+    int i;
+
+    for (i = 0; i < NET_RX_RSC_FLOWS; i++) {
+        if (rsc->flows[i].segments &&
+            net_rx_rsc_drain(rsc, &rsc->flows[i]) == 0) {
+            pending = true;
+        }
+    }
+
+    if (pending) {
+        timer_mod(rsc->timer,
+                  qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) + rsc->timeout);
+    } else {
+        timer_del(rsc->timer);
+    }
+}
+
+void net_rx_rsc_purge(NetRxRsc *rsc)
+{
+    int i;
+
+    for (i = 0; i < NET_RX_RSC_FLOWS; i++) {
+        rsc->flows[i].segments = 0;
+    }
+    timer_del(rsc->timer);
+}
+
+static void net_rx_rsc_timer(void *opaque)
+{
+    NetRxRsc *rsc = opaque;
+    AioContext *ctx = rsc->ctx;
+
+    if (ctx) {
+        aio_context_acquire(ctx);
+    }
+    net_rx_rsc_flush(rsc);
+    if (ctx) {
+        aio_context_release(ctx);
+    }
+}
+
+static QEMUTimer *net_rx_rsc_new_timer(NetRxRsc *rsc)
+{
+    if (rsc->ctx) {
+        return aio_timer_new(rsc->ctx, QEMU_CLOCK_VIRTUAL, SCALE_NS,
+                             net_rx_rsc_timer, rsc);
+    }
+    return timer_new_ns(QEMU_CLOCK_VIRTUAL, net_rx_rsc_timer, rsc);
+}
+
+NetRxRsc *net_rx_rsc_new(NetRxRscDeliver *deliver, void *opaque,
+                         int64_t timeout)
+{
+    NetRxRsc *rsc = g_new0(NetRxRsc, 1);
+
+    rsc->deliver = deliver;
+    rsc->opaque = opaque;
+    rsc->timeout = timeout;
+    rsc->timer = net_rx_rsc_new_timer(rsc);
+    return rsc;
+}
+
+void net_rx_rsc_free(NetRxRsc *rsc)
+{
+    int i;
+
+    timer_del(rsc->timer);
+    timer_free(rsc->timer);
+    for (i = 0; i < NET_RX_RSC_FLOWS; i++) {
+        g_free(rsc->flows[i].buf);
+    }
+    g_free(rsc);
+}
+
+void net_rx_rsc_set_types(NetRxRsc *rsc, bool ipv4, bool ipv6)
+{
+    if (rsc->ipv4 != ipv4 || rsc->ipv6 != ipv6) {
+        net_rx_rsc_purge(rsc);
+        rsc->ipv4 = ipv4;
+        rsc->ipv6 = ipv6;
+    }
+}
+
+void net_rx_rsc_set_aio_context(NetRxRsc *rsc, AioContext *ctx)
+{
+    bool pending = timer_pending(rsc->timer);
+    int64_t expire = timer_expire_time_ns(rsc->timer);
+
+    timer_del(rsc->timer);
+    timer_free(rsc->timer);
+    rsc->ctx = ctx;
+    rsc->timer = net_rx_rsc_new_timer(rsc);
+    if (pending) {
+        timer_mod(rsc->timer, expire);
+    }
+}
@@ -133,7 +133,11 @@ typedef enum {
     NetPktRssIpV4Tcp,
     NetPktRssIpV6Tcp,
     NetPktRssIpV6,
-    NetPktRssIpV6Ex
+    NetPktRssIpV6Ex,
+    NetPktRssIpV6TcpEx,
+    NetPktRssIpV4Udp,
+    NetPktRssIpV6Udp,
+    NetPktRssIpV6UdpEx,
 } NetRxPktRssType;
 
 /**
@@ -360,4 +364,112 @@ bool net_rx_pkt_validate_l3_csum(struct NetRxPkt *pkt, bool *csum_valid);
 */
 bool net_rx_pkt_fix_l4_csum(struct NetRxPkt *pkt);
 
+/*
+ * Receive segment coalescing
+ *
+ * Merges in-order TCP segments of a flow into one frame of up to 64 KiB,
+ * for NICs that can tell the guest about it.  A flow is delivered when a
+ * segment cannot be appended to it, or when its timeout expires.
+ */
+
+typedef struct NetRxRsc NetRxRsc;
+
+typedef struct NetRxRscInfo {
+    uint16_t segments;      /* number of merged segments */
+    uint16_t mss;           /* payload size of the first segment */
+    uint16_t hdr_len;       /* Ethernet, IP and TCP headers */
+    bool ipv6;
+} NetRxRscInfo;
+
+/**
+ * callback for the frames held by the coalescer
+ *
+ * @opaque:         opaque pointer passed to net_rx_rsc_new
+ * @buf:            the frame, after the caller's header of its first segment
+ * @size:           size of @buf
+ * @info:           how the frame was merged, NULL for a lone segment
+ *
+ * Return: like the receive callback of NetClientInfo; 0 keeps the frame
+ * for a later attempt
+ */
+typedef ssize_t (NetRxRscDeliver)(void *opaque, const uint8_t *buf,
+                                  size_t size, const NetRxRscInfo *info);
+
+/* net_rx_rsc_receive flags */
+#define NET_RX_RSC_CSUM_VALID   1   /* the TCP checksum is known to be good */
+#define NET_RX_RSC_NO_MERGE     2   /* deliver on its own, after its flow */
+
+/**
+* create a coalescer, with both IP versions disabled
+*
+* @deliver:        callback for the merged frames
+* @opaque:         opaque pointer for @deliver
+* @timeout:        time a flow may wait for more segments, in ns
+*
+*/
+NetRxRsc *net_rx_rsc_new(NetRxRscDeliver *deliver, void *opaque,
+                         int64_t timeout);
+
+/**
+* destroy a coalescer, dropping the flows it holds
+*
+* @rsc:            coalescer
+*
+*/
+void net_rx_rsc_free(NetRxRsc *rsc);
+
+/**
+* select the IP versions to coalesce; flows held so far are dropped if
+* this changes anything
+*
+* @rsc:            coalescer
+* @ipv4:           coalesce TCP over IPv4
+* @ipv6:           coalesce TCP over IPv6
+*
+*/
+void net_rx_rsc_set_types(NetRxRsc *rsc, bool ipv4, bool ipv6);
+
+/**
+* run the flow timeout in @ctx, or in the main loop if @ctx is NULL.  The
+* deliver callback is called with @ctx acquired.
+*
+* @rsc:            coalescer
+* @ctx:            AioContext
+*
+*/
+void net_rx_rsc_set_aio_context(NetRxRsc *rsc, AioContext *ctx);
+
+/**
+* offer a received frame to the coalescer
+*
+* @rsc:            coalescer
+* @buf:            caller's header, then the frame
+* @size:           size of @buf
+* @hdr_len:        size of the caller's header, at most 64 bytes
+* @flags:          NET_RX_RSC_* flags
+*
+* Return: @size if the frame was taken, 0 if it must be offered again
+* later because a flow could not be delivered, or -1 if the caller
+* should deliver it on its own
+*
+*/
+ssize_t net_rx_rsc_receive(NetRxRsc *rsc, const uint8_t *buf, size_t size,
+                           size_t hdr_len, int flags);
+
+/**
+* deliver all flows; those that the callback cannot take yet are kept
+*
+* @rsc:            coalescer
+*
+*/
+void net_rx_rsc_flush(NetRxRsc *rsc);
+
+/**
+* drop all flows
+*
+* @rsc:            coalescer
+*
+*/
+void net_rx_rsc_purge(NetRxRsc *rsc);
+
 #endif
@@ -53,6 +53,8 @@ static const int kernel_feature_bits[] = {
     VIRTIO_F_VERSION_1,
     VIRTIO_NET_F_MTU,
     VIRTIO_F_IOMMU_PLATFORM,
+    VIRTIO_F_RING_PACKED,
+    VIRTIO_F_IN_ORDER,
     VHOST_INVALID_FEATURE_BIT
 };
 
@@ -78,6 +80,8 @@ static const int user_feature_bits[] = {
     VIRTIO_NET_F_MRG_RXBUF,
     VIRTIO_NET_F_MTU,
     VIRTIO_F_IOMMU_PLATFORM,
+    VIRTIO_F_RING_PACKED,
+    VIRTIO_F_IN_ORDER,
 
     /* This bit implies RARP isn't sent by QEMU out of band */
     VIRTIO_NET_F_GUEST_ANNOUNCE,
@@ -450,6 +454,21 @@ int vhost_net_set_mtu(struct vhost_net *net, uint16_t mtu)
     return vhost_ops->vhost_net_set_mtu(&net->dev, mtu);
 }
 
+/* Moderate the interrupts of ring @idx, 0 for RX and 1 for TX */
+int vhost_net_set_vring_coalesce(struct vhost_net *net, int idx,
+                                 uint32_t usecs, uint32_t frames)
+{
+    const VhostOps *vhost_ops = net->dev.vhost_ops;
+    int index = vhost_ops->vhost_get_vq_index(&net->dev,
+                                              net->dev.vq_index + idx);
+
+    if (!vhost_ops->vhost_set_vring_coalesce) {
+        return -ENOTSUP;
+    }
+
+    return vhost_ops->vhost_set_vring_coalesce(&net->dev, index, usecs, frames);
+}
+
 #else
 uint64_t vhost_net_get_max_queues(VHostNetState *net)
 {
@@ -521,4 +540,10 @@ int vhost_net_set_mtu(struct vhost_net *net, uint16_t mtu)
 {
     return 0;
 }
+
+int vhost_net_set_vring_coalesce(struct vhost_net *net, int idx,
+                                 uint32_t usecs, uint32_t frames)
+{
+    return -ENOTSUP;
+}
 #endif
@@ -22,11 +22,16 @@
 #include "hw/virtio/virtio-net.h"
 #include "net/vhost_net.h"
 #include "hw/virtio/virtio-bus.h"
+#include "block/aio.h"
+#include "block/aio-wait.h"
 #include "qapi/error.h"
+#include "qapi/visitor.h"
 #include "qapi/qapi-events-net.h"
 #include "hw/virtio/virtio-access.h"
 #include "migration/misc.h"
 #include "standard-headers/linux/ethtool.h"
+#include "net_rx_pkt.h"
+#include "trace.h"
 
 #define VIRTIO_NET_VM_VERSION    11
 
@@ -41,6 +46,14 @@
 #define VIRTIO_NET_RX_QUEUE_MIN_SIZE VIRTIO_NET_RX_QUEUE_DEFAULT_SIZE
 #define VIRTIO_NET_TX_QUEUE_MIN_SIZE VIRTIO_NET_TX_QUEUE_DEFAULT_SIZE
 
+/* Packets popped from the TX virtqueue at once */
+#define VIRTIO_NET_TX_BATCH 32
+
+/* Segments that fit in a preallocated element; packets made of more
+ * segments are allocated on the heap.
+ */
+#define VIRTIO_NET_POOL_SG 4
+
 /*
  * Calculate the number of bytes up to and including the given 'field' of
  * 'container'.
@@ -48,6 +61,16 @@
 #define endof(container, field) \
     (offsetof(container, field) + sizeof_field(container, field))
 
+#define VIRTIO_NET_RSS_SUPPORTED_HASHES (VIRTIO_NET_RSS_HASH_TYPE_IPv4 | \
+                                         VIRTIO_NET_RSS_HASH_TYPE_TCPv4 | \
+                                         VIRTIO_NET_RSS_HASH_TYPE_UDPv4 | \
+                                         VIRTIO_NET_RSS_HASH_TYPE_IPv6 | \
+                                         VIRTIO_NET_RSS_HASH_TYPE_TCPv6 | \
+                                         VIRTIO_NET_RSS_HASH_TYPE_UDPv6 | \
+                                         VIRTIO_NET_RSS_HASH_TYPE_IP_EX | \
+                                         VIRTIO_NET_RSS_HASH_TYPE_TCP_EX | \
+                                         VIRTIO_NET_RSS_HASH_TYPE_UDP_EX)
+
 typedef struct VirtIOFeature {
     uint64_t flags;
     size_t end;
@@ -64,6 +87,8 @@ static VirtIOFeature feature_sizes[] = {
      .end = endof(struct virtio_net_config, mtu)},
     {.flags = 1ULL << VIRTIO_NET_F_SPEED_DUPLEX,
      .end = endof(struct virtio_net_config, duplex)},
+    {.flags = (1ULL << VIRTIO_NET_F_RSS) | (1ULL << VIRTIO_NET_F_HASH_REPORT),
+     .end = endof(struct virtio_net_config, supported_hash_types)},
     {}
 };
 
@@ -94,6 +119,11 @@ static void virtio_net_get_config(VirtIODevice *vdev, uint8_t *config)
     memcpy(netcfg.mac, n->mac, ETH_ALEN);
     virtio_stl_p(vdev, &netcfg.speed, n->net_conf.speed);
     netcfg.duplex = n->net_conf.duplex;
+    netcfg.rss_max_key_size = VIRTIO_NET_RSS_MAX_KEY_SIZE;
+    virtio_stw_p(vdev, &netcfg.rss_max_indirection_table_length,
+                 VIRTIO_NET_RSS_MAX_TABLE_LEN);
+    virtio_stl_p(vdev, &netcfg.supported_hash_types,
+                 VIRTIO_NET_RSS_SUPPORTED_HASHES);
     memcpy(config, &netcfg, n->config_size);
 }
 
@@ -129,6 +159,34 @@ static void virtio_net_announce_timer(void *opaque)
     virtio_notify_config(vdev);
 }
 
+/* Hand the moderation settings to the vhost backends running the rings */
+static void virtio_net_vhost_set_coalesce(VirtIONet *n, Error **errp)
+{
+    int queues = n->multiqueue ? n->max_queues : 1;
+    int i, r;
+
+    for (i = 0; i < queues; i++) {
+        NetClientState *nc = qemu_get_subqueue(n->nic, i);
+        VHostNetState *net = get_vhost_net(nc->peer);
+
+        r = vhost_net_set_vring_coalesce(net, 0, n->rx_coalesce.usecs,
+                                         n->rx_coalesce.frames);
+        if (!r) {
+            r = vhost_net_set_vring_coalesce(net, 1, n->tx_coalesce.usecs,
+                                             n->tx_coalesce.frames);
+        }
+        if (r == -ENOTSUP) {
+            error_setg(errp, "vhost backend does not support "
+                       "interrupt coalescing");
+            return;
+        } else if (r < 0) {
+            error_setg(errp, "vhost backend failed to set interrupt "
+                       "coalescing on queue pair %d", i);
+            return;
+        }
+    }
+}
+
 static void virtio_net_vhost_status(VirtIONet *n, uint8_t status)
 {
     VirtIODevice *vdev = VIRTIO_DEVICE(n);
@@ -180,6 +238,13 @@ static void virtio_net_vhost_status(VirtIONet *n, uint8_t status)
             error_report("unable to start vhost net: %d: "
                          "falling back on userspace virtio", -r);
             n->vhost_started = 0;
+        } else if (n->rx_coalesce.usecs || n->tx_coalesce.usecs) {
+            Error *local_err = NULL;
+
+            virtio_net_vhost_set_coalesce(n, &local_err);
+            if (local_err) {
+                warn_report_err(local_err);
+            }
         }
     } else {
         vhost_net_stop(vdev, n->nic->ncs, queues);
@@ -240,11 +305,188 @@ static void virtio_net_vnet_endian_status(VirtIONet *n, uint8_t status)
     }
 }
 
+/* Queue pairs running in an IOThread raise their interrupts through irqfd */
+static void virtio_net_notify_now(VirtIONetQueue *q, VirtQueue *vq)
+{
+    VirtIODevice *vdev = VIRTIO_DEVICE(q->n);
+
+    if (q->ctx) {
+        virtio_notify_irqfd(vdev, vq);
+    } else {
+        virtio_notify(vdev, vq);
+    }
+}
+
+/* Interrupt moderation
+ *
+ * With rx/tx-coalesce-usecs set, the notification for buffers used on a
+ * queue is held back until the oldest of them waited that long, or until
+ * rx/tx-coalesce-frames of them are pending.  The guest still suppresses
+ * notifications as usual when it is polling the ring.
+ */
+
+static void virtio_net_notify(VirtIONetQueue *q, VirtQueue *vq,
+                              unsigned int used)
+{
+    VirtIONet *n = q->n;
+    bool rx = vq == q->rx_vq;
+    VirtIONetCoalesce *c = rx ? &n->rx_coalesce : &n->tx_coalesce;
+    QEMUTimer *timer = rx ? q->rx_notify_timer : q->tx_notify_timer;
+    uint32_t *pending = rx ? &q->rx_notify_pending : &q->tx_notify_pending;
+
+    *pending += used;
+    if (c->usecs && (!c->frames || *pending < c->frames)) {
+        if (!timer_pending(timer)) {
+            timer_mod(timer, qemu_clock_get_us(QEMU_CLOCK_VIRTUAL) + c->usecs);
+        }
+        return;
+    }
+
+    timer_del(timer);
+    *pending = 0;
+    virtio_net_notify_now(q, vq);
+}
+
+/* Deliver, or with @discard forget, the notifications held back on @q */
+static void virtio_net_notify_flush(VirtIONetQueue *q, bool discard)
+{
+    if (!q->rx_notify_timer) {
+        /* The queue pair was removed, see virtio_net_change_num_queues */
+        return;
+    }
+    timer_del(q->rx_notify_timer);
+    timer_del(q->tx_notify_timer);
+    if (q->rx_notify_pending && !discard) {
+        virtio_net_notify_now(q, q->rx_vq);
+    }
+    if (q->tx_notify_pending && !discard) {
+        virtio_net_notify_now(q, q->tx_vq);
+    }
+    q->rx_notify_pending = 0;
+    q->tx_notify_pending = 0;
+}
+
+static AioContext *virtio_net_queue_lock(VirtIONetQueue *q)
+{
+    AioContext *ctx = q->ctx;
+
+    if (ctx) {
+        aio_context_acquire(ctx);
+    }
+    return ctx;
+}
+
+static void virtio_net_queue_unlock(AioContext *ctx)
+{
+    if (ctx) {
+        aio_context_release(ctx);
+    }
+}
+
+static void virtio_net_lock_queues(VirtIONet *n)
+{
+    int i;
+
+    for (i = 0; i < n->max_queues; i++) {
+        virtio_net_queue_lock(&n->vqs[i]);
+    }
+}
+
+static void virtio_net_unlock_queues(VirtIONet *n)
+{
+    int i;
+
+    for (i = 0; i < n->max_queues; i++) {
+        virtio_net_queue_unlock(n->vqs[i].ctx);
+    }
+}
+
+static void virtio_net_rx_notify_timer(void *opaque)
+{
+    VirtIONetQueue *q = opaque;
+    AioContext *ctx = virtio_net_queue_lock(q);
+
+    q->rx_notify_pending = 0;
+    virtio_net_notify_now(q, q->rx_vq);
+    virtio_net_queue_unlock(ctx);
+}
+
+static void virtio_net_tx_notify_timer(void *opaque)
+{
+    VirtIONetQueue *q = opaque;
+    AioContext *ctx = virtio_net_queue_lock(q);
+
+    q->tx_notify_pending = 0;
+    virtio_net_notify_now(q, q->tx_vq);
+    virtio_net_queue_unlock(ctx);
+}
+
+static QEMUTimer *virtio_net_new_notify_timer(VirtIONetQueue *q,
+                                              QEMUTimerCB *cb)
+{
+    if (q->ctx) {
+        return aio_timer_new(q->ctx, QEMU_CLOCK_VIRTUAL, SCALE_US, cb, q);
+    }
+    return timer_new_us(QEMU_CLOCK_VIRTUAL, cb, q);
+}
+
+static void virtio_net_init_notify_timers(VirtIONetQueue *q)
+{
+    q->rx_notify_timer =
+        virtio_net_new_notify_timer(q, virtio_net_rx_notify_timer);
+    q->tx_notify_timer =
+        virtio_net_new_notify_timer(q, virtio_net_tx_notify_timer);
+}
+
+static void virtio_net_free_notify_timers(VirtIONetQueue *q)
+{
+    timer_free(q->rx_notify_timer);
+    timer_free(q->tx_notify_timer);
+    q->rx_notify_timer = NULL;
+    q->tx_notify_timer = NULL;
+}
+
+/* Move @q, and the timers of its held back notifications, to @ctx */
+static void virtio_net_queue_set_aio_context(VirtIONetQueue *q,
+                                             AioContext *ctx)
+{
+    VirtIODevice *vdev = VIRTIO_DEVICE(q->n);
+
+    virtio_net_notify_flush(q, !(vdev->status & VIRTIO_CONFIG_S_DRIVER_OK));
+    virtio_net_free_notify_timers(q);
+    q->ctx = ctx;
+    virtio_net_init_notify_timers(q);
+}
+
+static void virtio_net_disable_rss(VirtIONet *n)
+{
+    n->rss.enabled = false;
+    n->rss.redirect = false;
+}
+
+/* Coalesce the TCP versions for which the guest enabled both RSC and TSO */
+static void virtio_net_update_rsc(VirtIONet *n)
+{
+    uint64_t offloads = n->curr_guest_offloads;
+    bool rsc = virtio_has_feature(offloads, VIRTIO_NET_F_RSC_EXT);
+    int i;
+
+    virtio_net_lock_queues(n);
+    for (i = 0; i < n->max_queues; i++) {
+        net_rx_rsc_set_types(n->vqs[i].rsc,
+                rsc && virtio_has_feature(offloads, VIRTIO_NET_F_GUEST_TSO4),
+                rsc && virtio_has_feature(offloads, VIRTIO_NET_F_GUEST_TSO6));
+    }
+    virtio_net_unlock_queues(n);
+}
+
 static void virtio_net_drop_tx_queue_data(VirtIODevice *vdev, VirtQueue *vq)
 {
+    VirtIONet *n = VIRTIO_NET(vdev);
     unsigned int dropped = virtqueue_drop_all(vq);
     if (dropped) {
-        virtio_notify(vdev, vq);
+        virtio_net_notify(&n->vqs[vq2q(virtio_get_queue_index(vq))], vq,
+                          dropped);
     }
 }
 
@@ -261,6 +503,7 @@ static void virtio_net_set_status(struct VirtIODevice *vdev, uint8_t status)
     for (i = 0; i < n->max_queues; i++) {
         NetClientState *ncs = qemu_get_subqueue(n->nic, i);
         bool queue_started;
+        AioContext *ctx;
         q = &n->vqs[i];
 
         if ((!n->multiqueue && i != 0) || i >= n->curr_queues) {
@@ -271,11 +514,18 @@ static void virtio_net_set_status(struct VirtIODevice *vdev, uint8_t status)
         queue_started =
             virtio_net_started(n, queue_status) && !n->vhost_started;
 
+        ctx = virtio_net_queue_lock(q);
         if (queue_started) {
             qemu_flush_queued_packets(ncs);
+        } else {
+            /* Buffers the driver is waiting for go out with the queue */
+            bool discard = !(queue_status & VIRTIO_CONFIG_S_DRIVER_OK);
+
+            virtio_net_notify_flush(q, discard);
         }
 
         if (!q->tx_waiting) {
+            virtio_net_queue_unlock(ctx);
             continue;
         }
 
@@ -302,6 +552,7 @@ static void virtio_net_set_status(struct VirtIODevice *vdev, uint8_t status)
                 virtio_net_drop_tx_queue_data(vdev, q->tx_vq);
             }
         }
+        virtio_net_queue_unlock(ctx);
     }
 }
 
@@ -452,6 +703,8 @@ static void virtio_net_reset(VirtIODevice *vdev)
     qemu_format_nic_info_str(qemu_get_queue(n->nic), n->mac);
     memset(n->vlans, 0, MAX_VLAN >> 3);
 
+    virtio_net_disable_rss(n);
+
     /* Flush any async TX */
     for (i = 0;  i < n->max_queues; i++) {
         NetClientState *nc = qemu_get_subqueue(n->nic, i);
@@ -460,9 +713,17 @@ static void virtio_net_reset(VirtIODevice *vdev)
             qemu_flush_or_purge_queued_packets(nc->peer, true);
             assert(!virtio_net_get_subqueue(nc)->async_tx.elem);
         }
+        n->vqs[i].rx_pending = 0;
+        net_rx_rsc_set_types(n->vqs[i].rsc, false, false);
     }
 }
 
+/* Queue pairs with a queue of the netdev; the others have no peer */
+static int virtio_net_backend_queues(VirtIONet *n)
+{
+    return MAX(n->nic_conf.peers.queues, 1);
+}
+
 static void peer_test_vnet_hdr(VirtIONet *n)
 {
     NetClientState *nc = qemu_get_queue(n->nic);
@@ -489,14 +750,16 @@ static int peer_has_ufo(VirtIONet *n)
 }
 
 static void virtio_net_set_mrg_rx_bufs(VirtIONet *n, int mergeable_rx_bufs,
-                                       int version_1)
+                                       int version_1, int hash_report)
 {
     int i;
     NetClientState *nc;
 
     n->mergeable_rx_bufs = mergeable_rx_bufs;
 
-    if (version_1) {
+    if (hash_report) {
+        n->guest_hdr_len = sizeof(struct virtio_net_hdr_v1_hash);
+    } else if (version_1) {
         n->guest_hdr_len = sizeof(struct virtio_net_hdr_mrg_rxbuf);
     } else {
         n->guest_hdr_len = n->mergeable_rx_bufs ?
@@ -504,7 +767,7 @@ static void virtio_net_set_mrg_rx_bufs(VirtIONet *n, int mergeable_rx_bufs,
             sizeof(struct virtio_net_hdr);
     }
 
-    for (i = 0; i < n->max_queues; i++) {
+    for (i = 0; i < virtio_net_backend_queues(n); i++) {
         nc = qemu_get_subqueue(n->nic, i);
 
         if (peer_has_vnet_hdr(n) &&
@@ -549,7 +812,7 @@ static int peer_attach(VirtIONet *n, int index)
         return 0;
     }
 
-    if (n->max_queues == 1) {
+    if (virtio_net_backend_queues(n) == 1) {
         return 0;
     }
 
@@ -584,6 +847,8 @@ static void virtio_net_set_queues(VirtIONet *n)
         return;
     }
 
+    /* Netdevs of queue pairs in IOThreads update their handlers there */
+    virtio_net_lock_queues(n);
     for (i = 0; i < n->max_queues; i++) {
         if (i < n->curr_queues) {
             r = peer_attach(n, i);
@@ -593,6 +858,7 @@ static void virtio_net_set_queues(VirtIONet *n)
             assert(!r);
         }
     }
+    virtio_net_unlock_queues(n);
 }
 
 static void virtio_net_set_multiqueue(VirtIONet *n, int multiqueue);
@@ -608,16 +874,32 @@ static uint64_t virtio_net_get_features(VirtIODevice *vdev, uint64_t features,
 
     virtio_add_feature(&features, VIRTIO_NET_F_MAC);
 
+    /* Segments are coalesced by the device model */
+    if (get_vhost_net(nc->peer)) {
+        virtio_clear_feature(&features, VIRTIO_NET_F_RSC_EXT);
+    }
+
     if (!peer_has_vnet_hdr(n)) {
         virtio_clear_feature(&features, VIRTIO_NET_F_CSUM);
         virtio_clear_feature(&features, VIRTIO_NET_F_HOST_TSO4);
         virtio_clear_feature(&features, VIRTIO_NET_F_HOST_TSO6);
         virtio_clear_feature(&features, VIRTIO_NET_F_HOST_ECN);
 
-        virtio_clear_feature(&features, VIRTIO_NET_F_GUEST_CSUM);
-        virtio_clear_feature(&features, VIRTIO_NET_F_GUEST_TSO4);
-        virtio_clear_feature(&features, VIRTIO_NET_F_GUEST_TSO6);
         virtio_clear_feature(&features, VIRTIO_NET_F_GUEST_ECN);
+
+        /* Coalesced segments are the only large packets the guest can
+         * get from such a peer.
+         */
+        if (!virtio_has_feature(features, VIRTIO_NET_F_RSC_EXT)) {
+            virtio_clear_feature(&features, VIRTIO_NET_F_GUEST_CSUM);
+            virtio_clear_feature(&features, VIRTIO_NET_F_GUEST_TSO4);
+            virtio_clear_feature(&features, VIRTIO_NET_F_GUEST_TSO6);
+        }
+    }
+
+    if (!virtio_has_feature(features, VIRTIO_NET_F_GUEST_TSO4) &&
+        !virtio_has_feature(features, VIRTIO_NET_F_GUEST_TSO6)) {
+        virtio_clear_feature(&features, VIRTIO_NET_F_RSC_EXT);
     }
 
     if (!peer_has_vnet_hdr(n) || !peer_has_ufo(n)) {
@@ -625,6 +907,15 @@ static uint64_t virtio_net_get_features(VirtIODevice *vdev, uint64_t features,
         virtio_clear_feature(&features, VIRTIO_NET_F_HOST_UFO);
     }
 
+    /* The hash is computed by the device model, and needs the control
+     * queue to be configured.
+     */
+    if (!virtio_has_feature(features, VIRTIO_NET_F_CTRL_VQ) ||
+        get_vhost_net(nc->peer)) {
+        virtio_clear_feature(&features, VIRTIO_NET_F_RSS);
+        virtio_clear_feature(&features, VIRTIO_NET_F_HASH_REPORT);
+    }
+
     if (!get_vhost_net(nc->peer)) {
         return features;
     }
@@ -664,14 +955,15 @@ static void virtio_net_apply_guest_offloads(VirtIONet *n)
             !!(n->curr_guest_offloads & (1ULL << VIRTIO_NET_F_GUEST_UFO)));
 }
 
-static uint64_t virtio_net_guest_offloads_by_features(uint32_t features)
+static uint64_t virtio_net_guest_offloads_by_features(uint64_t features)
 {
     static const uint64_t guest_offloads_mask =
         (1ULL << VIRTIO_NET_F_GUEST_CSUM) |
         (1ULL << VIRTIO_NET_F_GUEST_TSO4) |
         (1ULL << VIRTIO_NET_F_GUEST_TSO6) |
         (1ULL << VIRTIO_NET_F_GUEST_ECN)  |
-        (1ULL << VIRTIO_NET_F_GUEST_UFO);
+        (1ULL << VIRTIO_NET_F_GUEST_UFO)  |
+        (1ULL << VIRTIO_NET_F_RSC_EXT);
 
     return guest_offloads_mask & features;
 }
@@ -699,13 +991,15 @@ static void virtio_net_set_features(VirtIODevice *vdev, uint64_t features)
                                virtio_has_feature(features,
                                                   VIRTIO_NET_F_MRG_RXBUF),
                                virtio_has_feature(features,
-                                                  VIRTIO_F_VERSION_1));
+                                                  VIRTIO_F_VERSION_1),
+                               virtio_has_feature(features,
+                                                  VIRTIO_NET_F_HASH_REPORT));
 
+    n->curr_guest_offloads = virtio_net_guest_offloads_by_features(features);
     if (n->has_vnet_hdr) {
-        n->curr_guest_offloads =
-            virtio_net_guest_offloads_by_features(features);
         virtio_net_apply_guest_offloads(n);
     }
+    virtio_net_update_rsc(n);
 
     for (i = 0;  i < n->max_queues; i++) {
         NetClientState *nc = qemu_get_subqueue(n->nic, i);
@@ -777,7 +1071,8 @@ static int virtio_net_handle_offloads(VirtIONet *n, uint8_t cmd,
 
         offloads = virtio_ldq_p(vdev, &offloads);
 
-        if (!n->has_vnet_hdr) {
+        if (!n->has_vnet_hdr &&
+            !virtio_vdev_has_feature(vdev, VIRTIO_NET_F_RSC_EXT)) {
             return VIRTIO_NET_ERR;
         }
 
@@ -787,7 +1082,10 @@ static int virtio_net_handle_offloads(VirtIONet *n, uint8_t cmd,
         }
 
         n->curr_guest_offloads = offloads;
-        virtio_net_apply_guest_offloads(n);
+        if (n->has_vnet_hdr) {
+            virtio_net_apply_guest_offloads(n);
+        }
+        virtio_net_update_rsc(n);
 
         return VIRTIO_NET_OK;
     } else {
@@ -937,29 +1235,174 @@ static int virtio_net_handle_announce(VirtIONet *n, uint8_t cmd,
     }
 }
 
+/* Parse VIRTIO_NET_CTRL_MQ_RSS_CONFIG, or VIRTIO_NET_CTRL_MQ_HASH_CONFIG
+ * if @do_rss is false; the latter has the layout of the former with a
+ * single entry indirection table.  Returns the number of queue pairs the
+ * guest asked for, or 0 if the command is invalid.
+ */
+static uint16_t virtio_net_handle_rss(VirtIONet *n, bool do_rss,
+                                      struct iovec *iov, unsigned int iov_cnt)
+{
+    VirtIODevice *vdev = VIRTIO_DEVICE(n);
+    VirtIONetRss *rss = &n->rss;
+    struct virtio_net_rss_config cfg;
+    struct {
+        uint16_t max_tx_vq;
+        uint8_t hash_key_length;
+    } QEMU_PACKED tail;
+    size_t s, offset;
+    uint32_t len;
+    uint16_t queues;
+    const char *err_msg;
+    uint32_t err_value = 0;
+    int i;
+
+    if (!virtio_vdev_has_feature(vdev, do_rss ? VIRTIO_NET_F_RSS :
+                                                VIRTIO_NET_F_HASH_REPORT)) {
+        err_msg = "feature not negotiated";
+        goto error;
+    }
+
+    offset = offsetof(struct virtio_net_rss_config, indirection_table);
+    s = iov_to_buf(iov, iov_cnt, 0, &cfg, offset);
+    if (s != offset) {
+        err_msg = "short command";
+        err_value = s;
+        goto error;
+    }
+
+    rss->hash_types = virtio_ldl_p(vdev, &cfg.hash_types) &
+                      VIRTIO_NET_RSS_SUPPORTED_HASHES;
+    if (do_rss) {
+        len = virtio_lduw_p(vdev, &cfg.indirection_table_mask) + 1;
+        rss->default_queue = virtio_lduw_p(vdev, &cfg.unclassified_queue);
+    } else {
+        len = 1;
+        rss->default_queue = 0;
+    }
+    if (!is_power_of_2(len) || len > VIRTIO_NET_RSS_MAX_TABLE_LEN) {
+        err_msg = "invalid indirection table length";
+        err_value = len;
+        goto error;
+    }
+    if (rss->default_queue >= n->max_queues) {
+        err_msg = "invalid unclassified queue";
+        err_value = rss->default_queue;
+        goto error;
+    }
+    rss->indirections_len = len;
+
+    s = iov_to_buf(iov, iov_cnt, offset, rss->indirections_table,
+                   len * sizeof(uint16_t));
+    if (s != len * sizeof(uint16_t)) {
+        err_msg = "short indirection table";
+        err_value = s;
+        goto error;
+    }
+    offset += s;
+    for (i = 0; i < len; i++) {
+        uint16_t queue = virtio_lduw_p(vdev, &rss->indirections_table[i]);
+
+        if (do_rss && queue >= n->max_queues) {
+            err_msg = "invalid queue in indirection table";
+            err_value = queue;
+            goto error;
+        }
+        rss->indirections_table[i] = do_rss ? queue : 0;
+    }
+
+    s = iov_to_buf(iov, iov_cnt, offset, &tail, sizeof(tail));
+    if (s != sizeof(tail)) {
+        err_msg = "short command";
+        err_value = s;
+        goto error;
+    }
+    offset += s;
+    queues = do_rss ? virtio_lduw_p(vdev, &tail.max_tx_vq) : n->curr_queues;
+    if (queues == 0 || queues > n->max_queues) {
+        err_msg = "invalid number of queues";
+        err_value = queues;
+        goto error;
+    }
+    if (tail.hash_key_length > VIRTIO_NET_RSS_MAX_KEY_SIZE) {
+        err_msg = "invalid key size";
+        err_value = tail.hash_key_length;
+        goto error;
+    }
+    if (!tail.hash_key_length) {
+        if (rss->hash_types) {
+            err_msg = "no key for hash types";
+            err_value = rss->hash_types;
+            goto error;
+        }
+        /* An empty configuration turns the feature off */
+        virtio_net_disable_rss(n);
+        return queues;
+    }
+
+    memset(rss->key, 0, sizeof(rss->key));
+    s = iov_to_buf(iov, iov_cnt, offset, rss->key, tail.hash_key_length);
+    if (s != tail.hash_key_length) {
+        err_msg = "short key";
+        err_value = s;
+        goto error;
+    }
+
+    rss->enabled = true;
+    rss->redirect = do_rss;
+    return queues;
+
+error:
+    trace_virtio_net_rss_error(err_msg, err_value);
+    virtio_net_disable_rss(n);
+    return 0;
+}
+
 static int virtio_net_handle_mq(VirtIONet *n, uint8_t cmd,
                                 struct iovec *iov, unsigned int iov_cnt)
 {
     VirtIODevice *vdev = VIRTIO_DEVICE(n);
     struct virtio_net_ctrl_mq mq;
     size_t s;
-    uint16_t queues;
-
-    s = iov_to_buf(iov, iov_cnt, 0, &mq, sizeof(mq));
-    if (s != sizeof(mq)) {
-        return VIRTIO_NET_ERR;
-    }
+    uint16_t queues = 0;
 
-    if (cmd != VIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET) {
+    /* The RSS state is read by the queue pairs, which may be running in
+     * IOThreads.  Any MQ command replaces it.
+     */
+    virtio_net_lock_queues(n);
+    virtio_net_disable_rss(n);
+    if (cmd == VIRTIO_NET_CTRL_MQ_RSS_CONFIG ||
+        cmd == VIRTIO_NET_CTRL_MQ_HASH_CONFIG) {
+        queues = virtio_net_handle_rss(n, cmd == VIRTIO_NET_CTRL_MQ_RSS_CONFIG,
+                                       iov, iov_cnt);
+    }
+    virtio_net_unlock_queues(n);
+
+    if (cmd == VIRTIO_NET_CTRL_MQ_HASH_CONFIG) {
+        return queues ? VIRTIO_NET_OK : VIRTIO_NET_ERR;
+    } else if (cmd == VIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET) {
+        s = iov_to_buf(iov, iov_cnt, 0, &mq, sizeof(mq));
+        if (s != sizeof(mq)) {
+            return VIRTIO_NET_ERR;
+        }
+        queues = virtio_lduw_p(vdev, &mq.virtqueue_pairs);
+    } else if (cmd != VIRTIO_NET_CTRL_MQ_RSS_CONFIG) {
         return VIRTIO_NET_ERR;
     }
 
-    queues = virtio_lduw_p(vdev, &mq.virtqueue_pairs);
-
+    /* RSS may be used to steer traffic across a single queue pair
+     * without VIRTIO_NET_F_MQ.
+     */
     if (queues < VIRTIO_NET_CTRL_MQ_VQ_PAIRS_MIN ||
         queues > VIRTIO_NET_CTRL_MQ_VQ_PAIRS_MAX ||
         queues > n->max_queues ||
-        !n->multiqueue) {
+        (!n->multiqueue &&
+         (cmd == VIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET || queues > 1))) {
+        if (cmd == VIRTIO_NET_CTRL_MQ_RSS_CONFIG) {
+            virtio_net_lock_queues(n);
+            virtio_net_disable_rss(n);
+            virtio_net_unlock_queues(n);
+        }
         return VIRTIO_NET_ERR;
     }
 
@@ -972,6 +1415,27 @@ static int virtio_net_handle_mq(VirtIONet *n, uint8_t cmd,
     return VIRTIO_NET_OK;
 }
 
+/* The receive filter is read by the queue pairs, which may be running in
+ * IOThreads.
+ */
+static int virtio_net_handle_rx_filter(VirtIONet *n,
+                                       struct virtio_net_ctrl_hdr *ctrl,
+                                       struct iovec *iov, unsigned int iov_cnt)
+{
+    int status;
+
+    virtio_net_lock_queues(n);
+    if (ctrl->class == VIRTIO_NET_CTRL_RX) {
+        status = virtio_net_handle_rx_mode(n, ctrl->cmd, iov, iov_cnt);
+    } else if (ctrl->class == VIRTIO_NET_CTRL_MAC) {
+        status = virtio_net_handle_mac(n, ctrl->cmd, iov, iov_cnt);
+    } else {
+        status = virtio_net_handle_vlan_table(n, ctrl->cmd, iov, iov_cnt);
+    }
+    virtio_net_unlock_queues(n);
+    return status;
+}
+
 static void virtio_net_handle_ctrl(VirtIODevice *vdev, VirtQueue *vq)
 {
     VirtIONet *n = VIRTIO_NET(vdev);
@@ -1001,12 +1465,10 @@ static void virtio_net_handle_ctrl(VirtIODevice *vdev, VirtQueue *vq)
         iov_discard_front(&iov, &iov_cnt, sizeof(ctrl));
         if (s != sizeof(ctrl)) {
             status = VIRTIO_NET_ERR;
-        } else if (ctrl.class == VIRTIO_NET_CTRL_RX) {
-            status = virtio_net_handle_rx_mode(n, ctrl.cmd, iov, iov_cnt);
-        } else if (ctrl.class == VIRTIO_NET_CTRL_MAC) {
-            status = virtio_net_handle_mac(n, ctrl.cmd, iov, iov_cnt);
-        } else if (ctrl.class == VIRTIO_NET_CTRL_VLAN) {
-            status = virtio_net_handle_vlan_table(n, ctrl.cmd, iov, iov_cnt);
+        } else if (ctrl.class == VIRTIO_NET_CTRL_RX ||
+                   ctrl.class == VIRTIO_NET_CTRL_MAC ||
+                   ctrl.class == VIRTIO_NET_CTRL_VLAN) {
+            status = virtio_net_handle_rx_filter(n, &ctrl, iov, iov_cnt);
         } else if (ctrl.class == VIRTIO_NET_CTRL_ANNOUNCE) {
             status = virtio_net_handle_announce(n, ctrl.cmd, iov, iov_cnt);
         } else if (ctrl.class == VIRTIO_NET_CTRL_MQ) {
@@ -1188,8 +1650,142 @@ static int receive_filter(VirtIONet *n, const uint8_t *buf, int size)
     return 0;
 }
 
+/* Publish the buffers filled since the last flush and notify the guest */
+static void virtio_net_rx_flush(VirtIONetQueue *q)
+{
+    if (q->rx_pending) {
+        virtqueue_flush(q->rx_vq, q->rx_pending);
+        virtio_net_notify(q, q->rx_vq, q->rx_pending);
+        q->rx_pending = 0;
+    }
+}
+
+static void virtio_net_flush_batch(NetClientState *nc)
+{
+    rcu_read_lock();
+    virtio_net_rx_flush(virtio_net_get_subqueue(nc));
+    rcu_read_unlock();
+}
+
+typedef struct VirtIONetRxHash {
+    uint32_t value;
+    uint16_t report;
+} VirtIONetRxHash;
+
+static void receive_hash(VirtIODevice *vdev, const struct iovec *iov,
+                         int iov_cnt, const VirtIONetRxHash *hash)
+{
+    struct virtio_net_hdr_v1_hash hdr;
+    size_t offset = offsetof(struct virtio_net_hdr_v1_hash, hash_value);
+
+    virtio_stl_p(vdev, &hdr.hash_value, hash->value);
+    virtio_stw_p(vdev, &hdr.hash_report, hash->report);
+    hdr.padding = 0;
+    iov_from_buf(iov, iov_cnt, offset, &hdr.hash_value, sizeof(hdr) - offset);
+}
+
+/* With RSC_INFO, csum_start and csum_offset carry the number of merged
+ * segments and of duplicate ACKs, which are never merged here.
+ */
+static void receive_rsc(VirtIODevice *vdev, const struct iovec *iov,
+                        int iov_cnt, const NetRxRscInfo *rsc)
+{
+    struct virtio_net_hdr hdr = {
+        .flags = VIRTIO_NET_HDR_F_DATA_VALID | VIRTIO_NET_HDR_F_RSC_INFO,
+        .gso_type = rsc->ipv6 ? VIRTIO_NET_HDR_GSO_TCPV6 :
+                                VIRTIO_NET_HDR_GSO_TCPV4,
+    };
+
+    virtio_stw_p(vdev, &hdr.hdr_len, rsc->hdr_len);
+    virtio_stw_p(vdev, &hdr.gso_size, rsc->mss);
+    virtio_stw_p(vdev, &hdr.csum_start, rsc->segments);
+    virtio_stw_p(vdev, &hdr.csum_offset, 0);
+    iov_from_buf(iov, iov_cnt, 0, &hdr, sizeof(hdr));
+}
+
+static int virtio_net_rss_hash_type(struct NetRxPkt *pkt, uint32_t types)
+{
+    bool isip4, isip6, isudp, istcp;
+
+    net_rx_pkt_get_protocols(pkt, &isip4, &isip6, &isudp, &istcp);
+    if (isip4) {
+        if (istcp && (types & VIRTIO_NET_RSS_HASH_TYPE_TCPv4)) {
+            return NetPktRssIpV4Tcp;
+        }
+        if (isudp && (types & VIRTIO_NET_RSS_HASH_TYPE_UDPv4)) {
+            return NetPktRssIpV4Udp;
+        }
+        if (types & VIRTIO_NET_RSS_HASH_TYPE_IPv4) {
+            return NetPktRssIpV4;
+        }
+    } else if (isip6) {
+        if (istcp && (types & VIRTIO_NET_RSS_HASH_TYPE_TCP_EX)) {
+            return NetPktRssIpV6TcpEx;
+        }
+        if (istcp && (types & VIRTIO_NET_RSS_HASH_TYPE_TCPv6)) {
+            return NetPktRssIpV6Tcp;
+        }
+        if (isudp && (types & VIRTIO_NET_RSS_HASH_TYPE_UDP_EX)) {
+            return NetPktRssIpV6UdpEx;
+        }
+        if (isudp && (types & VIRTIO_NET_RSS_HASH_TYPE_UDPv6)) {
+            return NetPktRssIpV6Udp;
+        }
+        if (types & VIRTIO_NET_RSS_HASH_TYPE_IP_EX) {
+            return NetPktRssIpV6Ex;
+        }
+        if (types & VIRTIO_NET_RSS_HASH_TYPE_IPv6) {
+            return NetPktRssIpV6;
+        }
+    }
+    return -1;
+}
+
+static const uint16_t virtio_net_hash_reports[] = {
+    [NetPktRssIpV4] = VIRTIO_NET_HASH_REPORT_IPv4,
+    [NetPktRssIpV4Tcp] = VIRTIO_NET_HASH_REPORT_TCPv4,
+    [NetPktRssIpV6Tcp] = VIRTIO_NET_HASH_REPORT_TCPv6,
+    [NetPktRssIpV6] = VIRTIO_NET_HASH_REPORT_IPv6,
+    [NetPktRssIpV6Ex] = VIRTIO_NET_HASH_REPORT_IPv6_EX,
+    [NetPktRssIpV6TcpEx] = VIRTIO_NET_HASH_REPORT_TCPv6_EX,
+    [NetPktRssIpV4Udp] = VIRTIO_NET_HASH_REPORT_UDPv4,
+    [NetPktRssIpV6Udp] = VIRTIO_NET_HASH_REPORT_UDPv6,
+    [NetPktRssIpV6UdpEx] = VIRTIO_NET_HASH_REPORT_UDPv6_EX,
+};
+
+/* Hash a packet received on queue pair @index with the Toeplitz function
+ * and return the queue pair it should be delivered to.
+ */
+static int virtio_net_process_rss(VirtIONet *n, int index,
+                                  const uint8_t *buf, size_t size,
+                                  VirtIONetRxHash *hash)
+{
+    VirtIONetRss *rss = &n->rss;
+    struct NetRxPkt *pkt = n->vqs[index].rx_pkt;
+    int type;
+
+    if (size <= n->host_hdr_len) {
+        return index;
+    }
+
+    net_rx_pkt_set_protocols(pkt, buf + n->host_hdr_len,
+                             size - n->host_hdr_len);
+    type = virtio_net_rss_hash_type(pkt, rss->hash_types);
+    if (type < 0) {
+        return rss->redirect ? rss->default_queue : index;
+    }
+
+    hash->value = net_rx_pkt_calc_rss_hash(pkt, type, rss->key);
+    hash->report = virtio_net_hash_reports[type];
+    if (!rss->redirect) {
+        return index;
+    }
+    return rss->indirections_table[hash->value & (rss->indirections_len - 1)];
+}
+
 static ssize_t virtio_net_receive_rcu(NetClientState *nc, const uint8_t *buf,
-                                      size_t size)
+                                      size_t size, const VirtIONetRxHash *hash,
+                                      const NetRxRscInfo *rsc)
 {
     VirtIONet *n = qemu_get_nic_opaque(nc);
     VirtIONetQueue *q = virtio_net_get_subqueue(nc);
@@ -1220,8 +1816,7 @@ static ssize_t virtio_net_receive_rcu(NetClientState *nc, const uint8_t *buf,
 
         total = 0;
 
-        elem = virtqueue_pop(q->rx_vq, sizeof(VirtQueueElement));
-        if (!elem) {
+        if (!virtqueue_pop_batch(q->rx_vq, q->rx_pool, &elem, 1)) {
             if (i) {
                 virtio_error(vdev, "virtio-net unexpected empty queue: "
                              "i %zd mergeable %d offset %zd, size %zd, "
@@ -1238,7 +1833,7 @@ static ssize_t virtio_net_receive_rcu(NetClientState *nc, const uint8_t *buf,
             virtio_error(vdev,
                          "virtio-net receive queue contains no in buffers");
             virtqueue_detach_element(q->rx_vq, elem, 0);
-            g_free(elem);
+            virtqueue_element_free(elem);
             return -1;
         }
 
@@ -1253,6 +1848,12 @@ static ssize_t virtio_net_receive_rcu(NetClientState *nc, const uint8_t *buf,
             }
 
             receive_header(n, sg, elem->in_num, buf, size);
+            if (rsc) {
+                receive_rsc(vdev, sg, elem->in_num, rsc);
+            }
+            if (virtio_vdev_has_feature(vdev, VIRTIO_NET_F_HASH_REPORT)) {
+                receive_hash(vdev, sg, elem->in_num, hash);
+            }
             offset = n->host_hdr_len;
             total += n->guest_hdr_len;
             guest_offset = n->guest_hdr_len;
@@ -1270,13 +1871,13 @@ static ssize_t virtio_net_receive_rcu(NetClientState *nc, const uint8_t *buf,
          * Otherwise, drop it. */
         if (!n->mergeable_rx_bufs && offset < size) {
             virtqueue_unpop(q->rx_vq, elem, total);
-            g_free(elem);
+            virtqueue_element_free(elem);
             return size;
         }
 
         /* signal other side */
-        virtqueue_fill(q->rx_vq, elem, total, i++);
-        g_free(elem);
+        virtqueue_fill(q->rx_vq, elem, total, q->rx_pending + i++);
+        virtqueue_element_free(elem);
     }
 
     if (mhdr_cnt) {
@@ -1286,49 +1887,208 @@ static ssize_t virtio_net_receive_rcu(NetClientState *nc, const uint8_t *buf,
                      &mhdr.num_buffers, sizeof mhdr.num_buffers);
     }
 
-    virtqueue_flush(q->rx_vq, i);
-    virtio_notify(vdev, q->rx_vq);
+    q->rx_pending += i;
+    if (!nc->receive_batching) {
+        virtio_net_rx_flush(q);
+    }
 
     return size;
 }
 
-static ssize_t virtio_net_receive(NetClientState *nc, const uint8_t *buf,
-                                  size_t size)
+/* Called by the coalescer of the queue pair for the frames it held */
+static ssize_t virtio_net_rsc_deliver(void *opaque, const uint8_t *buf,
+                                      size_t size, const NetRxRscInfo *info)
 {
+    VirtIONetQueue *q = opaque;
+    VirtIONet *n = q->n;
+    NetClientState *nc = qemu_get_subqueue(n->nic, q - n->vqs);
+    VirtIONetRxHash hash = { 0, VIRTIO_NET_HASH_REPORT_NONE };
     ssize_t r;
 
     rcu_read_lock();
-    r = virtio_net_receive_rcu(nc, buf, size);
+    if (n->rss.enabled) {
+        /* The flow already is on its queue pair, only the hash is needed */
+        virtio_net_process_rss(n, nc->queue_index, buf, size, &hash);
+    }
+    r = virtio_net_receive_rcu(nc, buf, size, &hash, info);
     rcu_read_unlock();
     return r;
 }
 
-static int32_t virtio_net_flush_tx(VirtIONetQueue *q);
-
-static void virtio_net_tx_complete(NetClientState *nc, ssize_t len)
+static ssize_t virtio_net_rsc_receive(NetClientState *nc, const uint8_t *buf,
+                                      size_t size)
 {
     VirtIONet *n = qemu_get_nic_opaque(nc);
-    VirtIONetQueue *q = virtio_net_get_subqueue(nc);
-    VirtIODevice *vdev = VIRTIO_DEVICE(n);
-
-    virtqueue_push(q->tx_vq, q->async_tx.elem, 0);
-    virtio_notify(vdev, q->tx_vq);
+    int flags = 0;
 
-    g_free(q->async_tx.elem);
-    q->async_tx.elem = NULL;
+    if (n->has_vnet_hdr) {
+        const struct virtio_net_hdr *hdr = (const void *)buf;
 
-    virtio_queue_set_notification(q->tx_vq, 1);
-    virtio_net_flush_tx(q);
+        if (size < sizeof(*hdr)) {
+            return -1;
+        }
+        if (hdr->flags & (VIRTIO_NET_HDR_F_NEEDS_CSUM |
+                          VIRTIO_NET_HDR_F_DATA_VALID)) {
+            flags |= NET_RX_RSC_CSUM_VALID;
+        }
+        if (hdr->gso_type != VIRTIO_NET_HDR_GSO_NONE) {
+            flags |= NET_RX_RSC_NO_MERGE;
+        }
+    }
+    return net_rx_rsc_receive(virtio_net_get_subqueue(nc)->rsc, buf, size,
+                              n->host_hdr_len, flags);
+}
+
+static ssize_t virtio_net_receive(NetClientState *nc, const uint8_t *buf,
+                                  size_t size)
+{
+    VirtIONet *n = qemu_get_nic_opaque(nc);
+    VirtIONetRxHash hash = { 0, VIRTIO_NET_HASH_REPORT_NONE };
+    bool steered = false;
+    ssize_t r;
+
+    rcu_read_lock();
+    if (n->rss.enabled) {
+        int index = virtio_net_process_rss(n, nc->queue_index, buf, size,
+                                           &hash);
+
+        /* Only steer to queue pairs served by the same AioContext, whose
+         * lock is already held; taking the lock of another IOThread here
+         * could deadlock against it.  Otherwise the packet stays on the
+         * queue pair of the netdev queue, see docs/virtio-net-rss.txt.
+         */
+        if (index != nc->queue_index) {
+            if (n->vqs[index].ctx == n->vqs[nc->queue_index].ctx) {
+                nc = qemu_get_subqueue(n->nic, index);
+                steered = true;
+            } else {
+                trace_virtio_net_rss_not_steered(n, nc->queue_index, index);
+            }
+        }
+    }
+    r = -1;
+    if (virtio_has_feature(n->curr_guest_offloads, VIRTIO_NET_F_RSC_EXT) &&
+        virtio_net_can_receive(nc)) {
+        r = virtio_net_rsc_receive(nc, buf, size);
+    }
+    if (r < 0) {
+        r = virtio_net_receive_rcu(nc, buf, size, &hash, NULL);
+    }
+    rcu_read_unlock();
+
+    /* The packet was not queued on the receiving net client; a full ring
+     * drops it, like on a physical NIC.
+     */
+    if (steered && r <= 0) {
+        r = size;
+    }
+    return r;
+}
+
+static int32_t virtio_net_flush_tx(VirtIONetQueue *q);
+
+static void virtio_net_tx_complete(NetClientState *nc, ssize_t len)
+{
+    VirtIONetQueue *q = virtio_net_get_subqueue(nc);
+
+    virtqueue_push(q->tx_vq, q->async_tx.elem, 0);
+    virtio_net_notify(q, q->tx_vq, 1);
+
+    virtqueue_element_free(q->async_tx.elem);
+    q->async_tx.elem = NULL;
+
+    virtio_queue_set_notification(q->tx_vq, 1);
+    virtio_net_flush_tx(q);
 }
 
 /* TX */
-static int32_t virtio_net_flush_tx(VirtIONetQueue *q)
+
+/* Queue pairs past those of the netdev send through one that has a netdev
+ * queue.  They are all in the main loop, see virtio_net_device_realize.
+ */
+static NetClientState *virtio_net_tx_client(VirtIONet *n, int queue_index)
+{
+    return qemu_get_subqueue(n->nic,
+                             queue_index % virtio_net_backend_queues(n));
+}
+
+/* Returns 1 once @elem was sent or dropped, 0 if it is being sent
+ * asynchronously, or -EINVAL if the device is broken.
+ */
+static int virtio_net_tx_elem(VirtIONetQueue *q, VirtQueueElement *elem)
 {
     VirtIONet *n = q->n;
     VirtIODevice *vdev = VIRTIO_DEVICE(n);
-    VirtQueueElement *elem;
-    int32_t num_packets = 0;
     int queue_index = vq2q(virtio_get_queue_index(q->tx_vq));
+    NetClientState *nc;
+    ssize_t ret;
+    unsigned int out_num;
+    struct iovec sg[VIRTQUEUE_MAX_SIZE], sg2[VIRTQUEUE_MAX_SIZE + 1], *out_sg;
+    struct virtio_net_hdr_v1_hash mhdr;
+
+    out_num = elem->out_num;
+    out_sg = elem->out_sg;
+    if (out_num < 1) {
+        virtio_error(vdev, "virtio-net header not in first element");
+        return -EINVAL;
+    }
+
+    if (n->has_vnet_hdr) {
+        if (iov_to_buf(out_sg, out_num, 0, &mhdr, n->guest_hdr_len) <
+            n->guest_hdr_len) {
+            virtio_error(vdev, "virtio-net header incorrect");
+            return -EINVAL;
+        }
+        if (n->needs_vnet_hdr_swap) {
+            virtio_net_hdr_swap(vdev, (void *) &mhdr);
+            sg2[0].iov_base = &mhdr;
+            sg2[0].iov_len = n->guest_hdr_len;
+            out_num = iov_copy(&sg2[1], ARRAY_SIZE(sg2) - 1,
+                               out_sg, out_num,
+                               n->guest_hdr_len, -1);
+            if (out_num == VIRTQUEUE_MAX_SIZE) {
+                return 1;
+            }
+            out_num += 1;
+            out_sg = sg2;
+        }
+    }
+    /*
+     * If host wants to see the guest header as is, we can
+     * pass it on unchanged. Otherwise, copy just the parts
+     * that host is interested in.
+     */
+    assert(n->host_hdr_len <= n->guest_hdr_len);
+    if (n->host_hdr_len != n->guest_hdr_len) {
+        unsigned sg_num = iov_copy(sg, ARRAY_SIZE(sg),
+                                   out_sg, out_num,
+                                   0, n->host_hdr_len);
+        sg_num += iov_copy(sg + sg_num, ARRAY_SIZE(sg) - sg_num,
+                         out_sg, out_num,
+                         n->guest_hdr_len, -1);
+        out_num = sg_num;
+        out_sg = sg;
+    }
+
+    nc = virtio_net_tx_client(n, queue_index);
+    if (nc->queue_index != queue_index) {
+        /* Without flow control, a full netdev queue drops the packet */
+        qemu_sendv_packet_async(nc, out_sg, out_num, NULL);
+        return 1;
+    }
+    ret = qemu_sendv_packet_async(nc, out_sg, out_num, virtio_net_tx_complete);
+    return ret != 0;
+}
+
+static int32_t virtio_net_tx_burst(VirtIONetQueue *q)
+{
+    VirtIONet *n = q->n;
+    VirtIODevice *vdev = VIRTIO_DEVICE(n);
+    VirtQueueElement *elems[VIRTIO_NET_TX_BATCH];
+    unsigned int i, count, done;
+    int32_t num_packets = 0;
+    int ret;
+
     if (!(vdev->status & VIRTIO_CONFIG_S_DRIVER_OK)) {
         return num_packets;
     }
@@ -1338,85 +2098,64 @@ static int32_t virtio_net_flush_tx(VirtIONetQueue *q)
         return num_packets;
     }
 
-    for (;;) {
-        ssize_t ret;
-        unsigned int out_num;
-        struct iovec sg[VIRTQUEUE_MAX_SIZE], sg2[VIRTQUEUE_MAX_SIZE + 1], *out_sg;
-        struct virtio_net_hdr_mrg_rxbuf mhdr;
-
-        elem = virtqueue_pop(q->tx_vq, sizeof(VirtQueueElement));
-        if (!elem) {
+    while (num_packets < n->tx_burst) {
+        count = virtqueue_pop_batch(q->tx_vq, q->tx_pool, elems,
+                                    MIN(ARRAY_SIZE(elems),
+                                        n->tx_burst - num_packets));
+        if (!count) {
             break;
         }
 
-        out_num = elem->out_num;
-        out_sg = elem->out_sg;
-        if (out_num < 1) {
-            virtio_error(vdev, "virtio-net header not in first element");
-            virtqueue_detach_element(q->tx_vq, elem, 0);
-            g_free(elem);
-            return -EINVAL;
+        for (done = 0; done < count; done++) {
+            ret = virtio_net_tx_elem(q, elems[done]);
+            if (ret <= 0) {
+                break;
+            }
         }
 
-        if (n->has_vnet_hdr) {
-            if (iov_to_buf(out_sg, out_num, 0, &mhdr, n->guest_hdr_len) <
-                n->guest_hdr_len) {
-                virtio_error(vdev, "virtio-net header incorrect");
-                virtqueue_detach_element(q->tx_vq, elem, 0);
-                g_free(elem);
-                return -EINVAL;
-            }
-            if (n->needs_vnet_hdr_swap) {
-                virtio_net_hdr_swap(vdev, (void *) &mhdr);
-                sg2[0].iov_base = &mhdr;
-                sg2[0].iov_len = n->guest_hdr_len;
-                out_num = iov_copy(&sg2[1], ARRAY_SIZE(sg2) - 1,
-                                   out_sg, out_num,
-                                   n->guest_hdr_len, -1);
-                if (out_num == VIRTQUEUE_MAX_SIZE) {
-                    goto drop;
-		}
-                out_num += 1;
-                out_sg = sg2;
-	    }
+        /* Give back the packets that are gone with a single notification */
+        if (done) {
+            virtqueue_fill_batch(q->tx_vq, elems, NULL, done);
+            virtio_net_notify(q, q->tx_vq, done);
+            num_packets += done;
+        }
+        for (i = 0; i < done; i++) {
+            virtqueue_element_free(elems[i]);
+        }
+        if (done == count) {
+            continue;
+        }
+
+        /* The packets after the one that stopped us are fetched again later */
+        for (i = count - 1; i > done; i--) {
+            virtqueue_unpop(q->tx_vq, elems[i], 0);
+            virtqueue_element_free(elems[i]);
         }
-        /*
-         * If host wants to see the guest header as is, we can
-         * pass it on unchanged. Otherwise, copy just the parts
-         * that host is interested in.
-         */
-        assert(n->host_hdr_len <= n->guest_hdr_len);
-        if (n->host_hdr_len != n->guest_hdr_len) {
-            unsigned sg_num = iov_copy(sg, ARRAY_SIZE(sg),
-                                       out_sg, out_num,
-                                       0, n->host_hdr_len);
-            sg_num += iov_copy(sg + sg_num, ARRAY_SIZE(sg) - sg_num,
-                             out_sg, out_num,
-                             n->guest_hdr_len, -1);
-            out_num = sg_num;
-            out_sg = sg;
-        }
-
-        ret = qemu_sendv_packet_async(qemu_get_subqueue(n->nic, queue_index),
-                                      out_sg, out_num, virtio_net_tx_complete);
         if (ret == 0) {
             virtio_queue_set_notification(q->tx_vq, 0);
-            q->async_tx.elem = elem;
+            q->async_tx.elem = elems[done];
             return -EBUSY;
         }
-
-drop:
-        virtqueue_push(q->tx_vq, elem, 0);
-        virtio_notify(vdev, q->tx_vq);
-        g_free(elem);
-
-        if (++num_packets >= n->tx_burst) {
-            break;
-        }
+        virtqueue_detach_element(q->tx_vq, elems[done], 0);
+        virtqueue_element_free(elems[done]);
+        return -EINVAL;
     }
     return num_packets;
 }
 
+static int32_t virtio_net_flush_tx(VirtIONetQueue *q)
+{
+    int queue_index = vq2q(virtio_get_queue_index(q->tx_vq));
+    NetClientState *nc = virtio_net_tx_client(q->n, queue_index);
+    int32_t ret;
+
+    /* Let the peer push the whole burst to its device at once */
+    qemu_send_batch_begin(nc);
+    ret = virtio_net_tx_burst(q);
+    qemu_send_batch_end(nc);
+    return ret;
+}
+
 static void virtio_net_handle_tx_timer(VirtIODevice *vdev, VirtQueue *vq)
 {
     VirtIONet *n = VIRTIO_NET(vdev);
@@ -1542,6 +2281,294 @@ static void virtio_net_tx_bh(void *opaque)
     }
 }
 
+/* IOThreads
+ *
+ * While ioeventfd is active, a queue pair with an IOThread has the host
+ * notifiers of both virtqueues, its TX bottom half and its peer's file
+ * descriptors handled in that IOThread, which holds its AioContext while
+ * doing so.  The control virtqueue always stays in the main loop.
+ */
+
+static bool virtio_net_rx_aio_output(VirtIODevice *vdev, VirtQueue *vq)
+{
+    VirtIONet *n = VIRTIO_NET(vdev);
+    VirtIONetQueue *q = &n->vqs[vq2q(virtio_get_queue_index(vq))];
+
+    aio_context_acquire(q->ctx);
+    virtio_net_handle_rx(vdev, vq);
+    aio_context_release(q->ctx);
+
+    /* A non-empty RX ring is the normal state, don't keep polling it */
+    return false;
+}
+
+static bool virtio_net_tx_aio_output(VirtIODevice *vdev, VirtQueue *vq)
+{
+    VirtIONet *n = VIRTIO_NET(vdev);
+    VirtIONetQueue *q = &n->vqs[vq2q(virtio_get_queue_index(vq))];
+    bool progress;
+
+    aio_context_acquire(q->ctx);
+    progress = !q->tx_waiting;
+    virtio_net_handle_tx_bh(vdev, vq);
+    aio_context_release(q->ctx);
+    return progress;
+}
+
+static void virtio_net_tx_aio_bh(void *opaque)
+{
+    VirtIONetQueue *q = opaque;
+    AioContext *ctx = q->ctx;
+
+    aio_context_acquire(ctx);
+    virtio_net_tx_bh(q);
+    aio_context_release(ctx);
+}
+
+/* Context: QEMU global mutex held */
+static void virtio_net_iothread_start_queue(VirtIONetQueue *q,
+                                            NetClientState *nc)
+{
+    AioContext *ctx = iothread_get_aio_context(q->iothread);
+
+    if (!nc->peer) {
+        warn_report("virtio-net: queue %d has no netdev, using the main loop",
+                    nc->queue_index);
+        return;
+    }
+
+    /* Filters expect the QEMU global mutex, see qemu_net_client_in_iothread */
+    if (!QTAILQ_EMPTY(&nc->peer->filters)) {
+        warn_report("virtio-net: netdev '%s' has filters, "
+                    "queue %d stays in the main loop",
+                    nc->peer->name, nc->queue_index);
+        return;
+    }
+
+    aio_context_acquire(ctx);
+    virtio_net_queue_set_aio_context(q, ctx);
+    if (qemu_set_net_aio_context(nc->peer, ctx)) {
+        qemu_set_net_aio_context(nc, ctx);
+    } else {
+        /* The netdev stays in the main loop and packets cross over */
+        qemu_set_net_handoff(nc, ctx);
+        q->handoff = true;
+    }
+    net_rx_rsc_set_aio_context(q->rsc, ctx);
+
+    qemu_bh_delete(q->tx_bh);
+    q->tx_bh = aio_bh_new(ctx, virtio_net_tx_aio_bh, q);
+    if (q->tx_waiting) {
+        qemu_bh_schedule(q->tx_bh);
+    }
+
+    event_notifier_set_handler(virtio_queue_get_host_notifier(q->rx_vq), NULL);
+    event_notifier_set_handler(virtio_queue_get_host_notifier(q->tx_vq), NULL);
+    virtio_queue_aio_set_host_notifier_handler(q->rx_vq, ctx,
+                                               virtio_net_rx_aio_output);
+    virtio_queue_aio_set_host_notifier_handler(q->tx_vq, ctx,
+                                               virtio_net_tx_aio_output);
+    aio_context_release(ctx);
+
+    /* Pick up whatever was kicked while the handlers moved */
+    event_notifier_set(virtio_queue_get_host_notifier(q->rx_vq));
+    event_notifier_set(virtio_queue_get_host_notifier(q->tx_vq));
+}
+
+/* Context: IOThread of the queue pair */
+static void virtio_net_iothread_stop_queue_bh(void *opaque)
+{
+    VirtIONetQueue *q = opaque;
+    VirtIONet *n = q->n;
+    NetClientState *nc = qemu_get_subqueue(n->nic, q - n->vqs);
+
+    virtio_queue_aio_set_host_notifier_handler(q->rx_vq, q->ctx, NULL);
+    virtio_queue_aio_set_host_notifier_handler(q->tx_vq, q->ctx, NULL);
+
+    qemu_bh_delete(q->tx_bh);
+    q->tx_bh = qemu_bh_new(virtio_net_tx_bh, q);
+    if (q->tx_waiting) {
+        qemu_bh_schedule(q->tx_bh);
+    }
+
+    if (q->handoff) {
+        qemu_set_net_handoff(nc, NULL);
+        q->handoff = false;
+    } else {
+        if (nc->peer) {
+            qemu_set_net_aio_context(nc->peer, NULL);
+        }
+        qemu_set_net_aio_context(nc, NULL);
+    }
+    net_rx_rsc_set_aio_context(q->rsc, NULL);
+    virtio_net_queue_set_aio_context(q, NULL);
+}
+
+/* Context: QEMU global mutex held */
+static void virtio_net_iothreads_start(VirtIONet *n)
+{
+    VirtIODevice *vdev = VIRTIO_DEVICE(n);
+    BusState *qbus = qdev_get_parent_bus(DEVICE(vdev));
+    VirtioBusClass *k = VIRTIO_BUS_GET_CLASS(qbus);
+    int queues = n->multiqueue ? n->max_queues : 1;
+    int i, r;
+
+    if (n->iothreads_started || n->iothreads_disabled) {
+        return;
+    }
+
+    if (!k->set_guest_notifiers) {
+        error_report("virtio-net: binding does not support guest notifiers");
+        goto fail;
+    }
+
+    /* Masking is only implemented for vhost, so let the transport drop
+     * the irqfds of masked vectors instead.
+     */
+    n->iothreads_saved_notifier_mask = vdev->use_guest_notifier_mask;
+    vdev->use_guest_notifier_mask = false;
+    r = k->set_guest_notifiers(qbus->parent, queues * 2, true);
+    if (r != 0) {
+        vdev->use_guest_notifier_mask = n->iothreads_saved_notifier_mask;
+        error_report("virtio-net: Failed to set guest notifiers (%d), "
+                     "ensure -accel kvm is set.", r);
+        goto fail;
+    }
+
+    for (i = 0; i < queues; i++) {
+        if (n->vqs[i].iothread) {
+            virtio_net_iothread_start_queue(&n->vqs[i],
+                                            qemu_get_subqueue(n->nic, i));
+        }
+    }
+    n->iothreads_started = true;
+    return;
+
+fail:
+    /* Stay in the main loop until ioeventfd is stopped */
+    n->iothreads_disabled = true;
+}
+
+/* Context: QEMU global mutex held */
+static void virtio_net_iothreads_stop(VirtIONet *n)
+{
+    VirtIODevice *vdev = VIRTIO_DEVICE(n);
+    BusState *qbus = qdev_get_parent_bus(DEVICE(vdev));
+    VirtioBusClass *k = VIRTIO_BUS_GET_CLASS(qbus);
+    int queues = n->multiqueue ? n->max_queues : 1;
+    int i;
+
+    /* Better luck next time. */
+    if (n->iothreads_disabled) {
+        n->iothreads_disabled = false;
+        return;
+    }
+    if (!n->iothreads_started) {
+        return;
+    }
+
+    for (i = 0; i < queues; i++) {
+        VirtIONetQueue *q = &n->vqs[i];
+        AioContext *ctx = q->ctx;
+
+        if (!ctx) {
+            continue;
+        }
+        aio_context_acquire(ctx);
+        aio_wait_bh_oneshot(ctx, virtio_net_iothread_stop_queue_bh, q);
+        aio_context_release(ctx);
+    }
+
+    k->set_guest_notifiers(qbus->parent, queues * 2, false);
+    vdev->use_guest_notifier_mask = n->iothreads_saved_notifier_mask;
+    n->iothreads_started = false;
+}
+
+static int virtio_net_start_ioeventfd(VirtIODevice *vdev)
+{
+    VirtIONet *n = VIRTIO_NET(vdev);
+    int r;
+
+    r = virtio_device_start_ioeventfd_impl(vdev);
+    if (r < 0) {
+        return r;
+    }
+    if (n->num_iothreads) {
+        virtio_net_iothreads_start(n);
+    }
+    return 0;
+}
+
+static void virtio_net_stop_ioeventfd(VirtIODevice *vdev)
+{
+    VirtIONet *n = VIRTIO_NET(vdev);
+
+    virtio_net_iothreads_stop(n);
+    virtio_device_stop_ioeventfd_impl(vdev);
+}
+
+static bool virtio_net_check_iothreads(VirtIONet *n, Error **errp)
+{
+    virtio_net_conf *conf = &n->net_conf;
+    uint32_t i;
+
+    if (!conf->iothread && !conf->num_iothread_vq_mapping) {
+        return true;
+    }
+    if (conf->iothread && conf->num_iothread_vq_mapping) {
+        error_setg(errp, "iothread and iothread-vq-mapping are mutually "
+                   "exclusive");
+        return false;
+    }
+    if (conf->tx && !strcmp(conf->tx, "timer")) {
+        error_setg(errp, "tx=timer cannot be used with IOThreads");
+        return false;
+    }
+    for (i = 0; i < conf->num_iothread_vq_mapping; i++) {
+        const char *id = conf->iothread_vq_mapping[i];
+
+        if (!id || !iothread_by_id(id)) {
+            error_setg(errp, "iothread-vq-mapping[%" PRIu32 "]: "
+                       "IOThread '%s' not found", i, id ? id : "");
+            return false;
+        }
+    }
+    return true;
+}
+
+static void virtio_net_get_iothreads(VirtIONet *n)
+{
+    virtio_net_conf *conf = &n->net_conf;
+    uint32_t i;
+
+    if (conf->iothread) {
+        n->num_iothreads = 1;
+        n->iothreads = g_new(IOThread *, 1);
+        n->iothreads[0] = conf->iothread;
+    } else {
+        n->num_iothreads = conf->num_iothread_vq_mapping;
+        n->iothreads = g_new(IOThread *, n->num_iothreads);
+        for (i = 0; i < n->num_iothreads; i++) {
+            n->iothreads[i] = iothread_by_id(conf->iothread_vq_mapping[i]);
+        }
+    }
+    for (i = 0; i < n->num_iothreads; i++) {
+        object_ref(OBJECT(n->iothreads[i]));
+    }
+}
+
+static void virtio_net_put_iothreads(VirtIONet *n)
+{
+    uint32_t i;
+
+    for (i = 0; i < n->num_iothreads; i++) {
+        object_unref(OBJECT(n->iothreads[i]));
+    }
+    g_free(n->iothreads);
+    n->iothreads = NULL;
+    n->num_iothreads = 0;
+}
+
 static void virtio_net_add_queue(VirtIONet *n, int index)
 {
     VirtIODevice *vdev = VIRTIO_DEVICE(n);
@@ -1563,6 +2590,17 @@ static void virtio_net_add_queue(VirtIONet *n, int index)
         n->vqs[index].tx_bh = qemu_bh_new(virtio_net_tx_bh, &n->vqs[index]);
     }
 
+    n->vqs[index].rx_pool =
+        virtqueue_element_pool_new(sizeof(VirtQueueElement), VIRTIO_NET_POOL_SG,
+                                   n->net_conf.rx_queue_size);
+    n->vqs[index].tx_pool =
+        virtqueue_element_pool_new(sizeof(VirtQueueElement), VIRTIO_NET_POOL_SG,
+                                   n->net_conf.tx_queue_size);
+
+    if (n->num_iothreads) {
+        n->vqs[index].iothread = n->iothreads[index % n->num_iothreads];
+    }
+    virtio_net_init_notify_timers(&n->vqs[index]);
     n->vqs[index].tx_waiting = 0;
     n->vqs[index].n = n;
 }
@@ -1586,6 +2624,15 @@ static void virtio_net_del_queue(VirtIONet *n, int index)
     }
     q->tx_waiting = 0;
     virtio_del_queue(vdev, index * 2 + 1);
+
+    virtio_net_notify_flush(q, true);
+    virtio_net_free_notify_timers(q);
+
+    virtqueue_element_pool_free(q->rx_pool);
+    q->rx_pool = NULL;
+    virtqueue_element_pool_free(q->tx_pool);
+    q->tx_pool = NULL;
+    q->iothread = NULL;
 }
 
 static void virtio_net_change_num_queues(VirtIONet *n, int new_max_queues)
@@ -1641,7 +2688,9 @@ static int virtio_net_post_load_device(void *opaque, int version_id)
 
     virtio_net_set_mrg_rx_bufs(n, n->mergeable_rx_bufs,
                                virtio_vdev_has_feature(vdev,
-                                                       VIRTIO_F_VERSION_1));
+                                                       VIRTIO_F_VERSION_1),
+                               virtio_vdev_has_feature(vdev,
+                                                VIRTIO_NET_F_HASH_REPORT));
 
     /* MAC_TABLE_ENTRIES may be different from the saved image */
     if (n->mac_table.in_use > MAC_TABLE_ENTRIES) {
@@ -1655,6 +2704,7 @@ static int virtio_net_post_load_device(void *opaque, int version_id)
     if (peer_has_vnet_hdr(n)) {
         virtio_net_apply_guest_offloads(n);
     }
+    virtio_net_update_rsc(n);
 
     virtio_net_set_queues(n);
 
@@ -1840,6 +2890,49 @@ static const VMStateDescription vmstate_virtio_net_has_vnet = {
     },
 };
 
+static bool virtio_net_rss_needed(void *opaque)
+{
+    return VIRTIO_NET(opaque)->rss.enabled;
+}
+
+static int virtio_net_rss_post_load(void *opaque, int version_id)
+{
+    VirtIONet *n = opaque;
+    VirtIONetRss *rss = &n->rss;
+    int i;
+
+    if (!is_power_of_2(rss->indirections_len) ||
+        rss->indirections_len > VIRTIO_NET_RSS_MAX_TABLE_LEN ||
+        rss->default_queue >= n->max_queues) {
+        return -EINVAL;
+    }
+    for (i = 0; i < rss->indirections_len; i++) {
+        if (rss->indirections_table[i] >= n->max_queues) {
+            return -EINVAL;
+        }
+    }
+    return 0;
+}
+
+static const VMStateDescription vmstate_virtio_net_rss = {
+    .name = "virtio-net-device/rss",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .needed = virtio_net_rss_needed,
+    .post_load = virtio_net_rss_post_load,
+    .fields = (VMStateField[]) {
+        VMSTATE_BOOL(rss.enabled, VirtIONet),
+        VMSTATE_BOOL(rss.redirect, VirtIONet),
+        VMSTATE_UINT32(rss.hash_types, VirtIONet),
+        VMSTATE_UINT8_ARRAY(rss.key, VirtIONet, VIRTIO_NET_RSS_MAX_KEY_SIZE),
+        VMSTATE_UINT16(rss.indirections_len, VirtIONet),
+        VMSTATE_UINT16_ARRAY(rss.indirections_table, VirtIONet,
+                             VIRTIO_NET_RSS_MAX_TABLE_LEN),
+        VMSTATE_UINT16(rss.default_queue, VirtIONet),
+        VMSTATE_END_OF_LIST()
+    },
+};
+
 static const VMStateDescription vmstate_virtio_net_device = {
     .name = "virtio-net-device",
     .version_id = VIRTIO_NET_VM_VERSION,
@@ -1890,6 +2983,10 @@ static const VMStateDescription vmstate_virtio_net_device = {
                             has_ctrl_guest_offloads),
         VMSTATE_END_OF_LIST()
    },
+    .subsections = (const VMStateDescription * []) {
+        &vmstate_virtio_net_rss,
+        NULL
+    },
 };
 
 static NetClientInfo net_virtio_info = {
@@ -1899,13 +2996,21 @@ static NetClientInfo net_virtio_info = {
     .receive = virtio_net_receive,
     .link_status_changed = virtio_net_set_link_status,
     .query_rx_filter = virtio_net_query_rxfilter,
+    .flush_batch = virtio_net_flush_batch,
 };
 
 static bool virtio_net_guest_notifier_pending(VirtIODevice *vdev, int idx)
 {
     VirtIONet *n = VIRTIO_NET(vdev);
     NetClientState *nc = qemu_get_subqueue(n->nic, vq2q(idx));
-    assert(n->vhost_started);
+
+    if (!n->vhost_started) {
+        /* Plain irqfd of a queue pair running in an IOThread */
+        VirtQueue *vq = virtio_get_queue(vdev, idx);
+
+        return event_notifier_test_and_clear(
+            virtio_queue_get_guest_notifier(vq));
+    }
     return vhost_net_virtqueue_pending(get_vhost_net(nc->peer), idx);
 }
 
@@ -1953,6 +3058,10 @@ static void virtio_net_device_realize(DeviceState *dev, Error **errp)
     NetClientState *nc;
     int i;
 
+    if (!virtio_net_check_iothreads(n, errp)) {
+        return;
+    }
+
     if (n->net_conf.mtu) {
         n->host_features |= (1ULL << VIRTIO_NET_F_MTU);
     }
@@ -2006,7 +3115,15 @@ static void virtio_net_device_realize(DeviceState *dev, Error **errp)
         return;
     }
 
-    n->max_queues = MAX(n->nic_conf.peers.queues, 1);
+    if (n->nic_conf.queues < 0 ||
+        (n->nic_conf.queues && n->nic_conf.queues < n->nic_conf.peers.queues)) {
+        error_setg(errp, "Invalid number of queues (= %" PRId32 "), "
+                   "must be at least the %" PRId32 " queues of the netdev",
+                   n->nic_conf.queues, n->nic_conf.peers.queues);
+        virtio_cleanup(vdev);
+        return;
+    }
+    n->max_queues = MAX(MAX(n->nic_conf.peers.queues, n->nic_conf.queues), 1);
     if (n->max_queues * 2 + 1 > VIRTIO_QUEUE_MAX) {
         error_setg(errp, "Invalid number of queues (= %" PRIu32 "), "
                    "must be a positive integer less than %d.",
@@ -2014,6 +3131,23 @@ static void virtio_net_device_realize(DeviceState *dev, Error **errp)
         virtio_cleanup(vdev);
         return;
     }
+    if (n->max_queues > virtio_net_backend_queues(n)) {
+        NetClientState *peer = n->nic_conf.peers.ncs[0];
+
+        /* Queue pairs past the netdev are served by QEMU, in the main loop */
+        if (peer && get_vhost_net(peer)) {
+            error_setg(errp, "queues beyond those of the netdev "
+                       "are not supported with vhost");
+            virtio_cleanup(vdev);
+            return;
+        }
+        if (n->net_conf.iothread || n->net_conf.num_iothread_vq_mapping) {
+            error_setg(errp, "queues beyond those of the netdev "
+                       "are not supported with IOThreads");
+            virtio_cleanup(vdev);
+            return;
+        }
+    }
     n->vqs = g_malloc0(sizeof(VirtIONetQueue) * n->max_queues);
     n->curr_queues = 1;
     n->tx_timeout = n->net_conf.txtimer;
@@ -2029,8 +3163,13 @@ static void virtio_net_device_realize(DeviceState *dev, Error **errp)
     n->net_conf.tx_queue_size = MIN(virtio_net_max_tx_queue_size(n),
                                     n->net_conf.tx_queue_size);
 
+    virtio_net_get_iothreads(n);
     for (i = 0; i < n->max_queues; i++) {
         virtio_net_add_queue(n, i);
+        /* Kept across changes of the number of queues, see process_rss */
+        net_rx_pkt_init(&n->vqs[i].rx_pkt, false);
+        n->vqs[i].rsc = net_rx_rsc_new(virtio_net_rsc_deliver, &n->vqs[i],
+                                       n->net_conf.rsc_interval);
     }
 
     n->ctrl_vq = virtio_add_queue(vdev, 64, virtio_net_handle_ctrl);
@@ -2053,7 +3192,7 @@ static void virtio_net_device_realize(DeviceState *dev, Error **errp)
 
     peer_test_vnet_hdr(n);
     if (peer_has_vnet_hdr(n)) {
-        for (i = 0; i < n->max_queues; i++) {
+        for (i = 0; i < virtio_net_backend_queues(n); i++) {
             qemu_using_vnet_hdr(qemu_get_subqueue(n->nic, i)->peer, true);
         }
         n->host_hdr_len = sizeof(struct virtio_net_hdr);
@@ -2065,7 +3204,7 @@ static void virtio_net_device_realize(DeviceState *dev, Error **errp)
 
     n->vqs[0].tx_waiting = 0;
     n->tx_burst = n->net_conf.txburst;
-    virtio_net_set_mrg_rx_bufs(n, 0, 0);
+    virtio_net_set_mrg_rx_bufs(n, 0, 0, 0);
     n->promisc = 1; /* for compatibility */
 
     n->mac_table.macs = g_malloc0(MAC_TABLE_ENTRIES * ETH_ALEN);
@@ -2102,11 +3241,65 @@ static void virtio_net_device_unrealize(DeviceState *dev, Error **errp)
 
     timer_del(n->announce_timer);
     timer_free(n->announce_timer);
+    virtio_net_put_iothreads(n);
+    for (i = 0; i < n->max_queues; i++) {
+        net_rx_pkt_uninit(n->vqs[i].rx_pkt);
+        net_rx_rsc_free(n->vqs[i].rsc);
+    }
     g_free(n->vqs);
     qemu_del_nic(n->nic);
     virtio_cleanup(vdev);
 }
 
+static void virtio_net_get_coalesce(Object *obj, Visitor *v, const char *name,
+                                    void *opaque, Error **errp)
+{
+    visit_type_uint32(v, name, opaque, errp);
+}
+
+/* Context: QEMU global mutex held, may be called while the device runs */
+static void virtio_net_set_coalesce(Object *obj, Visitor *v, const char *name,
+                                    void *opaque, Error **errp)
+{
+    VirtIONet *n = VIRTIO_NET(obj);
+    VirtIODevice *vdev = VIRTIO_DEVICE(obj);
+    uint32_t *field = opaque;
+    Error *local_err = NULL;
+    uint32_t value;
+    int i;
+
+    visit_type_uint32(v, name, &value, &local_err);
+    if (local_err) {
+        error_propagate(errp, local_err);
+        return;
+    }
+
+    if ((field == &n->rx_coalesce.usecs || field == &n->tx_coalesce.usecs) &&
+        value > VIRTIO_NET_COALESCE_MAX_USECS) {
+        error_setg(errp, "Property '%s' must be at most %u", name,
+                   VIRTIO_NET_COALESCE_MAX_USECS);
+        return;
+    }
+
+    if (!DEVICE(obj)->realized) {
+        *field = value;
+        return;
+    }
+
+    /* What is held back goes out now, the new settings apply from here */
+    virtio_net_lock_queues(n);
+    *field = value;
+    for (i = 0; i < (n->multiqueue ? n->max_queues : 1); i++) {
+        virtio_net_notify_flush(&n->vqs[i],
+                                !(vdev->status & VIRTIO_CONFIG_S_DRIVER_OK));
+    }
+    virtio_net_unlock_queues(n);
+
+    if (n->vhost_started) {
+        virtio_net_vhost_set_coalesce(n, errp);
+    }
+}
+
 static void virtio_net_instance_init(Object *obj)
 {
     VirtIONet *n = VIRTIO_NET(obj);
@@ -2119,6 +3312,18 @@ static void virtio_net_instance_init(Object *obj)
     device_add_bootindex_property(obj, &n->nic_conf.bootindex,
                                   "bootindex", "/ethernet-phy@0",
                                   DEVICE(n), NULL);
+    object_property_add(obj, "rx-coalesce-usecs", "uint32",
+                        virtio_net_get_coalesce, virtio_net_set_coalesce,
+                        NULL, &n->rx_coalesce.usecs, NULL);
+    object_property_add(obj, "rx-coalesce-frames", "uint32",
+                        virtio_net_get_coalesce, virtio_net_set_coalesce,
+                        NULL, &n->rx_coalesce.frames, NULL);
+    object_property_add(obj, "tx-coalesce-usecs", "uint32",
+                        virtio_net_get_coalesce, virtio_net_set_coalesce,
+                        NULL, &n->tx_coalesce.usecs, NULL);
+    object_property_add(obj, "tx-coalesce-frames", "uint32",
+                        virtio_net_get_coalesce, virtio_net_set_coalesce,
+                        NULL, &n->tx_coalesce.frames, NULL);
 }
 
 static int virtio_net_pre_save(void *opaque)
@@ -2184,7 +3389,16 @@ static Property virtio_net_properties[] = {
     DEFINE_PROP_BIT64("ctrl_guest_offloads", VirtIONet, host_features,
                     VIRTIO_NET_F_CTRL_GUEST_OFFLOADS, true),
     DEFINE_PROP_BIT64("mq", VirtIONet, host_features, VIRTIO_NET_F_MQ, false),
+    DEFINE_PROP_BIT64("rss", VirtIONet, host_features,
+                      VIRTIO_NET_F_RSS, false),
+    DEFINE_PROP_BIT64("hash", VirtIONet, host_features,
+                      VIRTIO_NET_F_HASH_REPORT, false),
+    DEFINE_PROP_BIT64("guest_rsc_ext", VirtIONet, host_features,
+                      VIRTIO_NET_F_RSC_EXT, false),
+    DEFINE_PROP_UINT32("rsc_interval", VirtIONet, net_conf.rsc_interval,
+                       VIRTIO_NET_RSC_DEFAULT_INTERVAL),
     DEFINE_NIC_PROPERTIES(VirtIONet, nic_conf),
+    DEFINE_PROP_INT32("queues", VirtIONet, nic_conf.queues, 0),
     DEFINE_PROP_UINT32("x-txtimer", VirtIONet, net_conf.txtimer,
                        TX_TIMER_INTERVAL),
     DEFINE_PROP_INT32("x-txburst", VirtIONet, net_conf.txburst, TX_BURST),
@@ -2198,6 +3412,11 @@ static Property virtio_net_properties[] = {
                      true),
     DEFINE_PROP_INT32("speed", VirtIONet, net_conf.speed, SPEED_UNKNOWN),
     DEFINE_PROP_STRING("duplex", VirtIONet, net_conf.duplex_str),
+    DEFINE_PROP_LINK("iothread", VirtIONet, net_conf.iothread, TYPE_IOTHREAD,
+                     IOThread *),
+    DEFINE_PROP_ARRAY("iothread-vq-mapping", VirtIONet,
+                      net_conf.num_iothread_vq_mapping,
+                      net_conf.iothread_vq_mapping, qdev_prop_string, char *),
     DEFINE_PROP_END_OF_LIST(),
 };
 
@@ -2220,6 +3439,8 @@ static void virtio_net_class_init(ObjectClass *klass, void *data)
     vdc->set_status = virtio_net_set_status;
     vdc->guest_notifier_mask = virtio_net_guest_notifier_mask;
     vdc->guest_notifier_pending = virtio_net_guest_notifier_pending;
+    vdc->start_ioeventfd = virtio_net_start_ioeventfd;
+    vdc->stop_ioeventfd = virtio_net_stop_ioeventfd;
     vdc->legacy_features |= (0x1 << VIRTIO_NET_F_GSO);
     vdc->vmsd = &vmstate_virtio_net_device;
 }
@@ -34,6 +34,14 @@ static void virtio_ccw_net_instance_init(Object *obj)
                                 TYPE_VIRTIO_NET);
     object_property_add_alias(obj, "bootindex", OBJECT(&dev->vdev),
                               "bootindex", &error_abort);
+    object_property_add_alias(obj, "rx-coalesce-usecs", OBJECT(&dev->vdev),
+                              "rx-coalesce-usecs", &error_abort);
+    object_property_add_alias(obj, "rx-coalesce-frames", OBJECT(&dev->vdev),
+                              "rx-coalesce-frames", &error_abort);
+    object_property_add_alias(obj, "tx-coalesce-usecs", OBJECT(&dev->vdev),
+                              "tx-coalesce-usecs", &error_abort);
+    object_property_add_alias(obj, "tx-coalesce-frames", OBJECT(&dev->vdev),
+                              "tx-coalesce-frames", &error_abort);
 }
 
 static Property virtio_ccw_net_properties[] = {
@@ -52,6 +52,7 @@ enum VhostUserProtocolFeature {
     VHOST_USER_PROTOCOL_F_CONFIG = 9,
     VHOST_USER_PROTOCOL_F_SLAVE_SEND_FD = 10,
     VHOST_USER_PROTOCOL_F_HOST_NOTIFIER = 11,
+    VHOST_USER_PROTOCOL_F_VRING_COALESCE = 12,
     VHOST_USER_PROTOCOL_F_MAX
 };
 
@@ -89,6 +90,7 @@ typedef enum VhostUserRequest {
     VHOST_USER_POSTCOPY_ADVISE  = 28,
     VHOST_USER_POSTCOPY_LISTEN  = 29,
     VHOST_USER_POSTCOPY_END     = 30,
+    VHOST_USER_SET_VRING_COALESCE = 31,
     VHOST_USER_MAX
 } VhostUserRequest;
 
@@ -147,6 +149,13 @@ typedef struct VhostUserVringArea {
     uint64_t offset;
 } VhostUserVringArea;
 
+typedef struct VhostUserVringCoalesce {
+    uint32_t index;
+    uint32_t usecs;
+    uint32_t frames;
+    uint32_t padding;
+} VhostUserVringCoalesce;
+
 typedef struct {
     VhostUserRequest request;
 
@@ -169,6 +178,7 @@ typedef union {
         VhostUserConfig config;
         VhostUserCryptoSession session;
         VhostUserVringArea area;
+        VhostUserVringCoalesce coalesce;
 } VhostUserPayload;
 
 typedef struct VhostUserMsg {
@@ -1533,6 +1543,40 @@ static int vhost_user_net_set_mtu(struct vhost_dev *dev, uint16_t mtu)
     return 0;
 }
 
+static int vhost_user_set_vring_coalesce(struct vhost_dev *dev, int index,
+                                         uint32_t usecs, uint32_t frames)
+{
+    bool reply_supported = virtio_has_feature(dev->protocol_features,
+                                              VHOST_USER_PROTOCOL_F_REPLY_ACK);
+    VhostUserMsg msg = {
+        .hdr.request = VHOST_USER_SET_VRING_COALESCE,
+        .hdr.flags = VHOST_USER_VERSION,
+        .payload.coalesce.index = index,
+        .payload.coalesce.usecs = usecs,
+        .payload.coalesce.frames = frames,
+        .hdr.size = sizeof(msg.payload.coalesce),
+    };
+
+    if (!virtio_has_feature(dev->protocol_features,
+                            VHOST_USER_PROTOCOL_F_VRING_COALESCE)) {
+        return -ENOTSUP;
+    }
+
+    if (reply_supported) {
+        msg.hdr.flags |= VHOST_USER_NEED_REPLY_MASK;
+    }
+
+    if (vhost_user_write(dev, &msg, NULL, 0) < 0) {
+        return -1;
+    }
+
+    if (reply_supported) {
+        return process_message_reply(dev, &msg);
+    }
+
+    return 0;
+}
+
 static int vhost_user_send_device_iotlb_msg(struct vhost_dev *dev,
                                             struct vhost_iotlb_msg *imsg)
 {
@@ -1783,6 +1827,7 @@ const VhostOps user_ops = {
         .vhost_migration_done = vhost_user_migration_done,
         .vhost_backend_can_merge = vhost_user_can_merge,
         .vhost_net_set_mtu = vhost_user_net_set_mtu,
+        .vhost_set_vring_coalesce = vhost_user_set_vring_coalesce,
         .vhost_set_iotlb_callback = vhost_user_set_iotlb_callback,
         .vhost_send_device_iotlb_msg = vhost_user_send_device_iotlb_msg,
         .vhost_get_config = vhost_user_get_config,
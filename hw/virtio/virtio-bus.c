@@ -274,11 +274,14 @@ int virtio_bus_set_host_notifier(VirtioBusState *bus, int n, bool assign)
     }
 
     if (assign) {
-        r = event_notifier_init(notifier, 1);
-        if (r < 0) {
-            error_report("%s: unable to init event notifier: %s (%d)",
-                         __func__, strerror(-r), r);
-            return r;
+        /* A shared notifier is set up by its group */
+        if (!virtio_queue_get_notify_group(vq)) {
+            r = event_notifier_init(notifier, 1);
+            if (r < 0) {
+                error_report("%s: unable to init event notifier: %s (%d)",
+                             __func__, strerror(-r), r);
+                return r;
+            }
         }
         r = k->ioeventfd_assign(proxy, notifier, n, true);
         if (r < 0) {
@@ -298,11 +301,16 @@ void virtio_bus_cleanup_host_notifier(VirtioBusState *bus, int n)
     VirtQueue *vq = virtio_get_queue(vdev, n);
     EventNotifier *notifier = virtio_queue_get_host_notifier(vq);
 
+    if (virtio_queue_get_notify_group(vq)) {
+        virtio_queue_set_notify_group(vq, NULL);
+        return;
+    }
+
     /* Test and clear notifier after disabling event,
      * in case poll callback didn't have time to run.
      */
     virtio_queue_host_notifier_read(notifier);
-    event_notifier_cleanup(notifier);
+    virtio_queue_cleanup_host_notifier(vq);
 }
 
 static char *virtio_bus_get_dev_path(DeviceState *dev)
@@ -1168,9 +1168,25 @@ static uint64_t virtio_pci_common_read(void *opaque, hwaddr addr,
 {
     VirtIOPCIProxy *proxy = opaque;
     VirtIODevice *vdev = virtio_bus_get_device(&proxy->bus);
+    bool unlock = false;
     uint32_t val = 0;
     int i;
 
+    /* Like for writes, selectors and queue setup are covered by proxy->lock;
+     * device state is changed under the BQL, e.g. by a reset.
+     */
+    switch (addr) {
+    case VIRTIO_PCI_COMMON_DF:
+    case VIRTIO_PCI_COMMON_MSIX:
+    case VIRTIO_PCI_COMMON_NUMQ:
+    case VIRTIO_PCI_COMMON_STATUS:
+    case VIRTIO_PCI_COMMON_CFGGENERATION:
+    case VIRTIO_PCI_COMMON_Q_SIZE:
+    case VIRTIO_PCI_COMMON_Q_MSIX:
+        unlock = memory_region_lock_iothread(&proxy->common.mr);
+        break;
+    }
+
     switch (addr) {
     case VIRTIO_PCI_COMMON_DFSELECT:
         val = proxy->dfselect;
@@ -1245,6 +1261,9 @@ static uint64_t virtio_pci_common_read(void *opaque, hwaddr addr,
         val = 0;
     }
 
+    if (unlock) {
+        qemu_mutex_unlock_iothread();
+    }
     return val;
 }
 
@@ -1253,6 +1272,20 @@ static void virtio_pci_common_write(void *opaque, hwaddr addr,
 {
     VirtIOPCIProxy *proxy = opaque;
     VirtIODevice *vdev = virtio_bus_get_device(&proxy->bus);
+    bool unlock = false;
+
+    /* Selectors and queue setup only touch state protected by proxy->lock,
+     * everything else calls into the device and interrupt code.
+     */
+    switch (addr) {
+    case VIRTIO_PCI_COMMON_GF:
+    case VIRTIO_PCI_COMMON_MSIX:
+    case VIRTIO_PCI_COMMON_STATUS:
+    case VIRTIO_PCI_COMMON_Q_MSIX:
+    case VIRTIO_PCI_COMMON_Q_ENABLE:
+        unlock = memory_region_lock_iothread(&proxy->common.mr);
+        break;
+    }
 
     switch (addr) {
     case VIRTIO_PCI_COMMON_DFSELECT:
@@ -1289,7 +1322,10 @@ static void virtio_pci_common_write(void *opaque, hwaddr addr,
         }
 
         if (vdev->status == 0) {
+            /* We hold the BQL here, so proxy->lock can be dropped */
+            qemu_mutex_unlock(&proxy->lock);
             virtio_pci_reset(DEVICE(proxy));
+            qemu_mutex_lock(&proxy->lock);
         }
 
         break;
@@ -1343,6 +1379,10 @@ static void virtio_pci_common_write(void *opaque, hwaddr addr,
     default:
         break;
     }
+
+    if (unlock) {
+        qemu_mutex_unlock_iothread();
+    }
 }
 
 
@@ -1360,7 +1400,7 @@ static void virtio_pci_notify_write(void *opaque, hwaddr addr,
     unsigned queue = addr / virtio_pci_queue_mem_mult(proxy);
 
     if (queue < VIRTIO_QUEUE_MAX) {
-        virtio_queue_notify(vdev, queue);
+        virtio_queue_notify_unlocked(vdev, queue);
     }
 }
 
@@ -1482,6 +1522,7 @@ static void virtio_pci_modern_regions_init(VirtIOPCIProxy *proxy)
                           proxy,
                           "virtio-pci-common",
                           proxy->common.size);
+    memory_region_set_lock(&proxy->common.mr, &proxy->lock);
 
     memory_region_init_io(&proxy->isr.mr, OBJECT(proxy),
                           &isr_ops,
@@ -1500,6 +1541,7 @@ static void virtio_pci_modern_regions_init(VirtIOPCIProxy *proxy)
                           virtio_bus_get_device(&proxy->bus),
                           "virtio-pci-notify",
                           proxy->notify.size);
+    memory_region_clear_global_locking(&proxy->notify.mr);
 
     memory_region_init_io(&proxy->notify_pio.mr, OBJECT(proxy),
                           &notify_pio_ops,
@@ -1733,6 +1775,8 @@ static void virtio_pci_realize(PCIDevice *pci_dev, Error **errp)
     bool pcie_port = pci_bus_is_express(pci_get_bus(pci_dev)) &&
                      !pci_bus_is_root(pci_get_bus(pci_dev));
 
+    qemu_mutex_init(&proxy->lock);
+
     if (kvm_enabled() && !kvm_has_many_ioeventfds()) {
         proxy->flags &= ~VIRTIO_PCI_FLAG_USE_IOEVENTFD;
     }
@@ -1844,7 +1888,10 @@ static void virtio_pci_realize(PCIDevice *pci_dev, Error **errp)
 
 static void virtio_pci_exit(PCIDevice *pci_dev)
 {
+    VirtIOPCIProxy *proxy = VIRTIO_PCI(pci_dev);
+
     msix_uninit_exclusive_bar(pci_dev);
+    qemu_mutex_destroy(&proxy->lock);
 }
 
 static void virtio_pci_reset(DeviceState *qdev)
@@ -1858,6 +1905,7 @@ static void virtio_pci_reset(DeviceState *qdev)
     virtio_bus_reset(bus);
     msix_unuse_all_vectors(&proxy->pci_dev);
 
+    qemu_mutex_lock(&proxy->lock);
     for (i = 0; i < VIRTIO_QUEUE_MAX; i++) {
         proxy->vqs[i].enabled = 0;
         proxy->vqs[i].num = 0;
@@ -1865,6 +1913,7 @@ static void virtio_pci_reset(DeviceState *qdev)
         proxy->vqs[i].avail[0] = proxy->vqs[i].avail[1] = 0;
         proxy->vqs[i].used[0] = proxy->vqs[i].used[1] = 0;
     }
+    qemu_mutex_unlock(&proxy->lock);
 
     if (pci_is_express(dev)) {
         pcie_cap_deverr_reset(dev);
@@ -2460,6 +2509,14 @@ static void virtio_net_pci_instance_init(Object *obj)
                                 TYPE_VIRTIO_NET);
     object_property_add_alias(obj, "bootindex", OBJECT(&dev->vdev),
                               "bootindex", &error_abort);
+    object_property_add_alias(obj, "rx-coalesce-usecs", OBJECT(&dev->vdev),
+                              "rx-coalesce-usecs", &error_abort);
+    object_property_add_alias(obj, "rx-coalesce-frames", OBJECT(&dev->vdev),
+                              "rx-coalesce-frames", &error_abort);
+    object_property_add_alias(obj, "tx-coalesce-usecs", OBJECT(&dev->vdev),
+                              "tx-coalesce-usecs", &error_abort);
+    object_property_add_alias(obj, "tx-coalesce-frames", OBJECT(&dev->vdev),
+                              "tx-coalesce-frames", &error_abort);
 }
 
 static const TypeInfo virtio_net_pci_info = {
@@ -182,6 +182,8 @@ struct VirtIOPCIProxy {
     OnOffAuto disable_legacy;
     uint32_t class_code;
     uint32_t nvectors;
+    /* Protects the common configuration registers below */
+    QemuMutex lock;
     uint32_t dfselect;
     uint32_t gfselect;
     uint32_t guest_features[2];
@@ -20,6 +20,7 @@
 #include "qemu/error-report.h"
 #include "hw/virtio/virtio.h"
 #include "qemu/atomic.h"
+#include "qemu/bitmap.h"
 #include "hw/virtio/virtio-bus.h"
 #include "hw/virtio/virtio-access.h"
 #include "sysemu/dma.h"
@@ -59,6 +60,42 @@ typedef struct VRingUsed
     VRingUsedElem ring[0];
 } VRingUsed;
 
+typedef struct VRingPackedDesc {
+    uint64_t addr;
+    uint32_t len;
+    uint16_t id;
+    uint16_t flags;
+} VRingPackedDesc;
+
+/* Layout of both the driver and the device event suppression areas */
+typedef struct VRingPackedDescEvent {
+    uint16_t off_wrap;
+    uint16_t flags;
+} VRingPackedDescEvent;
+
+/* A used buffer that virtqueue_flush() has yet to write to a packed ring */
+typedef struct VRingPackedUsedElem {
+    uint16_t id;
+    uint16_t ndescs;
+    uint32_t len;
+} VRingPackedUsedElem;
+
+/* A buffer popped from a ring that uses VIRTIO_F_IN_ORDER */
+typedef struct VRingInOrderElem {
+    uint16_t id;
+    uint16_t ndescs;
+    uint32_t len;
+    bool filled;
+} VRingInOrderElem;
+
+struct VirtQueueElementPool {
+    size_t sz;
+    size_t slot_size;
+    void *slots;
+    void **free;
+    unsigned int nfree;
+};
+
 typedef struct VRingMemoryRegionCaches {
     struct rcu_head rcu;
     MemoryRegionCache desc;
@@ -72,6 +109,7 @@ typedef struct VRing
     unsigned int num_default;
     unsigned int align;
     hwaddr desc;
+    /* Driver and device event suppression areas for a packed ring */
     hwaddr avail;
     hwaddr used;
     VRingMemoryRegionCaches *caches;
@@ -83,11 +121,32 @@ struct VirtQueue
 
     /* Next head to pop */
     uint16_t last_avail_idx;
+    bool last_avail_wrap_counter;
 
     /* Last avail_idx read from VQ. */
     uint16_t shadow_avail_idx;
+    bool shadow_avail_wrap_counter;
 
     uint16_t used_idx;
+    bool used_wrap_counter;
+
+    /* Packed ring only: buffers passed to virtqueue_fill(), and the
+     * position of the ring before each of the last vring.num pops so
+     * that they can be undone by virtqueue_rewind().  Allocated once the
+     * feature is negotiated, see virtio_queue_alloc_elems().
+     */
+    VRingPackedUsedElem *used_elems;
+    uint16_t *pop_log;
+    unsigned int pop_count;
+    /* Entries of pop_log that can be rewound to, at most vring.num */
+    unsigned int pop_valid;
+
+    /* With VIRTIO_F_IN_ORDER: the buffers between used_idx and
+     * last_avail_idx, indexed by their position in the ring, so that
+     * completions can be published in the order buffers were made available.
+     * Allocated like used_elems.
+     */
+    VRingInOrderElem *in_order_elems;
 
     /* Last used index value we have signalled on */
     uint16_t signalled_used;
@@ -108,9 +167,33 @@ struct VirtQueue
     VirtIODevice *vdev;
     EventNotifier guest_notifier;
     EventNotifier host_notifier;
+    /* If set, used instead of host_notifier */
+    VirtIONotifyGroup *notify_group;
     QLIST_ENTRY(VirtQueue) node;
 };
 
+/*
+ * A group of virtqueues that share a single host notifier, so that an
+ * AioContext serving many queues of a device is woken up through a single
+ * eventfd.  ioeventfds do not tell which queue was kicked, so the handler
+ * looks at the avail ring of all the queues in @active; kicks coming from
+ * QEMU itself are flagged in @pending instead.
+ */
+struct VirtIONotifyGroup {
+    struct rcu_head rcu;
+    VirtIODevice *vdev;
+    EventNotifier notifier;
+    AioContext *ctx;
+    unsigned long *active;
+    unsigned long *pending;
+};
+
+/* A host notifier whose file descriptors are closed after a grace period */
+typedef struct VirtIOHostNotifierRCU {
+    struct rcu_head rcu;
+    EventNotifier notifier;
+} VirtIOHostNotifierRCU;
+
 static void virtio_free_region_cache(VRingMemoryRegionCaches *caches)
 {
     if (!caches) {
@@ -143,7 +226,13 @@ static void virtio_init_region_cache(VirtIODevice *vdev, int n)
     int event_size;
     int64_t len;
 
+    bool packed = virtio_vdev_has_feature(vq->vdev, VIRTIO_F_RING_PACKED);
+
     event_size = virtio_vdev_has_feature(vq->vdev, VIRTIO_RING_F_EVENT_IDX) ? 2 : 0;
+    if (packed) {
+        /* The event suppression areas have a fixed size */
+        event_size = 0;
+    }
 
     addr = vq->vring.desc;
     if (!addr) {
@@ -151,8 +240,9 @@ static void virtio_init_region_cache(VirtIODevice *vdev, int n)
     }
     new = g_new0(VRingMemoryRegionCaches, 1);
     size = virtio_queue_get_desc_size(vdev, n);
+    /* Used descriptors are written back to the ring of a packed queue */
     len = address_space_cache_init(&new->desc, vdev->dma_as,
-                                   addr, size, false);
+                                   addr, size, packed);
     if (len < size) {
         virtio_error(vdev, "Cannot map desc");
         goto err_desc;
@@ -225,6 +315,109 @@ static VRingMemoryRegionCaches *vring_get_region_caches(struct VirtQueue *vq)
     assert(caches != NULL);
     return caches;
 }
+
+/* Called within rcu_read_lock().  */
+static void vring_packed_desc_read_flags(VirtIODevice *vdev, uint16_t *flags,
+                                         MemoryRegionCache *cache, int i)
+{
+    hwaddr off = i * sizeof(VRingPackedDesc) + offsetof(VRingPackedDesc, flags);
+
+    *flags = virtio_lduw_phys_cached(vdev, cache, off);
+}
+
+/* Called within rcu_read_lock().  */
+static void vring_packed_desc_read(VirtIODevice *vdev, VRingPackedDesc *desc,
+                                   MemoryRegionCache *cache, int i,
+                                   bool strict_order)
+{
+    hwaddr off = i * sizeof(VRingPackedDesc);
+
+    vring_packed_desc_read_flags(vdev, &desc->flags, cache, i);
+    if (strict_order) {
+        /* Make sure the flags are read before the rest of the descriptor */
+        smp_rmb();
+    }
+
+    address_space_read_cached(cache, off + offsetof(VRingPackedDesc, addr),
+                              &desc->addr, sizeof(desc->addr));
+    address_space_read_cached(cache, off + offsetof(VRingPackedDesc, id),
+                              &desc->id, sizeof(desc->id));
+    address_space_read_cached(cache, off + offsetof(VRingPackedDesc, len),
+                              &desc->len, sizeof(desc->len));
+    virtio_tswap64s(vdev, &desc->addr);
+    virtio_tswap16s(vdev, &desc->id);
+    virtio_tswap32s(vdev, &desc->len);
+}
+
+/* Called within rcu_read_lock().  */
+static void vring_packed_desc_write(VirtIODevice *vdev, VRingPackedDesc *desc,
+                                    MemoryRegionCache *cache, int i,
+                                    bool strict_order)
+{
+    hwaddr off = i * sizeof(VRingPackedDesc);
+    hwaddr off_id = off + offsetof(VRingPackedDesc, id);
+    hwaddr off_len = off + offsetof(VRingPackedDesc, len);
+    hwaddr off_flags = off + offsetof(VRingPackedDesc, flags);
+
+    virtio_tswap16s(vdev, &desc->id);
+    virtio_tswap32s(vdev, &desc->len);
+    address_space_write_cached(cache, off_id, &desc->id, sizeof(desc->id));
+    address_space_cache_invalidate(cache, off_id, sizeof(desc->id));
+    address_space_write_cached(cache, off_len, &desc->len, sizeof(desc->len));
+    address_space_cache_invalidate(cache, off_len, sizeof(desc->len));
+
+    if (strict_order) {
+        /* The flags hand the descriptor over to the driver, write them last */
+        smp_wmb();
+    }
+
+    virtio_stw_phys_cached(vdev, cache, off_flags, desc->flags);
+    address_space_cache_invalidate(cache, off_flags, sizeof(desc->flags));
+}
+
+/* Called within rcu_read_lock().  */
+static void vring_packed_event_read(VirtIODevice *vdev,
+                                    MemoryRegionCache *cache,
+                                    VRingPackedDescEvent *e)
+{
+    hwaddr off_off = offsetof(VRingPackedDescEvent, off_wrap);
+    hwaddr off_flags = offsetof(VRingPackedDescEvent, flags);
+
+    e->flags = virtio_lduw_phys_cached(vdev, cache, off_flags);
+    /* Make sure the flags are seen before off_wrap */
+    smp_rmb();
+    e->off_wrap = virtio_lduw_phys_cached(vdev, cache, off_off);
+}
+
+/* Called within rcu_read_lock().  */
+static void vring_packed_off_wrap_write(VirtIODevice *vdev,
+                                        MemoryRegionCache *cache,
+                                        uint16_t off_wrap)
+{
+    hwaddr off = offsetof(VRingPackedDescEvent, off_wrap);
+
+    virtio_stw_phys_cached(vdev, cache, off, off_wrap);
+    address_space_cache_invalidate(cache, off, sizeof(off_wrap));
+}
+
+/* Called within rcu_read_lock().  */
+static void vring_packed_flags_write(VirtIODevice *vdev,
+                                     MemoryRegionCache *cache, uint16_t flags)
+{
+    hwaddr off = offsetof(VRingPackedDescEvent, flags);
+
+    virtio_stw_phys_cached(vdev, cache, off, flags);
+    address_space_cache_invalidate(cache, off, sizeof(flags));
+}
+
+static inline bool is_desc_avail(uint16_t flags, bool wrap_counter)
+{
+    bool avail, used;
+
+    avail = !!(flags & (1 << VRING_PACKED_DESC_F_AVAIL));
+    used = !!(flags & (1 << VRING_PACKED_DESC_F_USED));
+    return (avail != used) && (avail == wrap_counter);
+}
 /* Called within rcu_read_lock().  */
 static inline uint16_t vring_avail_flags(VirtQueue *vq)
 {
@@ -325,6 +518,40 @@ static inline void vring_set_avail_event(VirtQueue *vq, uint16_t val)
     address_space_cache_invalidate(&caches->used, pa, sizeof(val));
 }
 
+/* Called within rcu_read_lock().  */
+static void virtio_queue_split_set_notification(VirtQueue *vq, int enable)
+{
+    if (virtio_vdev_has_feature(vq->vdev, VIRTIO_RING_F_EVENT_IDX)) {
+        vring_set_avail_event(vq, vring_avail_idx(vq));
+    } else if (enable) {
+        vring_used_flags_unset_bit(vq, VRING_USED_F_NO_NOTIFY);
+    } else {
+        vring_used_flags_set_bit(vq, VRING_USED_F_NO_NOTIFY);
+    }
+}
+
+/* Called within rcu_read_lock().  */
+static void virtio_queue_packed_set_notification(VirtQueue *vq, int enable)
+{
+    VRingMemoryRegionCaches *caches = vring_get_region_caches(vq);
+    uint16_t off_wrap, flags;
+
+    if (!enable) {
+        flags = VRING_PACKED_EVENT_FLAG_DISABLE;
+    } else if (virtio_vdev_has_feature(vq->vdev, VIRTIO_RING_F_EVENT_IDX)) {
+        off_wrap = vq->shadow_avail_idx |
+                   vq->shadow_avail_wrap_counter << VRING_PACKED_EVENT_F_WRAP_CTR;
+        vring_packed_off_wrap_write(vq->vdev, &caches->used, off_wrap);
+        /* Make sure off_wrap is written before the flags */
+        smp_wmb();
+        flags = VRING_PACKED_EVENT_FLAG_DESC;
+    } else {
+        flags = VRING_PACKED_EVENT_FLAG_ENABLE;
+    }
+
+    vring_packed_flags_write(vq->vdev, &caches->used, flags);
+}
+
 void virtio_queue_set_notification(VirtQueue *vq, int enable)
 {
     vq->notification = enable;
@@ -334,12 +561,10 @@ void virtio_queue_set_notification(VirtQueue *vq, int enable)
     }
 
     rcu_read_lock();
-    if (virtio_vdev_has_feature(vq->vdev, VIRTIO_RING_F_EVENT_IDX)) {
-        vring_set_avail_event(vq, vring_avail_idx(vq));
-    } else if (enable) {
-        vring_used_flags_unset_bit(vq, VRING_USED_F_NO_NOTIFY);
+    if (virtio_vdev_has_feature(vq->vdev, VIRTIO_F_RING_PACKED)) {
+        virtio_queue_packed_set_notification(vq, enable);
     } else {
-        vring_used_flags_set_bit(vq, VRING_USED_F_NO_NOTIFY);
+        virtio_queue_split_set_notification(vq, enable);
     }
     if (enable) {
         /* Expose avail event/used flags before caller checks the avail idx. */
@@ -356,6 +581,27 @@ int virtio_queue_ready(VirtQueue *vq)
 /* Fetch avail_idx from VQ memory only when we really need to know if
  * guest has added some buffers.
  * Called within rcu_read_lock().  */
+static int virtio_queue_split_empty_rcu(VirtQueue *vq)
+{
+    if (vq->shadow_avail_idx != vq->last_avail_idx) {
+        return 0;
+    }
+
+    return vring_avail_idx(vq) == vq->last_avail_idx;
+}
+
+/* Called within rcu_read_lock().  */
+static int virtio_queue_packed_empty_rcu(VirtQueue *vq)
+{
+    VRingMemoryRegionCaches *caches = vring_get_region_caches(vq);
+    uint16_t flags;
+
+    vring_packed_desc_read_flags(vq->vdev, &flags, &caches->desc,
+                                 vq->last_avail_idx);
+    return !is_desc_avail(flags, vq->last_avail_wrap_counter);
+}
+
+/* Called within rcu_read_lock().  */
 static int virtio_queue_empty_rcu(VirtQueue *vq)
 {
     if (unlikely(vq->vdev->broken)) {
@@ -366,11 +612,11 @@ static int virtio_queue_empty_rcu(VirtQueue *vq)
         return 1;
     }
 
-    if (vq->shadow_avail_idx != vq->last_avail_idx) {
-        return 0;
+    if (virtio_vdev_has_feature(vq->vdev, VIRTIO_F_RING_PACKED)) {
+        return virtio_queue_packed_empty_rcu(vq);
+    } else {
+        return virtio_queue_split_empty_rcu(vq);
     }
-
-    return vring_avail_idx(vq) == vq->last_avail_idx;
 }
 
 int virtio_queue_empty(VirtQueue *vq)
@@ -385,12 +631,13 @@ int virtio_queue_empty(VirtQueue *vq)
         return 1;
     }
 
-    if (vq->shadow_avail_idx != vq->last_avail_idx) {
+    if (!virtio_vdev_has_feature(vq->vdev, VIRTIO_F_RING_PACKED) &&
+        vq->shadow_avail_idx != vq->last_avail_idx) {
         return 0;
     }
 
     rcu_read_lock();
-    empty = vring_avail_idx(vq) == vq->last_avail_idx;
+    empty = virtio_queue_empty_rcu(vq);
     rcu_read_unlock();
     return empty;
 }
@@ -420,6 +667,14 @@ static void virtqueue_unmap_sg(VirtQueue *vq, const VirtQueueElement *elem,
                          elem->out_sg[i].iov_len);
 }
 
+static void virtqueue_forget_element(VirtQueue *vq,
+                                     const VirtQueueElement *elem,
+                                     unsigned int len)
+{
+    vq->inuse--;
+    virtqueue_unmap_sg(vq, elem, len);
+}
+
 /* virtqueue_detach_element:
  * @vq: The #VirtQueue
  * @elem: The #VirtQueueElement
@@ -428,12 +683,88 @@ static void virtqueue_unmap_sg(VirtQueue *vq, const VirtQueueElement *elem,
  * Detach the element from the virtqueue.  This function is suitable for device
  * reset or other situations where a #VirtQueueElement is simply freed and will
  * not be pushed or discarded.
+ *
+ * A running device with VIRTIO_F_IN_ORDER cannot leave a hole in the ring, as
+ * the buffers after it would never be used, so the element is pushed with
+ * @len instead.  The caller is in charge of notifying the guest.
  */
 void virtqueue_detach_element(VirtQueue *vq, const VirtQueueElement *elem,
                               unsigned int len)
 {
-    vq->inuse--;
-    virtqueue_unmap_sg(vq, elem, len);
+    if (virtio_vdev_has_feature(vq->vdev, VIRTIO_F_IN_ORDER) &&
+        (vq->vdev->status & VIRTIO_CONFIG_S_DRIVER_OK)) {
+        rcu_read_lock();
+        virtqueue_fill(vq, elem, len, 0);
+        virtqueue_flush(vq, 1);
+        rcu_read_unlock();
+        return;
+    }
+    virtqueue_forget_element(vq, elem, len);
+}
+
+/* Packed ring positions are logged as the index and wrap counter packed in
+ * the same way as in the off_wrap field of the event suppression areas.
+ */
+static void virtqueue_packed_log_pop(VirtQueue *vq)
+{
+    vq->pop_log[vq->pop_count++ % vq->vring.num] = vq->last_avail_idx |
+        vq->last_avail_wrap_counter << VRING_PACKED_EVENT_F_WRAP_CTR;
+    if (vq->pop_valid < vq->vring.num) {
+        vq->pop_valid++;
+    }
+}
+
+static void virtqueue_packed_set_last_avail(VirtQueue *vq, uint16_t idx,
+                                            bool wrap_counter)
+{
+    vq->last_avail_idx = vq->shadow_avail_idx = idx;
+    vq->last_avail_wrap_counter = vq->shadow_avail_wrap_counter =
+        wrap_counter;
+}
+
+/* The log is empty after migration or virtio_queue_set_last_avail_idx(), but
+ * the buffers in use always start at the used index.
+ */
+static bool virtqueue_packed_rewind(VirtQueue *vq, unsigned int num)
+{
+    uint16_t pos;
+
+    if (num > vq->pop_valid) {
+        if (num != vq->inuse) {
+            return false;
+        }
+        virtqueue_packed_set_last_avail(vq, vq->used_idx,
+                                        vq->used_wrap_counter);
+        vq->pop_valid = 0;
+        return true;
+    }
+    if (!num) {
+        return true;
+    }
+
+    vq->pop_count -= num;
+    vq->pop_valid -= num;
+    pos = vq->pop_log[vq->pop_count % vq->vring.num];
+    virtqueue_packed_set_last_avail(vq,
+                                    pos & ~(1 << VRING_PACKED_EVENT_F_WRAP_CTR),
+                                    pos >> VRING_PACKED_EVENT_F_WRAP_CTR);
+    return true;
+}
+
+/* Without a log entry, step back over the descriptors of @elem */
+static void virtqueue_packed_unpop(VirtQueue *vq, const VirtQueueElement *elem)
+{
+    int idx = vq->last_avail_idx - elem->ndescs;
+    bool wrap_counter = vq->last_avail_wrap_counter;
+
+    if (virtqueue_packed_rewind(vq, 1)) {
+        return;
+    }
+    if (idx < 0) {
+        idx += vq->vring.num;
+        wrap_counter ^= 1;
+    }
+    virtqueue_packed_set_last_avail(vq, idx, wrap_counter);
 }
 
 /* virtqueue_unpop:
@@ -447,8 +778,12 @@ void virtqueue_detach_element(VirtQueue *vq, const VirtQueueElement *elem,
 void virtqueue_unpop(VirtQueue *vq, const VirtQueueElement *elem,
                      unsigned int len)
 {
-    vq->last_avail_idx--;
-    virtqueue_detach_element(vq, elem, len);
+    if (virtio_vdev_has_feature(vq->vdev, VIRTIO_F_RING_PACKED)) {
+        virtqueue_packed_unpop(vq, elem);
+    } else {
+        vq->last_avail_idx--;
+    }
+    virtqueue_forget_element(vq, elem, len);
 }
 
 /* virtqueue_rewind:
@@ -461,50 +796,99 @@ void virtqueue_unpop(VirtQueue *vq, const VirtQueueElement *elem,
  * Use virtqueue_unpop() instead if you have a VirtQueueElement.
  *
  * Returns: true on success, false if @num is greater than the number of in use
- * elements.
+ * elements.  A packed ring can only go back over the elements popped since
+ * migration or virtio_queue_set_last_avail_idx(), or over all of them.
  */
 bool virtqueue_rewind(VirtQueue *vq, unsigned int num)
 {
     if (num > vq->inuse) {
         return false;
     }
-    vq->last_avail_idx -= num;
+    if (virtio_vdev_has_feature(vq->vdev, VIRTIO_F_RING_PACKED)) {
+        if (!virtqueue_packed_rewind(vq, num)) {
+            return false;
+        }
+    } else {
+        vq->last_avail_idx -= num;
+    }
     vq->inuse -= num;
     return true;
 }
 
 /* Called within rcu_read_lock().  */
-void virtqueue_fill(VirtQueue *vq, const VirtQueueElement *elem,
-                    unsigned int len, unsigned int idx)
+static void virtqueue_split_fill(VirtQueue *vq, const VirtQueueElement *elem,
+                                 unsigned int len, unsigned int idx)
 {
     VRingUsedElem uelem;
 
-    trace_virtqueue_fill(vq, elem, len, idx);
+    idx = (idx + vq->used_idx) % vq->vring.num;
 
-    virtqueue_unmap_sg(vq, elem, len);
+    uelem.id = elem->index;
+    uelem.len = len;
+    vring_used_write(vq, &uelem, idx);
+}
 
-    if (unlikely(vq->vdev->broken)) {
-        return;
-    }
+/* The used descriptors of a packed ring can only be written when flushing,
+ * since the first of them has to be written last.
+ */
+static void virtqueue_packed_fill(VirtQueue *vq, const VirtQueueElement *elem,
+                                  unsigned int len, unsigned int idx)
+{
+    vq->used_elems[idx].id = elem->index;
+    vq->used_elems[idx].ndescs = elem->ndescs;
+    vq->used_elems[idx].len = len;
+}
 
-    if (unlikely(!vq->vring.used)) {
+/* Remember the buffer popped at position @pos of an in-order ring */
+static void virtqueue_in_order_record(VirtQueue *vq,
+                                      const VirtQueueElement *elem,
+                                      unsigned int pos)
+{
+    VRingInOrderElem *e;
+
+    if (!virtio_vdev_has_feature(vq->vdev, VIRTIO_F_IN_ORDER)) {
         return;
     }
 
-    idx = (idx + vq->used_idx) % vq->vring.num;
+    e = &vq->in_order_elems[pos];
+    e->id = elem->index;
+    e->ndescs = elem->ndescs;
+    e->len = 0;
+    e->filled = false;
+}
 
-    uelem.id = elem->index;
-    uelem.len = len;
-    vring_used_write(vq, &uelem, idx);
+/* The buffers in use start at used_idx in both ring layouts, and each takes
+ * ndescs positions.
+ */
+static void virtqueue_in_order_fill(VirtQueue *vq,
+                                    const VirtQueueElement *elem,
+                                    unsigned int len)
+{
+    unsigned int i, pos = vq->used_idx % vq->vring.num;
+
+    for (i = 0; i < vq->inuse; i++) {
+        VRingInOrderElem *e = &vq->in_order_elems[pos];
+
+        if (e->id == elem->index && !e->filled) {
+            e->len = len;
+            e->filled = true;
+            return;
+        }
+        pos = (pos + e->ndescs) % vq->vring.num;
+    }
+
+    virtio_error(vq->vdev, "virtio: buffer %u is not in use", elem->index);
 }
 
 /* Called within rcu_read_lock().  */
-void virtqueue_flush(VirtQueue *vq, unsigned int count)
+void virtqueue_fill(VirtQueue *vq, const VirtQueueElement *elem,
+                    unsigned int len, unsigned int idx)
 {
-    uint16_t old, new;
+    trace_virtqueue_fill(vq, elem, len, idx);
+
+    virtqueue_unmap_sg(vq, elem, len);
 
     if (unlikely(vq->vdev->broken)) {
-        vq->inuse -= count;
         return;
     }
 
@@ -512,6 +896,20 @@ void virtqueue_flush(VirtQueue *vq, unsigned int count)
         return;
     }
 
+    if (virtio_vdev_has_feature(vq->vdev, VIRTIO_F_IN_ORDER)) {
+        virtqueue_in_order_fill(vq, elem, len);
+    } else if (virtio_vdev_has_feature(vq->vdev, VIRTIO_F_RING_PACKED)) {
+        virtqueue_packed_fill(vq, elem, len, idx);
+    } else {
+        virtqueue_split_fill(vq, elem, len, idx);
+    }
+}
+
+/* Called within rcu_read_lock().  */
+static void virtqueue_split_flush(VirtQueue *vq, unsigned int count)
+{
+    uint16_t old, new;
+
     /* Make sure buffer is written before we update index. */
     smp_wmb();
     trace_virtqueue_flush(vq, count);
@@ -523,56 +921,171 @@ void virtqueue_flush(VirtQueue *vq, unsigned int count)
         vq->signalled_used_valid = false;
 }
 
-void virtqueue_push(VirtQueue *vq, const VirtQueueElement *elem,
-                    unsigned int len)
+/* Called within rcu_read_lock().  */
+static void virtqueue_packed_fill_desc(VirtQueue *vq,
+                                       const VRingPackedUsedElem *uelem,
+                                       unsigned int head, bool strict_order)
 {
-    rcu_read_lock();
-    virtqueue_fill(vq, elem, len, 0);
-    virtqueue_flush(vq, 1);
-    rcu_read_unlock();
+    VRingMemoryRegionCaches *caches = vring_get_region_caches(vq);
+    bool wrap_counter = vq->used_wrap_counter;
+    VRingPackedDesc desc = {
+        .id = uelem->id,
+        .len = uelem->len,
+    };
+
+    if (head >= vq->vring.num) {
+        head -= vq->vring.num;
+        wrap_counter ^= 1;
+    }
+    if (wrap_counter) {
+        desc.flags = (1 << VRING_PACKED_DESC_F_AVAIL) |
+                     (1 << VRING_PACKED_DESC_F_USED);
+    }
+
+    vring_packed_desc_write(vq->vdev, &desc, &caches->desc, head,
+                            strict_order);
 }
 
 /* Called within rcu_read_lock().  */
-static int virtqueue_num_heads(VirtQueue *vq, unsigned int idx)
+static void virtqueue_packed_flush(VirtQueue *vq, unsigned int count)
 {
-    uint16_t num_heads = vring_avail_idx(vq) - idx;
+    unsigned int i, ndescs;
 
-    /* Check it isn't doing very strange things with descriptor numbers. */
-    if (num_heads > vq->vring.num) {
-        virtio_error(vq->vdev, "Guest moved used index from %u to %u",
-                     idx, vq->shadow_avail_idx);
-        return -EINVAL;
+    if (!count) {
+        return;
     }
-    /* On success, callers read a descriptor at vq->last_avail_idx.
-     * Make sure descriptor read does not bypass avail index read. */
-    if (num_heads) {
-        smp_rmb();
+
+    trace_virtqueue_flush(vq, count);
+
+    /* Each buffer takes one used descriptor at the position of its first
+     * available descriptor.  Make the batch visible to the driver at once
+     * by handing over the first buffer after all the others.
+     */
+    ndescs = vq->used_elems[0].ndescs;
+    for (i = 1; i < count; i++) {
+        virtqueue_packed_fill_desc(vq, &vq->used_elems[i],
+                                   vq->used_idx + ndescs, false);
+        ndescs += vq->used_elems[i].ndescs;
     }
+    virtqueue_packed_fill_desc(vq, &vq->used_elems[0], vq->used_idx, true);
 
-    return num_heads;
+    vq->inuse -= count;
+    vq->used_idx += ndescs;
+    if (vq->used_idx >= vq->vring.num) {
+        vq->used_idx -= vq->vring.num;
+        vq->used_wrap_counter ^= 1;
+    }
 }
 
 /* Called within rcu_read_lock().  */
-static bool virtqueue_get_head(VirtQueue *vq, unsigned int idx,
-                               unsigned int *head)
+static void virtqueue_in_order_flush(VirtQueue *vq)
 {
-    /* Grab the next descriptor number they're advertising, and increment
-     * the index we've seen. */
-    *head = vring_avail_ring(vq, idx % vq->vring.num);
+    bool packed = virtio_vdev_has_feature(vq->vdev, VIRTIO_F_RING_PACKED);
+    unsigned int count = 0, pos = vq->used_idx % vq->vring.num;
 
-    /* If their number is silly, that's a fatal mistake. */
-    if (*head >= vq->vring.num) {
-        virtio_error(vq->vdev, "Guest says index %u is available", *head);
-        return false;
+    /* Publish the completed buffers up to the oldest one still in flight */
+    while (count < vq->inuse && vq->in_order_elems[pos].filled) {
+        VRingInOrderElem *e = &vq->in_order_elems[pos];
+
+        if (packed) {
+            vq->used_elems[count].id = e->id;
+            vq->used_elems[count].ndescs = e->ndescs;
+            vq->used_elems[count].len = e->len;
+        } else {
+            VRingUsedElem uelem = {
+                .id = e->id,
+                .len = e->len,
+            };
+
+            vring_used_write(vq, &uelem, pos);
+        }
+        e->filled = false;
+        pos = (pos + e->ndescs) % vq->vring.num;
+        count++;
     }
 
-    return true;
+    if (!count) {
+        return;
+    }
+    if (packed) {
+        virtqueue_packed_flush(vq, count);
+    } else {
+        virtqueue_split_flush(vq, count);
+    }
 }
 
-enum {
-    VIRTQUEUE_READ_DESC_ERROR = -1,
-    VIRTQUEUE_READ_DESC_DONE = 0,   /* end of chain */
-    VIRTQUEUE_READ_DESC_MORE = 1,   /* more buffers in chain */
+/* Called within rcu_read_lock().  */
+void virtqueue_flush(VirtQueue *vq, unsigned int count)
+{
+    if (unlikely(vq->vdev->broken)) {
+        vq->inuse -= count;
+        return;
+    }
+
+    if (unlikely(!vq->vring.used)) {
+        return;
+    }
+
+    if (virtio_vdev_has_feature(vq->vdev, VIRTIO_F_IN_ORDER)) {
+        /* @count does not matter, buffers may be held back or released */
+        virtqueue_in_order_flush(vq);
+    } else if (virtio_vdev_has_feature(vq->vdev, VIRTIO_F_RING_PACKED)) {
+        virtqueue_packed_flush(vq, count);
+    } else {
+        virtqueue_split_flush(vq, count);
+    }
+}
+
+void virtqueue_push(VirtQueue *vq, const VirtQueueElement *elem,
+                    unsigned int len)
+{
+    rcu_read_lock();
+    virtqueue_fill(vq, elem, len, 0);
+    virtqueue_flush(vq, 1);
+    rcu_read_unlock();
+}
+
+/* Called within rcu_read_lock().  */
+static int virtqueue_num_heads(VirtQueue *vq, unsigned int idx)
+{
+    uint16_t num_heads = vring_avail_idx(vq) - idx;
+
+    /* Check it isn't doing very strange things with descriptor numbers. */
+    if (num_heads > vq->vring.num) {
+        virtio_error(vq->vdev, "Guest moved used index from %u to %u",
+                     idx, vq->shadow_avail_idx);
+        return -EINVAL;
+    }
+    /* On success, callers read a descriptor at vq->last_avail_idx.
+     * Make sure descriptor read does not bypass avail index read. */
+    if (num_heads) {
+        smp_rmb();
+    }
+
+    return num_heads;
+}
+
+/* Called within rcu_read_lock().  */
+static bool virtqueue_get_head(VirtQueue *vq, unsigned int idx,
+                               unsigned int *head)
+{
+    /* Grab the next descriptor number they're advertising, and increment
+     * the index we've seen. */
+    *head = vring_avail_ring(vq, idx % vq->vring.num);
+
+    /* If their number is silly, that's a fatal mistake. */
+    if (*head >= vq->vring.num) {
+        virtio_error(vq->vdev, "Guest says index %u is available", *head);
+        return false;
+    }
+
+    return true;
+}
+
+enum {
+    VIRTQUEUE_READ_DESC_ERROR = -1,
+    VIRTQUEUE_READ_DESC_DONE = 0,   /* end of chain */
+    VIRTQUEUE_READ_DESC_MORE = 1,   /* more buffers in chain */
 };
 
 static int virtqueue_read_next_desc(VirtIODevice *vdev, VRingDesc *desc,
@@ -598,38 +1111,25 @@ static int virtqueue_read_next_desc(VirtIODevice *vdev, VRingDesc *desc,
     return VIRTQUEUE_READ_DESC_MORE;
 }
 
-void virtqueue_get_avail_bytes(VirtQueue *vq, unsigned int *in_bytes,
-                               unsigned int *out_bytes,
-                               unsigned max_in_bytes, unsigned max_out_bytes)
+/* Called within rcu_read_lock().  */
+static void virtqueue_split_get_avail_bytes(VirtQueue *vq,
+                                            unsigned int *in_bytes,
+                                            unsigned int *out_bytes,
+                                            unsigned max_in_bytes,
+                                            unsigned max_out_bytes,
+                                            VRingMemoryRegionCaches *caches)
 {
     VirtIODevice *vdev = vq->vdev;
     unsigned int max, idx;
     unsigned int total_bufs, in_total, out_total;
-    VRingMemoryRegionCaches *caches;
     MemoryRegionCache indirect_desc_cache = MEMORY_REGION_CACHE_INVALID;
     int64_t len = 0;
     int rc;
 
-    if (unlikely(!vq->vring.desc)) {
-        if (in_bytes) {
-            *in_bytes = 0;
-        }
-        if (out_bytes) {
-            *out_bytes = 0;
-        }
-        return;
-    }
-
-    rcu_read_lock();
     idx = vq->last_avail_idx;
     total_bufs = in_total = out_total = 0;
 
     max = vq->vring.num;
-    caches = vring_get_region_caches(vq);
-    if (caches->desc.len < max * sizeof(VRingDesc)) {
-        virtio_error(vdev, "Cannot map descriptor ring");
-        goto err;
-    }
 
     while ((rc = virtqueue_num_heads(vq, idx)) > 0) {
         MemoryRegionCache *desc_cache = &caches->desc;
@@ -709,13 +1209,144 @@ void virtqueue_get_avail_bytes(VirtQueue *vq, unsigned int *in_bytes,
 
 done:
     address_space_cache_destroy(&indirect_desc_cache);
-    if (in_bytes) {
-        *in_bytes = in_total;
+    *in_bytes = in_total;
+    *out_bytes = out_total;
+    return;
+
+err:
+    in_total = out_total = 0;
+    goto done;
+}
+
+/* Called within rcu_read_lock().  */
+static int virtqueue_packed_read_next_desc(VirtQueue *vq,
+                                           VRingPackedDesc *desc,
+                                           MemoryRegionCache *desc_cache,
+                                           unsigned int max,
+                                           unsigned int *next,
+                                           bool indirect)
+{
+    /* If this descriptor says it doesn't chain, we're done. */
+    if (!indirect && !(desc->flags & VRING_DESC_F_NEXT)) {
+        return VIRTQUEUE_READ_DESC_DONE;
     }
-    if (out_bytes) {
-        *out_bytes = out_total;
+
+    ++*next;
+    if (*next == max) {
+        if (indirect) {
+            return VIRTQUEUE_READ_DESC_DONE;
+        }
+        /* The chain wraps around the end of the ring */
+        *next -= vq->vring.num;
     }
-    rcu_read_unlock();
+
+    vring_packed_desc_read(vq->vdev, desc, desc_cache, *next, false);
+    return VIRTQUEUE_READ_DESC_MORE;
+}
+
+/* Called within rcu_read_lock().  */
+static void virtqueue_packed_get_avail_bytes(VirtQueue *vq,
+                                             unsigned int *in_bytes,
+                                             unsigned int *out_bytes,
+                                             unsigned max_in_bytes,
+                                             unsigned max_out_bytes,
+                                             VRingMemoryRegionCaches *caches)
+{
+    VirtIODevice *vdev = vq->vdev;
+    unsigned int max, idx;
+    unsigned int total_bufs, in_total, out_total;
+    MemoryRegionCache indirect_desc_cache = MEMORY_REGION_CACHE_INVALID;
+    bool wrap_counter;
+    int64_t len = 0;
+    int rc;
+
+    idx = vq->last_avail_idx;
+    wrap_counter = vq->last_avail_wrap_counter;
+    total_bufs = in_total = out_total = 0;
+
+    for (;;) {
+        MemoryRegionCache *desc_cache = &caches->desc;
+        unsigned int num_bufs = total_bufs;
+        unsigned int i = idx;
+        VRingPackedDesc desc;
+
+        max = vq->vring.num;
+        vring_packed_desc_read(vdev, &desc, desc_cache, idx, true);
+        if (!is_desc_avail(desc.flags, wrap_counter)) {
+            break;
+        }
+
+        if (desc.flags & VRING_DESC_F_INDIRECT) {
+            if (desc.len % sizeof(VRingPackedDesc)) {
+                virtio_error(vdev, "Invalid size for indirect buffer table");
+                goto err;
+            }
+
+            /* If we've got too many, that implies a descriptor loop. */
+            if (num_bufs >= max) {
+                virtio_error(vdev, "Looped descriptor");
+                goto err;
+            }
+
+            /* loop over the indirect descriptor table */
+            len = address_space_cache_init(&indirect_desc_cache,
+                                           vdev->dma_as,
+                                           desc.addr, desc.len, false);
+            desc_cache = &indirect_desc_cache;
+            if (len < desc.len) {
+                virtio_error(vdev, "Cannot map indirect buffer");
+                goto err;
+            }
+
+            max = desc.len / sizeof(VRingPackedDesc);
+            num_bufs = i = 0;
+            vring_packed_desc_read(vdev, &desc, desc_cache, i, false);
+        }
+
+        do {
+            /* If we've got too many, that implies a descriptor loop. */
+            if (++num_bufs > max) {
+                virtio_error(vdev, "Looped descriptor");
+                goto err;
+            }
+
+            if (desc.flags & VRING_DESC_F_WRITE) {
+                in_total += desc.len;
+            } else {
+                out_total += desc.len;
+            }
+            if (in_total >= max_in_bytes && out_total >= max_out_bytes) {
+                goto done;
+            }
+
+            rc = virtqueue_packed_read_next_desc(vq, &desc, desc_cache, max,
+                                                 &i, desc_cache ==
+                                                 &indirect_desc_cache);
+        } while (rc == VIRTQUEUE_READ_DESC_MORE);
+
+        if (desc_cache == &indirect_desc_cache) {
+            address_space_cache_destroy(&indirect_desc_cache);
+            total_bufs++;
+            idx++;
+        } else {
+            idx += num_bufs - total_bufs;
+            total_bufs = num_bufs;
+        }
+
+        if (idx >= vq->vring.num) {
+            idx -= vq->vring.num;
+            wrap_counter ^= 1;
+        }
+    }
+
+    /* Record how far we have looked, for the event suppression offset */
+    vq->shadow_avail_idx = idx;
+    vq->shadow_avail_wrap_counter = wrap_counter;
+
+done:
+    address_space_cache_destroy(&indirect_desc_cache);
+    *in_bytes = in_total;
+    *out_bytes = out_total;
     return;
 
 err:
@@ -723,6 +1354,43 @@ err:
     goto done;
 }
 
+void virtqueue_get_avail_bytes(VirtQueue *vq, unsigned int *in_bytes,
+                               unsigned int *out_bytes,
+                               unsigned max_in_bytes, unsigned max_out_bytes)
+{
+    unsigned int desc_size, in_total = 0, out_total = 0;
+    VRingMemoryRegionCaches *caches;
+    bool packed;
+
+    if (unlikely(!vq->vring.desc)) {
+        goto out;
+    }
+
+    packed = virtio_vdev_has_feature(vq->vdev, VIRTIO_F_RING_PACKED);
+    desc_size = packed ? sizeof(VRingPackedDesc) : sizeof(VRingDesc);
+
+    rcu_read_lock();
+    caches = vring_get_region_caches(vq);
+    if (caches->desc.len < vq->vring.num * desc_size) {
+        virtio_error(vq->vdev, "Cannot map descriptor ring");
+    } else if (packed) {
+        virtqueue_packed_get_avail_bytes(vq, &in_total, &out_total,
+                                         max_in_bytes, max_out_bytes, caches);
+    } else {
+        virtqueue_split_get_avail_bytes(vq, &in_total, &out_total,
+                                        max_in_bytes, max_out_bytes, caches);
+    }
+    rcu_read_unlock();
+
+out:
+    if (in_bytes) {
+        *in_bytes = in_total;
+    }
+    if (out_bytes) {
+        *out_bytes = out_total;
+    }
+}
+
 int virtqueue_avail_bytes(VirtQueue *vq, unsigned int in_bytes,
                           unsigned int out_bytes)
 {
@@ -825,7 +1493,8 @@ void virtqueue_map(VirtIODevice *vdev, VirtQueueElement *elem)
     virtqueue_map_iovec(vdev, elem->out_sg, elem->out_addr, &elem->out_num, 0);
 }
 
-static void *virtqueue_alloc_element(size_t sz, unsigned out_num, unsigned in_num)
+static void *virtqueue_alloc_element(VirtQueueElementPool *pool, size_t sz,
+                                     unsigned out_num, unsigned in_num)
 {
     VirtQueueElement *elem;
     size_t in_addr_ofs = QEMU_ALIGN_UP(sz, __alignof__(elem->in_addr[0]));
@@ -836,8 +1505,15 @@ static void *virtqueue_alloc_element(size_t sz, unsigned out_num, unsigned in_nu
     size_t out_sg_end = out_sg_ofs + out_num * sizeof(elem->out_sg[0]);
 
     assert(sz >= sizeof(VirtQueueElement));
-    elem = g_malloc(out_sg_end);
+    if (pool && pool->nfree && out_sg_end <= pool->slot_size) {
+        assert(sz == pool->sz);
+        elem = pool->free[--pool->nfree];
+    } else {
+        elem = g_malloc(out_sg_end);
+        pool = NULL;
+    }
     trace_virtqueue_alloc_element(elem, sz, in_num, out_num);
+    elem->pool = pool;
     elem->out_num = out_num;
     elem->in_num = in_num;
     elem->in_addr = (void *)elem + in_addr_ofs;
@@ -847,7 +1523,8 @@ static void *virtqueue_alloc_element(size_t sz, unsigned out_num, unsigned in_nu
     return elem;
 }
 
-void *virtqueue_pop(VirtQueue *vq, size_t sz)
+static void *virtqueue_split_pop(VirtQueue *vq, size_t sz,
+                                 VirtQueueElementPool *pool)
 {
     unsigned int i, head, max;
     VRingMemoryRegionCaches *caches;
@@ -887,10 +1564,6 @@ void *virtqueue_pop(VirtQueue *vq, size_t sz)
         goto done;
     }
 
-    if (virtio_vdev_has_feature(vdev, VIRTIO_RING_F_EVENT_IDX)) {
-        vring_set_avail_event(vq, vq->last_avail_idx);
-    }
-
     i = head;
 
     caches = vring_get_region_caches(vq);
@@ -957,8 +1630,9 @@ void *virtqueue_pop(VirtQueue *vq, size_t sz)
     }
 
     /* Now copy what we have collected and mapped */
-    elem = virtqueue_alloc_element(sz, out_num, in_num);
+    elem = virtqueue_alloc_element(pool, sz, out_num, in_num);
     elem->index = head;
+    elem->ndescs = 1;
     for (i = 0; i < out_num; i++) {
         elem->out_addr[i] = addr[i];
         elem->out_sg[i] = iov[i];
@@ -968,6 +1642,8 @@ void *virtqueue_pop(VirtQueue *vq, size_t sz)
         elem->in_sg[i] = iov[out_num + i];
     }
 
+    virtqueue_in_order_record(vq, elem, (uint16_t)(vq->last_avail_idx - 1) %
+                                        vq->vring.num);
     vq->inuse++;
 
     trace_virtqueue_pop(vq, elem, elem->in_num, elem->out_num);
@@ -982,23 +1658,302 @@ err_undo_map:
     goto done;
 }
 
-/* virtqueue_drop_all:
+static void *virtqueue_packed_pop(VirtQueue *vq, size_t sz,
+                                  VirtQueueElementPool *pool)
+{
+    unsigned int i, max;
+    VRingMemoryRegionCaches *caches;
+    MemoryRegionCache indirect_desc_cache = MEMORY_REGION_CACHE_INVALID;
+    MemoryRegionCache *desc_cache;
+    int64_t len;
+    VirtIODevice *vdev = vq->vdev;
+    VirtQueueElement *elem = NULL;
+    unsigned out_num, in_num, elem_entries;
+    hwaddr addr[VIRTQUEUE_MAX_SIZE];
+    struct iovec iov[VIRTQUEUE_MAX_SIZE];
+    VRingPackedDesc desc;
+    uint16_t id;
+    int rc;
+
+    if (unlikely(vdev->broken)) {
+        return NULL;
+    }
+    rcu_read_lock();
+    if (virtio_queue_empty_rcu(vq)) {
+        goto done;
+    }
+
+    /* When we start there are none of either input nor output. */
+    out_num = in_num = elem_entries = 0;
+
+    max = vq->vring.num;
+
+    if (vq->inuse >= vq->vring.num) {
+        virtio_error(vdev, "Virtqueue size exceeded");
+        goto done;
+    }
+
+    i = vq->last_avail_idx;
+
+    caches = vring_get_region_caches(vq);
+    if (caches->desc.len < max * sizeof(VRingPackedDesc)) {
+        virtio_error(vdev, "Cannot map descriptor ring");
+        goto done;
+    }
+
+    desc_cache = &caches->desc;
+    vring_packed_desc_read(vdev, &desc, desc_cache, i, true);
+    id = desc.id;
+    if (desc.flags & VRING_DESC_F_INDIRECT) {
+        if (desc.len % sizeof(VRingPackedDesc)) {
+            virtio_error(vdev, "Invalid size for indirect buffer table");
+            goto done;
+        }
+
+        /* loop over the indirect descriptor table */
+        len = address_space_cache_init(&indirect_desc_cache, vdev->dma_as,
+                                       desc.addr, desc.len, false);
+        desc_cache = &indirect_desc_cache;
+        if (len < desc.len) {
+            virtio_error(vdev, "Cannot map indirect buffer");
+            goto done;
+        }
+
+        max = desc.len / sizeof(VRingPackedDesc);
+        i = 0;
+        vring_packed_desc_read(vdev, &desc, desc_cache, i, false);
+    }
+
+    /* Collect all the descriptors */
+    do {
+        bool map_ok;
+
+        if (desc.flags & VRING_DESC_F_WRITE) {
+            map_ok = virtqueue_map_desc(vdev, &in_num, addr + out_num,
+                                        iov + out_num,
+                                        VIRTQUEUE_MAX_SIZE - out_num, true,
+                                        desc.addr, desc.len);
+        } else {
+            if (in_num) {
+                virtio_error(vdev, "Incorrect order for descriptors");
+                goto err_undo_map;
+            }
+            map_ok = virtqueue_map_desc(vdev, &out_num, addr, iov,
+                                        VIRTQUEUE_MAX_SIZE, false,
+                                        desc.addr, desc.len);
+        }
+        if (!map_ok) {
+            goto err_undo_map;
+        }
+
+        /* If we've got too many, that implies a descriptor loop. */
+        if (++elem_entries > max) {
+            virtio_error(vdev, "Looped descriptor");
+            goto err_undo_map;
+        }
+
+        rc = virtqueue_packed_read_next_desc(vq, &desc, desc_cache, max, &i,
+                                             desc_cache ==
+                                             &indirect_desc_cache);
+    } while (rc == VIRTQUEUE_READ_DESC_MORE);
+
+    /* Now copy what we have collected and mapped */
+    elem = virtqueue_alloc_element(pool, sz, out_num, in_num);
+    elem->index = id;
+    elem->ndescs = (desc_cache == &indirect_desc_cache) ? 1 : elem_entries;
+    for (i = 0; i < out_num; i++) {
+        elem->out_addr[i] = addr[i];
+        elem->out_sg[i] = iov[i];
+    }
+    for (i = 0; i < in_num; i++) {
+        elem->in_addr[i] = addr[out_num + i];
+        elem->in_sg[i] = iov[out_num + i];
+    }
+
+    virtqueue_packed_log_pop(vq);
+    virtqueue_in_order_record(vq, elem, vq->last_avail_idx);
+    vq->inuse++;
+    vq->last_avail_idx += elem->ndescs;
+    if (vq->last_avail_idx >= vq->vring.num) {
+        vq->last_avail_idx -= vq->vring.num;
+        vq->last_avail_wrap_counter ^= 1;
+    }
+    vq->shadow_avail_idx = vq->last_avail_idx;
+    vq->shadow_avail_wrap_counter = vq->last_avail_wrap_counter;
+
+    trace_virtqueue_pop(vq, elem, elem->in_num, elem->out_num);
+done:
+    address_space_cache_destroy(&indirect_desc_cache);
+    rcu_read_unlock();
+
+    return elem;
+
+err_undo_map:
+    virtqueue_undo_map_desc(out_num, in_num, iov);
+    goto done;
+}
+
+/* Let the driver know which buffers have been looked at */
+static void virtqueue_split_set_avail_event(VirtQueue *vq)
+{
+    if (virtio_vdev_has_feature(vq->vdev, VIRTIO_RING_F_EVENT_IDX)) {
+        rcu_read_lock();
+        vring_set_avail_event(vq, vq->last_avail_idx);
+        rcu_read_unlock();
+    }
+}
+
+void *virtqueue_pop(VirtQueue *vq, size_t sz)
+{
+    VirtQueueElement *elem;
+
+    if (virtio_vdev_has_feature(vq->vdev, VIRTIO_F_RING_PACKED)) {
+        return virtqueue_packed_pop(vq, sz, NULL);
+    }
+
+    elem = virtqueue_split_pop(vq, sz, NULL);
+    if (elem) {
+        virtqueue_split_set_avail_event(vq);
+    }
+    return elem;
+}
+
+/* virtqueue_element_pool_new:
+ * @sz: Size of the structure embedding each #VirtQueueElement, as would be
+ *      passed to virtqueue_pop()
+ * @max_sg: Number of scatter-gather entries each element has room for
+ * @size: Number of elements in the pool
+ *
+ * Preallocate elements for virtqueue_pop_batch().  Buffers with more than
+ * @max_sg segments, and buffers popped while the whole pool is in use, are
+ * allocated on the heap instead.
+ *
+ * The pool is not thread-safe: popping and freeing its elements must be
+ * serialized by the device, e.g. by processing its virtqueues in a single
+ * AioContext.
+ */
+VirtQueueElementPool *virtqueue_element_pool_new(size_t sz,
+                                                 unsigned int max_sg,
+                                                 unsigned int size)
+{
+    VirtQueueElementPool *pool = g_new0(VirtQueueElementPool, 1);
+    size_t addr_end = QEMU_ALIGN_UP(sz, __alignof__(hwaddr)) +
+                      max_sg * sizeof(hwaddr);
+    size_t sg_end = QEMU_ALIGN_UP(addr_end, __alignof__(struct iovec)) +
+                    max_sg * sizeof(struct iovec);
+    unsigned int i;
+
+    assert(sz >= sizeof(VirtQueueElement));
+    pool->sz = sz;
+    /* Keep each slot as aligned as g_malloc() memory */
+    pool->slot_size = QEMU_ALIGN_UP(sg_end, 16);
+    pool->slots = g_malloc(pool->slot_size * size);
+    pool->free = g_new(void *, size);
+    for (i = 0; i < size; i++) {
+        pool->free[i] = pool->slots + (size - 1 - i) * pool->slot_size;
+    }
+    pool->nfree = size;
+    return pool;
+}
+
+/* virtqueue_element_pool_free:
+ * @pool: The #VirtQueueElementPool, or NULL
+ *
+ * Free the pool.  None of its elements may still be in use.
+ */
+void virtqueue_element_pool_free(VirtQueueElementPool *pool)
+{
+    if (!pool) {
+        return;
+    }
+    g_free(pool->free);
+    g_free(pool->slots);
+    g_free(pool);
+}
+
+/* virtqueue_element_free:
+ * @elem: The #VirtQueueElement
+ *
+ * Free an element returned by virtqueue_pop() or virtqueue_pop_batch(),
+ * giving it back to its pool if it was allocated from one.
+ */
+void virtqueue_element_free(VirtQueueElement *elem)
+{
+    VirtQueueElementPool *pool = elem->pool;
+
+    if (pool) {
+        pool->free[pool->nfree++] = elem;
+    } else {
+        g_free(elem);
+    }
+}
+
+/* virtqueue_pop_batch:
  * @vq: The #VirtQueue
- * Drops all queued buffers and indicates them to the guest
- * as if they are done. Useful when buffers can not be
- * processed but must be returned to the guest.
+ * @pool: The #VirtQueueElementPool to allocate elements from
+ * @elems: Array receiving the elements
+ * @max: Maximum number of elements to pop
+ *
+ * Pop up to @max elements, of the size @pool was created for, at once.  The
+ * avail event of a split ring is only published once for the whole batch.
+ * The elements must be freed with virtqueue_element_free().
+ *
+ * Returns: the number of elements popped.
  */
-unsigned int virtqueue_drop_all(VirtQueue *vq)
+unsigned int virtqueue_pop_batch(VirtQueue *vq, VirtQueueElementPool *pool,
+                                 VirtQueueElement **elems, unsigned int max)
+{
+    bool packed = virtio_vdev_has_feature(vq->vdev, VIRTIO_F_RING_PACKED);
+    unsigned int n;
+
+    rcu_read_lock();
+    for (n = 0; n < max; n++) {
+        if (packed) {
+            elems[n] = virtqueue_packed_pop(vq, pool->sz, pool);
+        } else {
+            elems[n] = virtqueue_split_pop(vq, pool->sz, pool);
+        }
+        if (!elems[n]) {
+            break;
+        }
+    }
+    if (n && !packed) {
+        virtqueue_split_set_avail_event(vq);
+    }
+    rcu_read_unlock();
+
+    return n;
+}
+
+/* virtqueue_fill_batch:
+ * @vq: The #VirtQueue
+ * @elems: The elements to give back to the driver
+ * @lens: Number of bytes written to each element, or NULL if none were
+ * @count: Number of elements
+ *
+ * Give @count elements back to the driver with a single update of the used
+ * index.  The caller still has to notify the driver and free the elements.
+ */
+void virtqueue_fill_batch(VirtQueue *vq, VirtQueueElement **elems,
+                          const unsigned int *lens, unsigned int count)
+{
+    unsigned int i;
+
+    rcu_read_lock();
+    for (i = 0; i < count; i++) {
+        virtqueue_fill(vq, elems[i], lens ? lens[i] : 0, i);
+    }
+    virtqueue_flush(vq, count);
+    rcu_read_unlock();
+}
+
+static unsigned int virtqueue_split_drop_all(VirtQueue *vq)
 {
     unsigned int dropped = 0;
     VirtQueueElement elem = {};
     VirtIODevice *vdev = vq->vdev;
     bool fEventIdx = virtio_vdev_has_feature(vdev, VIRTIO_RING_F_EVENT_IDX);
 
-    if (unlikely(vdev->broken)) {
-        return 0;
-    }
-
     while (!virtio_queue_empty(vq) && vq->inuse < vq->vring.num) {
         /* works similar to virtqueue_pop but does not map buffers
         * and does not allocate any memory */
@@ -1006,6 +1961,9 @@ unsigned int virtqueue_drop_all(VirtQueue *vq)
         if (!virtqueue_get_head(vq, vq->last_avail_idx, &elem.index)) {
             break;
         }
+        elem.ndescs = 1;
+        virtqueue_in_order_record(vq, &elem,
+                                  vq->last_avail_idx % vq->vring.num);
         vq->inuse++;
         vq->last_avail_idx++;
         if (fEventIdx) {
@@ -1020,6 +1978,82 @@ unsigned int virtqueue_drop_all(VirtQueue *vq)
     return dropped;
 }
 
+static unsigned int virtqueue_packed_drop_all(VirtQueue *vq)
+{
+    VirtIODevice *vdev = vq->vdev;
+    VRingMemoryRegionCaches *caches;
+    MemoryRegionCache *desc_cache;
+    unsigned int dropped = 0;
+    VirtQueueElement elem = {};
+    VRingPackedDesc desc;
+
+    if (unlikely(!vq->vring.desc)) {
+        return 0;
+    }
+
+    rcu_read_lock();
+    caches = vring_get_region_caches(vq);
+    desc_cache = &caches->desc;
+
+    while (vq->inuse < vq->vring.num) {
+        unsigned int idx = vq->last_avail_idx;
+
+        /* works similar to virtqueue_pop but does not map buffers
+         * and does not allocate any memory */
+        vring_packed_desc_read(vdev, &desc, desc_cache, idx, true);
+        if (!is_desc_avail(desc.flags, vq->last_avail_wrap_counter)) {
+            break;
+        }
+        elem.index = desc.id;
+        elem.ndescs = 1;
+        while (virtqueue_packed_read_next_desc(vq, &desc, desc_cache,
+                                               vq->vring.num, &idx, false)) {
+            if (++elem.ndescs > vq->vring.num) {
+                virtio_error(vdev, "Looped descriptor");
+                goto out;
+            }
+        }
+
+        virtqueue_packed_log_pop(vq);
+        virtqueue_in_order_record(vq, &elem, vq->last_avail_idx);
+        vq->inuse++;
+        vq->last_avail_idx += elem.ndescs;
+        if (vq->last_avail_idx >= vq->vring.num) {
+            vq->last_avail_idx -= vq->vring.num;
+            vq->last_avail_wrap_counter ^= 1;
+        }
+        /* immediately push the element, nothing to unmap
+         * as both in_num and out_num are set to 0 */
+        virtqueue_push(vq, &elem, 0);
+        dropped++;
+    }
+
+out:
+    vq->shadow_avail_idx = vq->last_avail_idx;
+    vq->shadow_avail_wrap_counter = vq->last_avail_wrap_counter;
+    rcu_read_unlock();
+    return dropped;
+}
+
+/* virtqueue_drop_all:
+ * @vq: The #VirtQueue
+ * Drops all queued buffers and indicates them to the guest
+ * as if they are done. Useful when buffers can not be
+ * processed but must be returned to the guest.
+ */
+unsigned int virtqueue_drop_all(VirtQueue *vq)
+{
+    if (unlikely(vq->vdev->broken)) {
+        return 0;
+    }
+
+    if (virtio_vdev_has_feature(vq->vdev, VIRTIO_F_RING_PACKED)) {
+        return virtqueue_packed_drop_all(vq);
+    } else {
+        return virtqueue_split_drop_all(vq);
+    }
+}
+
 /* Reading and writing a structure directly to QEMUFile is *awful*, but
  * it is what QEMU has always done by mistake.  We can change it sooner
  * or later by bumping the version number of the affected vm states.
@@ -1053,8 +2087,12 @@ void *qemu_get_virtqueue_element(VirtIODevice *vdev, QEMUFile *f, size_t sz)
     assert(ARRAY_SIZE(data.in_addr) >= data.in_num);
     assert(ARRAY_SIZE(data.out_addr) >= data.out_num);
 
-    elem = virtqueue_alloc_element(sz, data.out_num, data.in_num);
+    elem = virtqueue_alloc_element(NULL, sz, data.out_num, data.in_num);
     elem->index = data.index;
+    elem->ndescs = 1;
+    if (virtio_host_has_feature(vdev, VIRTIO_F_RING_PACKED)) {
+        elem->ndescs = qemu_get_be16(f);
+    }
 
     for (i = 0; i < elem->in_num; i++) {
         elem->in_addr[i] = data.in_addr[i];
@@ -1080,7 +2118,8 @@ void *qemu_get_virtqueue_element(VirtIODevice *vdev, QEMUFile *f, size_t sz)
     return elem;
 }
 
-void qemu_put_virtqueue_element(QEMUFile *f, VirtQueueElement *elem)
+void qemu_put_virtqueue_element(VirtIODevice *vdev, QEMUFile *f,
+                                VirtQueueElement *elem)
 {
     VirtQueueElementOld data;
     int i;
@@ -1109,6 +2148,13 @@ void qemu_put_virtqueue_element(QEMUFile *f, VirtQueueElement *elem)
         data.out_sg[i].iov_len = elem->out_sg[i].iov_len;
     }
     qemu_put_buffer(f, (uint8_t *)&data, sizeof(VirtQueueElementOld));
+
+    /* The host features are known before the device state is loaded, unlike
+     * the guest features above the first 32.
+     */
+    if (virtio_host_has_feature(vdev, VIRTIO_F_RING_PACKED)) {
+        qemu_put_be16(f, elem->ndescs);
+    }
 }
 
 /* virtio device */
@@ -1189,6 +2235,42 @@ static enum virtio_device_endian virtio_current_cpu_endian(void)
     }
 }
 
+static void virtio_queue_free_elems(VirtQueue *vq)
+{
+    g_free(vq->used_elems);
+    vq->used_elems = NULL;
+    g_free(vq->pop_log);
+    vq->pop_log = NULL;
+    vq->pop_valid = 0;
+    g_free(vq->in_order_elems);
+    vq->in_order_elems = NULL;
+}
+
+/* The bookkeeping of packed and in-order rings has one entry per descriptor,
+ * so it is only allocated for the features the driver negotiated and has to
+ * follow the size of the ring.  Arrays that already exist are kept.
+ */
+static void virtio_queue_alloc_elems(VirtQueue *vq)
+{
+    unsigned int num = vq->vring.num;
+
+    if (!num) {
+        return;
+    }
+    if (virtio_vdev_has_feature(vq->vdev, VIRTIO_F_RING_PACKED)) {
+        if (!vq->used_elems) {
+            vq->used_elems = g_new0(VRingPackedUsedElem, num);
+        }
+        if (!vq->pop_log) {
+            vq->pop_log = g_new0(uint16_t, num);
+        }
+    }
+    if (virtio_vdev_has_feature(vq->vdev, VIRTIO_F_IN_ORDER) &&
+        !vq->in_order_elems) {
+        vq->in_order_elems = g_new0(VRingInOrderElem, num);
+    }
+}
+
 void virtio_reset(void *opaque)
 {
     VirtIODevice *vdev = opaque;
@@ -1223,6 +2305,11 @@ void virtio_reset(void *opaque)
         vdev->vq[i].last_avail_idx = 0;
         vdev->vq[i].shadow_avail_idx = 0;
         vdev->vq[i].used_idx = 0;
+        vdev->vq[i].last_avail_wrap_counter = true;
+        vdev->vq[i].shadow_avail_wrap_counter = true;
+        vdev->vq[i].used_wrap_counter = true;
+        vdev->vq[i].pop_count = 0;
+        vdev->vq[i].pop_valid = 0;
         virtio_queue_set_vector(vdev, i, VIRTIO_NO_VECTOR);
         vdev->vq[i].signalled_used = 0;
         vdev->vq[i].signalled_used_valid = false;
@@ -1230,6 +2317,7 @@ void virtio_reset(void *opaque)
         vdev->vq[i].vring.num = vdev->vq[i].vring.num_default;
         vdev->vq[i].inuse = 0;
         virtio_virtqueue_reset_region_cache(&vdev->vq[i]);
+        virtio_queue_free_elems(&vdev->vq[i]);
     }
 }
 
@@ -1458,7 +2546,11 @@ void virtio_queue_set_num(VirtIODevice *vdev, int n, int num)
         num < 0) {
         return;
     }
-    vdev->vq[n].vring.num = num;
+    if (vdev->vq[n].vring.num != num) {
+        vdev->vq[n].vring.num = num;
+        virtio_queue_free_elems(&vdev->vq[n]);
+        virtio_queue_alloc_elems(&vdev->vq[n]);
+    }
 }
 
 VirtQueue *virtio_vector_first_queue(VirtIODevice *vdev, uint16_t vector)
@@ -1528,6 +2620,19 @@ static bool virtio_queue_notify_aio_vq(VirtQueue *vq)
     return false;
 }
 
+/* Called within rcu_read_lock().  */
+static void virtio_queue_kick_host_notifier(VirtQueue *vq)
+{
+    VirtIONotifyGroup *group = atomic_rcu_read(&vq->notify_group);
+
+    if (group) {
+        set_bit_atomic(vq->queue_index, group->pending);
+        event_notifier_set(&group->notifier);
+    } else {
+        event_notifier_set(&vq->host_notifier);
+    }
+}
+
 static void virtio_queue_notify_vq(VirtQueue *vq)
 {
     if (vq->vring.desc && vq->handle_output) {
@@ -1552,12 +2657,46 @@ void virtio_queue_notify(VirtIODevice *vdev, int n)
 
     trace_virtio_queue_notify(vdev, vq - vdev->vq, vq);
     if (vq->handle_aio_output) {
-        event_notifier_set(&vq->host_notifier);
+        virtio_queue_kick_host_notifier(vq);
     } else if (vq->handle_output) {
         vq->handle_output(vdev, vq);
     }
 }
 
+/* Like virtio_queue_notify, but may be called without the BQL.  Queues
+ * served by an AioContext only need their host notifier kicked; all the
+ * others are processed under the BQL, which is taken if necessary.
+ *
+ * The notifier and its group may be torn down concurrently by the main
+ * loop; they are only released after an RCU grace period.
+ */
+void virtio_queue_notify_unlocked(VirtIODevice *vdev, int n)
+{
+    VirtQueue *vq = &vdev->vq[n];
+    bool kicked = false;
+
+    if (qemu_mutex_iothread_locked()) {
+        virtio_queue_notify(vdev, n);
+        return;
+    }
+
+    rcu_read_lock();
+    if (unlikely(!vq->vring.desc || atomic_read(&vdev->broken))) {
+        kicked = true;
+    } else if (atomic_rcu_read(&vq->handle_aio_output)) {
+        trace_virtio_queue_notify(vdev, n, vq);
+        virtio_queue_kick_host_notifier(vq);
+        kicked = true;
+    }
+    rcu_read_unlock();
+
+    if (!kicked) {
+        qemu_mutex_lock_iothread();
+        virtio_queue_notify(vdev, n);
+        qemu_mutex_unlock_iothread();
+    }
+}
+
 uint16_t virtio_queue_vector(VirtIODevice *vdev, int n)
 {
     return n < VIRTIO_QUEUE_MAX ? vdev->vq[n].vector :
@@ -1599,6 +2738,8 @@ VirtQueue *virtio_add_queue(VirtIODevice *vdev, int queue_size,
     vdev->vq[i].vring.align = VIRTIO_PCI_VRING_ALIGN;
     vdev->vq[i].handle_output = handle_output;
     vdev->vq[i].handle_aio_output = NULL;
+    /* In case the features have already been negotiated */
+    virtio_queue_alloc_elems(&vdev->vq[i]);
 
     return &vdev->vq[i];
 }
@@ -1613,6 +2754,7 @@ void virtio_del_queue(VirtIODevice *vdev, int n)
     vdev->vq[n].vring.num_default = 0;
     vdev->vq[n].handle_output = NULL;
     vdev->vq[n].handle_aio_output = NULL;
+    virtio_queue_free_elems(&vdev->vq[n]);
 }
 
 static void virtio_set_isr(VirtIODevice *vdev, int value)
@@ -1628,17 +2770,10 @@ static void virtio_set_isr(VirtIODevice *vdev, int value)
 }
 
 /* Called within rcu_read_lock().  */
-static bool virtio_should_notify(VirtIODevice *vdev, VirtQueue *vq)
+static bool virtio_split_should_notify(VirtIODevice *vdev, VirtQueue *vq)
 {
     uint16_t old, new;
     bool v;
-    /* We need to expose used array entries before checking used event. */
-    smp_mb();
-    /* Always notify when queue is empty (when feature acknowledge) */
-    if (virtio_vdev_has_feature(vdev, VIRTIO_F_NOTIFY_ON_EMPTY) &&
-        !vq->inuse && virtio_queue_empty(vq)) {
-        return true;
-    }
 
     if (!virtio_vdev_has_feature(vdev, VIRTIO_RING_F_EVENT_IDX)) {
         return !(vring_avail_flags(vq) & VRING_AVAIL_F_NO_INTERRUPT);
@@ -1651,6 +2786,65 @@ static bool virtio_should_notify(VirtIODevice *vdev, VirtQueue *vq)
     return !v || vring_need_event(vring_get_used_event(vq), new, old);
 }
 
+/* The indexes of a packed ring wrap at vring.num, bring the event offset
+ * in the same lap as @new before comparing.
+ */
+static bool vring_packed_need_event(VirtQueue *vq, bool wrap,
+                                    uint16_t off_wrap, uint16_t new,
+                                    uint16_t old)
+{
+    int off = off_wrap & ~(1 << VRING_PACKED_EVENT_F_WRAP_CTR);
+
+    if (wrap != off_wrap >> VRING_PACKED_EVENT_F_WRAP_CTR) {
+        off -= vq->vring.num;
+    }
+
+    return vring_need_event(off, new, old);
+}
+
+/* Called within rcu_read_lock().  */
+static bool virtio_packed_should_notify(VirtIODevice *vdev, VirtQueue *vq)
+{
+    VRingMemoryRegionCaches *caches = vring_get_region_caches(vq);
+    VRingPackedDescEvent e;
+    uint16_t old, new;
+    bool v;
+
+    vring_packed_event_read(vdev, &caches->avail, &e);
+
+    old = vq->signalled_used;
+    new = vq->signalled_used = vq->used_idx;
+    v = vq->signalled_used_valid;
+    vq->signalled_used_valid = true;
+
+    if (e.flags == VRING_PACKED_EVENT_FLAG_DISABLE) {
+        return false;
+    } else if (e.flags == VRING_PACKED_EVENT_FLAG_ENABLE) {
+        return true;
+    }
+
+    return !v || vring_packed_need_event(vq, vq->used_wrap_counter,
+                                         e.off_wrap, new, old);
+}
+
+/* Called within rcu_read_lock().  */
+static bool virtio_should_notify(VirtIODevice *vdev, VirtQueue *vq)
+{
+    /* We need to expose used array entries before checking used event. */
+    smp_mb();
+    /* Always notify when queue is empty (when feature acknowledge) */
+    if (virtio_vdev_has_feature(vdev, VIRTIO_F_NOTIFY_ON_EMPTY) &&
+        !vq->inuse && virtio_queue_empty(vq)) {
+        return true;
+    }
+
+    if (virtio_vdev_has_feature(vdev, VIRTIO_F_RING_PACKED)) {
+        return virtio_packed_should_notify(vdev, vq);
+    } else {
+        return virtio_split_should_notify(vdev, vq);
+    }
+}
+
 void virtio_notify_irqfd(VirtIODevice *vdev, VirtQueue *vq)
 {
     bool should_notify;
@@ -1740,6 +2934,20 @@ static bool virtio_virtqueue_needed(void *opaque)
     return virtio_host_has_feature(vdev, VIRTIO_F_VERSION_1);
 }
 
+static bool virtio_packed_virtqueue_needed(void *opaque)
+{
+    VirtIODevice *vdev = opaque;
+
+    return virtio_host_has_feature(vdev, VIRTIO_F_RING_PACKED);
+}
+
+static bool virtio_in_order_virtqueue_needed(void *opaque)
+{
+    VirtIODevice *vdev = opaque;
+
+    return virtio_vdev_has_feature(vdev, VIRTIO_F_IN_ORDER);
+}
+
 static bool virtio_ringsize_needed(void *opaque)
 {
     VirtIODevice *vdev = opaque;
@@ -1793,6 +3001,85 @@ static const VMStateDescription vmstate_virtio_virtqueues = {
     }
 };
 
+/* A packed ring has no used index in guest memory, and the number of
+ * buffers in use cannot be derived from the ring indexes.
+ */
+static const VMStateDescription vmstate_packed_virtqueue = {
+    .name = "packed_virtqueue_state",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT16(last_avail_idx, struct VirtQueue),
+        VMSTATE_BOOL(last_avail_wrap_counter, struct VirtQueue),
+        VMSTATE_UINT16(used_idx, struct VirtQueue),
+        VMSTATE_BOOL(used_wrap_counter, struct VirtQueue),
+        VMSTATE_UINT32(inuse, struct VirtQueue),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+static const VMStateDescription vmstate_virtio_packed_virtqueues = {
+    .name = "virtio/packed_virtqueues",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .needed = &virtio_packed_virtqueue_needed,
+    .fields = (VMStateField[]) {
+        VMSTATE_STRUCT_VARRAY_POINTER_KNOWN(vq, struct VirtIODevice,
+                      VIRTIO_QUEUE_MAX, 0, vmstate_packed_virtqueue, VirtQueue),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+static const VMStateDescription vmstate_in_order_elem = {
+    .name = "virtqueue_in_order_elem",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT16(id, VRingInOrderElem),
+        VMSTATE_UINT16(ndescs, VRingInOrderElem),
+        VMSTATE_UINT32(len, VRingInOrderElem),
+        VMSTATE_BOOL(filled, VRingInOrderElem),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+/* The ring sizes have been loaded, but not yet the features */
+static int virtio_in_order_virtqueue_pre_load(void *opaque)
+{
+    VirtQueue *vq = opaque;
+
+    g_free(vq->in_order_elems);
+    vq->in_order_elems = g_new0(VRingInOrderElem, vq->vring.num);
+    return 0;
+}
+
+/* Buffers that completed ahead of older ones are only recorded here */
+static const VMStateDescription vmstate_in_order_virtqueue = {
+    .name = "in_order_virtqueue_state",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .pre_load = virtio_in_order_virtqueue_pre_load,
+    .fields = (VMStateField[]) {
+        VMSTATE_STRUCT_VARRAY_POINTER_UINT32(in_order_elems, struct VirtQueue,
+                                             vring.num, vmstate_in_order_elem,
+                                             VRingInOrderElem),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+static const VMStateDescription vmstate_virtio_in_order_virtqueues = {
+    .name = "virtio/in_order_virtqueues",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .needed = &virtio_in_order_virtqueue_needed,
+    .fields = (VMStateField[]) {
+        VMSTATE_STRUCT_VARRAY_POINTER_KNOWN(vq, struct VirtIODevice,
+                      VIRTIO_QUEUE_MAX, 0, vmstate_in_order_virtqueue,
+                      VirtQueue),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
 static const VMStateDescription vmstate_ringsize = {
     .name = "ringsize_state",
     .version_id = 1,
@@ -1913,6 +3200,8 @@ static const VMStateDescription vmstate_virtio = {
         &vmstate_virtio_ringsize,
         &vmstate_virtio_broken,
         &vmstate_virtio_extra_state,
+        &vmstate_virtio_packed_virtqueues,
+        &vmstate_virtio_in_order_virtqueues,
         NULL
     }
 };
@@ -2015,7 +3304,7 @@ static int virtio_set_features_nocheck(VirtIODevice *vdev, uint64_t val)
 
 int virtio_set_features(VirtIODevice *vdev, uint64_t val)
 {
-    int ret;
+    int i, ret;
     /*
      * The driver must not attempt to set features after feature negotiation
      * has finished.
@@ -2024,9 +3313,15 @@ int virtio_set_features(VirtIODevice *vdev, uint64_t val)
         return -EINVAL;
     }
     ret = virtio_set_features_nocheck(vdev, val);
-    if (!ret && virtio_vdev_has_feature(vdev, VIRTIO_RING_F_EVENT_IDX)) {
-        /* VIRTIO_RING_F_EVENT_IDX changes the size of the caches.  */
-        int i;
+    /* The driver may still change the features or the ring sizes */
+    for (i = 0; i < VIRTIO_QUEUE_MAX; i++) {
+        virtio_queue_free_elems(&vdev->vq[i]);
+        virtio_queue_alloc_elems(&vdev->vq[i]);
+    }
+    if (!ret && (virtio_vdev_has_feature(vdev, VIRTIO_RING_F_EVENT_IDX) ||
+                 virtio_vdev_has_feature(vdev, VIRTIO_F_RING_PACKED))) {
+        /* VIRTIO_RING_F_EVENT_IDX and VIRTIO_F_RING_PACKED change the size
+         * and the layout of the caches.  */
         for (i = 0; i < VIRTIO_QUEUE_MAX; i++) {
             if (vdev->vq[i].vring.num != 0) {
                 virtio_init_region_cache(vdev, i);
@@ -2052,6 +3347,10 @@ int virtio_load(VirtIODevice *vdev, QEMUFile *f, int version_id)
      */
     vdev->device_endian = VIRTIO_DEVICE_ENDIAN_UNKNOWN;
 
+    for (i = 0; i < VIRTIO_QUEUE_MAX; i++) {
+        virtio_queue_free_elems(&vdev->vq[i]);
+    }
+
     if (k->load_config) {
         ret = k->load_config(qbus->parent, f);
         if (ret)
@@ -2099,6 +3398,11 @@ int virtio_load(VirtIODevice *vdev, QEMUFile *f, int version_id)
 
     for (i = 0; i < num; i++) {
         vdev->vq[i].vring.num = qemu_get_be32(f);
+        if (vdev->vq[i].vring.num > VIRTQUEUE_MAX_SIZE) {
+            error_report("VQ %d size 0x%x exceeds the maximum", i,
+                         vdev->vq[i].vring.num);
+            return -1;
+        }
         if (k->has_variable_vring_alignment) {
             vdev->vq[i].vring.align = qemu_get_be32(f);
         }
@@ -2168,6 +3472,11 @@ int virtio_load(VirtIODevice *vdev, QEMUFile *f, int version_id)
         }
     }
 
+    /* in_order_elems, if any, came with vmstate_in_order_virtqueue */
+    for (i = 0; i < VIRTIO_QUEUE_MAX; i++) {
+        virtio_queue_alloc_elems(&vdev->vq[i]);
+    }
+
     rcu_read_lock();
     for (i = 0; i < num; i++) {
         if (vdev->vq[i].vring.desc) {
@@ -2185,6 +3494,16 @@ int virtio_load(VirtIODevice *vdev, QEMUFile *f, int version_id)
                 virtio_queue_update_rings(vdev, i);
             }
 
+            if (virtio_vdev_has_feature(vdev, VIRTIO_F_RING_PACKED)) {
+                /* Everything else came with vmstate_packed_virtqueue */
+                vdev->vq[i].shadow_avail_idx = vdev->vq[i].last_avail_idx;
+                vdev->vq[i].shadow_avail_wrap_counter =
+                    vdev->vq[i].last_avail_wrap_counter;
+                vdev->vq[i].pop_count = 0;
+                vdev->vq[i].pop_valid = 0;
+                continue;
+            }
+
             nheads = vring_avail_idx(&vdev->vq[i]) - vdev->vq[i].last_avail_idx;
             /* Check it isn't doing strange things with descriptor numbers. */
             if (nheads > vdev->vq[i].vring.num) {
@@ -2283,6 +3602,9 @@ void virtio_init(VirtIODevice *vdev, const char *name,
         vdev->vq[i].vector = VIRTIO_NO_VECTOR;
         vdev->vq[i].vdev = vdev;
         vdev->vq[i].queue_index = i;
+        vdev->vq[i].last_avail_wrap_counter = true;
+        vdev->vq[i].shadow_avail_wrap_counter = true;
+        vdev->vq[i].used_wrap_counter = true;
     }
 
     vdev->name = name;
@@ -2315,34 +3637,86 @@ hwaddr virtio_queue_get_used_addr(VirtIODevice *vdev, int n)
 
 hwaddr virtio_queue_get_desc_size(VirtIODevice *vdev, int n)
 {
+    if (virtio_vdev_has_feature(vdev, VIRTIO_F_RING_PACKED)) {
+        return sizeof(VRingPackedDesc) * vdev->vq[n].vring.num;
+    }
     return sizeof(VRingDesc) * vdev->vq[n].vring.num;
 }
 
 hwaddr virtio_queue_get_avail_size(VirtIODevice *vdev, int n)
 {
+    if (virtio_vdev_has_feature(vdev, VIRTIO_F_RING_PACKED)) {
+        return sizeof(VRingPackedDescEvent);
+    }
     return offsetof(VRingAvail, ring) +
         sizeof(uint16_t) * vdev->vq[n].vring.num;
 }
 
 hwaddr virtio_queue_get_used_size(VirtIODevice *vdev, int n)
 {
+    if (virtio_vdev_has_feature(vdev, VIRTIO_F_RING_PACKED)) {
+        return sizeof(VRingPackedDescEvent);
+    }
     return offsetof(VRingUsed, ring) +
         sizeof(VRingUsedElem) * vdev->vq[n].vring.num;
 }
 
-uint16_t virtio_queue_get_last_avail_idx(VirtIODevice *vdev, int n)
+/* For a packed ring, the low 16 bits hold last_avail_idx and the high 16
+ * bits hold used_idx, each with its wrap counter in the top bit.  This is
+ * the vring base format used by vhost for packed rings.
+ */
+unsigned int virtio_queue_get_last_avail_idx(VirtIODevice *vdev, int n)
 {
-    return vdev->vq[n].last_avail_idx;
+    VirtQueue *vq = &vdev->vq[n];
+    unsigned int avail, used;
+
+    if (!virtio_vdev_has_feature(vdev, VIRTIO_F_RING_PACKED)) {
+        return vq->last_avail_idx;
+    }
+
+    avail = vq->last_avail_idx |
+            vq->last_avail_wrap_counter << VRING_PACKED_EVENT_F_WRAP_CTR;
+    used = vq->used_idx |
+           vq->used_wrap_counter << VRING_PACKED_EVENT_F_WRAP_CTR;
+    return avail | used << 16;
 }
 
-void virtio_queue_set_last_avail_idx(VirtIODevice *vdev, int n, uint16_t idx)
+void virtio_queue_set_last_avail_idx(VirtIODevice *vdev, int n,
+                                     unsigned int idx)
 {
-    vdev->vq[n].last_avail_idx = idx;
-    vdev->vq[n].shadow_avail_idx = idx;
+    VirtQueue *vq = &vdev->vq[n];
+    uint16_t mask = (1 << VRING_PACKED_EVENT_F_WRAP_CTR) - 1;
+
+    if (!virtio_vdev_has_feature(vdev, VIRTIO_F_RING_PACKED)) {
+        vq->last_avail_idx = idx;
+        vq->shadow_avail_idx = idx;
+        return;
+    }
+
+    vq->last_avail_idx = vq->shadow_avail_idx = idx & mask;
+    vq->last_avail_wrap_counter = vq->shadow_avail_wrap_counter =
+        !!(idx & (1 << VRING_PACKED_EVENT_F_WRAP_CTR));
+    idx >>= 16;
+    vq->used_idx = idx & mask;
+    vq->used_wrap_counter = !!(idx & (1 << VRING_PACKED_EVENT_F_WRAP_CTR));
+    vq->pop_count = 0;
+    vq->pop_valid = 0;
 }
 
 void virtio_queue_restore_last_avail_idx(VirtIODevice *vdev, int n)
 {
+    VirtQueue *vq = &vdev->vq[n];
+
+    if (virtio_vdev_has_feature(vdev, VIRTIO_F_RING_PACKED)) {
+        /* There is no used index in guest memory, used_idx is as far as
+         * the backend is known to have gone.
+         */
+        vq->last_avail_idx = vq->shadow_avail_idx = vq->used_idx;
+        vq->last_avail_wrap_counter = vq->shadow_avail_wrap_counter =
+            vq->used_wrap_counter;
+        return;
+    }
+
     rcu_read_lock();
     if (vdev->vq[n].vring.desc) {
         vdev->vq[n].last_avail_idx = vring_used_idx(&vdev->vq[n]);
@@ -2353,6 +3727,11 @@ void virtio_queue_restore_last_avail_idx(VirtIODevice *vdev, int n)
 
 void virtio_queue_update_used_idx(VirtIODevice *vdev, int n)
 {
+    if (virtio_vdev_has_feature(vdev, VIRTIO_F_RING_PACKED)) {
+        /* Set together with last_avail_idx from the vring base */
+        return;
+    }
+
     rcu_read_lock();
     if (vdev->vq[n].vring.desc) {
         vdev->vq[n].used_idx = vring_used_idx(&vdev->vq[n]);
@@ -2444,11 +3823,16 @@ static void virtio_queue_host_notifier_aio_poll_end(EventNotifier *n)
     virtio_queue_set_notification(vq, 1);
 }
 
+static void virtio_notify_group_set_handler(VirtQueue *vq, AioContext *ctx,
+                                            VirtIOHandleAIOOutput handle_output);
+
 void virtio_queue_aio_set_host_notifier_handler(VirtQueue *vq, AioContext *ctx,
                                                 VirtIOHandleAIOOutput handle_output)
 {
-    if (handle_output) {
-        vq->handle_aio_output = handle_output;
+    if (vq->notify_group) {
+        virtio_notify_group_set_handler(vq, ctx, handle_output);
+    } else if (handle_output) {
+        atomic_rcu_set(&vq->handle_aio_output, handle_output);
         aio_set_event_notifier(ctx, &vq->host_notifier, true,
                                virtio_queue_host_notifier_aio_read,
                                virtio_queue_host_notifier_aio_poll);
@@ -2460,7 +3844,7 @@ void virtio_queue_aio_set_host_notifier_handler(VirtQueue *vq, AioContext *ctx,
         /* Test and clear notifier before after disabling event,
          * in case poll callback didn't have time to run. */
         virtio_queue_host_notifier_aio_read(&vq->host_notifier);
-        vq->handle_aio_output = NULL;
+        atomic_rcu_set(&vq->handle_aio_output, NULL);
     }
 }
 
@@ -2472,11 +3856,215 @@ void virtio_queue_host_notifier_read(EventNotifier *n)
     }
 }
 
+static void virtio_queue_host_notifier_free_rcu(VirtIOHostNotifierRCU *hn)
+{
+    event_notifier_cleanup(&hn->notifier);
+    g_free(hn);
+}
+
+/* Close the private host notifier of @vq.  Like a notify group, it may
+ * still be kicked by virtio_queue_notify_unlocked(); the file descriptors
+ * are closed after a grace period, and @vq can get a new notifier at once.
+ */
+void virtio_queue_cleanup_host_notifier(VirtQueue *vq)
+{
+    VirtIOHostNotifierRCU *hn = g_new(VirtIOHostNotifierRCU, 1);
+
+    assert(!vq->notify_group);
+    hn->notifier = vq->host_notifier;
+    call_rcu(hn, virtio_queue_host_notifier_free_rcu, rcu);
+}
+
 EventNotifier *virtio_queue_get_host_notifier(VirtQueue *vq)
 {
+    if (vq->notify_group) {
+        return &vq->notify_group->notifier;
+    }
     return &vq->host_notifier;
 }
 
+/* Grab the queues kicked from QEMU since the last call */
+static void virtio_notify_group_take_pending(VirtIONotifyGroup *group,
+                                             unsigned long *pending)
+{
+    int i;
+
+    for (i = 0; i < BITS_TO_LONGS(VIRTIO_QUEUE_MAX); i++) {
+        pending[i] = atomic_read(&group->pending[i]) ?
+                     atomic_xchg(&group->pending[i], 0) : 0;
+    }
+}
+
+static bool virtio_notify_group_run(VirtIONotifyGroup *group)
+{
+    VirtIODevice *vdev = group->vdev;
+    unsigned long pending[BITS_TO_LONGS(VIRTIO_QUEUE_MAX)];
+    bool progress = false;
+    long n;
+
+    virtio_notify_group_take_pending(group, pending);
+    for (n = find_first_bit(group->active, VIRTIO_QUEUE_MAX);
+         n < VIRTIO_QUEUE_MAX;
+         n = find_next_bit(group->active, VIRTIO_QUEUE_MAX, n + 1)) {
+        VirtQueue *vq = &vdev->vq[n];
+
+        if (test_bit(n, pending) || !virtio_queue_empty(vq)) {
+            progress |= virtio_queue_notify_aio_vq(vq);
+        }
+    }
+    return progress;
+}
+
+static void virtio_notify_group_set_notification(VirtIONotifyGroup *group,
+                                                 int enable)
+{
+    long n;
+
+    for (n = find_first_bit(group->active, VIRTIO_QUEUE_MAX);
+         n < VIRTIO_QUEUE_MAX;
+         n = find_next_bit(group->active, VIRTIO_QUEUE_MAX, n + 1)) {
+        virtio_queue_set_notification(&group->vdev->vq[n], enable);
+    }
+}
+
+static void virtio_notify_group_aio_read(EventNotifier *n)
+{
+    VirtIONotifyGroup *group = container_of(n, VirtIONotifyGroup, notifier);
+
+    if (event_notifier_test_and_clear(n)) {
+        virtio_notify_group_run(group);
+    }
+}
+
+static void virtio_notify_group_aio_poll_begin(EventNotifier *n)
+{
+    VirtIONotifyGroup *group = container_of(n, VirtIONotifyGroup, notifier);
+
+    virtio_notify_group_set_notification(group, 0);
+}
+
+static bool virtio_notify_group_aio_poll(void *opaque)
+{
+    EventNotifier *n = opaque;
+    VirtIONotifyGroup *group = container_of(n, VirtIONotifyGroup, notifier);
+    bool progress;
+
+    progress = virtio_notify_group_run(group);
+    if (progress) {
+        /* In case the handler functions re-enabled notifications */
+        virtio_notify_group_set_notification(group, 0);
+    }
+    return progress;
+}
+
+static void virtio_notify_group_aio_poll_end(EventNotifier *n)
+{
+    VirtIONotifyGroup *group = container_of(n, VirtIONotifyGroup, notifier);
+
+    /* Caller polls once more after this to catch requests that race with us */
+    virtio_notify_group_set_notification(group, 1);
+}
+
+static void virtio_notify_group_set_handler(VirtQueue *vq, AioContext *ctx,
+                                            VirtIOHandleAIOOutput handle_output)
+{
+    VirtIONotifyGroup *group = vq->notify_group;
+    unsigned int n = vq->queue_index;
+
+    if (handle_output) {
+        assert(!group->ctx || group->ctx == ctx);
+        atomic_rcu_set(&vq->handle_aio_output, handle_output);
+        set_bit(n, group->active);
+        if (!group->ctx) {
+            group->ctx = ctx;
+            aio_set_event_notifier(ctx, &group->notifier, true,
+                                   virtio_notify_group_aio_read,
+                                   virtio_notify_group_aio_poll);
+            aio_set_event_notifier_poll(ctx, &group->notifier,
+                                        virtio_notify_group_aio_poll_begin,
+                                        virtio_notify_group_aio_poll_end);
+        }
+        /* Queues attached before this one may have consumed a kick that
+         * was meant for it.
+         */
+        virtio_queue_kick_host_notifier(vq);
+    } else {
+        /* Process requests that are already queued, like the read callback
+         * of a private notifier would.
+         */
+        if (!virtio_queue_empty(vq)) {
+            virtio_queue_notify_aio_vq(vq);
+        }
+        clear_bit(n, group->active);
+        if (bitmap_empty(group->active, VIRTIO_QUEUE_MAX)) {
+            aio_set_event_notifier(ctx, &group->notifier, true, NULL, NULL);
+            group->ctx = NULL;
+        }
+        atomic_rcu_set(&vq->handle_aio_output, NULL);
+    }
+}
+
+/* Returns NULL if the shared notifier cannot be created */
+VirtIONotifyGroup *virtio_notify_group_new(VirtIODevice *vdev)
+{
+    VirtIONotifyGroup *group = g_new0(VirtIONotifyGroup, 1);
+    int r;
+
+    r = event_notifier_init(&group->notifier, 0);
+    if (r < 0) {
+        error_report("%s: unable to init event notifier: %s (%d)",
+                     __func__, strerror(-r), r);
+        g_free(group);
+        return NULL;
+    }
+    group->vdev = vdev;
+    group->active = bitmap_new(VIRTIO_QUEUE_MAX);
+    group->pending = bitmap_new(VIRTIO_QUEUE_MAX);
+    return group;
+}
+
+static void virtio_notify_group_free_rcu(VirtIONotifyGroup *group)
+{
+    event_notifier_cleanup(&group->notifier);
+    g_free(group->active);
+    g_free(group->pending);
+    g_free(group);
+}
+
+/* All queues must have left the group already.  vCPUs may still be
+ * kicking it from virtio_queue_notify_unlocked(), so it goes away after
+ * a grace period.
+ */
+void virtio_notify_group_free(VirtIONotifyGroup *group)
+{
+    assert(!group->ctx);
+    call_rcu(group, virtio_notify_group_free_rcu, rcu);
+}
+
+/*
+ * Must be called before the host notifier of @vq is set up, and with a NULL
+ * @group after it has been torn down.
+ */
+void virtio_queue_set_notify_group(VirtQueue *vq, VirtIONotifyGroup *group)
+{
+    VirtIONotifyGroup *old = vq->notify_group;
+
+    assert(!vq->handle_aio_output);
+    if (old && !group) {
+        /* Kicks that arrived after the AioContext handler went away */
+        if (test_and_clear_bit(vq->queue_index, old->pending) ||
+            !virtio_queue_empty(vq)) {
+            virtio_queue_notify_vq(vq);
+        }
+    }
+    atomic_rcu_set(&vq->notify_group, group);
+}
+
+VirtIONotifyGroup *virtio_queue_get_notify_group(VirtQueue *vq)
+{
+    return vq->notify_group;
+}
+
 int virtio_queue_set_host_notifier_mr(VirtIODevice *vdev, int n,
                                       MemoryRegion *mr, bool assign)
 {
@@ -2585,6 +4173,7 @@ static void virtio_device_free_virtqueues(VirtIODevice *vdev)
             break;
         }
         virtio_virtqueue_reset_region_cache(&vdev->vq[i]);
+        virtio_queue_free_elems(&vdev->vq[i]);
     }
     g_free(vdev->vq);
 }
@@ -2605,7 +4194,7 @@ static Property virtio_properties[] = {
     DEFINE_PROP_END_OF_LIST(),
 };
 
-static int virtio_device_start_ioeventfd_impl(VirtIODevice *vdev)
+int virtio_device_start_ioeventfd_impl(VirtIODevice *vdev)
 {
     VirtioBusState *qbus = VIRTIO_BUS(qdev_get_parent_bus(DEVICE(vdev)));
     int i, n, r, err;
@@ -2667,7 +4256,7 @@ int virtio_device_start_ioeventfd(VirtIODevice *vdev)
     return virtio_bus_start_ioeventfd(vbus);
 }
 
-static void virtio_device_stop_ioeventfd_impl(VirtIODevice *vdev)
+void virtio_device_stop_ioeventfd_impl(VirtIODevice *vdev)
 {
     VirtioBusState *qbus = VIRTIO_BUS(qdev_get_parent_bus(DEVICE(vdev)));
     int n, r;
@@ -64,4 +64,20 @@ extern const uint32_t AES_Te0[256], AES_Te1[256], AES_Te2[256],
 extern const uint32_t AES_Td0[256], AES_Td1[256], AES_Td2[256],
                       AES_Td3[256], AES_Td4[256];
 
+/*
+ * Single AES rounds computed with the host's AES instructions.  These
+ * may only be called when aes_host_accel is true.  The 16-byte state and
+ * round key are in AES byte order and may overlap the output.
+ *
+ * aes_host_enc_round and aes_host_dec_round have the semantics of the
+ * x86 AESENC/AESENCLAST and AESDEC/AESDECLAST instructions: the round
+ * transformation is applied to @st and the result is xored with @rk.
+ * aes_host_mixcolumns applies MixColumns, or InvMixColumns if @inv.
+ */
+extern bool aes_host_accel;
+
+void aes_host_enc_round(void *out, const void *st, const void *rk, bool last);
+void aes_host_dec_round(void *out, const void *st, const void *rk, bool last);
+void aes_host_mixcolumns(void *out, const void *in, bool inv);
+
 #endif
@@ -25,6 +25,7 @@
 #include "qemu/notify.h"
 #include "qom/object.h"
 #include "qemu/rcu.h"
+#include "qemu/stats64.h"
 #include "hw/qdev-core.h"
 
 #define RAM_ADDR_INVALID (~(ram_addr_t)0)
@@ -385,6 +386,13 @@ struct MemoryRegion {
     const char *name;
     unsigned ioeventfd_nb;
     MemoryRegionIoeventfd *ioeventfds;
+    /* Taken around accesses instead of the BQL, see memory_region_set_lock */
+    QemuMutex *lock;
+    /* Generation of the last transaction that changed this region, and of
+     * the last commit that found its subtree unchanged.
+     */
+    unsigned topology_gen;
+    unsigned topology_checked;
 };
 
 struct IOMMUMemoryRegion {
@@ -431,6 +439,8 @@ struct MemoryListener {
     QTAILQ_ENTRY(MemoryListener) link_as;
 };
 
+#define DEFAULT_MAX_BOUNCE_BUFFER_SIZE (4096)
+
 /**
  * AddressSpace: describes a mapping of addresses to #MemoryRegion objects
  */
@@ -447,6 +457,20 @@ struct AddressSpace {
     struct MemoryRegionIoeventfd *ioeventfds;
     QTAILQ_HEAD(memory_listeners_as, MemoryListener) listeners;
     QTAILQ_ENTRY(AddressSpace) address_spaces_link;
+
+    /* Maximum DMA bounce buffer size used for indirect memory map requests */
+    size_t max_bounce_buffer_size;
+    /* Total size of bounce buffers currently allocated, atomically accessed */
+    size_t bounce_buffer_size;
+    /* Bounce buffers handed out and map requests that found none left */
+    Stat64 bounce_map_count;
+    Stat64 bounce_retry_count;
+    /* Bounce buffers currently in use, protected by bounce_buffer_lock */
+    QemuMutex bounce_buffer_lock;
+    QLIST_HEAD(, BounceBuffer) bounce_buffers;
+    /* List of callbacks to invoke when buffers free up */
+    QemuMutex map_client_list_lock;
+    QLIST_HEAD(, MapClient) map_client_list;
 };
 
 typedef struct AddressSpaceDispatch AddressSpaceDispatch;
@@ -1455,6 +1479,37 @@ void memory_region_clear_flush_coalesced(MemoryRegion *mr);
  */
 void memory_region_clear_global_locking(MemoryRegion *mr);
 
+/**
+ * memory_region_set_lock: Serialize accesses with a device lock instead of
+ *                         the QEMU global lock.
+ *
+ * Accesses to the memory region are processed outside of QEMU's global lock,
+ * like after memory_region_clear_global_locking(), but @lock is held around
+ * every call into the region's #MemoryRegionOps.  The global lock may still
+ * be held by the caller, so @lock always nests inside it: callbacks must not
+ * take the global lock themselves, but use memory_region_lock_iothread().
+ * Code running under the global lock that touches state protected by @lock
+ * must take @lock too.
+ *
+ * @mr: the memory region to be updated.
+ * @lock: the device lock.
+ */
+void memory_region_set_lock(MemoryRegion *mr, QemuMutex *lock);
+
+/**
+ * memory_region_lock_iothread: Take the QEMU global lock from a callback of
+ *                              a region with a device lock.
+ *
+ * Drops the device lock of @mr, takes the global lock and retakes the device
+ * lock, so state protected by the device lock may have changed across the
+ * call.  Returns true if the global lock was taken, in which case the caller
+ * must release it with qemu_mutex_unlock_iothread() before returning, and
+ * false if the caller already held it.
+ *
+ * @mr: the memory region whose callback is running.
+ */
+bool memory_region_lock_iothread(MemoryRegion *mr);
+
 /**
  * memory_region_add_eventfd: Request an eventfd to be triggered when a word
  *                            is written to a location.
@@ -1999,8 +2054,8 @@ bool address_space_access_valid(AddressSpace *as, hwaddr addr, int len,
  * May map a subset of the requested range, given by and returned in @plen.
  * May return %NULL if resources needed to perform the mapping are exhausted.
  * Use only for reads OR writes - not for read-modify-write operations.
- * Use cpu_register_map_client() to know when retrying the map operation is
- * likely to succeed.
+ * Use address_space_register_map_client() to know when retrying the map
+ * operation is likely to succeed.
  *
  * @as: #AddressSpace to be accessed
  * @addr: address within that address space
@@ -2025,6 +2080,27 @@ void *address_space_map(AddressSpace *as, hwaddr addr,
 void address_space_unmap(AddressSpace *as, void *buffer, hwaddr len,
                          int is_write, hwaddr access_len);
 
+/* address_space_register_map_client: Register a callback to invoke when
+ * resources for address_space_map() are available again.
+ *
+ * address_space_map may fail when there are not enough resources available,
+ * such as when bounce buffer memory would exceed the limit. The callback can
+ * be used to retry the address_space_map operation. Note that the callback
+ * gets automatically removed after firing.
+ *
+ * @as: #AddressSpace to be accessed
+ * @bh: callback to invoke when address_space_map() retry is appropriate
+ */
+void address_space_register_map_client(AddressSpace *as, QEMUBH *bh);
+
+/* address_space_unregister_map_client: Unregister a callback that has
+ * previously been registered and not fired yet.
+ *
+ * @as: #AddressSpace to be accessed
+ * @bh: callback to unregister
+ */
+void address_space_unregister_map_client(AddressSpace *as, QEMUBH *bh);
+
 
 /* Internal functions, part of the implementation of address_space_read.  */
 MemTxResult address_space_read_full(AddressSpace *as, hwaddr addr,
@@ -35,6 +35,8 @@ struct TBContext {
 
     /* statistics */
     unsigned tb_flush_count;
+    unsigned tb_evict_count;
+    size_t tb_evict_regions;
 };
 
 extern TBContext tb_ctx;
@@ -344,6 +344,9 @@ struct PCIDevice {
     MemoryRegion rom;
     uint32_t rom_bar;
 
+    /* Maximum DMA bounce buffer size used for indirect memory map requests */
+    uint64_t max_bounce_buffer_size;
+
     /* INTx routing notifier */
     PCIINTxRoutingNotifier intx_routing_notifier;
 
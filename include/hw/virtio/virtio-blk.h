@@ -40,6 +40,7 @@ struct VirtIOBlkConf
     uint32_t request_merging;
     uint16_t num_queues;
     uint16_t queue_size;
+    bool notify_group;
 };
 
 struct VirtIOBlockDataPlane;
@@ -57,6 +58,7 @@ typedef struct VirtIOBlock {
     bool dataplane_disabled;
     bool dataplane_started;
     struct VirtIOBlockDataPlane *dataplane;
+    VirtQueueElementPool *req_pool;
 } VirtIOBlock;
 
 typedef struct VirtIOBlockReq {
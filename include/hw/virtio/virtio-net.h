@@ -17,6 +17,7 @@
 #include "qemu/units.h"
 #include "standard-headers/linux/virtio_net.h"
 #include "hw/virtio/virtio.h"
+#include "sysemu/iothread.h"
 
 #define TYPE_VIRTIO_NET "virtio-net-device"
 #define VIRTIO_NET(obj) \
@@ -24,6 +25,9 @@
 
 #define TX_TIMER_INTERVAL 150000 /* 150 us */
 
+/* Maximum time a received TCP segment is held for coalescing */
+#define VIRTIO_NET_RSC_DEFAULT_INTERVAL 300000 /* 300 us */
+
 /* Limit the number of packets that can be sent via a single flush
  * of the TX queue.  This gives us a guaranteed exit condition and
  * ensures fairness in the io path.  256 conveniently matches the
@@ -35,6 +39,7 @@ typedef struct virtio_net_conf
 {
     uint32_t txtimer;
     int32_t txburst;
+    uint32_t rsc_interval;
     char *tx;
     uint16_t rx_queue_size;
     uint16_t tx_queue_size;
@@ -42,8 +47,35 @@ typedef struct virtio_net_conf
     int32_t speed;
     char *duplex_str;
     uint8_t duplex;
+    IOThread *iothread;
+    uint32_t num_iothread_vq_mapping;
+    char **iothread_vq_mapping;
 } virtio_net_conf;
 
+/* RSS limits advertised to the guest */
+#define VIRTIO_NET_RSS_MAX_KEY_SIZE     40
+#define VIRTIO_NET_RSS_MAX_TABLE_LEN    128
+
+/* Receive-side scaling and hash report state, set via the control queue */
+typedef struct VirtIONetRss {
+    bool enabled;           /* compute a hash for received packets */
+    bool redirect;          /* steer packets through the indirection table */
+    uint32_t hash_types;    /* VIRTIO_NET_RSS_HASH_TYPE_* */
+    uint8_t key[VIRTIO_NET_RSS_MAX_KEY_SIZE];
+    uint16_t indirections_len;
+    uint16_t indirections_table[VIRTIO_NET_RSS_MAX_TABLE_LEN];
+    uint16_t default_queue; /* for packets without a hash */
+} VirtIONetRss;
+
+/* Longest a used buffer notification can be held back */
+#define VIRTIO_NET_COALESCE_MAX_USECS   1000000
+
+/* Interrupt moderation for one direction, see virtio_net_notify */
+typedef struct VirtIONetCoalesce {
+    uint32_t usecs;         /* 0 disables moderation */
+    uint32_t frames;        /* notify early once this many buffers are used */
+} VirtIONetCoalesce;
+
 /* Maximum packet size we can receive from tap device: header + 64k */
 #define VIRTIO_NET_MAX_BUFSIZE (sizeof(struct virtio_net_hdr) + (64 * KiB))
 
@@ -56,6 +88,18 @@ typedef struct VirtIONetQueue {
     struct {
         VirtQueueElement *elem;
     } async_tx;
+    VirtQueueElementPool *rx_pool;
+    VirtQueueElementPool *tx_pool;
+    unsigned int rx_pending; /* filled but not flushed during a batch */
+    struct NetRxPkt *rx_pkt; /* for RSS parsing of received packets */
+    struct NetRxRsc *rsc;   /* TCP segments held for coalescing */
+    QEMUTimer *rx_notify_timer;
+    QEMUTimer *tx_notify_timer;
+    uint32_t rx_notify_pending; /* used buffers the guest was not told of */
+    uint32_t tx_notify_pending;
+    IOThread *iothread;     /* NULL if the queue pair stays in the main loop */
+    AioContext *ctx;        /* set while it runs in @iothread */
+    bool handoff;           /* the netdev stayed in the main loop */
     struct VirtIONet *n;
 } VirtIONetQueue;
 
@@ -103,6 +147,15 @@ typedef struct VirtIONet {
     int announce_counter;
     bool needs_vnet_hdr_swap;
     bool mtu_bypass_backend;
+    VirtIONetRss rss;
+    VirtIONetCoalesce rx_coalesce;
+    VirtIONetCoalesce tx_coalesce;
+    /* Queue pair i runs in iothreads[i % num_iothreads] */
+    IOThread **iothreads;
+    uint32_t num_iothreads;
+    bool iothreads_started;
+    bool iothreads_disabled;
+    bool iothreads_saved_notifier_mask;
 } VirtIONet;
 
 void virtio_net_set_netclient_name(VirtIONet *n, const char *name,
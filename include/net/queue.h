@@ -45,7 +45,26 @@ typedef ssize_t (NetQueueDeliverFunc)(NetClientState *sender,
                                       int iovcnt,
                                       void *opaque);
 
+/* Returns the number of packets, one per iovec, that were delivered or
+ * discarded; the others are queued for future redelivery.
+ */
+typedef int (NetQueueDeliverBatchFunc)(NetClientState *sender,
+                                       const struct iovec *packets,
+                                       int count,
+                                       void *opaque);
+
 NetQueue *qemu_new_net_queue(NetQueueDeliverFunc *deliver, void *opaque);
+void qemu_net_queue_set_deliver_batch(NetQueue *queue,
+                                      NetQueueDeliverBatchFunc *deliver_batch);
+void qemu_net_queue_set_aio_context(NetQueue *queue, AioContext *ctx);
+AioContext *qemu_net_queue_get_aio_context(NetQueue *queue);
+AioContext *qemu_net_queue_lock(NetQueue *queue);
+void qemu_net_queue_unlock(AioContext *ctx);
+void qemu_net_queue_start_ring(NetQueue *queue, NetClientState *producer,
+                               AioContext *producer_ctx, unsigned size);
+void qemu_net_queue_stop_ring(NetQueue *queue);
+bool qemu_net_queue_is_ring_producer(NetQueue *queue, NetClientState *sender);
+bool qemu_net_queue_ring_has_room(NetQueue *queue, NetClientState *sender);
 
 void qemu_net_queue_append_iov(NetQueue *queue,
                                NetClientState *sender,
@@ -72,5 +91,7 @@ ssize_t qemu_net_queue_send_iov(NetQueue *queue,
 
 void qemu_net_queue_purge(NetQueue *queue, NetClientState *from);
 bool qemu_net_queue_flush(NetQueue *queue);
+void qemu_net_queue_begin_batch(NetQueue *queue);
+void qemu_net_queue_end_batch(NetQueue *queue);
 
 #endif /* QEMU_NET_QUEUE_H */
@@ -437,4 +437,15 @@ void urshift(uint64_t *plow, uint64_t *phigh, int32_t shift);
  */
 void ulshift(uint64_t *plow, uint64_t *phigh, int32_t shift, bool *overflow);
 
+/**
+ * clmul64 - 64x64->128-bit carry-less (polynomial) multiply.
+ * @plow: out - lower 64 bits of the product.
+ * @phigh: out - upper 64 bits of the product.
+ * @a: in - first operand.
+ * @b: in - second operand.
+ *
+ * Uses the host's carry-less multiply instruction when one is available.
+ */
+void clmul64(uint64_t *plow, uint64_t *phigh, uint64_t a, uint64_t b);
+
 #endif
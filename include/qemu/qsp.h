@@ -16,10 +16,13 @@
 enum QSPSortBy {
     QSP_SORT_BY_TOTAL_WAIT_TIME,
     QSP_SORT_BY_AVG_WAIT_TIME,
+    QSP_SORT_BY_TOTAL_HOLD_TIME,
 };
 
 void qsp_report(FILE *f, fprintf_function cpu_fprintf, size_t max,
                 enum QSPSortBy sort_by, bool callsite_coalesce);
+struct SyncProfileEntryList *qsp_query(size_t max, enum QSPSortBy sort_by,
+                                       bool callsite_coalesce);
 
 bool qsp_is_enabled(void);
 void qsp_enable(void);
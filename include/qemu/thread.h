@@ -30,16 +30,20 @@ void qemu_mutex_unlock_impl(QemuMutex *mutex, const char *file, const int line);
 
 typedef void (*QemuMutexLockFunc)(QemuMutex *m, const char *f, int l);
 typedef int (*QemuMutexTrylockFunc)(QemuMutex *m, const char *f, int l);
+typedef void (*QemuMutexUnlockFunc)(QemuMutex *m, const char *f, int l);
 typedef void (*QemuRecMutexLockFunc)(QemuRecMutex *m, const char *f, int l);
 typedef int (*QemuRecMutexTrylockFunc)(QemuRecMutex *m, const char *f, int l);
+typedef void (*QemuRecMutexUnlockFunc)(QemuRecMutex *m, const char *f, int l);
 typedef void (*QemuCondWaitFunc)(QemuCond *c, QemuMutex *m, const char *f,
                                  int l);
 
 extern QemuMutexLockFunc qemu_bql_mutex_lock_func;
+extern QemuMutexUnlockFunc qemu_bql_mutex_unlock_func;
 extern QemuMutexLockFunc qemu_mutex_lock_func;
 extern QemuMutexTrylockFunc qemu_mutex_trylock_func;
 extern QemuRecMutexLockFunc qemu_rec_mutex_lock_func;
 extern QemuRecMutexTrylockFunc qemu_rec_mutex_trylock_func;
+extern QemuRecMutexUnlockFunc qemu_rec_mutex_unlock_func;
 extern QemuCondWaitFunc qemu_cond_wait_func;
 
 /* convenience macros to bypass the profiler */
@@ -61,6 +65,8 @@ extern QemuCondWaitFunc qemu_cond_wait_func;
             qemu_rec_mutex_lock_impl(m, __FILE__, __LINE__);
 #define qemu_rec_mutex_trylock(m)                                       \
             qemu_rec_mutex_trylock_impl(m, __FILE__, __LINE__);
+#define qemu_rec_mutex_unlock(m)                                        \
+            qemu_rec_mutex_unlock_impl(m, __FILE__, __LINE__);
 #define qemu_cond_wait(c, m)                                            \
             qemu_cond_wait_impl(c, m, __FILE__, __LINE__);
 #else
@@ -85,6 +91,12 @@ extern QemuCondWaitFunc qemu_cond_wait_func;
             _f(m, __FILE__, __LINE__);                          \
         })
 
+#define qemu_rec_mutex_unlock(m) ({                                     \
+            QemuRecMutexUnlockFunc _f;                                  \
+            _f = atomic_read(&qemu_rec_mutex_unlock_func);              \
+            _f(m, __FILE__, __LINE__);                                  \
+        })
+
 #define qemu_cond_wait(c, m) ({                                         \
             QemuCondWaitFunc _f = atomic_read(&qemu_cond_wait_func);    \
             _f(c, m, __FILE__, __LINE__);                               \
@@ -119,6 +131,11 @@ static inline int (qemu_rec_mutex_trylock)(QemuRecMutex *mutex)
     return qemu_rec_mutex_trylock(mutex);
 }
 
+static inline void (qemu_rec_mutex_unlock)(QemuRecMutex *mutex)
+{
+    qemu_rec_mutex_unlock(mutex);
+}
+
 /* Prototypes for other functions are in thread-posix.h/thread-win32.h.  */
 void qemu_rec_mutex_init(QemuRecMutex *mutex);
 
@@ -338,6 +338,11 @@ IOThreadInfoList *qmp_query_iothreads(Error **errp)
     return head;
 }
 
+static void iothread_kick_bh(void *opaque)
+{
+    /* Nothing to do, iothread_run() leaves aio_poll() to run the loop */
+}
+
 static gpointer iothread_g_main_context_init(gpointer opaque)
 {
     AioContext *ctx;
@@ -351,7 +356,11 @@ static gpointer iothread_g_main_context_init(gpointer opaque)
     g_source_attach(source, iothread->worker_context);
     g_source_unref(source);
 
-    aio_notify(iothread->ctx);
+    /*
+     * aio_notify() would be lost if iothread_run() has not entered
+     * aio_poll() yet, a scheduled bottom half is seen whenever it does.
+     */
+    aio_bh_schedule_oneshot(iothread->ctx, iothread_kick_bh, NULL);
     return NULL;
 }
 
@@ -204,10 +204,8 @@ unsigned long last_brk;
    of guest address space.  */
 static abi_ulong mmap_find_vma_reserved(abi_ulong start, abi_ulong size)
 {
-    abi_ulong addr;
+    target_ulong addr;
     abi_ulong end_addr;
-    int prot;
-    int looped = 0;
 
     if (size > reserved_va) {
         return (abi_ulong)-1;
@@ -218,26 +216,20 @@ static abi_ulong mmap_find_vma_reserved(abi_ulong start, abi_ulong size)
     if (end_addr > reserved_va) {
         end_addr = reserved_va;
     }
-    addr = end_addr - qemu_host_page_size;
 
-    while (1) {
-        if (addr > end_addr) {
-            if (looped) {
-                return (abi_ulong)-1;
-            }
-            end_addr = reserved_va;
-            addr = end_addr - qemu_host_page_size;
-            looped = 1;
-            continue;
-        }
-        prot = page_get_flags(addr);
-        if (prot) {
-            end_addr = addr;
-        }
-        if (addr && addr + size == end_addr) {
-            break;
+    /* Prefer the highest free block ending by start + size, then the
+       highest one anywhere.  Address 0 is never returned.  */
+    addr = -1;
+    if (end_addr >= size) {
+        addr = page_find_range_empty(1, end_addr - 1, size,
+                                     qemu_host_page_size);
+    }
+    if (addr == (target_ulong)-1) {
+        addr = page_find_range_empty(1, reserved_va - 1, size,
+                                     qemu_host_page_size);
+        if (addr == (target_ulong)-1) {
+            return (abi_ulong)-1;
         }
-        addr -= qemu_host_page_size;
     }
 
     if (start == mmap_next_start) {
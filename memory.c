@@ -22,6 +22,7 @@
 #include "qapi/visitor.h"
 #include "qemu/bitops.h"
 #include "qemu/error-report.h"
+#include "qemu/log.h"
 #include "qom/object.h"
 #include "trace-root.h"
 
@@ -36,6 +37,11 @@
 
 static unsigned memory_region_transaction_depth;
 static bool memory_region_update_pending;
+/* Every flat view must be regenerated, not just those that can reach a
+ * region changed by the current transaction.
+ */
+static bool memory_region_update_all;
+static unsigned memory_region_topology_gen = 1;
 static bool ioeventfd_update_pending;
 static bool global_dirty_log = false;
 
@@ -917,6 +923,48 @@ static void address_space_update_topology_pass(AddressSpace *as,
     }
 }
 
+/* Record that @mr changed in a way that affects the flat views it is
+ * part of, if @changed.
+ */
+static void memory_region_topology_changed(MemoryRegion *mr, bool changed)
+{
+    if (changed) {
+        mr->topology_gen = memory_region_topology_gen;
+        memory_region_update_pending = true;
+    }
+}
+
+/* Return true if any region that can be rendered from @mr, including
+ * disabled ones and those reached through aliases, was changed by the
+ * transaction being committed.
+ */
+static bool memory_region_topology_dirty(MemoryRegion *mr)
+{
+    MemoryRegion *subregion;
+
+    if (mr->topology_gen == memory_region_topology_gen) {
+        return true;
+    }
+    if (mr->topology_checked == memory_region_topology_gen) {
+        return false;
+    }
+
+    if (mr->alias) {
+        if (memory_region_topology_dirty(mr->alias)) {
+            return true;
+        }
+    } else {
+        QTAILQ_FOREACH(subregion, &mr->subregions, subregions_link) {
+            if (memory_region_topology_dirty(subregion)) {
+                return true;
+            }
+        }
+    }
+
+    mr->topology_checked = memory_region_topology_gen;
+    return false;
+}
+
 static void flatviews_init(void)
 {
     static FlatView *empty_view;
@@ -939,27 +987,43 @@ static void flatviews_init(void)
 
 static void flatviews_reset(void)
 {
+    GHashTable *old_views = flat_views;
     AddressSpace *as;
 
-    if (flat_views) {
-        g_hash_table_unref(flat_views);
-        flat_views = NULL;
-    }
+    flat_views = NULL;
     flatviews_init();
 
-    /* Render unique FVs */
+    /* Render unique FVs, reusing those whose regions were not touched
+     * by the transaction.
+     */
     QTAILQ_FOREACH(as, &address_spaces, address_spaces_link) {
         MemoryRegion *physmr = memory_region_get_flatview_root(as->root);
+        FlatView *view;
 
         if (g_hash_table_lookup(flat_views, physmr)) {
             continue;
         }
 
+        view = old_views ? g_hash_table_lookup(old_views, physmr) : NULL;
+        if (view && !memory_region_update_all &&
+            !memory_region_topology_dirty(physmr)) {
+            flatview_ref(view);
+            g_hash_table_replace(flat_views, physmr, view);
+            continue;
+        }
+
         generate_memory_topology(physmr);
     }
+
+    if (old_views) {
+        g_hash_table_unref(old_views);
+    }
+    memory_region_update_all = false;
+    memory_region_topology_gen++;
 }
 
-static void address_space_set_flatview(AddressSpace *as)
+/* Returns true if the address space now uses a different flat view.  */
+static bool address_space_set_flatview(AddressSpace *as)
 {
     FlatView *old_view = address_space_to_flatview(as);
     MemoryRegion *physmr = memory_region_get_flatview_root(as->root);
@@ -968,7 +1032,7 @@ static void address_space_set_flatview(AddressSpace *as)
     assert(new_view);
 
     if (old_view == new_view) {
-        return;
+        return false;
     }
 
     if (old_view) {
@@ -1002,6 +1066,7 @@ static void address_space_set_flatview(AddressSpace *as)
     if (old_view) {
         flatview_unref(old_view);
     }
+    return true;
 }
 
 static void address_space_update_topology(AddressSpace *as)
@@ -1036,8 +1101,10 @@ void memory_region_transaction_commit(void)
             MEMORY_LISTENER_CALL_GLOBAL(begin, Forward);
 
             QTAILQ_FOREACH(as, &address_spaces, address_spaces_link) {
-                address_space_set_flatview(as);
-                address_space_update_ioeventfds(as);
+                if (address_space_set_flatview(as) ||
+                    ioeventfd_update_pending) {
+                    address_space_update_ioeventfds(as);
+                }
             }
             memory_region_update_pending = false;
             ioeventfd_update_pending = false;
@@ -1386,12 +1453,49 @@ static MemTxResult memory_region_dispatch_read1(MemoryRegion *mr,
     }
 }
 
+/* Device locks taken by memory_region_dispatch_* in this thread, so that a
+ * device accessing its own registers (for example through DMA) fails
+ * instead of deadlocking.
+ */
+typedef struct DispatchLock {
+    QemuMutex *lock;
+    struct DispatchLock *next;
+} DispatchLock;
+
+static __thread DispatchLock *dispatch_locks;
+
+static bool memory_region_dispatch_lock(MemoryRegion *mr, DispatchLock *dl)
+{
+    DispatchLock *l;
+
+    for (l = dispatch_locks; l; l = l->next) {
+        if (l->lock == mr->lock) {
+            qemu_log_mask(LOG_GUEST_ERROR, "Blocked re-entrant access to "
+                          "memory region %s\n", memory_region_name(mr));
+            return false;
+        }
+    }
+    qemu_mutex_lock(mr->lock);
+    dl->lock = mr->lock;
+    dl->next = dispatch_locks;
+    dispatch_locks = dl;
+    return true;
+}
+
+static void memory_region_dispatch_unlock(MemoryRegion *mr, DispatchLock *dl)
+{
+    assert(dispatch_locks == dl);
+    dispatch_locks = dl->next;
+    qemu_mutex_unlock(mr->lock);
+}
+
 MemTxResult memory_region_dispatch_read(MemoryRegion *mr,
                                         hwaddr addr,
                                         uint64_t *pval,
                                         unsigned size,
                                         MemTxAttrs attrs)
 {
+    DispatchLock dl;
     MemTxResult r;
 
     if (!memory_region_access_valid(mr, addr, size, false, attrs)) {
@@ -1399,7 +1503,14 @@ MemTxResult memory_region_dispatch_read(MemoryRegion *mr,
         return MEMTX_DECODE_ERROR;
     }
 
+    if (mr->lock && !memory_region_dispatch_lock(mr, &dl)) {
+        *pval = unassigned_mem_read(mr, addr, size);
+        return MEMTX_ERROR;
+    }
     r = memory_region_dispatch_read1(mr, addr, pval, size, attrs);
+    if (mr->lock) {
+        memory_region_dispatch_unlock(mr, &dl);
+    }
     adjust_endianness(mr, pval, size);
     return r;
 }
@@ -1436,6 +1547,9 @@ MemTxResult memory_region_dispatch_write(MemoryRegion *mr,
                                          unsigned size,
                                          MemTxAttrs attrs)
 {
+    DispatchLock dl;
+    MemTxResult r;
+
     if (!memory_region_access_valid(mr, addr, size, true, attrs)) {
         unassigned_mem_write(mr, addr, data, size);
         return MEMTX_DECODE_ERROR;
@@ -1448,20 +1562,27 @@ MemTxResult memory_region_dispatch_write(MemoryRegion *mr,
         return MEMTX_OK;
     }
 
+    if (mr->lock && !memory_region_dispatch_lock(mr, &dl)) {
+        unassigned_mem_write(mr, addr, data, size);
+        return MEMTX_ERROR;
+    }
     if (mr->ops->write) {
-        return access_with_adjusted_size(addr, &data, size,
-                                         mr->ops->impl.min_access_size,
-                                         mr->ops->impl.max_access_size,
-                                         memory_region_write_accessor, mr,
-                                         attrs);
+        r = access_with_adjusted_size(addr, &data, size,
+                                      mr->ops->impl.min_access_size,
+                                      mr->ops->impl.max_access_size,
+                                      memory_region_write_accessor, mr,
+                                      attrs);
     } else {
-        return
-            access_with_adjusted_size(addr, &data, size,
+        r = access_with_adjusted_size(addr, &data, size,
                                       mr->ops->impl.min_access_size,
                                       mr->ops->impl.max_access_size,
                                       memory_region_write_with_attrs_accessor,
                                       mr, attrs);
     }
+    if (mr->lock) {
+        memory_region_dispatch_unlock(mr, &dl);
+    }
+    return r;
 }
 
 void memory_region_init_io(MemoryRegion *mr,
@@ -1971,7 +2092,7 @@ void memory_region_set_log(MemoryRegion *mr, bool log, unsigned client)
 
     memory_region_transaction_begin();
     mr->dirty_log_mask = (mr->dirty_log_mask & ~mask) | (log * mask);
-    memory_region_update_pending |= mr->enabled;
+    memory_region_topology_changed(mr, mr->enabled);
     memory_region_transaction_commit();
 }
 
@@ -2044,7 +2165,7 @@ void memory_region_set_readonly(MemoryRegion *mr, bool readonly)
     if (mr->readonly != readonly) {
         memory_region_transaction_begin();
         mr->readonly = readonly;
-        memory_region_update_pending |= mr->enabled;
+        memory_region_topology_changed(mr, mr->enabled);
         memory_region_transaction_commit();
     }
 }
@@ -2054,7 +2175,7 @@ void memory_region_set_nonvolatile(MemoryRegion *mr, bool nonvolatile)
     if (mr->nonvolatile != nonvolatile) {
         memory_region_transaction_begin();
         mr->nonvolatile = nonvolatile;
-        memory_region_update_pending |= mr->enabled;
+        memory_region_topology_changed(mr, mr->enabled);
         memory_region_transaction_commit();
     }
 }
@@ -2064,7 +2185,7 @@ void memory_region_rom_device_set_romd(MemoryRegion *mr, bool romd_mode)
     if (mr->romd_mode != romd_mode) {
         memory_region_transaction_begin();
         mr->romd_mode = romd_mode;
-        memory_region_update_pending |= mr->enabled;
+        memory_region_topology_changed(mr, mr->enabled);
         memory_region_transaction_commit();
     }
 }
@@ -2234,6 +2355,23 @@ void memory_region_clear_global_locking(MemoryRegion *mr)
     mr->global_locking = false;
 }
 
+void memory_region_set_lock(MemoryRegion *mr, QemuMutex *lock)
+{
+    mr->global_locking = false;
+    mr->lock = lock;
+}
+
+bool memory_region_lock_iothread(MemoryRegion *mr)
+{
+    if (qemu_mutex_iothread_locked()) {
+        return false;
+    }
+    qemu_mutex_unlock(mr->lock);
+    qemu_mutex_lock_iothread();
+    qemu_mutex_lock(mr->lock);
+    return true;
+}
+
 static bool userspace_eventfd_warning;
 
 void memory_region_add_eventfd(MemoryRegion *mr,
@@ -2329,7 +2467,7 @@ static void memory_region_update_container_subregions(MemoryRegion *subregion)
     }
     QTAILQ_INSERT_TAIL(&mr->subregions, subregion, subregions_link);
 done:
-    memory_region_update_pending |= mr->enabled && subregion->enabled;
+    memory_region_topology_changed(mr, mr->enabled && subregion->enabled);
     memory_region_transaction_commit();
 }
 
@@ -2368,7 +2506,7 @@ void memory_region_del_subregion(MemoryRegion *mr,
     subregion->container = NULL;
     QTAILQ_REMOVE(&mr->subregions, subregion, subregions_link);
     memory_region_unref(subregion);
-    memory_region_update_pending |= mr->enabled && subregion->enabled;
+    memory_region_topology_changed(mr, mr->enabled && subregion->enabled);
     memory_region_transaction_commit();
 }
 
@@ -2379,7 +2517,7 @@ void memory_region_set_enabled(MemoryRegion *mr, bool enabled)
     }
     memory_region_transaction_begin();
     mr->enabled = enabled;
-    memory_region_update_pending = true;
+    memory_region_topology_changed(mr, true);
     memory_region_transaction_commit();
 }
 
@@ -2395,7 +2533,7 @@ void memory_region_set_size(MemoryRegion *mr, uint64_t size)
     }
     memory_region_transaction_begin();
     mr->size = s;
-    memory_region_update_pending = true;
+    memory_region_topology_changed(mr, true);
     memory_region_transaction_commit();
 }
 
@@ -2432,7 +2570,7 @@ void memory_region_set_alias_offset(MemoryRegion *mr, hwaddr offset)
 
     memory_region_transaction_begin();
     mr->alias_offset = offset;
-    memory_region_update_pending |= mr->enabled;
+    memory_region_topology_changed(mr, mr->enabled);
     memory_region_transaction_commit();
 }
 
@@ -2557,6 +2695,7 @@ void memory_global_dirty_log_start(void)
     /* Refresh DIRTY_LOG_MIGRATION bit.  */
     memory_region_transaction_begin();
     memory_region_update_pending = true;
+    memory_region_update_all = true;
     memory_region_transaction_commit();
 }
 
@@ -2567,6 +2706,7 @@ static void memory_global_dirty_log_do_stop(void)
     /* Refresh DIRTY_LOG_MIGRATION bit.  */
     memory_region_transaction_begin();
     memory_region_update_pending = true;
+    memory_region_update_all = true;
     memory_region_transaction_commit();
 
     MEMORY_LISTENER_CALL_GLOBAL(log_global_stop, Reverse);
@@ -2715,11 +2855,24 @@ void address_space_init(AddressSpace *as, MemoryRegion *root, const char *name)
     as->name = g_strdup(name ? name : "anonymous");
     address_space_update_topology(as);
     address_space_update_ioeventfds(as);
+
+    as->max_bounce_buffer_size = DEFAULT_MAX_BOUNCE_BUFFER_SIZE;
+    as->bounce_buffer_size = 0;
+    stat64_init(&as->bounce_map_count, 0);
+    stat64_init(&as->bounce_retry_count, 0);
+    qemu_mutex_init(&as->bounce_buffer_lock);
+    QLIST_INIT(&as->bounce_buffers);
+    qemu_mutex_init(&as->map_client_list_lock);
+    QLIST_INIT(&as->map_client_list);
 }
 
 static void do_address_space_destroy(AddressSpace *as)
 {
     assert(QTAILQ_EMPTY(&as->listeners));
+    assert(QLIST_EMPTY(&as->bounce_buffers));
+    assert(QLIST_EMPTY(&as->map_client_list));
+    qemu_mutex_destroy(&as->bounce_buffer_lock);
+    qemu_mutex_destroy(&as->map_client_list_lock);
 
     flatview_unref(as->current_map);
     g_free(as->name);
@@ -3056,6 +3209,15 @@ void mtree_info(fprintf_function mon_printf, void *f, bool flatview,
 
     QTAILQ_FOREACH(as, &address_spaces, address_spaces_link) {
         mon_printf(f, "address-space: %s\n", as->name);
+        if (stat64_get(&as->bounce_map_count) ||
+            stat64_get(&as->bounce_retry_count)) {
+            mon_printf(f, "  bounce buffers: %" PRIu64 " maps, %" PRIu64
+                       " retries, %zu/%zu bytes in use\n",
+                       stat64_get(&as->bounce_map_count),
+                       stat64_get(&as->bounce_retry_count),
+                       atomic_read(&as->bounce_buffer_size),
+                       as->max_bounce_buffer_size);
+        }
         mtree_print_mr(mon_printf, f, as->root, 1, 0, &ml_head, owner);
         mon_printf(f, "\n");
     }
@@ -1368,13 +1368,25 @@ static void hmp_info_sync_profile(Monitor *mon, const QDict *qdict)
 {
     int64_t max = qdict_get_try_int(qdict, "max", 10);
     bool mean = qdict_get_try_bool(qdict, "mean", false);
+    bool hold = qdict_get_try_bool(qdict, "hold", false);
     bool coalesce = !qdict_get_try_bool(qdict, "no_coalesce", false);
     enum QSPSortBy sort_by;
 
-    sort_by = mean ? QSP_SORT_BY_AVG_WAIT_TIME : QSP_SORT_BY_TOTAL_WAIT_TIME;
+    if (hold) {
+        sort_by = QSP_SORT_BY_TOTAL_HOLD_TIME;
+    } else if (mean) {
+        sort_by = QSP_SORT_BY_AVG_WAIT_TIME;
+    } else {
+        sort_by = QSP_SORT_BY_TOTAL_WAIT_TIME;
+    }
     qsp_report((FILE *)mon, monitor_fprintf, max, sort_by, coalesce);
 }
 
+static void hmp_info_bql(Monitor *mon, const QDict *qdict)
+{
+    dump_bql_info((FILE *)mon, monitor_fprintf);
+}
+
 static void hmp_info_history(Monitor *mon, const QDict *qdict)
 {
     int i;
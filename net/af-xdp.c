@@ -0,0 +1,644 @@
+/*
+ * AF_XDP network backend
+ *
+ * Each queue of the netdev is an AF_XDP socket bound to one queue of a host
+ * NIC.  A small XDP program attached to the NIC redirects the frames that
+ * arrive on those queues to the sockets, through an XSKMAP.  Frames are
+ * exchanged with the kernel through four rings that share a UMEM area with
+ * it, so that drivers with zero-copy support can DMA straight into QEMU's
+ * memory.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include <sys/syscall.h>
+#include <net/if.h>
+#include <linux/bpf.h>
+#include <linux/if_link.h>
+#include <linux/if_xdp.h>
+
+#include "net/net.h"
+#include "clients.h"
+#include "block/aio.h"
+#include "qapi/error.h"
+#include "qemu/atomic.h"
+#include "qemu/iov.h"
+#include "qemu/main-loop.h"
+#include "qemu/sockets.h"
+#include "qemu/timer.h"
+
+/* Every frame of the UMEM holds one packet; there is no multi-buffer
+ * support, so larger packets are dropped.
+ */
+#define AF_XDP_FRAME_SIZE   4096
+
+/* Number of descriptors in each ring.  The UMEM has as many frames for
+ * RX, which cycle between the fill ring and the RX ring, and as many for TX.
+ */
+#define AF_XDP_RING_SIZE    2048
+#define AF_XDP_NUM_FRAMES   (2 * AF_XDP_RING_SIZE)
+
+/* Received frames handed to the peer per wakeup */
+#define AF_XDP_BATCH        64
+
+/* How often the completion ring is reaped while no TX frame is idle */
+#define AF_XDP_TX_REAP_US   50
+
+typedef struct AFXDPRing {
+    uint32_t *producer;
+    uint32_t *consumer;
+    uint32_t *flags;
+    void *descs;
+    void *map;
+    size_t map_size;
+} AFXDPRing;
+
+/* The XDP program and map of an interface, shared by the queues of a
+ * netdev.  Closing the link detaches the program.
+ */
+typedef struct AFXDPProgram {
+    int map_fd;
+    int prog_fd;
+    int link_fd;
+    unsigned int refcnt;
+} AFXDPProgram;
+
+typedef struct AFXDPState {
+    NetClientState nc;
+    int fd;
+    AioContext *ctx;
+    AFXDPProgram *prog;
+    uint32_t queue_id;
+    void *umem;
+    AFXDPRing fq;       /* frames given to the kernel for RX */
+    AFXDPRing cq;       /* frames the kernel is done transmitting */
+    AFXDPRing rx;
+    AFXDPRing tx;
+    uint64_t tx_frames[AF_XDP_RING_SIZE];   /* idle TX frames */
+    uint32_t n_tx_frames;
+    QEMUTimer *tx_timer;    /* reaps completions while TX is blocked */
+    bool read_poll;
+} AFXDPState;
+
+static int af_xdp_bpf(enum bpf_cmd cmd, union bpf_attr *attr)
+{
+    return syscall(__NR_bpf, cmd, attr, sizeof(*attr));
+}
+
+/* Entries a consumer can take from @r */
+static inline uint32_t af_xdp_ring_avail(AFXDPRing *r)
+{
+    return atomic_load_acquire(r->producer) - *r->consumer;
+}
+
+static inline uint64_t *af_xdp_ring_addr(AFXDPRing *r, uint32_t idx)
+{
+    return (uint64_t *)r->descs + (idx & (AF_XDP_RING_SIZE - 1));
+}
+
+static inline struct xdp_desc *af_xdp_ring_desc(AFXDPRing *r, uint32_t idx)
+{
+    return (struct xdp_desc *)r->descs + (idx & (AF_XDP_RING_SIZE - 1));
+}
+
+static inline uint64_t af_xdp_frame(uint64_t addr)
+{
+    return addr & ~(uint64_t)(AF_XDP_FRAME_SIZE - 1);
+}
+
+static void af_xdp_send(void *opaque);
+static void af_xdp_tx_reap(void *opaque);
+
+static void af_xdp_update_fd_handler(AFXDPState *s)
+{
+    IOHandler *read = s->read_poll ? af_xdp_send : NULL;
+
+    if (s->ctx) {
+        aio_set_fd_handler(s->ctx, s->fd, false, read, NULL, NULL, s);
+    } else {
+        qemu_set_fd_handler(s->fd, read, NULL, s);
+    }
+}
+
+static void af_xdp_tx_timer_init(AFXDPState *s)
+{
+    if (s->ctx) {
+        s->tx_timer = aio_timer_new(s->ctx, QEMU_CLOCK_REALTIME, SCALE_US,
+                                    af_xdp_tx_reap, s);
+    } else {
+        s->tx_timer = timer_new_us(QEMU_CLOCK_REALTIME, af_xdp_tx_reap, s);
+    }
+}
+
+static void af_xdp_tx_timer_del(AFXDPState *s)
+{
+    if (s->tx_timer) {
+        timer_del(s->tx_timer);
+        timer_free(s->tx_timer);
+        s->tx_timer = NULL;
+    }
+}
+
+/* POLLOUT only tells that the TX ring has room, which it always has when
+ * the frames run out, so the completion ring is polled instead.
+ */
+static void af_xdp_tx_reap_later(AFXDPState *s)
+{
+    if (!timer_pending(s->tx_timer)) {
+        timer_mod(s->tx_timer, qemu_clock_get_us(QEMU_CLOCK_REALTIME) +
+                               AF_XDP_TX_REAP_US);
+    }
+}
+
+static void af_xdp_read_poll(AFXDPState *s, bool enable)
+{
+    if (s->read_poll != enable) {
+        s->read_poll = enable;
+        af_xdp_update_fd_handler(s);
+    }
+}
+
+static void af_xdp_poll(NetClientState *nc, bool enable)
+{
+    af_xdp_read_poll(DO_UPCAST(AFXDPState, nc, nc), enable);
+}
+
+static void af_xdp_set_aio_context(NetClientState *nc, AioContext *ctx)
+{
+    AFXDPState *s = DO_UPCAST(AFXDPState, nc, nc);
+    bool read_poll = s->read_poll;
+    bool tx_blocked = timer_pending(s->tx_timer);
+
+    /* Drop the handlers from the old context before installing them
+     * in the new one.
+     */
+    s->read_poll = false;
+    af_xdp_update_fd_handler(s);
+    af_xdp_tx_timer_del(s);
+    s->ctx = ctx;
+    s->read_poll = read_poll;
+    af_xdp_update_fd_handler(s);
+    af_xdp_tx_timer_init(s);
+    if (tx_blocked) {
+        af_xdp_tx_reap_later(s);
+    }
+}
+
+/* Take back the TX frames that the kernel has sent */
+static void af_xdp_complete_tx(AFXDPState *s)
+{
+    uint32_t n = af_xdp_ring_avail(&s->cq);
+    uint32_t cons = *s->cq.consumer;
+    uint32_t i;
+
+    for (i = 0; i < n; i++) {
+        uint64_t addr = *af_xdp_ring_addr(&s->cq, cons + i);
+
+        s->tx_frames[s->n_tx_frames++] = af_xdp_frame(addr);
+    }
+    if (n) {
+        atomic_store_release(s->cq.consumer, cons + n);
+    }
+}
+
+static void af_xdp_kick_tx(AFXDPState *s)
+{
+    if (atomic_read(s->tx.flags) & XDP_RING_NEED_WAKEUP) {
+        /* EAGAIN and ENOBUFS only mean that the kernel is busy */
+        sendto(s->fd, NULL, 0, MSG_DONTWAIT, NULL, 0);
+    }
+}
+
+/* Resume the packets queued for lack of TX frames once some are back */
+static void af_xdp_tx_reap(void *opaque)
+{
+    AFXDPState *s = opaque;
+
+    af_xdp_complete_tx(s);
+    if (!s->n_tx_frames) {
+        af_xdp_kick_tx(s);
+        af_xdp_tx_reap_later(s);
+        return;
+    }
+    qemu_flush_queued_packets(&s->nc);
+}
+
+static ssize_t af_xdp_receive_iov(NetClientState *nc,
+                                  const struct iovec *iov, int iovcnt)
+{
+    AFXDPState *s = DO_UPCAST(AFXDPState, nc, nc);
+    size_t size = iov_size(iov, iovcnt);
+    struct xdp_desc *desc;
+    uint32_t prod;
+    uint64_t addr;
+
+    if (size > AF_XDP_FRAME_SIZE) {
+        /* Drop, like a NIC drops frames above its MTU */
+        return size;
+    }
+
+    af_xdp_complete_tx(s);
+    if (!s->n_tx_frames) {
+        af_xdp_kick_tx(s);
+        af_xdp_tx_reap_later(s);
+        return 0;
+    }
+
+    addr = s->tx_frames[--s->n_tx_frames];
+    iov_to_buf(iov, iovcnt, 0, s->umem + addr, size);
+
+    /* There are as many TX frames as TX descriptors, so the ring has room */
+    prod = *s->tx.producer;
+    desc = af_xdp_ring_desc(&s->tx, prod);
+    desc->addr = addr;
+    desc->len = size;
+    desc->options = 0;
+    atomic_store_release(s->tx.producer, prod + 1);
+
+    /* A batch is kicked once, from af_xdp_flush_batch() */
+    if (!nc->receive_batching) {
+        af_xdp_kick_tx(s);
+    }
+    return size;
+}
+
+static ssize_t af_xdp_receive(NetClientState *nc,
+                              const uint8_t *buf, size_t size)
+{
+    struct iovec iov = {
+        .iov_base = (void *)buf,
+        .iov_len = size,
+    };
+
+    return af_xdp_receive_iov(nc, &iov, 1);
+}
+
+static void af_xdp_flush_batch(NetClientState *nc)
+{
+    af_xdp_kick_tx(DO_UPCAST(AFXDPState, nc, nc));
+}
+
+static void af_xdp_send_completed(NetClientState *nc, ssize_t len)
+{
+    AFXDPState *s = DO_UPCAST(AFXDPState, nc, nc);
+
+    af_xdp_read_poll(s, true);
+}
+
+static void af_xdp_send(void *opaque)
+{
+    AFXDPState *s = opaque;
+    uint32_t n = MIN(af_xdp_ring_avail(&s->rx), AF_XDP_BATCH);
+    uint32_t cons = *s->rx.consumer;
+    uint32_t prod = *s->fq.producer;
+    ssize_t ret = 1;
+    uint32_t i;
+
+    /* Completions may have come in before the reap timer fires */
+    if (timer_pending(s->tx_timer)) {
+        timer_del(s->tx_timer);
+        af_xdp_tx_reap(s);
+    }
+
+    qemu_send_batch_begin(&s->nc);
+    for (i = 0; i < n && ret != 0; i++) {
+        const struct xdp_desc *desc = af_xdp_ring_desc(&s->rx, cons + i);
+
+        ret = qemu_send_packet_async(&s->nc, s->umem + desc->addr, desc->len,
+                                     af_xdp_send_completed);
+
+        /* A packet that the peer cannot take now is copied into its
+         * queue, so the frame can go back to the kernel right away.  The
+         * RX frames only ever live in the fill and RX rings, hence the
+         * fill ring has room for it.
+         */
+        *af_xdp_ring_addr(&s->fq, prod + i) = af_xdp_frame(desc->addr);
+    }
+    atomic_store_release(s->rx.consumer, cons + i);
+    atomic_store_release(s->fq.producer, prod + i);
+    qemu_send_batch_end(&s->nc);
+
+    if (ret == 0) {
+        af_xdp_read_poll(s, false);
+    }
+}
+
+static void af_xdp_unmap_ring(AFXDPRing *r)
+{
+    if (r->map) {
+        munmap(r->map, r->map_size);
+        r->map = NULL;
+    }
+}
+
+static void af_xdp_program_unref(AFXDPProgram *prog)
+{
+    if (--prog->refcnt) {
+        return;
+    }
+    if (prog->link_fd >= 0) {
+        close(prog->link_fd);
+    }
+    if (prog->prog_fd >= 0) {
+        close(prog->prog_fd);
+    }
+    if (prog->map_fd >= 0) {
+        close(prog->map_fd);
+    }
+    g_free(prog);
+}
+
+static void af_xdp_cleanup(NetClientState *nc)
+{
+    AFXDPState *s = DO_UPCAST(AFXDPState, nc, nc);
+
+    qemu_purge_queued_packets(nc);
+
+    if (s->fd >= 0) {
+        af_xdp_poll(nc, false);
+        af_xdp_tx_timer_del(s);
+        close(s->fd);
+        s->fd = -1;
+    }
+    af_xdp_unmap_ring(&s->fq);
+    af_xdp_unmap_ring(&s->cq);
+    af_xdp_unmap_ring(&s->rx);
+    af_xdp_unmap_ring(&s->tx);
+    qemu_vfree(s->umem);
+    s->umem = NULL;
+    if (s->prog) {
+        af_xdp_program_unref(s->prog);
+        s->prog = NULL;
+    }
+}
+
+static NetClientInfo net_af_xdp_info = {
+    .type = NET_CLIENT_DRIVER_AF_XDP,
+    .size = sizeof(AFXDPState),
+    .receive = af_xdp_receive,
+    .receive_iov = af_xdp_receive_iov,
+    .poll = af_xdp_poll,
+    .cleanup = af_xdp_cleanup,
+    .set_aio_context = af_xdp_set_aio_context,
+    .flush_batch = af_xdp_flush_batch,
+};
+
+/* Create the XSKMAP for queues 0 to @max_queues - 1 of @ifindex, and
+ * attach a program that redirects their frames to it.  Frames of queues
+ * without a socket go on to the host network stack.
+ */
+static AFXDPProgram *af_xdp_load_program(int ifindex, uint32_t max_queues,
+                                         const NetdevAFXDPOptions *opts,
+                                         Error **errp)
+{
+    AFXDPProgram *prog = g_new0(AFXDPProgram, 1);
+    struct bpf_insn insns[] = {
+        /* r2 = ctx->rx_queue_index */
+        { .code = BPF_LDX | BPF_MEM | BPF_W,
+          .dst_reg = BPF_REG_2, .src_reg = BPF_REG_1,
+          .off = offsetof(struct xdp_md, rx_queue_index) },
+        /* r1 = map, patched below */
+        { .code = BPF_LD | BPF_DW | BPF_IMM,
+          .dst_reg = BPF_REG_1, .src_reg = BPF_PSEUDO_MAP_FD },
+        { 0 },
+        /* r3 = action if the map has no socket for the queue */
+        { .code = BPF_ALU64 | BPF_MOV | BPF_K,
+          .dst_reg = BPF_REG_3, .imm = XDP_PASS },
+        { .code = BPF_JMP | BPF_CALL, .imm = BPF_FUNC_redirect_map },
+        { .code = BPF_JMP | BPF_EXIT },
+    };
+    static const char license[] = "GPL";
+    union bpf_attr attr;
+
+    prog->refcnt = 1;
+    prog->prog_fd = prog->link_fd = -1;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.map_type = BPF_MAP_TYPE_XSKMAP;
+    attr.key_size = sizeof(uint32_t);
+    attr.value_size = sizeof(int);
+    attr.max_entries = max_queues;
+    prog->map_fd = af_xdp_bpf(BPF_MAP_CREATE, &attr);
+    if (prog->map_fd < 0) {
+        error_setg_errno(errp, errno, "Failed to create XSKMAP");
+        goto fail;
+    }
+
+    insns[1].imm = prog->map_fd;
+    memset(&attr, 0, sizeof(attr));
+    attr.prog_type = BPF_PROG_TYPE_XDP;
+    attr.insns = (uintptr_t)insns;
+    attr.insn_cnt = ARRAY_SIZE(insns);
+    attr.license = (uintptr_t)license;
+    prog->prog_fd = af_xdp_bpf(BPF_PROG_LOAD, &attr);
+    if (prog->prog_fd < 0) {
+        error_setg_errno(errp, errno, "Failed to load XDP program");
+        goto fail;
+    }
+
+    memset(&attr, 0, sizeof(attr));
+    attr.link_create.prog_fd = prog->prog_fd;
+    attr.link_create.target_ifindex = ifindex;
+    attr.link_create.attach_type = BPF_XDP;
+    if (!opts->has_mode || opts->mode == AFXDP_MODE_NATIVE) {
+        attr.link_create.flags = XDP_FLAGS_DRV_MODE;
+        prog->link_fd = af_xdp_bpf(BPF_LINK_CREATE, &attr);
+    }
+    if (prog->link_fd < 0 &&
+        (!opts->has_mode || opts->mode == AFXDP_MODE_SKB)) {
+        attr.link_create.flags = XDP_FLAGS_SKB_MODE;
+        prog->link_fd = af_xdp_bpf(BPF_LINK_CREATE, &attr);
+    }
+    if (prog->link_fd < 0) {
+        error_setg_errno(errp, errno, "Failed to attach XDP program to %s",
+                         opts->ifname);
+        goto fail;
+    }
+    return prog;
+
+fail:
+    af_xdp_program_unref(prog);
+    return NULL;
+}
+
+static int af_xdp_map_ring(AFXDPRing *r, int fd, off_t pgoff,
+                           const struct xdp_ring_offset *off,
+                           size_t desc_size, Error **errp)
+{
+    void *map;
+
+    r->map_size = off->desc + AF_XDP_RING_SIZE * desc_size;
+    map = mmap(NULL, r->map_size, PROT_READ | PROT_WRITE,
+               MAP_SHARED | MAP_POPULATE, fd, pgoff);
+    if (map == MAP_FAILED) {
+        error_setg_errno(errp, errno, "Failed to map AF_XDP ring");
+        return -1;
+    }
+
+    r->map = map;
+    r->producer = map + off->producer;
+    r->consumer = map + off->consumer;
+    r->flags = map + off->flags;
+    r->descs = map + off->desc;
+    return 0;
+}
+
+static int af_xdp_socket_init(AFXDPState *s, int ifindex, bool force_copy,
+                              Error **errp)
+{
+    struct xdp_umem_reg reg = {
+        .len = AF_XDP_NUM_FRAMES * AF_XDP_FRAME_SIZE,
+        .chunk_size = AF_XDP_FRAME_SIZE,
+    };
+    struct sockaddr_xdp sxdp = {
+        .sxdp_family = AF_XDP,
+        .sxdp_ifindex = ifindex,
+        .sxdp_queue_id = s->queue_id,
+        .sxdp_flags = XDP_USE_NEED_WAKEUP | (force_copy ? XDP_COPY : 0),
+    };
+    struct xdp_mmap_offsets off;
+    struct xdp_options opts;
+    int ring_size = AF_XDP_RING_SIZE;
+    socklen_t optlen;
+    uint32_t i;
+
+    s->fd = qemu_socket(AF_XDP, SOCK_RAW, 0);
+    if (s->fd < 0) {
+        error_setg_errno(errp, errno, "Failed to create AF_XDP socket");
+        return -1;
+    }
+
+    s->umem = qemu_memalign(qemu_real_host_page_size, reg.len);
+    reg.addr = (uintptr_t)s->umem;
+    if (setsockopt(s->fd, SOL_XDP, XDP_UMEM_REG, &reg, sizeof(reg)) ||
+        setsockopt(s->fd, SOL_XDP, XDP_UMEM_FILL_RING,
+                   &ring_size, sizeof(ring_size)) ||
+        setsockopt(s->fd, SOL_XDP, XDP_UMEM_COMPLETION_RING,
+                   &ring_size, sizeof(ring_size)) ||
+        setsockopt(s->fd, SOL_XDP, XDP_RX_RING,
+                   &ring_size, sizeof(ring_size)) ||
+        setsockopt(s->fd, SOL_XDP, XDP_TX_RING,
+                   &ring_size, sizeof(ring_size))) {
+        error_setg_errno(errp, errno, "Failed to set up AF_XDP rings");
+        return -1;
+    }
+
+    optlen = sizeof(off);
+    if (getsockopt(s->fd, SOL_XDP, XDP_MMAP_OFFSETS, &off, &optlen)) {
+        error_setg_errno(errp, errno, "Failed to get AF_XDP ring offsets");
+        return -1;
+    }
+    if (af_xdp_map_ring(&s->fq, s->fd, XDP_UMEM_PGOFF_FILL_RING, &off.fr,
+                        sizeof(uint64_t), errp) ||
+        af_xdp_map_ring(&s->cq, s->fd, XDP_UMEM_PGOFF_COMPLETION_RING,
+                        &off.cr, sizeof(uint64_t), errp) ||
+        af_xdp_map_ring(&s->rx, s->fd, XDP_PGOFF_RX_RING, &off.rx,
+                        sizeof(struct xdp_desc), errp) ||
+        af_xdp_map_ring(&s->tx, s->fd, XDP_PGOFF_TX_RING, &off.tx,
+                        sizeof(struct xdp_desc), errp)) {
+        return -1;
+    }
+
+    /* The first half of the UMEM is for RX, the second half for TX */
+    for (i = 0; i < AF_XDP_RING_SIZE; i++) {
+        *af_xdp_ring_addr(&s->fq, i) = (uint64_t)i * AF_XDP_FRAME_SIZE;
+        s->tx_frames[i] = (uint64_t)(AF_XDP_RING_SIZE + i) * AF_XDP_FRAME_SIZE;
+    }
+    s->n_tx_frames = AF_XDP_RING_SIZE;
+    atomic_store_release(s->fq.producer, AF_XDP_RING_SIZE);
+
+    if (bind(s->fd, (struct sockaddr *)&sxdp, sizeof(sxdp))) {
+        error_setg_errno(errp, errno, "Failed to bind AF_XDP socket to "
+                         "queue %" PRIu32, s->queue_id);
+        return -1;
+    }
+
+    optlen = sizeof(opts);
+    if (getsockopt(s->fd, SOL_XDP, XDP_OPTIONS, &opts, &optlen)) {
+        opts.flags = 0;
+    }
+    snprintf(s->nc.info_str, sizeof(s->nc.info_str),
+             "af-xdp: queue=%" PRIu32 ",%s", s->queue_id,
+             opts.flags & XDP_OPTIONS_ZEROCOPY ? "zero-copy" : "copy");
+    return 0;
+}
+
+static int af_xdp_add_socket(AFXDPState *s, Error **errp)
+{
+    union bpf_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.map_fd = s->prog->map_fd;
+    attr.key = (uintptr_t)&s->queue_id;
+    attr.value = (uintptr_t)&s->fd;
+    if (af_xdp_bpf(BPF_MAP_UPDATE_ELEM, &attr)) {
+        error_setg_errno(errp, errno, "Failed to add AF_XDP socket for "
+                         "queue %" PRIu32 " to XSKMAP", s->queue_id);
+        return -1;
+    }
+    return 0;
+}
+
+int net_init_af_xdp(const Netdev *netdev, const char *name,
+                    NetClientState *peer, Error **errp)
+{
+    const NetdevAFXDPOptions *opts = &netdev->u.af_xdp;
+    int64_t queues = opts->has_queues ? opts->queues : 1;
+    int64_t start_queue = opts->has_start_queue ? opts->start_queue : 0;
+    NetClientState *nc = NULL;
+    AFXDPProgram *prog;
+    AFXDPState *s;
+    int ifindex;
+    int i;
+
+    if (peer && queues > 1) {
+        error_setg(errp, "Multiqueue af-xdp cannot be used with hubs");
+        return -1;
+    }
+    if (queues < 1 || queues > MAX_QUEUE_NUM) {
+        error_setg(errp, "af-xdp: queues must be between 1 and %d",
+                   MAX_QUEUE_NUM);
+        return -1;
+    }
+    if (start_queue < 0 || start_queue > UINT32_MAX - queues) {
+        error_setg(errp, "af-xdp: invalid start-queue %" PRId64, start_queue);
+        return -1;
+    }
+
+    ifindex = if_nametoindex(opts->ifname);
+    if (!ifindex) {
+        error_setg_errno(errp, errno, "Failed to get ifindex of '%s'",
+                         opts->ifname);
+        return -1;
+    }
+
+    prog = af_xdp_load_program(ifindex, start_queue + queues, opts, errp);
+    if (!prog) {
+        return -1;
+    }
+
+    for (i = 0; i < queues; i++) {
+        nc = qemu_new_net_client(&net_af_xdp_info, peer, "af-xdp", name);
+        s = DO_UPCAST(AFXDPState, nc, nc);
+        s->fd = -1;
+        s->queue_id = start_queue + i;
+        s->prog = prog;
+        prog->refcnt++;
+
+        if (af_xdp_socket_init(s, ifindex, opts->has_force_copy &&
+                               opts->force_copy, errp) ||
+            af_xdp_add_socket(s, errp)) {
+            /* This deletes the queues created so far as well */
+            qemu_del_net_client(nc);
+            af_xdp_program_unref(prog);
+            return -1;
+        }
+        af_xdp_tx_timer_init(s);
+        af_xdp_read_poll(s, true);
+    }
+
+    af_xdp_program_unref(prog);
+    return 0;
+}
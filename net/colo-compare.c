@@ -17,6 +17,7 @@
 #include "trace.h"
 #include "qemu-common.h"
 #include "qapi/error.h"
+#include "qapi/visitor.h"
 #include "net/net.h"
 #include "net/eth.h"
 #include "qom/object_interfaces.h"
@@ -25,8 +26,11 @@
 #include "net/queue.h"
 #include "chardev/char-fe.h"
 #include "qemu/sockets.h"
+#include "qemu/thread.h"
+#include "qemu/atomic.h"
 #include "colo.h"
 #include "sysemu/iothread.h"
+#include "block/aio-wait.h"
 #include "net/colo-compare.h"
 #include "migration/colo.h"
 #include "migration/migration.h"
@@ -43,6 +47,7 @@ static NotifierList colo_compare_notifiers =
 
 #define COMPARE_READ_LEN_MAX NET_BUFSIZE
 #define MAX_QUEUE_SIZE 1024
+#define MAX_COMPARE_WORKERS 64
 
 #define COLO_COMPARE_FREE_PRIMARY     0x01
 #define COLO_COMPARE_FREE_SECONDARY   0x02
@@ -55,7 +60,7 @@ static QemuCond event_complete_cond;
 static int event_unhandled_count;
 
 /*
- *  + CompareState ++
+ *  + CompareShard ++
  *  |               |
  *  +---------------+   +---------------+         +---------------+
  *  |   conn list   + - >      conn     + ------- >      conn     + -- > ......
@@ -76,6 +81,31 @@ static int event_unhandled_count;
  *                    |packet  |  |packet  +    |packet  | |packet  +
  *                    +--------+  +--------+    +--------+ +--------+
  */
+typedef struct CompareShard {
+    struct CompareState *s;
+
+    /*
+     * Record the connection that through the NIC
+     * Element type: Connection
+     */
+    GQueue conn_list;
+    /* Record the connection without repetition */
+    GHashTable *connection_track_table;
+
+    /*
+     * With more than one worker each shard has its own thread, fed by
+     * the compare thread through the input queues below.
+     */
+    QemuThread thread;
+    QemuMutex lock;
+    QemuCond cond;
+    GQueue pri_input;
+    GQueue sec_input;
+    bool check_old;
+    bool flush;
+    bool stopping;
+} CompareShard;
+
 typedef struct CompareState {
     Object parent;
 
@@ -89,13 +119,11 @@ typedef struct CompareState {
     SocketReadState sec_rs;
     bool vnet_hdr;
 
-    /*
-     * Record the connection that through the NIC
-     * Element type: Connection
-     */
-    GQueue conn_list;
-    /* Record the connection without repetition */
-    GHashTable *connection_track_table;
+    /* Connections are spread across the shards by their key hash */
+    uint32_t workers;
+    CompareShard *shards;
+    /* Set by the first shard that diverges, until the checkpoint */
+    bool checkpoint_requested;
 
     IOThread *iothread;
     GMainContext *worker_context;
@@ -116,8 +144,15 @@ enum {
     SECONDARY_IN,
 };
 
-static void colo_compare_inconsistency_notify(void)
+static void colo_compare_inconsistency_notify(CompareState *s)
 {
+    /*
+     * Any shard may find a difference; the first one asks for the
+     * checkpoint and the others need not repeat it until it is done.
+     */
+    if (atomic_xchg(&s->checkpoint_requested, true)) {
+        return;
+    }
     notifier_list_notify(&colo_compare_notifiers,
                 migrate_get_current());
 }
@@ -175,38 +210,37 @@ static int colo_insert_packet(GQueue *queue, Packet *pkt, uint32_t *max_ack)
 }
 
 /*
- * Return 0 on success, if return -1 means the pkt
+ * Return the packet read into @rs, if return NULL means the pkt
  * is unsupported(arp and ipv6) and will be sent later
  */
-static int packet_enqueue(CompareState *s, int mode, Connection **con)
+static Packet *compare_packet_new(SocketReadState *rs)
 {
-    ConnectionKey key;
-    Packet *pkt = NULL;
-    Connection *conn;
-
-    if (mode == PRIMARY_IN) {
-        pkt = packet_new(s->pri_rs.buf,
-                         s->pri_rs.packet_len,
-                         s->pri_rs.vnet_hdr_len);
-    } else {
-        pkt = packet_new(s->sec_rs.buf,
-                         s->sec_rs.packet_len,
-                         s->sec_rs.vnet_hdr_len);
-    }
+    Packet *pkt = packet_new(rs->buf, rs->packet_len, rs->vnet_hdr_len);
 
     if (parse_packet_early(pkt)) {
         packet_destroy(pkt, NULL);
-        pkt = NULL;
-        return -1;
+        return NULL;
     }
+    return pkt;
+}
+
+/*
+ * Queue the packet to its connection in @shard
+ * and return that connection.
+ */
+static Connection *packet_enqueue(CompareShard *shard, Packet *pkt, int mode)
+{
+    ConnectionKey key;
+    Connection *conn;
+
     fill_connection_key(pkt, &key);
 
-    conn = connection_get(s->connection_track_table,
+    conn = connection_get(shard->connection_track_table,
                           &key,
-                          &s->conn_list);
+                          &shard->conn_list);
 
     if (!conn->processing) {
-        g_queue_push_tail(&s->conn_list, conn);
+        g_queue_push_tail(&shard->conn_list, conn);
         conn->processing = true;
     }
 
@@ -221,9 +255,8 @@ static int packet_enqueue(CompareState *s, int mode, Connection **con)
                          "drop packet");
         }
     }
-    *con = conn;
 
-    return 0;
+    return conn;
 }
 
 static inline bool after(uint32_t seq1, uint32_t seq2)
@@ -437,7 +470,7 @@ sec:
         qemu_hexdump((char *)spkt->data, stderr,
                      "colo-compare spkt", spkt->size);
 
-        colo_compare_inconsistency_notify();
+        colo_compare_inconsistency_notify(s);
     }
 }
 
@@ -579,7 +612,7 @@ void colo_compare_unregister_notifier(Notifier *notify)
 }
 
 static int colo_old_packet_check_one_conn(Connection *conn,
-                                           void *user_data)
+                                           CompareState *s)
 {
     GList *result = NULL;
     int64_t check_time = REGULAR_PACKET_CHECK_MS;
@@ -590,7 +623,7 @@ static int colo_old_packet_check_one_conn(Connection *conn,
 
     if (result) {
         /* Do checkpoint will flush old packet */
-        colo_compare_inconsistency_notify();
+        colo_compare_inconsistency_notify(s);
         return 0;
     }
 
@@ -602,15 +635,13 @@ static int colo_old_packet_check_one_conn(Connection *conn,
  * if we have some then we have to checkpoint to wake
  * the secondary up.
  */
-static void colo_old_packet_check(void *opaque)
+static void colo_old_packet_check(CompareShard *shard)
 {
-    CompareState *s = opaque;
-
     /*
      * If we find one old packet, stop finding job and notify
      * COLO frame do checkpoint.
      */
-    g_queue_find_custom(&s->conn_list, NULL,
+    g_queue_find_custom(&shard->conn_list, shard->s,
                         (GCompareFunc)colo_old_packet_check_one_conn);
 }
 
@@ -639,7 +670,7 @@ static void colo_compare_packet(CompareState *s, Connection *conn,
              */
             trace_colo_compare_main("packet different");
             g_queue_push_head(&conn->primary_list, pkt);
-            colo_compare_inconsistency_notify();
+            colo_compare_inconsistency_notify(s);
             break;
         }
     }
@@ -672,6 +703,158 @@ static void colo_compare_connection(void *opaque, void *user_data)
     }
 }
 
+static void colo_flush_packets(void *opaque, void *user_data);
+
+static void colo_compare_event_done(void)
+{
+    qemu_mutex_lock(&event_mtx);
+    assert(event_unhandled_count > 0);
+    event_unhandled_count--;
+    qemu_cond_broadcast(&event_complete_cond);
+    qemu_mutex_unlock(&event_mtx);
+}
+
+/*
+ * Called from the compare thread on the primary to hand a packet
+ * to the shard owning its connection.  With a single worker the
+ * packet is compared right here.
+ */
+static void colo_compare_dispatch(CompareState *s, Packet *pkt, int mode)
+{
+    CompareShard *shard = &s->shards[0];
+    ConnectionKey key;
+
+    if (s->workers == 1) {
+        colo_compare_connection(packet_enqueue(shard, pkt, mode), s);
+        return;
+    }
+
+    fill_connection_key(pkt, &key);
+    shard = &s->shards[connection_key_hash(&key) % s->workers];
+
+    qemu_mutex_lock(&shard->lock);
+    g_queue_push_tail(mode == PRIMARY_IN ? &shard->pri_input
+                                         : &shard->sec_input, pkt);
+    qemu_cond_signal(&shard->cond);
+    qemu_mutex_unlock(&shard->lock);
+}
+
+static void colo_compare_shard_input(CompareShard *shard,
+                                     GQueue *input, int mode)
+{
+    Packet *pkt;
+
+    while ((pkt = g_queue_pop_head(input))) {
+        colo_compare_connection(packet_enqueue(shard, pkt, mode), shard->s);
+    }
+}
+
+/*
+ * Worker thread of one shard: it alone touches the connections of
+ * the shard, the compare thread and the checkpoint code only post
+ * work to it.  Queued packets are drained before it exits.
+ */
+static void *colo_compare_worker(void *opaque)
+{
+    CompareShard *shard = opaque;
+    GQueue pri_input, sec_input;
+    bool check_old, flush;
+
+    qemu_mutex_lock(&shard->lock);
+    for (;;) {
+        if (g_queue_is_empty(&shard->pri_input) &&
+            g_queue_is_empty(&shard->sec_input) &&
+            !shard->check_old && !shard->flush) {
+            if (shard->stopping) {
+                break;
+            }
+            qemu_cond_wait(&shard->cond, &shard->lock);
+            continue;
+        }
+
+        pri_input = shard->pri_input;
+        sec_input = shard->sec_input;
+        g_queue_init(&shard->pri_input);
+        g_queue_init(&shard->sec_input);
+        check_old = shard->check_old;
+        flush = shard->flush;
+        shard->check_old = shard->flush = false;
+        qemu_mutex_unlock(&shard->lock);
+
+        colo_compare_shard_input(shard, &pri_input, PRIMARY_IN);
+        colo_compare_shard_input(shard, &sec_input, SECONDARY_IN);
+        if (check_old) {
+            colo_old_packet_check(shard);
+        }
+        if (flush) {
+            g_queue_foreach(&shard->conn_list, colo_flush_packets, shard->s);
+            colo_compare_event_done();
+        }
+
+        qemu_mutex_lock(&shard->lock);
+    }
+    qemu_mutex_unlock(&shard->lock);
+
+    return NULL;
+}
+
+static void colo_compare_shard_post(CompareShard *shard, bool *work)
+{
+    qemu_mutex_lock(&shard->lock);
+    *work = true;
+    qemu_cond_signal(&shard->cond);
+    qemu_mutex_unlock(&shard->lock);
+}
+
+static void colo_compare_shards_init(CompareState *s)
+{
+    uint32_t i;
+
+    s->shards = g_new0(CompareShard, s->workers);
+    for (i = 0; i < s->workers; i++) {
+        CompareShard *shard = &s->shards[i];
+        char *name;
+
+        shard->s = s;
+        g_queue_init(&shard->conn_list);
+        shard->connection_track_table =
+            g_hash_table_new_full(connection_key_hash,
+                                  connection_key_equal,
+                                  g_free,
+                                  connection_destroy);
+        if (s->workers == 1) {
+            break;
+        }
+
+        g_queue_init(&shard->pri_input);
+        g_queue_init(&shard->sec_input);
+        qemu_mutex_init(&shard->lock);
+        qemu_cond_init(&shard->cond);
+        name = g_strdup_printf("colo-compare%u", i);
+        qemu_thread_create(&shard->thread, name, colo_compare_worker,
+                           shard, QEMU_THREAD_JOINABLE);
+        g_free(name);
+    }
+}
+
+static void colo_compare_shards_stop(CompareState *s)
+{
+    uint32_t i;
+
+    if (!s->shards || s->workers == 1) {
+        return;
+    }
+
+    for (i = 0; i < s->workers; i++) {
+        colo_compare_shard_post(&s->shards[i], &s->shards[i].stopping);
+    }
+    for (i = 0; i < s->workers; i++) {
+        qemu_thread_join(&s->shards[i].thread);
+        qemu_mutex_destroy(&s->shards[i].lock);
+        qemu_cond_destroy(&s->shards[i].cond);
+    }
+}
+
 static int compare_chr_send(CompareState *s,
                             const uint8_t *buf,
                             uint32_t size,
@@ -679,30 +862,31 @@ static int compare_chr_send(CompareState *s,
 {
     int ret = 0;
     uint32_t len = htonl(size);
+    struct iovec iov[3];
+    int cnt = 0;
 
     if (!size) {
         return 0;
     }
 
-    ret = qemu_chr_fe_write_all(&s->chr_out, (uint8_t *)&len, sizeof(len));
-    if (ret != sizeof(len)) {
-        goto err;
-    }
+    iov[cnt].iov_base = &len;
+    iov[cnt++].iov_len = sizeof(len);
 
     if (s->vnet_hdr) {
         /*
          * We send vnet header len make other module(like filter-redirector)
          * know how to parse net packet correctly.
          */
-        len = htonl(vnet_hdr_len);
-        ret = qemu_chr_fe_write_all(&s->chr_out, (uint8_t *)&len, sizeof(len));
-        if (ret != sizeof(len)) {
-            goto err;
-        }
+        vnet_hdr_len = htonl(vnet_hdr_len);
+        iov[cnt].iov_base = &vnet_hdr_len;
+        iov[cnt++].iov_len = sizeof(vnet_hdr_len);
     }
 
-    ret = qemu_chr_fe_write_all(&s->chr_out, (uint8_t *)buf, size);
-    if (ret != size) {
+    iov[cnt].iov_base = (uint8_t *)buf;
+    iov[cnt++].iov_len = size;
+
+    ret = qemu_chr_fe_writev_all(&s->chr_out, iov, cnt);
+    if (ret != iov_size(iov, cnt)) {
         goto err;
     }
 
@@ -758,9 +942,16 @@ static void compare_sec_chr_in(void *opaque, const uint8_t *buf, int size)
 static void check_old_packet_regular(void *opaque)
 {
     CompareState *s = opaque;
+    uint32_t i;
 
     /* if have old packet we will notify checkpoint */
-    colo_old_packet_check(s);
+    if (s->workers == 1) {
+        colo_old_packet_check(&s->shards[0]);
+    } else {
+        for (i = 0; i < s->workers; i++) {
+            colo_compare_shard_post(&s->shards[i], &s->shards[i].check_old);
+        }
+    }
     timer_mod(s->packet_check_timer, qemu_clock_get_ms(QEMU_CLOCK_VIRTUAL) +
                 REGULAR_PACKET_CHECK_MS);
 }
@@ -804,15 +995,25 @@ static void colo_compare_timer_del(CompareState *s)
     }
  }
 
-static void colo_flush_packets(void *opaque, void *user_data);
-
 static void colo_compare_handle_event(void *opaque)
 {
     CompareState *s = opaque;
+    uint32_t i;
 
     switch (s->event) {
     case COLO_EVENT_CHECKPOINT:
-        g_queue_foreach(&s->conn_list, colo_flush_packets, s);
+        atomic_set(&s->checkpoint_requested, false);
+        if (s->workers == 1) {
+            g_queue_foreach(&s->shards[0].conn_list, colo_flush_packets, s);
+            break;
+        }
+        /* Each worker flushes its own shard and completes the event */
+        qemu_mutex_lock(&event_mtx);
+        event_unhandled_count += s->workers;
+        qemu_mutex_unlock(&event_mtx);
+        for (i = 0; i < s->workers; i++) {
+            colo_compare_shard_post(&s->shards[i], &s->shards[i].flush);
+        }
         break;
     case COLO_EVENT_FAILOVER:
         break;
@@ -820,12 +1021,7 @@ static void colo_compare_handle_event(void *opaque)
         break;
     }
 
-    assert(event_unhandled_count > 0);
-
-    qemu_mutex_lock(&event_mtx);
-    event_unhandled_count--;
-    qemu_cond_broadcast(&event_complete_cond);
-    qemu_mutex_unlock(&event_mtx);
+    colo_compare_event_done();
 }
 
 static void colo_compare_iothread(CompareState *s)
@@ -905,12 +1101,51 @@ static void compare_set_vnet_hdr(Object *obj,
     s->vnet_hdr = value;
 }
 
+static void compare_get_workers(Object *obj, Visitor *v,
+                                const char *name, void *opaque,
+                                Error **errp)
+{
+    CompareState *s = COLO_COMPARE(obj);
+    uint32_t value = s->workers;
+
+    visit_type_uint32(v, name, &value, errp);
+}
+
+static void compare_set_workers(Object *obj, Visitor *v,
+                                const char *name, void *opaque,
+                                Error **errp)
+{
+    CompareState *s = COLO_COMPARE(obj);
+    Error *local_err = NULL;
+    uint32_t value;
+
+    visit_type_uint32(v, name, &value, &local_err);
+    if (local_err) {
+        goto out;
+    }
+    if (s->shards) {
+        error_setg(&local_err, "Property '%s.%s' can not be changed "
+                   "once the object is created",
+                   object_get_typename(obj), name);
+        goto out;
+    }
+    if (!value || value > MAX_COMPARE_WORKERS) {
+        error_setg(&local_err, "Property '%s.%s' must be between 1 and %d",
+                   object_get_typename(obj), name, MAX_COMPARE_WORKERS);
+        goto out;
+    }
+    s->workers = value;
+
+out:
+    error_propagate(errp, local_err);
+}
+
 static void compare_pri_rs_finalize(SocketReadState *pri_rs)
 {
     CompareState *s = container_of(pri_rs, CompareState, pri_rs);
-    Connection *conn = NULL;
+    Packet *pkt = compare_packet_new(pri_rs);
 
-    if (packet_enqueue(s, PRIMARY_IN, &conn)) {
+    if (!pkt) {
         trace_colo_compare_main("primary: unsupported packet in");
         compare_chr_send(s,
                          pri_rs->buf,
@@ -918,20 +1153,20 @@ static void compare_pri_rs_finalize(SocketReadState *pri_rs)
                          pri_rs->vnet_hdr_len);
     } else {
         /* compare packet in the specified connection */
-        colo_compare_connection(conn, s);
+        colo_compare_dispatch(s, pkt, PRIMARY_IN);
     }
 }
 
 static void compare_sec_rs_finalize(SocketReadState *sec_rs)
 {
     CompareState *s = container_of(sec_rs, CompareState, sec_rs);
-    Connection *conn = NULL;
+    Packet *pkt = compare_packet_new(sec_rs);
 
-    if (packet_enqueue(s, SECONDARY_IN, &conn)) {
+    if (!pkt) {
         trace_colo_compare_main("secondary: unsupported packet in");
     } else {
         /* compare packet in the specified connection */
-        colo_compare_connection(conn, s);
+        colo_compare_dispatch(s, pkt, SECONDARY_IN);
     }
 }
 
@@ -1001,15 +1236,10 @@ static void colo_compare_complete(UserCreatable *uc, Error **errp)
 
     QTAILQ_INSERT_TAIL(&net_compares, s, next);
 
-    g_queue_init(&s->conn_list);
-
     qemu_mutex_init(&event_mtx);
     qemu_cond_init(&event_complete_cond);
 
-    s->connection_track_table = g_hash_table_new_full(connection_key_hash,
-                                                      connection_key_equal,
-                                                      g_free,
-                                                      connection_destroy);
+    colo_compare_shards_init(s);
 
     colo_compare_iothread(s);
     return;
@@ -1063,19 +1293,37 @@ static void colo_compare_init(Object *obj)
     s->vnet_hdr = false;
     object_property_add_bool(obj, "vnet_hdr_support", compare_get_vnet_hdr,
                              compare_set_vnet_hdr, NULL);
+
+    s->workers = 1;
+    object_property_add(obj, "workers", "uint32",
+                        compare_get_workers, compare_set_workers,
+                        NULL, NULL, NULL);
+}
+
+static void colo_compare_iothread_sync_bh(void *opaque)
+{
 }
 
 static void colo_compare_finalize(Object *obj)
 {
     CompareState *s = COLO_COMPARE(obj);
     CompareState *tmp = NULL;
+    uint32_t i;
 
     qemu_chr_fe_deinit(&s->chr_pri_in, false);
     qemu_chr_fe_deinit(&s->chr_sec_in, false);
-    qemu_chr_fe_deinit(&s->chr_out, false);
     if (s->iothread) {
+        AioContext *ctx = iothread_get_aio_context(s->iothread);
+
         colo_compare_timer_del(s);
+        /* A read handler or the timer may still be running in the iothread */
+        aio_context_acquire(ctx);
+        aio_wait_bh_oneshot(ctx, colo_compare_iothread_sync_bh, NULL);
+        aio_context_release(ctx);
     }
+    /* The workers still send what they have queued */
+    colo_compare_shards_stop(s);
+    qemu_chr_fe_deinit(&s->chr_out, false);
 
     qemu_bh_delete(s->event_bh);
 
@@ -1087,13 +1335,12 @@ static void colo_compare_finalize(Object *obj)
     }
 
     /* Release all unhandled packets after compare thead exited */
-    g_queue_foreach(&s->conn_list, colo_flush_packets, s);
-
-    g_queue_clear(&s->conn_list);
-
-    if (s->connection_track_table) {
-        g_hash_table_destroy(s->connection_track_table);
+    for (i = 0; s->shards && i < s->workers; i++) {
+        g_queue_foreach(&s->shards[i].conn_list, colo_flush_packets, s);
+        g_queue_clear(&s->shards[i].conn_list);
+        g_hash_table_destroy(s->shards[i].connection_track_table);
     }
+    g_free(s->shards);
 
     if (s->iothread) {
         object_unref(OBJECT(s->iothread));
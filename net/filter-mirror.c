@@ -42,48 +42,56 @@ typedef struct MirrorState {
     bool vnet_hdr;
 } MirrorState;
 
+/* Enough for most packets, plus the length words in front */
+#define FILTER_SEND_IOV 64
+
 static int filter_send(MirrorState *s,
                        const struct iovec *iov,
                        int iovcnt)
 {
     NetFilterState *nf = NETFILTER(s);
+    struct iovec sg_buf[FILTER_SEND_IOV];
+    struct iovec *sg = sg_buf;
     int ret = 0;
     ssize_t size = 0;
     uint32_t len = 0;
-    char *buf;
+    uint32_t vnet_hdr_len = 0;
+    int cnt = 0;
 
     size = iov_size(iov, iovcnt);
     if (!size) {
         return 0;
     }
 
-    len = htonl(size);
-    ret = qemu_chr_fe_write_all(&s->chr_out, (uint8_t *)&len, sizeof(len));
-    if (ret != sizeof(len)) {
-        goto err;
+    if (iovcnt + 2 > ARRAY_SIZE(sg_buf)) {
+        sg = g_new(struct iovec, iovcnt + 2);
     }
 
+    len = htonl(size);
+    sg[cnt].iov_base = &len;
+    sg[cnt++].iov_len = sizeof(len);
+
     if (s->vnet_hdr) {
         /*
          * If vnet_hdr = on, we send vnet header len to make other
          * module(like colo-compare) know how to parse net
          * packet correctly.
          */
-        ssize_t vnet_hdr_len;
+        vnet_hdr_len = htonl(nf->netdev->vnet_hdr_len);
+        sg[cnt].iov_base = &vnet_hdr_len;
+        sg[cnt++].iov_len = sizeof(vnet_hdr_len);
+        size += sizeof(vnet_hdr_len);
+    }
+    size += sizeof(len);
 
-        vnet_hdr_len = nf->netdev->vnet_hdr_len;
+    /* The packet goes out straight from the caller's buffers */
+    memcpy(sg + cnt, iov, iovcnt * sizeof(*iov));
+    cnt += iovcnt;
 
-        len = htonl(vnet_hdr_len);
-        ret = qemu_chr_fe_write_all(&s->chr_out, (uint8_t *)&len, sizeof(len));
-        if (ret != sizeof(len)) {
-            goto err;
-        }
+    ret = qemu_chr_fe_writev_all(&s->chr_out, sg, cnt);
+    if (sg != sg_buf) {
+        g_free(sg);
     }
-
-    buf = g_malloc(size);
-    iov_to_buf(iov, iovcnt, 0, buf, size);
-    ret = qemu_chr_fe_write_all(&s->chr_out, (uint8_t *)buf, size);
-    g_free(buf);
     if (ret != size) {
         goto err;
     }
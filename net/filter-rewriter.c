@@ -256,7 +256,7 @@ static ssize_t colo_rewriter_receive_iov(NetFilterState *nf,
     Packet *pkt;
     ssize_t size = iov_size(iov, iovcnt);
     ssize_t vnet_hdr_len = 0;
-    char *buf = g_malloc0(size);
+    char *buf = g_malloc(size);
 
     iov_to_buf(iov, iovcnt, 0, buf, size);
 
@@ -264,8 +264,7 @@ static ssize_t colo_rewriter_receive_iov(NetFilterState *nf,
         vnet_hdr_len = nf->netdev->vnet_hdr_len;
     }
 
-    pkt = packet_new(buf, size, vnet_hdr_len);
-    g_free(buf);
+    pkt = packet_new_nocopy(buf, size, vnet_hdr_len);
 
     /*
      * if we get tcp packet
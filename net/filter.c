@@ -219,6 +219,12 @@ static void netfilter_complete(UserCreatable *uc, Error **errp)
         return;
     }
 
+    if (qemu_net_client_in_iothread(ncs[0])) {
+        error_setg(errp, "netdev '%s' is served by an IOThread",
+                   nf->netdev_id);
+        return;
+    }
+
     nf->netdev = ncs[0];
 
     if (nfc->setup) {
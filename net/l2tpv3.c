@@ -63,12 +63,15 @@ typedef struct NetL2TPV3State {
     int fd;
 
     /*
-     * these are used for xmit - that happens packet a time
-     * and for first sign of life packet (easier to parse that once)
+     * these are used for xmit - a packet at a time, or up to
+     * MAX_L2TPV3_MSGCNT packets when flushing the queue, one header
+     * and IOVSIZE iovecs each - and for first sign of life packet
+     * (easier to parse that once)
      */
 
     uint8_t *header_buf;
     struct iovec *vec;
+    struct mmsghdr *tx_msgvec;
 
     /*
      * these are used for receive - try to "eat" up to 32 packets at a time
@@ -180,32 +183,32 @@ static void l2tpv3_poll(NetClientState *nc, bool enable)
     l2tpv3_read_poll(s, enable);
 }
 
-static void l2tpv3_form_header(NetL2TPV3State *s)
+static void l2tpv3_form_header(NetL2TPV3State *s, uint8_t *header_buf)
 {
     uint32_t *counter;
 
     if (s->udp) {
-        stl_be_p((uint32_t *) s->header_buf, L2TPV3_DATA_PACKET);
+        stl_be_p((uint32_t *) header_buf, L2TPV3_DATA_PACKET);
     }
     stl_be_p(
-            (uint32_t *) (s->header_buf + s->session_offset),
+            (uint32_t *) (header_buf + s->session_offset),
             s->tx_session
         );
     if (s->cookie) {
         if (s->cookie_is_64) {
             stq_be_p(
-                (uint64_t *)(s->header_buf + s->cookie_offset),
+                (uint64_t *)(header_buf + s->cookie_offset),
                 s->tx_cookie
             );
         } else {
             stl_be_p(
-                (uint32_t *) (s->header_buf + s->cookie_offset),
+                (uint32_t *) (header_buf + s->cookie_offset),
                 s->tx_cookie
             );
         }
     }
     if (s->has_counter) {
-        counter = (uint32_t *)(s->header_buf + s->counter_offset);
+        counter = (uint32_t *)(header_buf + s->counter_offset);
         if (s->pin_counter) {
             *counter = 0;
         } else {
@@ -230,7 +233,7 @@ static ssize_t net_l2tpv3_receive_dgram_iov(NetClientState *nc,
         );
         return -1;
     }
-    l2tpv3_form_header(s);
+    l2tpv3_form_header(s, s->header_buf);
     memcpy(s->vec + 1, iov, iovcnt * sizeof(struct iovec));
     s->vec->iov_base = s->header_buf;
     s->vec->iov_len = s->offset;
@@ -272,7 +275,7 @@ static ssize_t net_l2tpv3_receive_dgram(NetClientState *nc,
     struct msghdr message;
     ssize_t ret = 0;
 
-    l2tpv3_form_header(s);
+    l2tpv3_form_header(s, s->header_buf);
     vec = s->vec;
     vec->iov_base = s->header_buf;
     vec->iov_len = s->offset;
@@ -307,6 +310,57 @@ static ssize_t net_l2tpv3_receive_dgram(NetClientState *nc,
     return ret;
 }
 
+/*
+ * A plain socket takes all the packets of a queue flush in one sendmmsg();
+ * the packets after the first one it could not take stay queued.
+ */
+static int net_l2tpv3_receive_dgram_batch(NetClientState *nc,
+                    const struct iovec *packets,
+                    int count)
+{
+    NetL2TPV3State *s = DO_UPCAST(NetL2TPV3State, nc, nc);
+
+    struct mmsghdr *msgvec = s->tx_msgvec;
+    struct iovec *vec;
+    uint8_t *header_buf;
+    int i, ret;
+
+    count = MIN(count, MAX_L2TPV3_MSGCNT);
+    for (i = 0; i < count; i++) {
+        vec = s->vec + i * IOVSIZE;
+        header_buf = s->header_buf + i * s->header_size;
+        l2tpv3_form_header(s, header_buf);
+        vec->iov_base = header_buf;
+        vec->iov_len = s->offset;
+        vec[1] = packets[i];
+        msgvec[i].msg_hdr.msg_name = s->dgram_dst;
+        msgvec[i].msg_hdr.msg_namelen = s->dst_size;
+        msgvec[i].msg_hdr.msg_iov = vec;
+        msgvec[i].msg_hdr.msg_iovlen = IOVSIZE;
+        msgvec[i].msg_hdr.msg_control = NULL;
+        msgvec[i].msg_hdr.msg_controllen = 0;
+        msgvec[i].msg_hdr.msg_flags = 0;
+    }
+    do {
+        ret = sendmmsg(s->fd, msgvec, count, 0);
+    } while ((ret == -1) && (errno == EINTR));
+    if (ret < 0) {
+        if (errno == EAGAIN || errno == ENOBUFS) {
+            /* signal upper layer that socket buffer is full */
+            l2tpv3_write_poll(s, true);
+            ret = 0;
+        } else {
+            /* drop the packet that failed, like the single packet path */
+            ret = 1;
+        }
+    }
+    if (s->has_counter && !s->pin_counter) {
+        /* the packets left behind get their numbers again */
+        s->counter -= count - ret;
+    }
+    return ret;
+}
+
 static int l2tpv3_verify_header(NetL2TPV3State *s, uint8_t *buf)
 {
 
@@ -355,6 +409,7 @@ static void net_l2tpv3_process_queue(NetL2TPV3State *s)
 
     /* go into ring mode only if there is a "pending" tail */
     if (s->queue_depth > 0) {
+        qemu_send_batch_begin(&s->nc);
         do {
             msgvec = s->msgvec + s->queue_tail;
             if (msgvec->msg_len > 0) {
@@ -395,6 +450,7 @@ static void net_l2tpv3_process_queue(NetL2TPV3State *s)
                  qemu_can_send_packet(&s->nc) &&
                 ((size > 0) || bad_read)
             );
+        qemu_send_batch_end(&s->nc);
     }
 }
 
@@ -512,6 +568,7 @@ static void net_l2tpv3_cleanup(NetClientState *nc)
     }
     destroy_vector(s->msgvec, MAX_L2TPV3_MSGCNT, IOVSIZE);
     g_free(s->vec);
+    g_free(s->tx_msgvec);
     g_free(s->header_buf);
     g_free(s->dgram_dst);
 }
@@ -521,6 +578,7 @@ static NetClientInfo net_l2tpv3_info = {
     .size = sizeof(NetL2TPV3State),
     .receive = net_l2tpv3_receive_dgram,
     .receive_iov = net_l2tpv3_receive_dgram_iov,
+    .receive_batch = net_l2tpv3_receive_dgram_batch,
     .poll = l2tpv3_poll,
     .cleanup = net_l2tpv3_cleanup,
 };
@@ -718,7 +776,8 @@ int net_init_l2tpv3(const Netdev *netdev,
 
     s->msgvec = build_l2tpv3_vector(s, MAX_L2TPV3_MSGCNT);
     s->vec = g_new(struct iovec, MAX_L2TPV3_IOVCNT);
-    s->header_buf = g_malloc(s->header_size);
+    s->tx_msgvec = g_new(struct mmsghdr, MAX_L2TPV3_MSGCNT);
+    s->header_buf = g_malloc(s->header_size * MAX_L2TPV3_MSGCNT);
 
     qemu_set_nonblock(fd);
 
@@ -255,6 +255,10 @@ static void qemu_net_client_setup(NetClientState *nc,
     QTAILQ_INSERT_TAIL(&net_clients, nc, next);
 
     nc->incoming_queue = qemu_new_net_queue(qemu_deliver_packet_iov, nc);
+    if (info->receive_batch) {
+        qemu_net_queue_set_deliver_batch(nc->incoming_queue,
+                                         qemu_deliver_packet_batch);
+    }
     nc->destructor = destructor;
     QTAILQ_INIT(&nc->filters);
 }
@@ -275,6 +279,12 @@ NetClientState *qemu_new_net_client(NetClientInfo *info,
     return nc;
 }
 
+/* Queues past the peers of a NIC have no peer */
+static int qemu_nic_conf_queues(NICConf *conf)
+{
+    return MAX(MAX(conf->peers.queues, conf->queues), 1);
+}
+
 NICState *qemu_new_nic(NetClientInfo *info,
                        NICConf *conf,
                        const char *model,
@@ -283,7 +293,7 @@ NICState *qemu_new_nic(NetClientInfo *info,
 {
     NetClientState **peers = conf->peers.ncs;
     NICState *nic;
-    int i, queues = MAX(1, conf->peers.queues);
+    int i, queues = qemu_nic_conf_queues(conf);
 
     assert(info->type == NET_CLIENT_DRIVER_NIC);
     assert(info->size >= sizeof(NICState));
@@ -401,13 +411,13 @@ void qemu_del_net_client(NetClientState *nc)
 
 void qemu_del_nic(NICState *nic)
 {
-    int i, queues = MAX(nic->conf->peers.queues, 1);
+    int i, queues = qemu_nic_conf_queues(nic->conf);
 
     qemu_macaddr_set_free(&nic->conf->macaddr);
 
     /* If this is a peer NIC and peer has already been deleted, free it now. */
     if (nic->peer_deleted) {
-        for (i = 0; i < queues; i++) {
+        for (i = 0; i < MAX(nic->conf->peers.queues, 1); i++) {
             qemu_free_net_client(qemu_get_subqueue(nic, i)->peer);
         }
     }
@@ -517,6 +527,79 @@ int qemu_set_vnet_be(NetClientState *nc, bool is_be)
 #endif
 }
 
+/* Move the file descriptors of @nc to @ctx, or back to the main loop if
+ * @ctx is NULL.  Packets for @nc are delivered with @ctx held from then on.
+ * NICs have no file descriptors of their own and can always be moved; for
+ * other clients this returns false if the backend does not support it.
+ */
+bool qemu_set_net_aio_context(NetClientState *nc, AioContext *ctx)
+{
+    if (nc->info->set_aio_context) {
+        nc->info->set_aio_context(nc, ctx);
+    } else if (nc->info->type != NET_CLIENT_DRIVER_NIC) {
+        return false;
+    }
+
+    qemu_net_queue_set_aio_context(nc->incoming_queue, ctx);
+    return true;
+}
+
+#define NET_HANDOFF_RING_SIZE 256
+
+/* Run @nc in @ctx while its peer stays in the main loop.  Packets cross
+ * between the two threads through a ring in each direction, so neither
+ * side takes the other's lock per packet.  @ctx NULL undoes it.
+ *
+ * Filters would run in @ctx for packets sent by @nc, so neither side may
+ * have any; see qemu_net_client_in_iothread().
+ *
+ * Context: neither @nc nor its peer may be sending or receiving
+ */
+void qemu_set_net_handoff(NetClientState *nc, AioContext *ctx)
+{
+    NetClientState *peer = nc->peer;
+
+    assert(!ctx || (QTAILQ_EMPTY(&nc->filters) &&
+                    QTAILQ_EMPTY(&peer->filters)));
+
+    qemu_net_queue_stop_ring(nc->incoming_queue);
+    qemu_net_queue_stop_ring(peer->incoming_queue);
+    qemu_net_queue_set_aio_context(nc->incoming_queue, ctx);
+    if (ctx) {
+        qemu_net_queue_start_ring(nc->incoming_queue, peer, NULL,
+                                  NET_HANDOFF_RING_SIZE);
+        qemu_net_queue_start_ring(peer->incoming_queue, nc, ctx,
+                                  NET_HANDOFF_RING_SIZE);
+    }
+}
+
+/* True if @nc or its peer processes packets outside the main loop.  Filters
+ * run in the thread of the sender and need the QEMU global mutex, so such a
+ * client cannot have any.
+ */
+bool qemu_net_client_in_iothread(NetClientState *nc)
+{
+    return qemu_net_queue_get_aio_context(nc->incoming_queue) ||
+           (nc->peer &&
+            qemu_net_queue_get_aio_context(nc->peer->incoming_queue));
+}
+
+/* Context: @nc's, i.e. the receiver's */
+int qemu_can_receive_packet(NetClientState *nc)
+{
+    if (!runstate_is_running()) {
+        return 0;
+    }
+
+    if (nc->receive_disabled) {
+        return 0;
+    } else if (nc->info->can_receive &&
+               !nc->info->can_receive(nc)) {
+        return 0;
+    }
+    return 1;
+}
+
 int qemu_can_send_packet(NetClientState *sender)
 {
     int vm_running = runstate_is_running();
@@ -529,13 +612,14 @@ int qemu_can_send_packet(NetClientState *sender)
         return 1;
     }
 
-    if (sender->peer->receive_disabled) {
-        return 0;
-    } else if (sender->peer->info->can_receive &&
-               !sender->peer->info->can_receive(sender->peer)) {
-        return 0;
+    /* The receiver runs in another thread; only the ring is ours to check */
+    if (qemu_net_queue_is_ring_producer(sender->peer->incoming_queue,
+                                        sender)) {
+        return qemu_net_queue_ring_has_room(sender->peer->incoming_queue,
+                                            sender);
     }
-    return 1;
+
+    return qemu_can_receive_packet(sender->peer);
 }
 
 static ssize_t filter_receive_iov(NetClientState *nc,
@@ -663,6 +747,54 @@ ssize_t qemu_send_packet_async(NetClientState *sender,
                                              buf, size, sent_cb);
 }
 
+/* Announce a burst of packets from @sender to its peer.  A peer that
+ * implements receive_batch gets them all at once from the matching
+ * qemu_send_batch_end().  Otherwise they are still delivered one by one,
+ * but a peer that implements flush_batch may defer their completion (used
+ * ring updates, interrupts) until then.
+ */
+void qemu_send_batch_begin(NetClientState *sender)
+{
+    NetClientState *peer = sender->peer;
+    AioContext *ctx;
+
+    /* Through a ring, the receiver batches whatever it drains at once */
+    if (!peer ||
+        qemu_net_queue_is_ring_producer(peer->incoming_queue, sender)) {
+        return;
+    }
+
+    qemu_net_queue_begin_batch(peer->incoming_queue);
+    if (!peer->info->flush_batch) {
+        return;
+    }
+
+    ctx = qemu_net_queue_lock(peer->incoming_queue);
+    peer->receive_batching = 1;
+    qemu_net_queue_unlock(ctx);
+}
+
+void qemu_send_batch_end(NetClientState *sender)
+{
+    NetClientState *peer = sender->peer;
+    AioContext *ctx;
+
+    if (!peer ||
+        qemu_net_queue_is_ring_producer(peer->incoming_queue, sender)) {
+        return;
+    }
+
+    qemu_net_queue_end_batch(peer->incoming_queue);
+    if (!peer->info->flush_batch) {
+        return;
+    }
+
+    ctx = qemu_net_queue_lock(peer->incoming_queue);
+    peer->receive_batching = 0;
+    peer->info->flush_batch(peer);
+    qemu_net_queue_unlock(ctx);
+}
+
 void qemu_send_packet(NetClientState *nc, const uint8_t *buf, int size)
 {
     qemu_send_packet_async(nc, buf, size, NULL);
@@ -740,6 +872,30 @@ ssize_t qemu_deliver_packet_iov(NetClientState *sender,
     return ret;
 }
 
+int qemu_deliver_packet_batch(NetClientState *sender,
+                              const struct iovec *packets,
+                              int count,
+                              void *opaque)
+{
+    NetClientState *nc = opaque;
+    int ret;
+
+    if (nc->link_down) {
+        return count;
+    }
+
+    if (nc->receive_disabled) {
+        return 0;
+    }
+
+    ret = nc->info->receive_batch(nc, packets, count);
+    if (ret == 0) {
+        nc->receive_disabled = 1;
+    }
+
+    return ret;
+}
+
 ssize_t qemu_sendv_packet_async(NetClientState *sender,
                                 const struct iovec *iov, int iovcnt,
                                 NetPacketSent *sent_cb)
@@ -951,6 +1107,9 @@ static int (* const net_client_init_fun[NET_CLIENT_DRIVER__MAX])(
 #ifdef CONFIG_NETMAP
         [NET_CLIENT_DRIVER_NETMAP]    = net_init_netmap,
 #endif
+#ifdef CONFIG_AF_XDP
+        [NET_CLIENT_DRIVER_AF_XDP]    = net_init_af_xdp,
+#endif
 #ifdef CONFIG_NET_BRIDGE
         [NET_CLIENT_DRIVER_BRIDGE]    = net_init_bridge,
 #endif
@@ -1084,6 +1243,9 @@ static void show_netdevs(void)
 #ifdef CONFIG_NETMAP
         "netmap",
 #endif
+#ifdef CONFIG_AF_XDP
+        "af-xdp",
+#endif
 #ifdef CONFIG_POSIX
         "vhost-user",
 #endif
@@ -1452,7 +1614,8 @@ void net_check_clients(void)
     net_hub_check_clients();
 
     QTAILQ_FOREACH(nc, &net_clients, next) {
-        if (!nc->peer) {
+        /* Queues of a NIC past those of its netdev have no peer */
+        if (!nc->peer && nc->queue_index == 0) {
             warn_report("%s %s has no peer",
                         nc->info->type == NET_CLIENT_DRIVER_NIC
                         ? "nic" : "netdev",
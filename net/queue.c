@@ -25,6 +25,10 @@
 #include "net/queue.h"
 #include "qemu/queue.h"
 #include "net/net.h"
+#include "qemu/host-utils.h"
+#include "qemu/iov.h"
+#include "qemu/main-loop.h"
+#include "block/aio.h"
 
 /* The delivery handler may only return zero if it will call
  * qemu_net_queue_flush() when it determines that it is once again able
@@ -38,6 +42,26 @@
  *
  * If a sent callback isn't provided, we just drop the packet to avoid
  * unbounded queueing.
+ *
+ * A queue whose receiver runs in an AioContext other than the main loop's
+ * takes that context around sending, flushing and purging, so that other
+ * threads can still feed packets to it.
+ *
+ * If the sender runs in a different thread as well, a ring avoids taking
+ * the receiver's context for every packet.  Packets from the producer are
+ * copied into preallocated slots and handed over without locks; the
+ * receiver's context drains the ring from a bottom half, under its lock
+ * like any other flush.  A full ring is the same as a zero return from the
+ * delivery handler: the packet is kept and its sent callback runs, in the
+ * producer's context, once the ring has room again.  Like packets on the
+ * list, packets stay in the ring while the receiver cannot take them (for
+ * example while the VM is stopped) until it flushes the queue.
+ *
+ * A receiver that can send several packets with one syscall gives the
+ * queue a batch delivery handler.  Flushes then hand it runs of packets
+ * from the same sender, and between qemu_net_queue_begin_batch() and
+ * qemu_net_queue_end_batch() the packets that could be delivered at once
+ * are queued instead, without a sent callback, until the batch ends.
  */
 
 struct NetPacket {
@@ -49,15 +73,58 @@ struct NetPacket {
     uint8_t data[0];
 };
 
+/* Most packets handed to the batch delivery handler at once */
+#define NET_QUEUE_BATCH 64
+
+/* Keeps the producer's and the consumer's fields apart */
+#define NET_QUEUE_CACHELINE 64
+
+typedef struct NetQueueSlot {
+    unsigned flags;
+    size_t size;
+    size_t capacity;
+    uint8_t *data;
+} NetQueueSlot;
+
+/* Written only by the producer */
+typedef struct NetQueueRingProducer {
+    uint32_t tail;
+    uint32_t cached_head;
+    NetPacket *pending;
+} QEMU_ALIGNED(NET_QUEUE_CACHELINE) NetQueueRingProducer;
+
+/* Written only by the consumer */
+typedef struct NetQueueRingConsumer {
+    uint32_t head;
+    uint32_t cached_tail;
+} QEMU_ALIGNED(NET_QUEUE_CACHELINE) NetQueueRingConsumer;
+
+typedef struct NetQueueRing {
+    NetQueueRingProducer prod;
+    NetQueueRingConsumer cons;
+
+    bool producer_waiting;
+    NetClientState *producer;
+    AioContext *producer_ctx;
+    QEMUBH *consumer_bh;
+    QEMUBH *producer_bh;
+    unsigned size;
+    NetQueueSlot *slots;
+} NetQueueRing;
+
 struct NetQueue {
     void *opaque;
+    AioContext *ctx;
+    NetQueueRing *ring;
     uint32_t nq_maxlen;
     uint32_t nq_count;
     NetQueueDeliverFunc *deliver;
+    NetQueueDeliverBatchFunc *deliver_batch;
 
     QTAILQ_HEAD(packets, NetPacket) packets;
 
     unsigned delivering : 1;
+    unsigned batching : 1;
 };
 
 NetQueue *qemu_new_net_queue(NetQueueDeliverFunc *deliver, void *opaque)
@@ -82,6 +149,7 @@ void qemu_del_net_queue(NetQueue *queue)
 {
     NetPacket *packet, *next;
 
+    qemu_net_queue_stop_ring(queue);
     QTAILQ_FOREACH_SAFE(packet, &queue->packets, entry, next) {
         QTAILQ_REMOVE(&queue->packets, packet, entry);
         g_free(packet);
@@ -90,6 +158,39 @@ void qemu_del_net_queue(NetQueue *queue)
     g_free(queue);
 }
 
+void qemu_net_queue_set_deliver_batch(NetQueue *queue,
+                                      NetQueueDeliverBatchFunc *deliver_batch)
+{
+    queue->deliver_batch = deliver_batch;
+}
+
+void qemu_net_queue_set_aio_context(NetQueue *queue, AioContext *ctx)
+{
+    atomic_set(&queue->ctx, ctx);
+}
+
+AioContext *qemu_net_queue_get_aio_context(NetQueue *queue)
+{
+    return atomic_read(&queue->ctx);
+}
+
+AioContext *qemu_net_queue_lock(NetQueue *queue)
+{
+    AioContext *ctx = atomic_read(&queue->ctx);
+
+    if (ctx) {
+        aio_context_acquire(ctx);
+    }
+    return ctx;
+}
+
+void qemu_net_queue_unlock(AioContext *ctx)
+{
+    if (ctx) {
+        aio_context_release(ctx);
+    }
+}
+
 static void qemu_net_queue_append(NetQueue *queue,
                                   NetClientState *sender,
                                   unsigned flags,
@@ -182,6 +283,328 @@ static ssize_t qemu_net_queue_deliver_iov(NetQueue *queue,
     return ret;
 }
 
+static int qemu_net_queue_deliver_batch(NetQueue *queue,
+                                        NetClientState *sender,
+                                        const struct iovec *packets,
+                                        int count)
+{
+    int ret;
+
+    queue->delivering = 1;
+    ret = queue->deliver_batch(sender, packets, count, queue->opaque);
+    queue->delivering = 0;
+
+    return ret;
+}
+
+static bool qemu_net_queue_ring_push(NetQueueRing *ring, unsigned flags,
+                                     const struct iovec *iov, int iovcnt)
+{
+    uint32_t pos = ring->prod.tail;
+    size_t size = iov_size(iov, iovcnt);
+    NetQueueSlot *slot;
+
+    if (pos - ring->prod.cached_head == ring->size) {
+        ring->prod.cached_head = atomic_load_acquire(&ring->cons.head);
+        if (pos - ring->prod.cached_head == ring->size) {
+            return false;
+        }
+    }
+
+    /* Slot buffers are kept and only ever grow */
+    slot = &ring->slots[pos % ring->size];
+    if (slot->capacity < size) {
+        g_free(slot->data);
+        slot->data = g_malloc(size);
+        slot->capacity = size;
+    }
+    slot->flags = flags;
+    slot->size = iov_to_buf(iov, iovcnt, 0, slot->data, size);
+
+    atomic_store_release(&ring->prod.tail, pos + 1);
+    return true;
+}
+
+/* Packets from the producer, sent in its own context, go through the ring */
+bool qemu_net_queue_is_ring_producer(NetQueue *queue, NetClientState *sender)
+{
+    NetQueueRing *ring = queue->ring;
+
+    return ring && sender == ring->producer &&
+           in_aio_context_home_thread(ring->producer_ctx);
+}
+
+/* Context: producer */
+static ssize_t qemu_net_queue_ring_send(NetQueue *queue,
+                                        unsigned flags,
+                                        const struct iovec *iov,
+                                        int iovcnt,
+                                        NetPacketSent *sent_cb)
+{
+    NetQueueRing *ring = queue->ring;
+
+    if (ring->prod.pending) {
+        goto full;
+    }
+    if (!qemu_net_queue_ring_push(ring, flags, iov, iovcnt)) {
+        if (!sent_cb) {
+            return 0; /* drop if ring full and no callback */
+        }
+
+        atomic_set(&ring->producer_waiting, true);
+        /* Check again for room; pairs with atomic_xchg() in ring_wake() */
+        smp_mb();
+        if (!qemu_net_queue_ring_push(ring, flags, iov, iovcnt)) {
+            goto full;
+        }
+        atomic_set(&ring->producer_waiting, false);
+    }
+    qemu_bh_schedule(ring->consumer_bh);
+    return iov_size(iov, iovcnt);
+
+full:
+    if (!ring->prod.pending && sent_cb) {
+        NetPacket *packet;
+
+        packet = g_malloc(sizeof(NetPacket) + iov_size(iov, iovcnt));
+        packet->sender = ring->producer;
+        packet->flags = flags;
+        packet->sent_cb = sent_cb;
+        packet->size = iov_to_buf(iov, iovcnt, 0, packet->data,
+                                  iov_size(iov, iovcnt));
+        ring->prod.pending = packet;
+    }
+    return 0;
+}
+
+/* Context: consumer, with the queue locked */
+static void qemu_net_queue_ring_wake(NetQueueRing *ring)
+{
+    if (atomic_xchg(&ring->producer_waiting, false)) {
+        qemu_bh_schedule(ring->producer_bh);
+    }
+}
+
+/* Context: consumer, with the queue locked
+ *
+ * Raw packets go to the receiver one by one.
+ */
+static int qemu_net_queue_ring_gather(NetQueue *queue, uint32_t pos,
+                                      struct iovec *packets)
+{
+    NetQueueRing *ring = queue->ring;
+    int count = 0;
+
+    if (!queue->deliver_batch) {
+        return 0;
+    }
+    while (count < NET_QUEUE_BATCH && pos != ring->cons.cached_tail) {
+        NetQueueSlot *slot = &ring->slots[pos % ring->size];
+
+        if (slot->flags & QEMU_NET_PACKET_FLAG_RAW) {
+            break;
+        }
+        packets[count].iov_base = slot->data;
+        packets[count].iov_len = slot->size;
+        count++;
+        pos++;
+    }
+    return count;
+}
+
+/* Context: consumer, with the queue locked
+ *
+ * Rings only exist on the incoming queue of a client, the receiver is
+ * the opaque of @queue.
+ */
+static bool qemu_net_queue_ring_flush(NetQueue *queue)
+{
+    NetQueueRing *ring = queue->ring;
+    struct iovec packets[NET_QUEUE_BATCH];
+    uint32_t pos = ring->cons.head;
+    bool ret = true;
+    int count, done;
+
+    for (;;) {
+        NetQueueSlot *slot;
+
+        if (pos == ring->cons.cached_tail) {
+            ring->cons.cached_tail = atomic_load_acquire(&ring->prod.tail);
+            if (pos == ring->cons.cached_tail) {
+                break;
+            }
+        }
+
+        /* Like qemu_net_queue_send(), don't make the receiver drop it */
+        if (!qemu_can_receive_packet(queue->opaque)) {
+            ret = false;
+            break;
+        }
+
+        count = qemu_net_queue_ring_gather(queue, pos, packets);
+        if (count > 1) {
+            done = qemu_net_queue_deliver_batch(queue, ring->producer,
+                                                packets, count);
+            pos += done;
+            if (done < count) {
+                ret = false;
+                break;
+            }
+            continue;
+        }
+
+        slot = &ring->slots[pos % ring->size];
+        if (qemu_net_queue_deliver(queue, ring->producer, slot->flags,
+                                   slot->data, slot->size) == 0) {
+            ret = false;
+            break;
+        }
+        pos++;
+    }
+
+    if (pos != ring->cons.head) {
+        atomic_store_release(&ring->cons.head, pos);
+        qemu_net_queue_ring_wake(ring);
+    }
+    return ret;
+}
+
+/* Packets from the producer that bypass the ring must not overtake it */
+static bool qemu_net_queue_ring_drained(NetQueue *queue,
+                                        NetClientState *sender)
+{
+    return !queue->ring || sender != queue->ring->producer ||
+           qemu_net_queue_ring_flush(queue);
+}
+
+static void qemu_net_queue_consumer_bh(void *opaque)
+{
+    NetQueue *queue = opaque;
+    NetClientState *producer = queue->ring->producer;
+
+    qemu_send_batch_begin(producer);
+    qemu_net_queue_flush(queue);
+    qemu_send_batch_end(producer);
+}
+
+static void qemu_net_queue_producer_bh(void *opaque)
+{
+    NetQueue *queue = opaque;
+    NetQueueRing *ring = queue->ring;
+    AioContext *ctx = ring->producer_ctx;
+    NetPacket *packet = ring->prod.pending;
+    struct iovec iov;
+
+    if (!packet) {
+        return;
+    }
+    if (ctx != qemu_get_aio_context()) {
+        aio_context_acquire(ctx);
+    }
+
+    iov.iov_base = packet->data;
+    iov.iov_len = packet->size;
+    atomic_set(&ring->producer_waiting, true);
+    /* Check again for room; pairs with atomic_xchg() in ring_wake() */
+    smp_mb();
+    if (qemu_net_queue_ring_push(ring, packet->flags, &iov, 1)) {
+        atomic_set(&ring->producer_waiting, false);
+        ring->prod.pending = NULL;
+        qemu_bh_schedule(ring->consumer_bh);
+        packet->sent_cb(packet->sender, packet->size);
+        g_free(packet);
+    }
+
+    if (ctx != qemu_get_aio_context()) {
+        aio_context_release(ctx);
+    }
+}
+
+/* Context: neither the producer nor the consumer may be running */
+void qemu_net_queue_start_ring(NetQueue *queue, NetClientState *producer,
+                               AioContext *producer_ctx, unsigned size)
+{
+    NetQueueRing *ring;
+
+    assert(!queue->ring && is_power_of_2(size));
+
+    ring = qemu_memalign(NET_QUEUE_CACHELINE, sizeof(*ring));
+    memset(ring, 0, sizeof(*ring));
+    ring->producer = producer;
+    ring->producer_ctx = producer_ctx ?: qemu_get_aio_context();
+    ring->size = size;
+    ring->slots = g_new0(NetQueueSlot, size);
+    ring->consumer_bh = aio_bh_new(queue->ctx ?: qemu_get_aio_context(),
+                                   qemu_net_queue_consumer_bh, queue);
+    ring->producer_bh = aio_bh_new(ring->producer_ctx,
+                                   qemu_net_queue_producer_bh, queue);
+    queue->ring = ring;
+}
+
+/* Context: neither the producer nor the consumer may be running
+ *
+ * Whatever is still in the ring moves to the packet list, in order, and is
+ * delivered by the next flush.
+ */
+void qemu_net_queue_stop_ring(NetQueue *queue)
+{
+    NetQueueRing *ring = queue->ring;
+    NetPacket *last = NULL;
+    uint32_t i;
+
+    if (!ring) {
+        return;
+    }
+
+    for (i = ring->cons.head; i != ring->prod.tail; i++) {
+        NetQueueSlot *slot = &ring->slots[i % ring->size];
+        NetPacket *packet = g_malloc(sizeof(NetPacket) + slot->size);
+
+        packet->sender = ring->producer;
+        packet->flags = slot->flags;
+        packet->size = slot->size;
+        packet->sent_cb = NULL;
+        memcpy(packet->data, slot->data, slot->size);
+
+        if (last) {
+            QTAILQ_INSERT_AFTER(&queue->packets, last, packet, entry);
+        } else {
+            QTAILQ_INSERT_HEAD(&queue->packets, packet, entry);
+        }
+        last = packet;
+        queue->nq_count++;
+    }
+    if (ring->prod.pending) {
+        QTAILQ_INSERT_TAIL(&queue->packets, ring->prod.pending, entry);
+        queue->nq_count++;
+    }
+
+    for (i = 0; i < ring->size; i++) {
+        g_free(ring->slots[i].data);
+    }
+    qemu_bh_delete(ring->consumer_bh);
+    qemu_bh_delete(ring->producer_bh);
+    g_free(ring->slots);
+    qemu_vfree(ring);
+    queue->ring = NULL;
+}
+
+/* Returns false if @sender feeds @queue through its ring and the ring is
+ * full, so that the sender can stop polling for more packets.
+ */
+bool qemu_net_queue_ring_has_room(NetQueue *queue, NetClientState *sender)
+{
+    NetQueueRing *ring = queue->ring;
+
+    if (!qemu_net_queue_is_ring_producer(queue, sender)) {
+        return true;
+    }
+    if (ring->prod.pending) {
+        return false;
+    }
+    return ring->prod.tail - atomic_read(&ring->cons.head) != ring->size;
+}
+
 ssize_t qemu_net_queue_send(NetQueue *queue,
                             NetClientState *sender,
                             unsigned flags,
@@ -189,21 +612,42 @@ ssize_t qemu_net_queue_send(NetQueue *queue,
                             size_t size,
                             NetPacketSent *sent_cb)
 {
+    AioContext *ctx;
     ssize_t ret;
 
-    if (queue->delivering || !qemu_can_send_packet(sender)) {
+    if (qemu_net_queue_is_ring_producer(queue, sender)) {
+        struct iovec iov = {
+            .iov_base = (void *)data,
+            .iov_len = size
+        };
+
+        return qemu_net_queue_ring_send(queue, flags, &iov, 1, sent_cb);
+    }
+
+    ctx = qemu_net_queue_lock(queue);
+    if (queue->delivering || !qemu_can_send_packet(sender) ||
+        !qemu_net_queue_ring_drained(queue, sender)) {
         qemu_net_queue_append(queue, sender, flags, data, size, sent_cb);
-        return 0;
+        ret = 0;
+        goto out;
+    }
+    if (queue->batching) {
+        /* Taken now, delivered with the rest of the batch */
+        qemu_net_queue_append(queue, sender, flags, data, size, NULL);
+        ret = size;
+        goto out;
     }
 
     ret = qemu_net_queue_deliver(queue, sender, flags, data, size);
     if (ret == 0) {
         qemu_net_queue_append(queue, sender, flags, data, size, sent_cb);
-        return 0;
+        goto out;
     }
 
     qemu_net_queue_flush(queue);
 
+out:
+    qemu_net_queue_unlock(ctx);
     return ret;
 }
 
@@ -214,28 +658,62 @@ ssize_t qemu_net_queue_send_iov(NetQueue *queue,
                                 int iovcnt,
                                 NetPacketSent *sent_cb)
 {
+    AioContext *ctx;
     ssize_t ret;
 
-    if (queue->delivering || !qemu_can_send_packet(sender)) {
+    if (qemu_net_queue_is_ring_producer(queue, sender)) {
+        return qemu_net_queue_ring_send(queue, flags, iov, iovcnt, sent_cb);
+    }
+
+    ctx = qemu_net_queue_lock(queue);
+    if (queue->delivering || !qemu_can_send_packet(sender) ||
+        !qemu_net_queue_ring_drained(queue, sender)) {
         qemu_net_queue_append_iov(queue, sender, flags, iov, iovcnt, sent_cb);
-        return 0;
+        ret = 0;
+        goto out;
+    }
+    if (queue->batching) {
+        qemu_net_queue_append_iov(queue, sender, flags, iov, iovcnt, NULL);
+        ret = iov_size(iov, iovcnt);
+        goto out;
     }
 
     ret = qemu_net_queue_deliver_iov(queue, sender, flags, iov, iovcnt);
     if (ret == 0) {
         qemu_net_queue_append_iov(queue, sender, flags, iov, iovcnt, sent_cb);
-        return 0;
+        goto out;
     }
 
     qemu_net_queue_flush(queue);
 
+out:
+    qemu_net_queue_unlock(ctx);
     return ret;
 }
 
 void qemu_net_queue_purge(NetQueue *queue, NetClientState *from)
 {
+    AioContext *ctx = qemu_net_queue_lock(queue);
+    NetQueueRing *ring = queue->ring;
     NetPacket *packet, *next;
 
+    /* Context: producer, which owns the pending packet.  Both sides must
+     * see an empty ring afterwards.
+     */
+    if (ring && from == ring->producer) {
+        uint32_t pos = atomic_load_acquire(&ring->prod.tail);
+
+        packet = ring->prod.pending;
+        ring->prod.pending = NULL;
+        atomic_set(&ring->producer_waiting, false);
+        ring->cons.cached_tail = pos;
+        atomic_store_release(&ring->cons.head, pos);
+        if (packet) {
+            packet->sent_cb(packet->sender, 0);
+            g_free(packet);
+        }
+    }
+
     QTAILQ_FOREACH_SAFE(packet, &queue->packets, entry, next) {
         if (packet->sender == from) {
             QTAILQ_REMOVE(&queue->packets, packet, entry);
@@ -246,13 +724,79 @@ void qemu_net_queue_purge(NetQueue *queue, NetClientState *from)
             g_free(packet);
         }
     }
+    qemu_net_queue_unlock(ctx);
+}
+
+/* The packets at the head of the list that can be delivered at once */
+static int qemu_net_queue_gather(NetQueue *queue, NetPacket **batch,
+                                 struct iovec *packets)
+{
+    NetPacket *packet;
+    int count = 0;
+
+    if (!queue->deliver_batch) {
+        return 0;
+    }
+    QTAILQ_FOREACH(packet, &queue->packets, entry) {
+        if (count == NET_QUEUE_BATCH ||
+            (packet->flags & QEMU_NET_PACKET_FLAG_RAW) ||
+            (count && packet->sender != batch[0]->sender)) {
+            break;
+        }
+        batch[count] = packet;
+        packets[count].iov_base = packet->data;
+        packets[count].iov_len = packet->size;
+        count++;
+    }
+    return count;
+}
+
+/* Returns false if some of the packets were left in the list */
+static bool qemu_net_queue_flush_batch(NetQueue *queue, NetPacket **batch,
+                                       const struct iovec *packets, int count)
+{
+    int i, done;
+
+    done = qemu_net_queue_deliver_batch(queue, batch[0]->sender,
+                                        packets, count);
+
+    /* A sent callback may flush again, the list must be up to date */
+    for (i = 0; i < done; i++) {
+        QTAILQ_REMOVE(&queue->packets, batch[i], entry);
+        queue->nq_count--;
+    }
+    for (i = 0; i < done; i++) {
+        if (batch[i]->sent_cb) {
+            batch[i]->sent_cb(batch[i]->sender, batch[i]->size);
+        }
+        g_free(batch[i]);
+    }
+    return done == count;
 }
 
 bool qemu_net_queue_flush(NetQueue *queue)
 {
+    AioContext *ctx = qemu_net_queue_lock(queue);
+
+    if (queue->ring && !qemu_net_queue_ring_flush(queue)) {
+        qemu_net_queue_unlock(ctx);
+        return false;
+    }
+
     while (!QTAILQ_EMPTY(&queue->packets)) {
+        NetPacket *batch[NET_QUEUE_BATCH];
+        struct iovec packets[NET_QUEUE_BATCH];
         NetPacket *packet;
-        int ret;
+        int count, ret;
+
+        count = qemu_net_queue_gather(queue, batch, packets);
+        if (count > 1) {
+            if (!qemu_net_queue_flush_batch(queue, batch, packets, count)) {
+                qemu_net_queue_unlock(ctx);
+                return false;
+            }
+            continue;
+        }
 
         packet = QTAILQ_FIRST(&queue->packets);
         QTAILQ_REMOVE(&queue->packets, packet, entry);
@@ -266,6 +810,7 @@ bool qemu_net_queue_flush(NetQueue *queue)
         if (ret == 0) {
             queue->nq_count++;
             QTAILQ_INSERT_HEAD(&queue->packets, packet, entry);
+            qemu_net_queue_unlock(ctx);
             return false;
         }
 
@@ -275,5 +820,36 @@ bool qemu_net_queue_flush(NetQueue *queue)
 
         g_free(packet);
     }
+    qemu_net_queue_unlock(ctx);
     return true;
 }
+
+/* Packets sent until qemu_net_queue_end_batch() wait in the queue, so that a
+ * receiver with a batch delivery handler gets them together.
+ */
+void qemu_net_queue_begin_batch(NetQueue *queue)
+{
+    AioContext *ctx;
+
+    if (!queue->deliver_batch) {
+        return;
+    }
+
+    ctx = qemu_net_queue_lock(queue);
+    queue->batching = 1;
+    qemu_net_queue_unlock(ctx);
+}
+
+void qemu_net_queue_end_batch(NetQueue *queue)
+{
+    AioContext *ctx;
+
+    if (!queue->deliver_batch) {
+        return;
+    }
+
+    ctx = qemu_net_queue_lock(queue);
+    queue->batching = 0;
+    qemu_net_queue_flush(queue);
+    qemu_net_queue_unlock(ctx);
+}
@@ -106,6 +106,20 @@ void slirp_output(void *opaque, const uint8_t *pkt, int pkt_len)
     qemu_send_packet(&s->nc, pkt, pkt_len);
 }
 
+void slirp_output_begin(void *opaque)
+{
+    SlirpState *s = opaque;
+
+    qemu_send_batch_begin(&s->nc);
+}
+
+void slirp_output_end(void *opaque)
+{
+    SlirpState *s = opaque;
+
+    qemu_send_batch_end(&s->nc);
+}
+
 static ssize_t net_slirp_receive(NetClientState *nc, const uint8_t *buf, size_t size)
 {
     SlirpState *s = DO_UPCAST(SlirpState, nc, nc);
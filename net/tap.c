@@ -34,6 +34,7 @@
 
 #include "net/net.h"
 #include "clients.h"
+#include "block/aio.h"
 #include "monitor/monitor.h"
 #include "sysemu/sysemu.h"
 #include "qapi/error.h"
@@ -57,6 +58,7 @@ typedef struct TAPState {
     bool using_vnet_hdr;
     bool has_ufo;
     bool enabled;
+    AioContext *ctx;
     VHostNetState *vhost_net;
     unsigned host_vnet_hdr_len;
     Notifier exit;
@@ -70,10 +72,14 @@ static void tap_writable(void *opaque);
 
 static void tap_update_fd_handler(TAPState *s)
 {
-    qemu_set_fd_handler(s->fd,
-                        s->read_poll && s->enabled ? tap_send : NULL,
-                        s->write_poll && s->enabled ? tap_writable : NULL,
-                        s);
+    IOHandler *read = s->read_poll && s->enabled ? tap_send : NULL;
+    IOHandler *write = s->write_poll && s->enabled ? tap_writable : NULL;
+
+    if (s->ctx) {
+        aio_set_fd_handler(s->ctx, s->fd, false, read, write, NULL, s);
+    } else {
+        qemu_set_fd_handler(s->fd, read, write, s);
+    }
 }
 
 static void tap_read_poll(TAPState *s, bool enable)
@@ -97,6 +103,12 @@ static void tap_writable(void *opaque)
     qemu_flush_queued_packets(&s->nc);
 }
 
+/*
+ * The tap character device takes one frame per write(), and Linux has no
+ * multi-frame variant of it outside vhost-net.  A packet socket bound to
+ * the interface would see the frames we write, not the ones for the host,
+ * so tap has no receive_batch and writes stay per-frame.
+ */
 static ssize_t tap_write_packet(TAPState *s, const struct iovec *iov, int iovcnt)
 {
     ssize_t len;
@@ -186,6 +198,7 @@ static void tap_send(void *opaque)
     int size;
     int packets = 0;
 
+    qemu_send_batch_begin(&s->nc);
     while (true) {
         uint8_t *buf = s->buf;
 
@@ -218,6 +231,7 @@ static void tap_send(void *opaque)
             break;
         }
     }
+    qemu_send_batch_end(&s->nc);
 }
 
 static bool tap_has_ufo(NetClientState *nc)
@@ -328,6 +342,21 @@ static void tap_cleanup(NetClientState *nc)
     s->fd = -1;
 }
 
+static void tap_set_aio_context(NetClientState *nc, AioContext *ctx)
+{
+    TAPState *s = DO_UPCAST(TAPState, nc, nc);
+    bool enabled = s->enabled;
+
+    /* Drop the handlers from the old context before installing them
+     * in the new one.
+     */
+    s->enabled = false;
+    tap_update_fd_handler(s);
+    s->ctx = ctx;
+    s->enabled = enabled;
+    tap_update_fd_handler(s);
+}
+
 static void tap_poll(NetClientState *nc, bool enable)
 {
     TAPState *s = DO_UPCAST(TAPState, nc, nc);
@@ -360,6 +389,7 @@ static NetClientInfo net_tap_info = {
     .set_vnet_hdr_len = tap_set_vnet_hdr_len,
     .set_vnet_le = tap_set_vnet_le,
     .set_vnet_be = tap_set_vnet_be,
+    .set_aio_context = tap_set_aio_context,
 };
 
 static TAPState *net_tap_fd_init(NetClientState *peer,
@@ -1914,6 +1914,13 @@ DEF("netdev", HAS_ARG, QEMU_OPTION_netdev,
     "                VALE port (created on the fly) called 'name' ('nmname' is name of the \n"
     "                netmap device, defaults to '/dev/netmap')\n"
 #endif
+#ifdef CONFIG_AF_XDP
+    "-netdev af-xdp,id=str,ifname=name[,mode=native|skb][,force-copy=on|off]\n"
+    "         [,queues=n][,start-queue=m]\n"
+    "                attach to queues 'm' to 'm'+'n'-1 of the network interface 'name'\n"
+    "                through AF_XDP sockets (default: n=1, m=0). 'mode' selects how the\n"
+    "                XDP program runs; use 'force-copy=on' to disable zero-copy\n"
+#endif
 #ifdef CONFIG_POSIX
     "-netdev vhost-user,id=str,chardev=dev[,vhostforce=on|off]\n"
     "                configure a vhost-user network, backed by a chardev 'dev'\n"
@@ -1934,6 +1941,9 @@ DEF("nic", HAS_ARG, QEMU_OPTION_nic,
 #ifdef CONFIG_NETMAP
     "netmap|"
 #endif
+#ifdef CONFIG_AF_XDP
+    "af-xdp|"
+#endif
 #ifdef CONFIG_POSIX
     "vhost-user|"
 #endif
@@ -1963,7 +1973,7 @@ DEF("net", HAS_ARG, QEMU_OPTION_net,
     "                old way to initialize a host network interface\n"
     "                (use the -netdev option if possible instead)\n", QEMU_ARCH_ALL)
 STEXI
-@item -nic [tap|bridge|user|l2tpv3|vde|netmap|vhost-user|socket][,...][,mac=macaddr][,model=mn]
+@item -nic [tap|bridge|user|l2tpv3|vde|netmap|af-xdp|vhost-user|socket][,...][,mac=macaddr][,model=mn]
 @findex -nic
 This option is a shortcut for configuring both the on-board (default) guest
 NIC hardware and the host network backend in one go. The host backend options
@@ -2357,6 +2367,35 @@ vde_switch -F -sock /tmp/myswitch
 qemu-system-i386 linux.img -nic vde,sock=/tmp/myswitch
 @end example
 
+@item -netdev af-xdp,id=@var{id},ifname=@var{name}[,mode=native|skb][,force-copy=on|off][,queues=@var{n}][,start-queue=@var{m}]
+Connect to queues @var{m} to @var{m}+@var{n}-1 of the host network interface
+@var{name} through AF_XDP sockets, bypassing the host network stack.  An XDP
+program attached to the interface redirects the frames received on those
+queues to QEMU; the frames of the other queues still reach the host.  By
+default the program runs in the driver if it supports XDP (@option{mode=native}),
+and in the generic network stack otherwise (@option{mode=skb}).  Frames are
+exchanged without copies if the driver supports it, unless
+@option{force-copy=on} is given.  Use @option{queues=@var{n}} with a multiqueue
+virtio-net device, and steer the traffic of the guest to the bound queues
+with the flow rules or channel settings of the interface.
+
+QEMU needs the CAP_NET_ADMIN, CAP_NET_RAW and CAP_BPF (or CAP_SYS_ADMIN)
+capabilities, and Linux 5.9 or newer.  Frames larger than 4096 bytes are
+dropped.  This option is only available if QEMU has been compiled with
+AF_XDP support enabled.
+
+Example:
+@example
+# create a veth pair, with one queue on each side
+ip link add veth0 type veth peer name veth1
+ip link set veth0 up
+ip link set veth1 up
+# launch QEMU instance on veth0, and reach the guest through veth1
+qemu-system-x86_64 linux.img \
+    -netdev af-xdp,id=n1,ifname=veth0,mode=skb \
+    -device virtio-net-pci,netdev=n1
+@end example
+
 @item -netdev vhost-user,chardev=@var{id}[,vhostforce=on|off][,queues=n]
 
 Establish a vhost-user netdev, backed by a chardev @var{id}. The chardev should
@@ -4194,13 +4233,16 @@ Dump the network traffic on netdev @var{dev} to the file specified by
 The file format is libpcap, so it can be analyzed with tools such as tcpdump
 or Wireshark.
 
-@item -object colo-compare,id=@var{id},primary_in=@var{chardevid},secondary_in=@var{chardevid},outdev=@var{chardevid}[,vnet_hdr_support]
+@item -object colo-compare,id=@var{id},primary_in=@var{chardevid},secondary_in=@var{chardevid},outdev=@var{chardevid}[,vnet_hdr_support][,workers=@var{n}]
 
 Colo-compare gets packet from primary_in@var{chardevid} and secondary_in@var{chardevid}, than compare primary packet with
 secondary packet. If the packets are same, we will output primary
 packet to outdev@var{chardevid}, else we will notify colo-frame
 do checkpoint and send primary packet to outdev@var{chardevid}.
 if it has the vnet_hdr_support flag, colo compare will send/recv packet with vnet_hdr_len.
+@option{workers} spreads the connections over @var{n} comparison threads
+by the hash of their addresses and ports (1 by default, at most 64); the
+first thread that sees a difference asks colo-frame for the checkpoint.
 
 we must use it with the help of filter-mirror and filter-redirector.
 
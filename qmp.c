@@ -737,3 +737,53 @@ MemoryInfo *qmp_query_memory_size_summary(Error **errp)
 
     return mem_info;
 }
+
+SyncProfileInfo *qmp_query_sync_profile(bool has_max, int64_t max,
+                                        bool has_sort_by,
+                                        SyncProfileSortBy sort_by,
+                                        bool has_coalesce, bool coalesce,
+                                        Error **errp)
+{
+    SyncProfileInfo *info;
+    enum QSPSortBy qsp_sort_by = QSP_SORT_BY_TOTAL_WAIT_TIME;
+
+    if (has_max && max < 0) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "max",
+                   "a non-negative value");
+        return NULL;
+    }
+    if (has_sort_by) {
+        switch (sort_by) {
+        case SYNC_PROFILE_SORT_BY_TOTAL_WAIT:
+            qsp_sort_by = QSP_SORT_BY_TOTAL_WAIT_TIME;
+            break;
+        case SYNC_PROFILE_SORT_BY_AVG_WAIT:
+            qsp_sort_by = QSP_SORT_BY_AVG_WAIT_TIME;
+            break;
+        case SYNC_PROFILE_SORT_BY_TOTAL_HOLD:
+            qsp_sort_by = QSP_SORT_BY_TOTAL_HOLD_TIME;
+            break;
+        default:
+            abort();
+        }
+    }
+
+    info = g_new0(SyncProfileInfo, 1);
+    info->enabled = qsp_is_enabled();
+    info->entries = qsp_query(has_max ? max : SIZE_MAX, qsp_sort_by,
+                              has_coalesce ? coalesce : true);
+    return info;
+}
+
+void qmp_sync_profile_set_state(bool enable, bool has_reset, bool reset,
+                                Error **errp)
+{
+    if (has_reset && reset) {
+        qsp_reset();
+    }
+    if (enable) {
+        qsp_enable();
+    } else {
+        qsp_disable();
+    }
+}
@@ -28,6 +28,9 @@ void slirp_input(Slirp *slirp, const uint8_t *pkt, int pkt_len);
 
 /* you must provide the following functions: */
 void slirp_output(void *opaque, const uint8_t *pkt, int pkt_len);
+/* Bracket the packets output while polling the host sockets */
+void slirp_output_begin(void *opaque);
+void slirp_output_end(void *opaque);
 
 int slirp_add_hostfwd(Slirp *slirp, int is_udp,
                       struct in_addr host_addr, int host_port,
@@ -18,7 +18,11 @@
 #include "qemu/osdep.h"
 #include "slirp.h"
 
-#define MBUF_THRESH 30
+/*
+ * Mbufs kept for reuse.  A burst of segments for the guest can hold
+ * well over a hundred of them at once, more with several busy sockets.
+ */
+#define MBUF_THRESH 256
 
 /*
  * Find a nice value for msize
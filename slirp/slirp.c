@@ -571,6 +571,8 @@ void slirp_pollfds_poll(GArray *pollfds, int select_error)
     curtime = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
 
     QTAILQ_FOREACH(slirp, &slirp_instances, entry) {
+        slirp_output_begin(slirp->opaque);
+
         /*
          * See if anything has timed out
          */
@@ -777,6 +779,7 @@ void slirp_pollfds_poll(GArray *pollfds, int select_error)
         }
 
         if_start(slirp);
+        slirp_output_end(slirp->opaque);
     }
 }
 
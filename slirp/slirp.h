@@ -198,12 +198,14 @@ struct Slirp {
     /* tcp states */
     struct socket tcb;
     struct socket *tcp_last_so;
+    struct sohash tcb_hash[SO_HASH_SIZE];
     tcp_seq tcp_iss;        /* tcp initial send seq # */
     uint32_t tcp_now;       /* for RFC 1323 timestamps */
 
     /* udp states */
     struct socket udb;
     struct socket *udp_last_so;
+    struct sohash udb_hash[SO_HASH_SIZE];
 
     /* icmp states */
     struct socket icmp;
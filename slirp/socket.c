@@ -16,10 +16,51 @@
 static void sofcantrcvmore(struct socket *so);
 static void sofcantsendmore(struct socket *so);
 
+static uint32_t sockaddr_hash(struct sockaddr_storage *a)
+{
+    switch (a->ss_family) {
+    case AF_INET:
+    {
+        struct sockaddr_in *a4 = (struct sockaddr_in *) a;
+        return a4->sin_addr.s_addr ^ a4->sin_port;
+    }
+    case AF_INET6:
+    {
+        struct sockaddr_in6 *a6 = (struct sockaddr_in6 *) a;
+        uint32_t h = a6->sin6_port;
+        int i;
+
+        for (i = 0; i < 16; i += 4) {
+            h ^= ldl_he_p(&a6->sin6_addr.s6_addr[i]);
+        }
+        return h;
+    }
+    default:
+        return 0;
+    }
+}
+
+static void sohash_remove(struct socket *so)
+{
+    if (so->so_hash.le_prev) {
+        QLIST_REMOVE(so, so_hash);
+        so->so_hash.le_prev = NULL;
+    }
+}
+
+/*
+ * The sockets of a list are indexed by address in @hash as they are
+ * looked up.  Their addresses may still change after that, so the
+ * bucket of a socket is only a hint: a miss falls back to walking the
+ * list, which moves the socket to its current bucket.
+ */
 struct socket *solookup(struct socket **last, struct socket *head,
+        struct sohash *hash,
         struct sockaddr_storage *lhost, struct sockaddr_storage *fhost)
 {
     struct socket *so = *last;
+    struct sohash *bucket;
+    uint32_t h;
 
     /* Optimisation */
     if (so != head && sockaddr_equal(&(so->lhost.ss), lhost)
@@ -27,9 +68,25 @@ struct socket *solookup(struct socket **last, struct socket *head,
         return so;
     }
 
+    h = sockaddr_hash(lhost);
+    if (fhost) {
+        h = h * 31 + sockaddr_hash(fhost);
+    }
+    bucket = &hash[(h * 0x9e3779b1) >> (32 - SO_HASH_BITS)];
+
+    QLIST_FOREACH(so, bucket, so_hash) {
+        if (sockaddr_equal(&(so->lhost.ss), lhost)
+                && (!fhost || sockaddr_equal(&so->fhost.ss, fhost))) {
+            *last = so;
+            return so;
+        }
+    }
+
     for (so = head->so_next; so != head; so = so->so_next) {
         if (sockaddr_equal(&(so->lhost.ss), lhost)
                 && (!fhost || sockaddr_equal(&so->fhost.ss, fhost))) {
+            sohash_remove(so);
+            QLIST_INSERT_HEAD(bucket, so, so_hash);
             *last = so;
             return so;
         }
@@ -104,6 +161,7 @@ sofree(struct socket *so)
   }
   m_free(so->so_m);
 
+  sohash_remove(so);
   if(so->so_next && so->so_prev)
     remque(so);  /* crashes if so is not in a queue */
 
@@ -545,12 +603,14 @@ sorecvfrom(struct socket *so)
 	} else {                            	/* A "normal" UDP packet */
 	  struct mbuf *m;
           int len;
+          int batch = 0;
 #ifdef _WIN32
           unsigned long n;
 #else
           int n;
 #endif
 
+        again:
 	  m = m_get(so->slirp);
 	  if (!m) {
 	      return;
@@ -656,6 +716,15 @@ sorecvfrom(struct socket *so)
 	        g_assert_not_reached();
 	        break;
 	    }
+
+            /*
+             * Take whatever else is queued on the socket now rather
+             * than one datagram per poll.
+             */
+            if (++batch < SO_RECV_BATCH &&
+                ioctlsocket(so->s, FIONREAD, &n) == 0 && n > 0) {
+                goto again;
+            }
 	  } /* rx error */
 	} /* if ping packet */
 }
@@ -11,6 +11,12 @@
 #define SO_EXPIRE 240000
 #define SO_EXPIREFAST 10000
 
+#define SO_HASH_BITS 8
+#define SO_HASH_SIZE (1 << SO_HASH_BITS)
+
+/* Datagrams read from one UDP socket per poll, at most */
+#define SO_RECV_BATCH 32
+
 /*
  * Our socket structure
  */
@@ -23,6 +29,7 @@ union slirp_sockaddr {
 
 struct socket {
   struct socket *so_next,*so_prev;      /* For a linked list of sockets */
+  QLIST_ENTRY(socket) so_hash;     /* Lookup hash chain, see solookup() */
 
   int s;                           /* The actual socket */
 
@@ -132,7 +139,9 @@ static inline socklen_t sockaddr_size(struct sockaddr_storage *a)
     }
 }
 
-struct socket *solookup(struct socket **, struct socket *,
+QLIST_HEAD(sohash, socket);
+
+struct socket *solookup(struct socket **, struct socket *, struct sohash *,
         struct sockaddr_storage *, struct sockaddr_storage *);
 struct socket *socreate(Slirp *);
 void sofree(struct socket *);
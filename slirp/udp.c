@@ -163,7 +163,8 @@ udp_input(register struct mbuf *m, int iphlen)
 	/*
 	 * Locate pcb for datagram.
 	 */
-	so = solookup(&slirp->udp_last_so, &slirp->udb, &lhost, NULL);
+        so = solookup(&slirp->udp_last_so, &slirp->udb, slirp->udb_hash,
+                      &lhost, NULL);
 
 	if (so == NULL) {
 	  /*
@@ -45,6 +45,18 @@ void HELPER(crypto_aese)(void *vd, void *vm, uint32_t decrypt)
     rk.l[0] ^= st.l[0];
     rk.l[1] ^= st.l[1];
 
+    if (aes_host_accel) {
+        /* AESE/AESD are AESENCLAST/AESDECLAST with the key added first.  */
+        static const uint64_t zero[2];
+
+        if (decrypt) {
+            aes_host_dec_round(rd, rk.bytes, zero, true);
+        } else {
+            aes_host_enc_round(rd, rk.bytes, zero, true);
+        }
+        return;
+    }
+
     /* combine ShiftRows operation and sbox substitution */
     for (i = 0; i < 16; i++) {
         CR_ST_BYTE(st, i) = sbox[decrypt][CR_ST_BYTE(rk, shift[decrypt][i])];
@@ -197,6 +209,11 @@ void HELPER(crypto_aesmc)(void *vd, void *vm, uint32_t decrypt)
 
     assert(decrypt < 2);
 
+    if (aes_host_accel) {
+        aes_host_mixcolumns(rd, st.bytes, decrypt);
+        return;
+    }
+
     for (i = 0; i < 16; i += 4) {
         CR_ST_WORD(st, i >> 2) =
             mc[decrypt][CR_ST_BYTE(st, i)] ^
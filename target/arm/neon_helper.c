@@ -11,6 +11,7 @@
 #include "cpu.h"
 #include "exec/helper-proto.h"
 #include "fpu/softfloat.h"
+#include "qemu/host-utils.h"
 
 #define SIGNBIT (uint32_t)0x80000000
 #define SIGNBIT64 ((uint64_t)1 << 63)
@@ -2231,26 +2232,15 @@ void HELPER(neon_zip16)(void *vd, void *vm)
  */
 uint64_t HELPER(neon_pmull_64_lo)(uint64_t op1, uint64_t op2)
 {
-    int bitnum;
-    uint64_t res = 0;
+    uint64_t lo, hi;
 
-    for (bitnum = 0; bitnum < 64; bitnum++) {
-        if (op1 & (1ULL << bitnum)) {
-            res ^= op2 << bitnum;
-        }
-    }
-    return res;
+    clmul64(&lo, &hi, op1, op2);
+    return lo;
 }
 uint64_t HELPER(neon_pmull_64_hi)(uint64_t op1, uint64_t op2)
 {
-    int bitnum;
-    uint64_t res = 0;
+    uint64_t lo, hi;
 
-    /* bit 0 of op1 can't influence the high 64 bits at all */
-    for (bitnum = 1; bitnum < 64; bitnum++) {
-        if (op1 & (1ULL << bitnum)) {
-            res ^= op2 >> (64 - bitnum);
-        }
-    }
-    return res;
+    clmul64(&lo, &hi, op1, op2);
+    return hi;
 }
@@ -19,6 +19,7 @@
  */
 
 #include "crypto/aes.h"
+#include "qemu/crc32c.h"
 
 #if SHIFT == 0
 #define Reg MMXReg
@@ -2150,40 +2151,21 @@ void glue(helper_pcmpistrm, SUFFIX)(CPUX86State *env, Reg *d, Reg *s,
     }
 }
 
-#define CRCPOLY        0x1edc6f41
-#define CRCPOLY_BITREV 0x82f63b78
 target_ulong helper_crc32(uint32_t crc1, target_ulong msg, uint32_t len)
 {
-    target_ulong crc = (msg & ((target_ulong) -1 >>
-                               (TARGET_LONG_BITS - len))) ^ crc1;
+    uint8_t buf[8];
 
-    while (len--) {
-        crc = (crc >> 1) ^ ((crc & 1) ? CRCPOLY_BITREV : 0);
-    }
-
-    return crc;
+    stq_le_p(buf, msg);
+    /* crc32c() returns the one's complement, which CRC32 does not.  */
+    return crc32c(crc1, buf, len / 8) ^ 0xffffffff;
 }
 
 void glue(helper_pclmulqdq, SUFFIX)(CPUX86State *env, Reg *d, Reg *s,
                                     uint32_t ctrl)
 {
-    uint64_t ah, al, b, resh, resl;
-
-    ah = 0;
-    al = d->Q((ctrl & 1) != 0);
-    b = s->Q((ctrl & 16) != 0);
-    resh = resl = 0;
-
-    while (b) {
-        if (b & 1) {
-            resl ^= al;
-            resh ^= ah;
-        }
-        ah = (ah << 1) | (al >> 63);
-        al <<= 1;
-        b >>= 1;
-    }
+    uint64_t resh, resl;
 
+    clmul64(&resl, &resh, d->Q((ctrl & 1) != 0), s->Q((ctrl & 16) != 0));
     d->Q(0) = resl;
     d->Q(1) = resh;
 }
@@ -2194,6 +2176,11 @@ void glue(helper_aesdec, SUFFIX)(CPUX86State *env, Reg *d, Reg *s)
     Reg st = *d;
     Reg rk = *s;
 
+    if (aes_host_accel) {
+        aes_host_dec_round(d, d, s, false);
+        return;
+    }
+
     for (i = 0 ; i < 4 ; i++) {
         d->L(i) = rk.L(i) ^ bswap32(AES_Td0[st.B(AES_ishifts[4*i+0])] ^
                                     AES_Td1[st.B(AES_ishifts[4*i+1])] ^
@@ -2208,6 +2195,11 @@ void glue(helper_aesdeclast, SUFFIX)(CPUX86State *env, Reg *d, Reg *s)
     Reg st = *d;
     Reg rk = *s;
 
+    if (aes_host_accel) {
+        aes_host_dec_round(d, d, s, true);
+        return;
+    }
+
     for (i = 0; i < 16; i++) {
         d->B(i) = rk.B(i) ^ (AES_isbox[st.B(AES_ishifts[i])]);
     }
@@ -2219,6 +2211,11 @@ void glue(helper_aesenc, SUFFIX)(CPUX86State *env, Reg *d, Reg *s)
     Reg st = *d;
     Reg rk = *s;
 
+    if (aes_host_accel) {
+        aes_host_enc_round(d, d, s, false);
+        return;
+    }
+
     for (i = 0 ; i < 4 ; i++) {
         d->L(i) = rk.L(i) ^ bswap32(AES_Te0[st.B(AES_shifts[4*i+0])] ^
                                     AES_Te1[st.B(AES_shifts[4*i+1])] ^
@@ -2233,6 +2230,11 @@ void glue(helper_aesenclast, SUFFIX)(CPUX86State *env, Reg *d, Reg *s)
     Reg st = *d;
     Reg rk = *s;
 
+    if (aes_host_accel) {
+        aes_host_enc_round(d, d, s, true);
+        return;
+    }
+
     for (i = 0; i < 16; i++) {
         d->B(i) = rk.B(i) ^ (AES_sbox[st.B(AES_shifts[i])]);
     }
@@ -2244,6 +2246,11 @@ void glue(helper_aesimc, SUFFIX)(CPUX86State *env, Reg *d, Reg *s)
     int i;
     Reg tmp = *s;
 
+    if (aes_host_accel) {
+        aes_host_mixcolumns(d, s, true);
+        return;
+    }
+
     for (i = 0 ; i < 4 ; i++) {
         d->L(i) = bswap32(AES_imc[tmp.B(4*i+0)][0] ^
                           AES_imc[tmp.B(4*i+1)][1] ^
@@ -23,6 +23,7 @@
 #include "disas/disas.h"
 #include "exec/exec-all.h"
 #include "tcg-op.h"
+#include "tcg-op-gvec.h"
 #include "exec/cpu_ldst.h"
 #include "exec/translator.h"
 
@@ -3026,6 +3027,84 @@ static const struct SSEOpHelper_eppi sse_op_table7[256] = {
     [0xdf] = AESNI_OP(aeskeygenassist),
 };
 
+/* Expand the simple integer and logical SSE/MMX operations inline with
+   the generic vector ops instead of calling the out of line helper.
+   Returns false if the operation must still go through sse_op_table1.
+
+   This only covers the two-operand legacy encodings of padd, psub,
+   pmullw, the logical ops and pcmpeq/pcmpgt.  Shifts, min/max, pack,
+   unpack and shuffles, and all floating point ops still use the helpers;
+   the latter need softfloat for rounding and exception flags.  There is
+   no AVX: a VEX prefix is accepted here but vex_v and vex_l are ignored,
+   as the rest of gen_sse does, and TCG does not report AVX in CPUID.  */
+static bool gen_sse_gvec(int b, int is_xmm, int op1_offset, int op2_offset)
+{
+    uint32_t sz = is_xmm ? 16 : 8;
+    TCGCond cond;
+    unsigned vece;
+
+    switch (b) {
+    case 0xfc ... 0xfe: /* padd[bwd] */
+        tcg_gen_gvec_add(b - 0xfc, op1_offset, op1_offset, op2_offset,
+                         sz, sz);
+        return true;
+    case 0xd4: /* paddq */
+        tcg_gen_gvec_add(MO_64, op1_offset, op1_offset, op2_offset, sz, sz);
+        return true;
+    case 0xf8 ... 0xfb: /* psub[bwdq] */
+        tcg_gen_gvec_sub(b - 0xf8, op1_offset, op1_offset, op2_offset,
+                         sz, sz);
+        return true;
+    case 0xd5: /* pmullw */
+        tcg_gen_gvec_mul(MO_16, op1_offset, op1_offset, op2_offset, sz, sz);
+        return true;
+    case 0xec ... 0xed: /* padds[bw] */
+        tcg_gen_gvec_ssadd(b - 0xec, op1_offset, op1_offset, op2_offset,
+                           sz, sz);
+        return true;
+    case 0xdc ... 0xdd: /* paddus[bw] */
+        tcg_gen_gvec_usadd(b - 0xdc, op1_offset, op1_offset, op2_offset,
+                           sz, sz);
+        return true;
+    case 0xe8 ... 0xe9: /* psubs[bw] */
+        tcg_gen_gvec_sssub(b - 0xe8, op1_offset, op1_offset, op2_offset,
+                           sz, sz);
+        return true;
+    case 0xd8 ... 0xd9: /* psubus[bw] */
+        tcg_gen_gvec_ussub(b - 0xd8, op1_offset, op1_offset, op2_offset,
+                           sz, sz);
+        return true;
+    case 0x54: /* andps, andpd */
+    case 0xdb: /* pand */
+        tcg_gen_gvec_and(MO_64, op1_offset, op1_offset, op2_offset, sz, sz);
+        return true;
+    case 0x55: /* andnps, andnpd */
+    case 0xdf: /* pandn */
+        tcg_gen_gvec_andc(MO_64, op1_offset, op2_offset, op1_offset, sz, sz);
+        return true;
+    case 0x56: /* orps, orpd */
+    case 0xeb: /* por */
+        tcg_gen_gvec_or(MO_64, op1_offset, op1_offset, op2_offset, sz, sz);
+        return true;
+    case 0x57: /* xorps, xorpd */
+    case 0xef: /* pxor */
+        tcg_gen_gvec_xor(MO_64, op1_offset, op1_offset, op2_offset, sz, sz);
+        return true;
+    case 0x74 ... 0x76: /* pcmpeq[bwd] */
+        cond = TCG_COND_EQ;
+        vece = b - 0x74;
+        break;
+    case 0x64 ... 0x66: /* pcmpgt[bwd] */
+        cond = TCG_COND_GT;
+        vece = b - 0x64;
+        break;
+    default:
+        return false;
+    }
+    tcg_gen_gvec_cmp(cond, vece, op1_offset, op1_offset, op2_offset, sz, sz);
+    return true;
+}
+
 static void gen_sse(CPUX86State *env, DisasContext *s, int b,
                     target_ulong pc_start, int rex_r)
 {
@@ -4460,6 +4539,9 @@ static void gen_sse(CPUX86State *env, DisasContext *s, int b,
             sse_fn_eppt(cpu_env, s->ptr0, s->ptr1, s->A0);
             break;
         default:
+            if (gen_sse_gvec(b, is_xmm, op1_offset, op2_offset)) {
+                break;
+            }
             tcg_gen_addi_ptr(s->ptr0, cpu_env, op1_offset);
             tcg_gen_addi_ptr(s->ptr1, cpu_env, op2_offset);
             sse_fn_epp(cpu_env, s->ptr0, s->ptr1);
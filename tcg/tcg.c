@@ -160,10 +160,17 @@ struct tcg_region_state {
     size_t stride; /* .size + guard size */
 
     /* fields protected by the lock */
-    size_t current; /* current region index */
+    uint64_t *seq; /* per-region allocation sequence number; 0 if free */
+    uint64_t next_seq; /* last sequence number handed out */
     size_t agg_size_full; /* aggregate size of full regions */
 };
 
+/*
+ * When the code buffer fills up, evict this fraction of the regions
+ * (at least one) instead of flushing all translations.
+ */
+#define TCG_REGION_EVICT_DIV 4
+
 static struct tcg_region_state region;
 /*
  * This is an array of struct tcg_region_tree's, with padding.
@@ -373,29 +380,37 @@ static void tcg_region_trees_init(void)
     }
 }
 
-static struct tcg_region_tree *tc_ptr_to_region_tree(void *p)
+static size_t tc_ptr_to_region_idx(const void *p)
 {
-    size_t region_idx;
+    ptrdiff_t offset;
 
     if (p < region.start_aligned) {
-        region_idx = 0;
-    } else {
-        ptrdiff_t offset = p - region.start_aligned;
-
-        if (offset > region.stride * (region.n - 1)) {
-            region_idx = region.n - 1;
-        } else {
-            region_idx = offset / region.stride;
-        }
+        return 0;
     }
-    return region_trees + region_idx * tree_size;
+    offset = p - region.start_aligned;
+    if (offset > region.stride * (region.n - 1)) {
+        return region.n - 1;
+    }
+    return offset / region.stride;
+}
+
+static struct tcg_region_tree *tc_ptr_to_region_tree(void *p)
+{
+    return region_trees + tc_ptr_to_region_idx(p) * tree_size;
 }
 
 void tcg_tb_insert(TranslationBlock *tb)
 {
     struct tcg_region_tree *rt = tc_ptr_to_region_tree(tb->tc.ptr);
+#ifdef CONFIG_PROFILER
+    TCGProfile *prof = &tcg_ctx->prof;
+    int64_t ti = profile_getclock();
+#endif
 
     qemu_mutex_lock(&rt->lock);
+#ifdef CONFIG_PROFILER
+    atomic_set(&prof->lock_time, prof->lock_time + profile_getclock() - ti);
+#endif
     g_tree_insert(rt->tree, &tb->tc, tb);
     qemu_mutex_unlock(&rt->lock);
 }
@@ -523,12 +538,16 @@ static void tcg_region_assign(TCGContext *s, size_t curr_region)
 
 static bool tcg_region_alloc__locked(TCGContext *s)
 {
-    if (region.current == region.n) {
-        return true;
+    size_t i;
+
+    for (i = 0; i < region.n; i++) {
+        if (region.seq[i] == 0) {
+            tcg_region_assign(s, i);
+            region.seq[i] = ++region.next_seq;
+            return false;
+        }
     }
-    tcg_region_assign(s, region.current);
-    region.current++;
-    return false;
+    return true;
 }
 
 /*
@@ -540,8 +559,15 @@ static bool tcg_region_alloc(TCGContext *s)
     bool err;
     /* read the region size now; alloc__locked will overwrite it on success */
     size_t size_full = s->code_gen_buffer_size;
+#ifdef CONFIG_PROFILER
+    TCGProfile *prof = &s->prof;
+    int64_t ti = profile_getclock();
+#endif
 
     qemu_mutex_lock(&region.lock);
+#ifdef CONFIG_PROFILER
+    atomic_set(&prof->lock_time, prof->lock_time + profile_getclock() - ti);
+#endif
     err = tcg_region_alloc__locked(s);
     if (!err) {
         region.agg_size_full += size_full - TCG_HIGHWATER;
@@ -566,7 +592,8 @@ void tcg_region_reset_all(void)
     unsigned int i;
 
     qemu_mutex_lock(&region.lock);
-    region.current = 0;
+    memset(region.seq, 0, region.n * sizeof(*region.seq));
+    region.next_seq = 0;
     region.agg_size_full = 0;
 
     for (i = 0; i < n_ctxs; i++) {
@@ -580,6 +607,68 @@ void tcg_region_reset_all(void)
     tcg_region_tree_reset_all();
 }
 
+/*
+ * Evict the oldest regions that are not currently assigned to a TCG
+ * context, so that their space can be reused without flushing the whole
+ * code buffer.  @func is called on every TB of an evicted region and must
+ * make sure the TB cannot be reached anymore.
+ * Returns the number of regions evicted; zero if there was no candidate.
+ * Call from a safe-work context.
+ */
+size_t tcg_region_evict(GTraverseFunc func, gpointer user_data)
+{
+    unsigned int n_ctxs = atomic_read(&n_tcg_ctxs);
+    size_t n_evict = MAX(region.n / TCG_REGION_EVICT_DIV, 1);
+    size_t evicted = 0;
+    unsigned long *busy;
+    unsigned int i;
+
+    busy = bitmap_new(region.n);
+
+    qemu_mutex_lock(&region.lock);
+    for (i = 0; i < n_ctxs; i++) {
+        const TCGContext *s = atomic_read(&tcg_ctxs[i]);
+
+        set_bit(tc_ptr_to_region_idx(s->code_gen_buffer), busy);
+    }
+
+    while (evicted < n_evict) {
+        struct tcg_region_tree *rt;
+        size_t j, victim = region.n;
+        void *start, *end;
+
+        for (j = 0; j < region.n; j++) {
+            if (region.seq[j] == 0 || test_bit(j, busy)) {
+                continue;
+            }
+            if (victim == region.n || region.seq[j] < region.seq[victim]) {
+                victim = j;
+            }
+        }
+        if (victim == region.n) {
+            break;
+        }
+
+        rt = region_trees + victim * tree_size;
+        qemu_mutex_lock(&rt->lock);
+        g_tree_foreach(rt->tree, func, user_data);
+        /* Increment the refcount first so that destroy acts as a reset */
+        g_tree_ref(rt->tree);
+        g_tree_destroy(rt->tree);
+        qemu_mutex_unlock(&rt->lock);
+
+        /* an unassigned region in use was accounted as full */
+        tcg_region_bounds(victim, &start, &end);
+        region.agg_size_full -= end - start - TCG_HIGHWATER;
+        region.seq[victim] = 0;
+        evicted++;
+    }
+    qemu_mutex_unlock(&region.lock);
+
+    g_free(busy);
+    return evicted;
+}
+
 #ifdef CONFIG_USER_ONLY
 static size_t tcg_n_regions(void)
 {
@@ -591,30 +680,30 @@ static size_t tcg_n_regions(void)
  * first try to set more regions than max_cpus, with those regions being of
  * reasonable size. If that's not possible we make do by evenly dividing
  * the code_gen_buffer among the vCPUs.
+ *
+ * Having several regions per thread also lets us evict the oldest regions
+ * once the buffer is full, instead of flushing everything; so even with a
+ * single vCPU thread we split the buffer if it is large enough.
  */
 static size_t tcg_n_regions(void)
 {
+    size_t n_threads = qemu_tcg_mttcg_enabled() ? max_cpus : 1;
     size_t i;
 
-    /* Use a single region if all we have is one vCPU thread */
-    if (max_cpus == 1 || !qemu_tcg_mttcg_enabled()) {
-        return 1;
-    }
-
-    /* Try to have more regions than max_cpus, with each region being >= 2 MB */
+    /* Try to have more regions than threads, with each region being >= 2 MB */
     for (i = 8; i > 0; i--) {
         size_t regions_per_thread = i;
         size_t region_size;
 
         region_size = tcg_init_ctx.code_gen_buffer_size;
-        region_size /= max_cpus * regions_per_thread;
+        region_size /= n_threads * regions_per_thread;
 
         if (region_size >= 2 * 1024u * 1024) {
-            return max_cpus * regions_per_thread;
+            return n_threads * regions_per_thread;
         }
     }
     /* If we can't, then just allocate one region per vCPU thread */
-    return max_cpus;
+    return n_threads;
 }
 #endif
 
@@ -629,7 +718,8 @@ static size_t tcg_n_regions(void)
  * code in parallel without synchronization.
  *
  * In softmmu the number of TCG threads is bounded by max_cpus, so we use at
- * least max_cpus regions in MTTCG. In !MTTCG we use a single region.
+ * least max_cpus regions in MTTCG. In !MTTCG we may still use more than one
+ * region, so that the oldest ones can be evicted; see tcg_n_regions().
  * Note that the TCG options from the command-line (i.e. -accel accel=tcg,[...])
  * must have been parsed before calling this function, since it calls
  * qemu_tcg_mttcg_enabled().
@@ -683,6 +773,7 @@ void tcg_region_init(void)
     region.end = QEMU_ALIGN_PTR_DOWN(buf + size, page_size);
     /* account for that last guard page */
     region.end -= page_size;
+    region.seq = g_new0(uint64_t, region.n);
 
     /* set guard pages */
     for (i = 0; i < region.n; i++) {
@@ -814,6 +905,35 @@ size_t tcg_tb_phys_invalidate_count(void)
     return total;
 }
 
+size_t tcg_tb_discard_count(void)
+{
+    unsigned int n_ctxs = atomic_read(&n_tcg_ctxs);
+    unsigned int i;
+    size_t total = 0;
+
+    for (i = 0; i < n_ctxs; i++) {
+        const TCGContext *s = atomic_read(&tcg_ctxs[i]);
+
+        total += atomic_read(&s->tb_discard_count);
+    }
+    return total;
+}
+
+void tcg_smc_counts(size_t *writes, size_t *hits, size_t *data_pages)
+{
+    unsigned int n_ctxs = atomic_read(&n_tcg_ctxs);
+    unsigned int i;
+
+    *writes = *hits = *data_pages = 0;
+    for (i = 0; i < n_ctxs; i++) {
+        const TCGContext *s = atomic_read(&tcg_ctxs[i]);
+
+        *writes += atomic_read(&s->smc_write_count);
+        *hits += atomic_read(&s->smc_hit_count);
+        *data_pages += atomic_read(&s->smc_data_page_count);
+    }
+}
+
 /* pool based memory allocation */
 void *tcg_malloc_internal(TCGContext *s, int size)
 {
@@ -2044,6 +2164,14 @@ void tcg_dump_ops(TCGContext *s)
                 }
             }
         }
+        if (op->output_pref[0] | op->output_pref[1]) {
+            for (; col < 48; ++col) {
+                putc(' ', qemu_logfile);
+            }
+            qemu_log("  pref=0x%" PRIx64 ",0x%" PRIx64,
+                     (uint64_t)op->output_pref[0],
+                     (uint64_t)op->output_pref[1]);
+        }
         qemu_log("\n");
     }
 }
@@ -2225,6 +2353,20 @@ TCGOp *tcg_op_insert_after(TCGContext *s, TCGOp *old_op,
 #define IS_DEAD_ARG(n)   (arg_life & (DEAD_ARG << (n)))
 #define NEED_SYNC_ARG(n) (arg_life & (SYNC_ARG << (n)))
 
+/* During liveness, state_ptr points to the register preference set
+   of the temp, i.e. the registers in which its next use wants it.  */
+static inline TCGRegSet *la_temp_pref(TCGTemp *ts)
+{
+    return ts->state_ptr;
+}
+
+/* Reset the register preference of a temp according to its liveness.  */
+static inline void la_reset_pref(TCGTemp *ts)
+{
+    *la_temp_pref(ts)
+        = (ts->state == TS_DEAD ? 0 : tcg_target_available_regs[ts->type]);
+}
+
 /* liveness analysis: end of function: all temps are dead, and globals
    should be in memory. */
 static void tcg_la_func_end(TCGContext *s)
@@ -2235,9 +2377,11 @@ static void tcg_la_func_end(TCGContext *s)
 
     for (i = 0; i < ng; ++i) {
         s->temps[i].state = TS_DEAD | TS_MEM;
+        la_reset_pref(&s->temps[i]);
     }
     for (i = ng; i < nt; ++i) {
         s->temps[i].state = TS_DEAD;
+        la_reset_pref(&s->temps[i]);
     }
 }
 
@@ -2257,20 +2401,72 @@ static void tcg_la_bb_end(TCGContext *s)
                              ? TS_DEAD | TS_MEM
                              : TS_DEAD);
     }
+    for (i = 0; i < nt; ++i) {
+        la_reset_pref(&s->temps[i]);
+    }
+}
+
+/* liveness analysis: globals are written by a helper: they are dead
+   before the call and their register preference no longer matters. */
+static void tcg_la_global_kill(TCGContext *s)
+{
+    int i;
+
+    for (i = 0; i < s->nb_globals; i++) {
+        s->temps[i].state = TS_DEAD | TS_MEM;
+        la_reset_pref(&s->temps[i]);
+    }
+}
+
+/* liveness analysis: a live temp that crosses a helper call should
+   prefer a call-saved register, so that it need not be spilled.  */
+static void tcg_la_cross_call(TCGContext *s)
+{
+    TCGRegSet mask = ~tcg_target_call_clobber_regs;
+    int i;
+
+    for (i = 0; i < s->nb_temps; i++) {
+        TCGTemp *ts = &s->temps[i];
+
+        if (!(ts->state & TS_DEAD)) {
+            TCGRegSet *pset = la_temp_pref(ts);
+            TCGRegSet set = *pset;
+
+            set &= mask;
+            /* If the combination is not possible, restart.  */
+            if (set == 0) {
+                set = tcg_target_available_regs[ts->type] & mask;
+            }
+            if (set == 0) {
+                set = tcg_target_available_regs[ts->type];
+            }
+            *pset = set;
+        }
+    }
 }
 
 /* Liveness analysis : update the opc_arg_life array to tell if a
    given input arguments is dead. Instructions updating dead
-   temporaries are removed. */
+   temporaries are removed.  Along the way, compute for each output
+   the set of registers preferred by its next use, which the register
+   allocator uses as a hint.  */
 static void liveness_pass_1(TCGContext *s)
 {
     int nb_globals = s->nb_globals;
+    int nb_temps = s->nb_temps;
     TCGOp *op, *op_prev;
+    TCGRegSet *prefs;
+    int i;
+
+    prefs = tcg_malloc(sizeof(TCGRegSet) * nb_temps);
+    for (i = 0; i < nb_temps; ++i) {
+        s->temps[i].state_ptr = prefs + i;
+    }
 
     tcg_la_func_end(s);
 
     QTAILQ_FOREACH_REVERSE_SAFE(op, &s->ops, TCGOpHead, link, op_prev) {
-        int i, nb_iargs, nb_oargs;
+        int nb_iargs, nb_oargs;
         TCGOpcode opc_new, opc_new2;
         bool have_opc_new2;
         TCGLifeData arg_life = 0;
@@ -2282,6 +2478,7 @@ static void liveness_pass_1(TCGContext *s)
         case INDEX_op_call:
             {
                 int call_flags;
+                int nb_call_regs;
 
                 nb_oargs = TCGOP_CALLO(op);
                 nb_iargs = TCGOP_CALLI(op);
@@ -2308,15 +2505,19 @@ static void liveness_pass_1(TCGContext *s)
                         if (arg_ts->state & TS_MEM) {
                             arg_life |= SYNC_ARG << i;
                         }
+                        op->output_pref[i] = *la_temp_pref(arg_ts);
                         arg_ts->state = TS_DEAD;
+                        *la_temp_pref(arg_ts) = 0;
                     }
 
+                    /* temps that are live across the call should
+                       avoid the call-clobbered registers */
+                    tcg_la_cross_call(s);
+
                     if (!(call_flags & (TCG_CALL_NO_WRITE_GLOBALS |
                                         TCG_CALL_NO_READ_GLOBALS))) {
                         /* globals should go back to memory */
-                        for (i = 0; i < nb_globals; i++) {
-                            s->temps[i].state = TS_DEAD | TS_MEM;
-                        }
+                        tcg_la_global_kill(s);
                     } else if (!(call_flags & TCG_CALL_NO_READ_GLOBALS)) {
                         /* globals should be synced to memory */
                         for (i = 0; i < nb_globals; i++) {
@@ -2331,13 +2532,26 @@ static void liveness_pass_1(TCGContext *s)
                             arg_life |= DEAD_ARG << i;
                         }
                     }
-                    /* input arguments are live for preceding opcodes */
-                    for (i = nb_oargs; i < nb_iargs + nb_oargs; i++) {
-                        arg_ts = arg_temp(op->args[i]);
-                        if (arg_ts) {
+                    /* input arguments are live for preceding opcodes;
+                       those passed in registers prefer their argument
+                       register, the others any register of the type */
+                    nb_call_regs = ARRAY_SIZE(tcg_target_call_iarg_regs);
+                    for (i = 0; i < nb_iargs; i++) {
+                        arg_ts = arg_temp(op->args[nb_oargs + i]);
+                        if (arg_ts && arg_ts->state & TS_DEAD) {
+                            *la_temp_pref(arg_ts)
+                                = (i < nb_call_regs ? 0 :
+                                   tcg_target_available_regs[arg_ts->type]);
                             arg_ts->state &= ~TS_DEAD;
                         }
                     }
+                    for (i = 0; i < MIN(nb_call_regs, nb_iargs); i++) {
+                        arg_ts = arg_temp(op->args[nb_oargs + i]);
+                        if (arg_ts) {
+                            tcg_regset_set_reg(*la_temp_pref(arg_ts),
+                                               tcg_target_call_iarg_regs[i]);
+                        }
+                    }
                 }
             }
             break;
@@ -2345,7 +2559,9 @@ static void liveness_pass_1(TCGContext *s)
             break;
         case INDEX_op_discard:
             /* mark the temporary as dead */
-            arg_temp(op->args[0])->state = TS_DEAD;
+            arg_ts = arg_temp(op->args[0]);
+            arg_ts->state = TS_DEAD;
+            *la_temp_pref(arg_ts) = 0;
             break;
 
         case INDEX_op_add2_i32:
@@ -2453,7 +2669,9 @@ static void liveness_pass_1(TCGContext *s)
                     if (arg_ts->state & TS_MEM) {
                         arg_life |= SYNC_ARG << i;
                     }
+                    op->output_pref[i] = *la_temp_pref(arg_ts);
                     arg_ts->state = TS_DEAD;
+                    *la_temp_pref(arg_ts) = 0;
                 }
 
                 /* if end of basic block, update */
@@ -2473,9 +2691,55 @@ static void liveness_pass_1(TCGContext *s)
                         arg_life |= DEAD_ARG << i;
                     }
                 }
-                /* input arguments are live for preceding opcodes */
+                /* input arguments are live for preceding opcodes; for
+                   those that were dead, initially allow all registers
+                   of the type */
                 for (i = nb_oargs; i < nb_oargs + nb_iargs; i++) {
-                    arg_temp(op->args[i])->state &= ~TS_DEAD;
+                    arg_ts = arg_temp(op->args[i]);
+                    if (arg_ts->state & TS_DEAD) {
+                        *la_temp_pref(arg_ts)
+                            = tcg_target_available_regs[arg_ts->type];
+                        arg_ts->state &= ~TS_DEAD;
+                    }
+                }
+
+                /* incorporate the constraints of this opcode, which
+                   may have been simplified above */
+                def = &tcg_op_defs[opc];
+                switch (opc) {
+                case INDEX_op_mov_i32:
+                case INDEX_op_mov_i64:
+                case INDEX_op_mov_vec:
+                    /* These are TCG_OPF_NOT_PRESENT and have no proper
+                       constraints.  If the source dies, the move will be
+                       suppressed, so propagate the output preference.  */
+                    if (IS_DEAD_ARG(1) && op->output_pref[0]) {
+                        *la_temp_pref(arg_temp(op->args[1]))
+                            = op->output_pref[0];
+                    }
+                    break;
+
+                default:
+                    if (def->flags & TCG_OPF_NOT_PRESENT) {
+                        break;
+                    }
+                    for (i = nb_oargs; i < nb_oargs + nb_iargs; i++) {
+                        const TCGArgConstraint *ct = &def->args_ct[i];
+                        TCGRegSet set, *pset;
+
+                        arg_ts = arg_temp(op->args[i]);
+                        pset = la_temp_pref(arg_ts);
+                        set = *pset & ct->u.regs;
+                        if (ct->ct & TCG_CT_IALIAS) {
+                            set &= op->output_pref[ct->alias_index];
+                        }
+                        /* If the combination is not possible, restart.  */
+                        if (set == 0) {
+                            set = ct->u.regs;
+                        }
+                        *pset = set;
+                    }
+                    break;
                 }
             }
             break;
@@ -2727,7 +2991,8 @@ static void temp_allocate_frame(TCGContext *s, TCGTemp *ts)
     s->current_frame_offset += sizeof(tcg_target_long);
 }
 
-static void temp_load(TCGContext *, TCGTemp *, TCGRegSet, TCGRegSet);
+static void temp_load(TCGContext *, TCGTemp *, TCGRegSet, TCGRegSet,
+                      TCGRegSet);
 
 /* Mark a temporary as free or dead.  If 'free_or_dead' is negative,
    mark it free; otherwise mark it dead.  */
@@ -2776,7 +3041,7 @@ static void temp_sync(TCGContext *s, TCGTemp *ts,
                 break;
             }
             temp_load(s, ts, tcg_target_available_regs[ts->type],
-                      allocated_regs);
+                      allocated_regs, 0);
             /* fallthrough */
 
         case TEMP_VAL_REG:
@@ -2803,35 +3068,57 @@ static void tcg_reg_free(TCGContext *s, TCGReg reg, TCGRegSet allocated_regs)
 {
     TCGTemp *ts = s->reg_to_temp[reg];
     if (ts != NULL) {
+#ifdef CONFIG_PROFILER
+        if (!ts->mem_coherent && !ts->fixed_reg) {
+            atomic_set(&s->prof.spill_count, s->prof.spill_count + 1);
+        }
+#endif
         temp_sync(s, ts, allocated_regs, -1);
     }
 }
 
-/* Allocate a register belonging to reg1 & ~reg2 */
-static TCGReg tcg_reg_alloc(TCGContext *s, TCGRegSet desired_regs,
-                            TCGRegSet allocated_regs, bool rev)
+/* Allocate a register belonging to required & ~allocated, picking one
+   of the preferred registers if that is possible without a spill.  */
+static TCGReg tcg_reg_alloc(TCGContext *s, TCGRegSet required_regs,
+                            TCGRegSet allocated_regs,
+                            TCGRegSet preferred_regs, bool rev)
 {
-    int i, n = ARRAY_SIZE(tcg_target_reg_alloc_order);
+    int i, j, f, n = ARRAY_SIZE(tcg_target_reg_alloc_order);
     const int *order;
     TCGReg reg;
-    TCGRegSet reg_ct;
+    TCGRegSet reg_ct[2];
+
+    reg_ct[1] = required_regs & ~allocated_regs;
+    tcg_debug_assert(reg_ct[1] != 0);
+    reg_ct[0] = reg_ct[1] & preferred_regs;
+
+    /* Skip the preferred set if it is empty or equal to the required set.  */
+    f = reg_ct[0] == 0 || reg_ct[0] == reg_ct[1];
 
-    reg_ct = desired_regs & ~allocated_regs;
     order = rev ? indirect_reg_alloc_order : tcg_target_reg_alloc_order;
 
-    /* first try free registers */
-    for(i = 0; i < n; i++) {
-        reg = order[i];
-        if (tcg_regset_test_reg(reg_ct, reg) && s->reg_to_temp[reg] == NULL)
-            return reg;
+    /* first try free registers, preferred ones first */
+    for (j = f; j < 2; j++) {
+        TCGRegSet set = reg_ct[j];
+
+        for (i = 0; i < n; i++) {
+            reg = order[i];
+            if (tcg_regset_test_reg(set, reg) && s->reg_to_temp[reg] == NULL) {
+                return reg;
+            }
+        }
     }
 
     /* XXX: do better spill choice */
-    for(i = 0; i < n; i++) {
-        reg = order[i];
-        if (tcg_regset_test_reg(reg_ct, reg)) {
-            tcg_reg_free(s, reg, allocated_regs);
-            return reg;
+    for (j = f; j < 2; j++) {
+        TCGRegSet set = reg_ct[j];
+
+        for (i = 0; i < n; i++) {
+            reg = order[i];
+            if (tcg_regset_test_reg(set, reg)) {
+                tcg_reg_free(s, reg, allocated_regs);
+                return reg;
+            }
         }
     }
 
@@ -2839,9 +3126,9 @@ static TCGReg tcg_reg_alloc(TCGContext *s, TCGRegSet desired_regs,
 }
 
 /* Make sure the temporary is in a register.  If needed, allocate the register
-   from DESIRED while avoiding ALLOCATED.  */
+   from DESIRED while avoiding ALLOCATED, preferably from PREFERRED.  */
 static void temp_load(TCGContext *s, TCGTemp *ts, TCGRegSet desired_regs,
-                      TCGRegSet allocated_regs)
+                      TCGRegSet allocated_regs, TCGRegSet preferred_regs)
 {
     TCGReg reg;
 
@@ -2849,12 +3136,14 @@ static void temp_load(TCGContext *s, TCGTemp *ts, TCGRegSet desired_regs,
     case TEMP_VAL_REG:
         return;
     case TEMP_VAL_CONST:
-        reg = tcg_reg_alloc(s, desired_regs, allocated_regs, ts->indirect_base);
+        reg = tcg_reg_alloc(s, desired_regs, allocated_regs,
+                            preferred_regs, ts->indirect_base);
         tcg_out_movi(s, ts->type, reg, ts->val);
         ts->mem_coherent = 0;
         break;
     case TEMP_VAL_MEM:
-        reg = tcg_reg_alloc(s, desired_regs, allocated_regs, ts->indirect_base);
+        reg = tcg_reg_alloc(s, desired_regs, allocated_regs,
+                            preferred_regs, ts->indirect_base);
         tcg_out_ld(s, ts->type, reg, ts->mem_base->reg, ts->mem_offset);
         ts->mem_coherent = 1;
         break;
@@ -2957,11 +3246,12 @@ static void tcg_reg_alloc_movi(TCGContext *s, const TCGOp *op)
 static void tcg_reg_alloc_mov(TCGContext *s, const TCGOp *op)
 {
     const TCGLifeData arg_life = op->life;
-    TCGRegSet allocated_regs;
+    TCGRegSet allocated_regs, preferred_regs;
     TCGTemp *ts, *ots;
     TCGType otype, itype;
 
     allocated_regs = s->reserved_regs;
+    preferred_regs = op->output_pref[0];
     ots = arg_temp(op->args[0]);
     ts = arg_temp(op->args[1]);
 
@@ -2982,9 +3272,12 @@ static void tcg_reg_alloc_mov(TCGContext *s, const TCGOp *op)
     /* If the source value is in memory we're going to be forced
        to have it in a register in order to perform the copy.  Copy
        the SOURCE value into its own register first, that way we
-       don't have to reload SOURCE the next time it is used. */
+       don't have to reload SOURCE the next time it is used.  If the
+       source dies, the move is suppressed and the register becomes
+       the output's, so honor the output preference.  */
     if (ts->val_type == TEMP_VAL_MEM) {
-        temp_load(s, ts, tcg_target_available_regs[itype], allocated_regs);
+        temp_load(s, ts, tcg_target_available_regs[itype], allocated_regs,
+                  IS_DEAD_ARG(1) ? preferred_regs : 0);
     }
 
     tcg_debug_assert(ts->val_type == TEMP_VAL_REG);
@@ -3014,7 +3307,8 @@ static void tcg_reg_alloc_mov(TCGContext *s, const TCGOp *op)
                    input one. */
                 tcg_regset_set_reg(allocated_regs, ts->reg);
                 ots->reg = tcg_reg_alloc(s, tcg_target_available_regs[otype],
-                                         allocated_regs, ots->indirect_base);
+                                         allocated_regs, preferred_regs,
+                                         ots->indirect_base);
             }
             tcg_out_mov(s, otype, ots->reg, ts->reg);
         }
@@ -3054,6 +3348,8 @@ static void tcg_reg_alloc_op(TCGContext *s, const TCGOp *op)
 
     /* satisfy input constraints */ 
     for (k = 0; k < nb_iargs; k++) {
+        TCGRegSet i_preferred_regs, o_preferred_regs;
+
         i = def->sorted_args[nb_oargs + k];
         arg = op->args[i];
         arg_ct = &def->args_ct[i];
@@ -3067,7 +3363,17 @@ static void tcg_reg_alloc_op(TCGContext *s, const TCGOp *op)
             goto iarg_end;
         }
 
-        temp_load(s, ts, arg_ct->u.regs, i_allocated_regs);
+        /* an input aliased to a dying output should land where the
+           output is wanted next */
+        i_preferred_regs = o_preferred_regs = 0;
+        if (arg_ct->ct & TCG_CT_IALIAS) {
+            o_preferred_regs = op->output_pref[arg_ct->alias_index];
+            if (IS_DEAD_ARG(i) && !ts->fixed_reg) {
+                i_preferred_regs = o_preferred_regs;
+            }
+        }
+
+        temp_load(s, ts, arg_ct->u.regs, i_allocated_regs, i_preferred_regs);
 
         if (arg_ct->ct & TCG_CT_IALIAS) {
             if (ts->fixed_reg) {
@@ -3102,7 +3408,7 @@ static void tcg_reg_alloc_op(TCGContext *s, const TCGOp *op)
             /* allocate a new register matching the constraint 
                and move the temporary register into it */
             reg = tcg_reg_alloc(s, arg_ct->u.regs, i_allocated_regs,
-                                ts->indirect_base);
+                                o_preferred_regs, ts->indirect_base);
             tcg_out_mov(s, ts->type, reg, ts->reg);
         }
         new_args[i] = reg;
@@ -3147,7 +3453,7 @@ static void tcg_reg_alloc_op(TCGContext *s, const TCGOp *op)
             } else if (arg_ct->ct & TCG_CT_NEWREG) {
                 reg = tcg_reg_alloc(s, arg_ct->u.regs,
                                     i_allocated_regs | o_allocated_regs,
-                                    ts->indirect_base);
+                                    op->output_pref[i], ts->indirect_base);
             } else {
                 /* if fixed register, we try to use it */
                 reg = ts->reg;
@@ -3156,7 +3462,7 @@ static void tcg_reg_alloc_op(TCGContext *s, const TCGOp *op)
                     goto oarg_end;
                 }
                 reg = tcg_reg_alloc(s, arg_ct->u.regs, o_allocated_regs,
-                                    ts->indirect_base);
+                                    op->output_pref[i], ts->indirect_base);
             }
             tcg_regset_set_reg(o_allocated_regs, reg);
             /* if a fixed register is used, then a move will be done afterwards */
@@ -3248,7 +3554,7 @@ static void tcg_reg_alloc_call(TCGContext *s, TCGOp *op)
         if (arg != TCG_CALL_DUMMY_ARG) {
             ts = arg_temp(arg);
             temp_load(s, ts, tcg_target_available_regs[ts->type],
-                      s->reserved_regs);
+                      s->reserved_regs, 0);
             tcg_out_st(s, ts->type, ts->reg, TCG_REG_CALL_STACK, stack_offset);
         }
 #ifndef TCG_TARGET_STACK_GROWSUP
@@ -3273,7 +3579,7 @@ static void tcg_reg_alloc_call(TCGContext *s, TCGOp *op)
                 TCGRegSet arg_set = 0;
 
                 tcg_regset_set_reg(arg_set, reg);
-                temp_load(s, ts, arg_set, allocated_regs);
+                temp_load(s, ts, arg_set, allocated_regs, 0);
             }
 
             tcg_regset_set_reg(allocated_regs, reg);
@@ -3373,10 +3679,12 @@ void tcg_profile_snapshot(TCGProfile *prof, bool counters, bool table)
             PROF_ADD(prof, orig, code_in_len);
             PROF_ADD(prof, orig, code_out_len);
             PROF_ADD(prof, orig, search_out_len);
+            PROF_ADD(prof, orig, spill_count);
             PROF_ADD(prof, orig, interm_time);
             PROF_ADD(prof, orig, code_time);
             PROF_ADD(prof, orig, la_time);
             PROF_ADD(prof, orig, opt_time);
+            PROF_ADD(prof, orig, lock_time);
             PROF_ADD(prof, orig, restore_count);
             PROF_ADD(prof, orig, restore_time);
         }
@@ -3661,6 +3969,8 @@ void tcg_dump_info(FILE *f, fprintf_function cpu_fprintf)
                 (double)s->code_out_len / tb_div_count);
     cpu_fprintf(f, "avg search data/TB  %0.1f\n",
                 (double)s->search_out_len / tb_div_count);
+    cpu_fprintf(f, "avg reg spills/TB   %0.2f\n",
+                (double)s->spill_count / tb_div_count);
     
     cpu_fprintf(f, "cycles/op           %0.1f\n", 
                 s->op_count ? (double)tot / s->op_count : 0);
@@ -3682,6 +3992,8 @@ void tcg_dump_info(FILE *f, fprintf_function cpu_fprintf)
                 * 100.0);
     cpu_fprintf(f, "liveness/code time  %0.1f%%\n", 
                 (double)s->la_time / (s->code_time ? s->code_time : 1) * 100.0);
+    cpu_fprintf(f, "lock wait/JIT time  %0.1f%%\n",
+                (double)s->lock_time / tot * 100.0);
     cpu_fprintf(f, "cpu_restore count   %" PRId64 "\n",
                 s->restore_count);
     cpu_fprintf(f, "  avg cycles        %0.1f\n",
@@ -613,6 +613,10 @@ typedef struct TCGOp {
     /* Lifetime data of the operands.  */
     unsigned life   : 16;       /* 32 */
 
+    /* Register preferences for the output(s), as computed by liveness
+       from the uses of the output temps.  Zero means no preference.  */
+    TCGRegSet output_pref[2];
+
     /* Next and previous opcodes.  */
     QTAILQ_ENTRY(TCGOp) link;
 
@@ -641,10 +645,12 @@ typedef struct TCGProfile {
     int64_t code_in_len;
     int64_t code_out_len;
     int64_t search_out_len;
+    int64_t spill_count;
     int64_t interm_time;
     int64_t code_time;
     int64_t la_time;
     int64_t opt_time;
+    int64_t lock_time; /* waiting for shared locks while translating */
     int64_t restore_count;
     int64_t restore_time;
     int64_t table_op_count[NB_OPS];
@@ -698,6 +704,14 @@ struct TCGContext {
     void *code_gen_highwater;
 
     size_t tb_phys_invalidate_count;
+    /* TBs discarded because another thread translated them first */
+    size_t tb_discard_count;
+
+    /* Self-modifying code: writes to pages holding TBs, writes that hit
+       translated code, and pages given up on as data pages */
+    size_t smc_write_count;
+    size_t smc_hit_count;
+    size_t smc_data_page_count;
 
     /* Track which vCPU triggers events */
     CPUState *cpu;                      /* *_trans */
@@ -868,6 +882,7 @@ TranslationBlock *tcg_tb_alloc(TCGContext *s);
 
 void tcg_region_init(void);
 void tcg_region_reset_all(void);
+size_t tcg_region_evict(GTraverseFunc func, gpointer user_data);
 
 size_t tcg_code_size(void);
 size_t tcg_code_capacity(void);
@@ -875,6 +890,8 @@ size_t tcg_code_capacity(void);
 void tcg_tb_insert(TranslationBlock *tb);
 void tcg_tb_remove(TranslationBlock *tb);
 size_t tcg_tb_phys_invalidate_count(void);
+size_t tcg_tb_discard_count(void);
+void tcg_smc_counts(size_t *writes, size_t *hits, size_t *data_pages);
 TranslationBlock *tcg_tb_lookup(uintptr_t tc_ptr);
 void tcg_tb_foreach(GTraverseFunc func, gpointer user_data);
 size_t tcg_nb_tbs(void);
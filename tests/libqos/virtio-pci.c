@@ -125,19 +125,19 @@ static uint64_t qvirtio_pci_config_readq(QVirtioDevice *d, uint64_t off)
     return val;
 }
 
-static uint32_t qvirtio_pci_get_features(QVirtioDevice *d)
+static uint64_t qvirtio_pci_get_features(QVirtioDevice *d)
 {
     QVirtioPCIDevice *dev = (QVirtioPCIDevice *)d;
     return qpci_io_readl(dev->pdev, dev->bar, VIRTIO_PCI_HOST_FEATURES);
 }
 
-static void qvirtio_pci_set_features(QVirtioDevice *d, uint32_t features)
+static void qvirtio_pci_set_features(QVirtioDevice *d, uint64_t features)
 {
     QVirtioPCIDevice *dev = (QVirtioPCIDevice *)d;
     qpci_io_writel(dev->pdev, dev->bar, VIRTIO_PCI_GUEST_FEATURES, features);
 }
 
-static uint32_t qvirtio_pci_get_guest_features(QVirtioDevice *d)
+static uint64_t qvirtio_pci_get_guest_features(QVirtioDevice *d)
 {
     QVirtioPCIDevice *dev = (QVirtioPCIDevice *)d;
     return qpci_io_readl(dev->pdev, dev->bar, VIRTIO_PCI_GUEST_FEATURES);
@@ -265,6 +265,7 @@ static void qvirtio_pci_virtqueue_cleanup(QVirtQueue *vq,
     QVirtQueuePCI *vqpci = container_of(vq, QVirtQueuePCI, vq);
 
     guest_free(alloc, vq->desc);
+    g_free(vq->chain_len);
     g_free(vqpci);
 }
 
@@ -294,6 +295,237 @@ const QVirtioBus qvirtio_pci = {
     .virtqueue_kick = qvirtio_pci_virtqueue_kick,
 };
 
+/* virtio 1.0 interface, through the vendor capabilities of the device */
+
+static uint8_t qvirtio_pci_modern_config_readb(QVirtioDevice *d, uint64_t off)
+{
+    QVirtioPCIDevice *dev = (QVirtioPCIDevice *)d;
+    return qpci_io_readb(dev->pdev, dev->modern_bar,
+                         dev->device_cfg_offset + off);
+}
+
+static uint16_t qvirtio_pci_modern_config_readw(QVirtioDevice *d, uint64_t off)
+{
+    QVirtioPCIDevice *dev = (QVirtioPCIDevice *)d;
+    return qpci_io_readw(dev->pdev, dev->modern_bar,
+                         dev->device_cfg_offset + off);
+}
+
+static uint32_t qvirtio_pci_modern_config_readl(QVirtioDevice *d, uint64_t off)
+{
+    QVirtioPCIDevice *dev = (QVirtioPCIDevice *)d;
+    return qpci_io_readl(dev->pdev, dev->modern_bar,
+                         dev->device_cfg_offset + off);
+}
+
+static uint64_t qvirtio_pci_modern_config_readq(QVirtioDevice *d, uint64_t off)
+{
+    QVirtioPCIDevice *dev = (QVirtioPCIDevice *)d;
+    return qpci_io_readq(dev->pdev, dev->modern_bar,
+                         dev->device_cfg_offset + off);
+}
+
+static uint64_t qvirtio_pci_modern_get_features(QVirtioDevice *d)
+{
+    QVirtioPCIDevice *dev = (QVirtioPCIDevice *)d;
+    uint64_t lo, hi;
+
+    qpci_io_writel(dev->pdev, dev->modern_bar,
+                   dev->common_cfg_offset + VIRTIO_PCI_COMMON_DFSELECT, 0);
+    lo = qpci_io_readl(dev->pdev, dev->modern_bar,
+                       dev->common_cfg_offset + VIRTIO_PCI_COMMON_DF);
+    qpci_io_writel(dev->pdev, dev->modern_bar,
+                   dev->common_cfg_offset + VIRTIO_PCI_COMMON_DFSELECT, 1);
+    hi = qpci_io_readl(dev->pdev, dev->modern_bar,
+                       dev->common_cfg_offset + VIRTIO_PCI_COMMON_DF);
+    return lo | hi << 32;
+}
+
+static void qvirtio_pci_modern_set_features(QVirtioDevice *d,
+                                            uint64_t features)
+{
+    QVirtioPCIDevice *dev = (QVirtioPCIDevice *)d;
+
+    qpci_io_writel(dev->pdev, dev->modern_bar,
+                   dev->common_cfg_offset + VIRTIO_PCI_COMMON_GFSELECT, 0);
+    qpci_io_writel(dev->pdev, dev->modern_bar,
+                   dev->common_cfg_offset + VIRTIO_PCI_COMMON_GF, features);
+    qpci_io_writel(dev->pdev, dev->modern_bar,
+                   dev->common_cfg_offset + VIRTIO_PCI_COMMON_GFSELECT, 1);
+    qpci_io_writel(dev->pdev, dev->modern_bar,
+                   dev->common_cfg_offset + VIRTIO_PCI_COMMON_GF,
+                   features >> 32);
+}
+
+static uint64_t qvirtio_pci_modern_get_guest_features(QVirtioDevice *d)
+{
+    QVirtioPCIDevice *dev = (QVirtioPCIDevice *)d;
+    uint64_t lo, hi;
+
+    qpci_io_writel(dev->pdev, dev->modern_bar,
+                   dev->common_cfg_offset + VIRTIO_PCI_COMMON_GFSELECT, 0);
+    lo = qpci_io_readl(dev->pdev, dev->modern_bar,
+                       dev->common_cfg_offset + VIRTIO_PCI_COMMON_GF);
+    qpci_io_writel(dev->pdev, dev->modern_bar,
+                   dev->common_cfg_offset + VIRTIO_PCI_COMMON_GFSELECT, 1);
+    hi = qpci_io_readl(dev->pdev, dev->modern_bar,
+                       dev->common_cfg_offset + VIRTIO_PCI_COMMON_GF);
+    return lo | hi << 32;
+}
+
+static uint8_t qvirtio_pci_modern_get_status(QVirtioDevice *d)
+{
+    QVirtioPCIDevice *dev = (QVirtioPCIDevice *)d;
+    return qpci_io_readb(dev->pdev, dev->modern_bar,
+                         dev->common_cfg_offset + VIRTIO_PCI_COMMON_STATUS);
+}
+
+static void qvirtio_pci_modern_set_status(QVirtioDevice *d, uint8_t status)
+{
+    QVirtioPCIDevice *dev = (QVirtioPCIDevice *)d;
+    qpci_io_writeb(dev->pdev, dev->modern_bar,
+                   dev->common_cfg_offset + VIRTIO_PCI_COMMON_STATUS, status);
+}
+
+static bool qvirtio_pci_modern_get_queue_isr_status(QVirtioDevice *d,
+                                                    QVirtQueue *vq)
+{
+    QVirtioPCIDevice *dev = (QVirtioPCIDevice *)d;
+
+    if (dev->pdev->msix_enabled) {
+        return qvirtio_pci_get_queue_isr_status(d, vq);
+    }
+    return qpci_io_readb(dev->pdev, dev->modern_bar,
+                         dev->isr_cfg_offset) & 1;
+}
+
+static bool qvirtio_pci_modern_get_config_isr_status(QVirtioDevice *d)
+{
+    QVirtioPCIDevice *dev = (QVirtioPCIDevice *)d;
+
+    if (dev->pdev->msix_enabled) {
+        return qvirtio_pci_get_config_isr_status(d);
+    }
+    return qpci_io_readb(dev->pdev, dev->modern_bar,
+                         dev->isr_cfg_offset) & 2;
+}
+
+static void qvirtio_pci_modern_queue_select(QVirtioDevice *d, uint16_t index)
+{
+    QVirtioPCIDevice *dev = (QVirtioPCIDevice *)d;
+    qpci_io_writew(dev->pdev, dev->modern_bar,
+                   dev->common_cfg_offset + VIRTIO_PCI_COMMON_Q_SELECT, index);
+}
+
+static uint16_t qvirtio_pci_modern_get_queue_size(QVirtioDevice *d)
+{
+    QVirtioPCIDevice *dev = (QVirtioPCIDevice *)d;
+    return qpci_io_readw(dev->pdev, dev->modern_bar,
+                         dev->common_cfg_offset + VIRTIO_PCI_COMMON_Q_SIZE);
+}
+
+static void qvirtio_pci_modern_set_queue_address(QVirtioDevice *d,
+                                                 uint32_t pfn)
+{
+    /* The three parts of the ring are set separately, see virtqueue_setup */
+    g_assert_not_reached();
+}
+
+static void qvirtio_pci_modern_write_addr(QVirtioPCIDevice *dev,
+                                          uint64_t off, uint64_t addr)
+{
+    qpci_io_writel(dev->pdev, dev->modern_bar, dev->common_cfg_offset + off,
+                   addr);
+    qpci_io_writel(dev->pdev, dev->modern_bar,
+                   dev->common_cfg_offset + off + 4, addr >> 32);
+}
+
+static QVirtQueue *qvirtio_pci_modern_virtqueue_setup(QVirtioDevice *d,
+                                        QGuestAllocator *alloc, uint16_t index)
+{
+    QVirtioPCIDevice *dev = (QVirtioPCIDevice *)d;
+    uint64_t feat;
+    uint64_t addr;
+    QVirtQueuePCI *vqpci;
+
+    vqpci = g_malloc0(sizeof(*vqpci));
+    feat = qvirtio_pci_modern_get_guest_features(d);
+
+    qvirtio_pci_modern_queue_select(d, index);
+    vqpci->vq.index = index;
+    vqpci->vq.size = qvirtio_pci_modern_get_queue_size(d);
+    vqpci->vq.free_head = 0;
+    vqpci->vq.num_free = vqpci->vq.size;
+    vqpci->vq.align = VIRTIO_PCI_VRING_ALIGN;
+    vqpci->vq.indirect = (feat & (1ull << VIRTIO_RING_F_INDIRECT_DESC)) != 0;
+    vqpci->vq.event = (feat & (1ull << VIRTIO_RING_F_EVENT_IDX)) != 0;
+    vqpci->vq.packed = (feat & (1ull << VIRTIO_F_RING_PACKED)) != 0;
+
+    vqpci->msix_entry = -1;
+    vqpci->msix_addr = 0;
+    vqpci->msix_data = 0x12345678;
+
+    /* Check different than 0 */
+    g_assert_cmpint(vqpci->vq.size, !=, 0);
+
+    /* Check power of 2 */
+    g_assert_cmpint(vqpci->vq.size & (vqpci->vq.size - 1), ==, 0);
+
+    if (vqpci->vq.packed) {
+        addr = guest_alloc(alloc, qvring_packed_size(vqpci->vq.size));
+    } else {
+        addr = guest_alloc(alloc, qvring_size(vqpci->vq.size,
+                                              VIRTIO_PCI_VRING_ALIGN));
+    }
+    qvring_init(alloc, &vqpci->vq, addr);
+
+    qvirtio_pci_modern_write_addr(dev, VIRTIO_PCI_COMMON_Q_DESCLO,
+                                  vqpci->vq.desc);
+    qvirtio_pci_modern_write_addr(dev, VIRTIO_PCI_COMMON_Q_AVAILLO,
+                                  vqpci->vq.avail);
+    qvirtio_pci_modern_write_addr(dev, VIRTIO_PCI_COMMON_Q_USEDLO,
+                                  vqpci->vq.used);
+    vqpci->notify_off = qpci_io_readw(dev->pdev, dev->modern_bar,
+                                      dev->common_cfg_offset +
+                                      VIRTIO_PCI_COMMON_Q_NOFF);
+    qpci_io_writew(dev->pdev, dev->modern_bar,
+                   dev->common_cfg_offset + VIRTIO_PCI_COMMON_Q_ENABLE, 1);
+
+    return &vqpci->vq;
+}
+
+static void qvirtio_pci_modern_virtqueue_kick(QVirtioDevice *d,
+                                              QVirtQueue *vq)
+{
+    QVirtioPCIDevice *dev = (QVirtioPCIDevice *)d;
+    QVirtQueuePCI *vqpci = container_of(vq, QVirtQueuePCI, vq);
+
+    qpci_io_writew(dev->pdev, dev->modern_bar,
+                   dev->notify_cfg_offset +
+                   vqpci->notify_off * dev->notify_off_multiplier,
+                   vq->index);
+}
+
+const QVirtioBus qvirtio_pci_modern = {
+    .config_readb = qvirtio_pci_modern_config_readb,
+    .config_readw = qvirtio_pci_modern_config_readw,
+    .config_readl = qvirtio_pci_modern_config_readl,
+    .config_readq = qvirtio_pci_modern_config_readq,
+    .get_features = qvirtio_pci_modern_get_features,
+    .set_features = qvirtio_pci_modern_set_features,
+    .get_guest_features = qvirtio_pci_modern_get_guest_features,
+    .get_status = qvirtio_pci_modern_get_status,
+    .set_status = qvirtio_pci_modern_set_status,
+    .get_queue_isr_status = qvirtio_pci_modern_get_queue_isr_status,
+    .get_config_isr_status = qvirtio_pci_modern_get_config_isr_status,
+    .queue_select = qvirtio_pci_modern_queue_select,
+    .get_queue_size = qvirtio_pci_modern_get_queue_size,
+    .set_queue_address = qvirtio_pci_modern_set_queue_address,
+    .virtqueue_setup = qvirtio_pci_modern_virtqueue_setup,
+    .virtqueue_cleanup = qvirtio_pci_virtqueue_cleanup,
+    .virtqueue_kick = qvirtio_pci_modern_virtqueue_kick,
+};
+
 static void qvirtio_pci_foreach(QPCIBus *bus, uint16_t device_type,
                 bool has_slot, int slot,
                 void (*func)(QVirtioDevice *d, void *data), void *data)
@@ -341,6 +573,61 @@ void qvirtio_pci_device_enable(QVirtioPCIDevice *d)
     d->bar = qpci_iomap(d->pdev, 0, NULL);
 }
 
+/* Switch @d to the virtio 1.0 interface; QEMU puts all of its structures
+ * in one memory BAR.
+ */
+void qvirtio_pci_device_enable_modern(QVirtioPCIDevice *d)
+{
+    uint8_t addr, cfg_type, bar = 0;
+    bool mapped = false;
+
+    qpci_device_enable(d->pdev);
+
+    addr = qpci_config_readb(d->pdev, PCI_CAPABILITY_LIST);
+    while (addr) {
+        uint64_t offset;
+
+        if (qpci_config_readb(d->pdev, addr) != PCI_CAP_ID_VNDR) {
+            addr = qpci_config_readb(d->pdev, addr + PCI_CAP_LIST_NEXT);
+            continue;
+        }
+
+        cfg_type = qpci_config_readb(d->pdev, addr + VIRTIO_PCI_CAP_CFG_TYPE);
+        offset = qpci_config_readl(d->pdev, addr + VIRTIO_PCI_CAP_OFFSET);
+        if (cfg_type != VIRTIO_PCI_CAP_PCI_CFG) {
+            if (!mapped) {
+                bar = qpci_config_readb(d->pdev, addr + VIRTIO_PCI_CAP_BAR);
+                d->modern_bar = qpci_iomap(d->pdev, bar, NULL);
+                mapped = true;
+            }
+            g_assert_cmpint(qpci_config_readb(d->pdev,
+                                              addr + VIRTIO_PCI_CAP_BAR),
+                            ==, bar);
+        }
+
+        switch (cfg_type) {
+        case VIRTIO_PCI_CAP_COMMON_CFG:
+            d->common_cfg_offset = offset;
+            break;
+        case VIRTIO_PCI_CAP_NOTIFY_CFG:
+            d->notify_cfg_offset = offset;
+            d->notify_off_multiplier =
+                qpci_config_readl(d->pdev, addr + VIRTIO_PCI_NOTIFY_CAP_MULT);
+            break;
+        case VIRTIO_PCI_CAP_ISR_CFG:
+            d->isr_cfg_offset = offset;
+            break;
+        case VIRTIO_PCI_CAP_DEVICE_CFG:
+            d->device_cfg_offset = offset;
+            break;
+        }
+        addr = qpci_config_readb(d->pdev, addr + PCI_CAP_LIST_NEXT);
+    }
+    g_assert(mapped);
+
+    d->vdev.bus = &qvirtio_pci_modern;
+}
+
 void qvirtio_pci_device_disable(QVirtioPCIDevice *d)
 {
     qpci_iounmap(d->pdev, d->bar);
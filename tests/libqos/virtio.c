@@ -33,14 +33,23 @@ uint64_t qvirtio_config_readq(QVirtioDevice *d, uint64_t addr)
     return d->bus->config_readq(d, addr);
 }
 
-uint32_t qvirtio_get_features(QVirtioDevice *d)
+uint64_t qvirtio_get_features(QVirtioDevice *d)
 {
     return d->bus->get_features(d);
 }
 
-void qvirtio_set_features(QVirtioDevice *d, uint32_t features)
+void qvirtio_set_features(QVirtioDevice *d, uint64_t features)
 {
+    d->features = features;
     d->bus->set_features(d, features);
+
+    /* A virtio 1.0 device must accept the features before setup goes on */
+    if (features & (1ull << VIRTIO_F_VERSION_1)) {
+        uint8_t status = d->bus->get_status(d) | VIRTIO_CONFIG_S_FEATURES_OK;
+
+        d->bus->set_status(d, status);
+        g_assert_cmphex(d->bus->get_status(d), ==, status);
+    }
 }
 
 QVirtQueue *qvirtqueue_setup(QVirtioDevice *d,
@@ -59,6 +68,7 @@ void qvirtio_reset(QVirtioDevice *d)
 {
     d->bus->set_status(d, 0);
     g_assert_cmphex(d->bus->get_status(d), ==, 0);
+    d->features = 0;
 }
 
 void qvirtio_set_acknowledge(QVirtioDevice *d)
@@ -76,9 +86,14 @@ void qvirtio_set_driver(QVirtioDevice *d)
 
 void qvirtio_set_driver_ok(QVirtioDevice *d)
 {
+    uint8_t status = VIRTIO_CONFIG_S_DRIVER_OK | VIRTIO_CONFIG_S_DRIVER |
+                     VIRTIO_CONFIG_S_ACKNOWLEDGE;
+
+    if (d->features & (1ull << VIRTIO_F_VERSION_1)) {
+        status |= VIRTIO_CONFIG_S_FEATURES_OK;
+    }
     d->bus->set_status(d, d->bus->get_status(d) | VIRTIO_CONFIG_S_DRIVER_OK);
-    g_assert_cmphex(d->bus->get_status(d), ==, VIRTIO_CONFIG_S_DRIVER_OK |
-                    VIRTIO_CONFIG_S_DRIVER | VIRTIO_CONFIG_S_ACKNOWLEDGE);
+    g_assert_cmphex(d->bus->get_status(d), ==, status);
 }
 
 void qvirtio_wait_queue_isr(QVirtioDevice *d,
@@ -161,10 +176,39 @@ void qvirtio_wait_config_isr(QVirtioDevice *d, gint64 timeout_us)
     }
 }
 
+static void qvring_packed_init(QVirtQueue *vq, uint64_t addr)
+{
+    int i;
+
+    vq->desc = addr;
+    vq->avail = vq->desc + vq->size * sizeof(struct vring_packed_desc);
+    vq->used = vq->avail + sizeof(struct vring_packed_desc_event);
+    vq->avail_wrap_counter = true;
+    vq->used_wrap_counter = true;
+    vq->in_chain = false;
+    vq->chain_len = g_new0(uint16_t, vq->size);
+
+    /* Neither available nor used with the wrap counters set */
+    for (i = 0; i < vq->size; i++) {
+        /* vq->desc[i].flags */
+        writew(vq->desc + (16 * i) + 14, 0);
+    }
+
+    /* vq->driver_event, notifications enabled */
+    writel(vq->avail, 0);
+    /* vq->device_event */
+    writel(vq->used, 0);
+}
+
 void qvring_init(const QGuestAllocator *alloc, QVirtQueue *vq, uint64_t addr)
 {
     int i;
 
+    if (vq->packed) {
+        qvring_packed_init(vq, addr);
+        return;
+    }
+
     vq->desc = addr;
     vq->avail = vq->desc + vq->size * sizeof(struct vring_desc);
     vq->used = (uint64_t)((vq->avail + sizeof(uint16_t) * (3 + vq->size)
@@ -235,10 +279,65 @@ void qvring_indirect_desc_add(QVRingIndirectDesc *indirect, uint64_t data,
     indirect->index++;
 }
 
+static uint32_t qvirtqueue_packed_add(QVirtQueue *vq, uint64_t data,
+                                      uint32_t len, bool write, bool next)
+{
+    uint16_t pos = vq->free_head;
+    uint16_t flags = 0;
+
+    g_assert_cmpint(vq->num_free, >, 0);
+    vq->num_free--;
+
+    if (!vq->in_chain) {
+        vq->in_chain = true;
+        vq->chain_head = pos;
+        vq->chain_len[pos] = 0;
+    }
+    vq->chain_len[vq->chain_head]++;
+
+    if (write) {
+        flags |= VRING_DESC_F_WRITE;
+    }
+    if (next) {
+        flags |= VRING_DESC_F_NEXT;
+    } else {
+        vq->in_chain = false;
+    }
+    if (vq->avail_wrap_counter) {
+        flags |= 1 << VRING_PACKED_DESC_F_AVAIL;
+    } else {
+        flags |= 1 << VRING_PACKED_DESC_F_USED;
+    }
+
+    /* vq->desc[pos].addr */
+    writeq(vq->desc + (16 * pos), data);
+    /* vq->desc[pos].len */
+    writel(vq->desc + (16 * pos) + 8, len);
+    /* vq->desc[pos].id */
+    writew(vq->desc + (16 * pos) + 12, vq->chain_head);
+    if (pos == vq->chain_head) {
+        vq->chain_head_flags = flags;
+    } else {
+        /* vq->desc[pos].flags */
+        writew(vq->desc + (16 * pos) + 14, flags);
+    }
+
+    if (++vq->free_head == vq->size) {
+        vq->free_head = 0;
+        vq->avail_wrap_counter = !vq->avail_wrap_counter;
+    }
+    return pos;
+}
+
 uint32_t qvirtqueue_add(QVirtQueue *vq, uint64_t data, uint32_t len, bool write,
                                                                     bool next)
 {
     uint16_t flags = 0;
+
+    if (vq->packed) {
+        return qvirtqueue_packed_add(vq, data, len, write, next);
+    }
+
     vq->num_free--;
 
     if (write) {
@@ -262,6 +361,7 @@ uint32_t qvirtqueue_add(QVirtQueue *vq, uint64_t data, uint32_t len, bool write,
 uint32_t qvirtqueue_add_indirect(QVirtQueue *vq, QVRingIndirectDesc *indirect)
 {
     g_assert(vq->indirect);
+    g_assert(!vq->packed);
     g_assert_cmpint(vq->size, >=, indirect->elem);
     g_assert_cmpint(indirect->index, ==, indirect->elem);
 
@@ -278,15 +378,38 @@ uint32_t qvirtqueue_add_indirect(QVirtQueue *vq, QVRingIndirectDesc *indirect)
     return vq->free_head++; /* Return and increase, in this order */
 }
 
+/* Make the buffer at @head available, all of its descriptors at once */
+static void qvirtqueue_packed_kick(QVirtioDevice *d, QVirtQueue *vq,
+                                   uint32_t head)
+{
+    g_assert(!vq->in_chain);
+    g_assert_cmpint(head, ==, vq->chain_head);
+
+    /* vq->desc[head].flags */
+    writew(vq->desc + (16 * head) + 14, vq->chain_head_flags);
+
+    /* vq->device_event.flags; with EVENT_IDX the driver may kick too often */
+    if (readw(vq->used + 2) != VRING_PACKED_EVENT_FLAG_DISABLE) {
+        d->bus->virtqueue_kick(d, vq);
+    }
+}
+
 void qvirtqueue_kick(QVirtioDevice *d, QVirtQueue *vq, uint32_t free_head)
 {
     /* vq->avail->idx */
-    uint16_t idx = readw(vq->avail + 2);
+    uint16_t idx;
     /* vq->used->flags */
     uint16_t flags;
     /* vq->used->avail_event */
     uint16_t avail_event;
 
+    if (vq->packed) {
+        qvirtqueue_packed_kick(d, vq, free_head);
+        return;
+    }
+
+    idx = readw(vq->avail + 2);
+
     /* vq->avail->ring[idx % vq->size] */
     writew(vq->avail + 4 + (2 * (idx % vq->size)), free_head);
     /* vq->avail->idx */
@@ -314,11 +437,52 @@ void qvirtqueue_kick(QVirtioDevice *d, QVirtQueue *vq, uint32_t free_head)
  *
  * Returns: true if an element was ready, false otherwise
  */
+static bool qvirtqueue_packed_get_buf(QVirtQueue *vq, uint32_t *desc_idx,
+                                      uint32_t *len)
+{
+    uint64_t desc = vq->desc + (16 * vq->last_used_idx);
+    /* vq->desc[vq->last_used_idx].flags */
+    uint16_t flags = readw(desc + 14);
+    bool avail = flags & (1 << VRING_PACKED_DESC_F_AVAIL);
+    bool used = flags & (1 << VRING_PACKED_DESC_F_USED);
+    uint16_t id;
+
+    if (avail != used || used != vq->used_wrap_counter) {
+        return false;
+    }
+
+    /* vq->desc[vq->last_used_idx].id */
+    id = readw(desc + 12);
+    g_assert_cmpint(id, <, vq->size);
+    g_assert_cmpint(vq->chain_len[id], >, 0);
+
+    if (desc_idx) {
+        *desc_idx = id;
+    }
+    if (len) {
+        /* vq->desc[vq->last_used_idx].len */
+        *len = readl(desc + 8);
+    }
+
+    vq->num_free += vq->chain_len[id];
+    vq->last_used_idx += vq->chain_len[id];
+    vq->chain_len[id] = 0;
+    if (vq->last_used_idx >= vq->size) {
+        vq->last_used_idx -= vq->size;
+        vq->used_wrap_counter = !vq->used_wrap_counter;
+    }
+    return true;
+}
+
 bool qvirtqueue_get_buf(QVirtQueue *vq, uint32_t *desc_idx, uint32_t *len)
 {
     uint16_t idx;
     uint64_t elem_addr;
 
+    if (vq->packed) {
+        return qvirtqueue_packed_get_buf(vq, desc_idx, len);
+    }
+
     idx = readw(vq->used + offsetof(struct vring_used, idx));
     if (idx == vq->last_used_idx) {
         return false;
@@ -344,6 +508,7 @@ bool qvirtqueue_get_buf(QVirtQueue *vq, uint32_t *desc_idx, uint32_t *len)
 void qvirtqueue_set_used_event(QVirtQueue *vq, uint16_t idx)
 {
     g_assert(vq->event);
+    g_assert(!vq->packed);
 
     /* vq->avail->used_event */
     writew(vq->avail + 4 + (2 * vq->size), idx);
@@ -11,6 +11,7 @@
 #define LIBQOS_VIRTIO_H
 
 #include "libqos/malloc.h"
+#include "standard-headers/linux/virtio_config.h"
 #include "standard-headers/linux/virtio_ring.h"
 
 #define QVIRTIO_F_BAD_FEATURE           0x40000000
@@ -21,6 +22,8 @@ typedef struct QVirtioDevice {
     const QVirtioBus *bus;
     /* Device type */
     uint16_t device_type;
+    /* Features set by the driver */
+    uint64_t features;
 } QVirtioDevice;
 
 typedef struct QVirtQueue {
@@ -35,6 +38,20 @@ typedef struct QVirtQueue {
     uint16_t last_used_idx;
     bool indirect;
     bool event;
+
+    /*
+     * VIRTIO_F_RING_PACKED: desc points to an array of struct
+     * vring_packed_desc, avail and used to the driver and device event
+     * suppression areas.  Buffer ids are the position of their first
+     * descriptor, whose flags are only written by qvirtqueue_kick().
+     */
+    bool packed;
+    bool avail_wrap_counter;
+    bool used_wrap_counter;
+    bool in_chain;
+    uint16_t chain_head;
+    uint16_t chain_head_flags;
+    uint16_t *chain_len; /* Descriptors of each buffer, indexed by id */
 } QVirtQueue;
 
 typedef struct QVRingIndirectDesc {
@@ -50,13 +67,13 @@ struct QVirtioBus {
     uint64_t (*config_readq)(QVirtioDevice *d, uint64_t addr);
 
     /* Get features of the device */
-    uint32_t (*get_features)(QVirtioDevice *d);
+    uint64_t (*get_features)(QVirtioDevice *d);
 
     /* Set features of the device */
-    void (*set_features)(QVirtioDevice *d, uint32_t features);
+    void (*set_features)(QVirtioDevice *d, uint64_t features);
 
     /* Get features of the guest */
-    uint32_t (*get_guest_features)(QVirtioDevice *d);
+    uint64_t (*get_guest_features)(QVirtioDevice *d);
 
     /* Get status of the device */
     uint8_t (*get_status)(QVirtioDevice *d);
@@ -92,7 +109,9 @@ struct QVirtioBus {
 
 static inline bool qvirtio_is_big_endian(QVirtioDevice *d)
 {
-    /* FIXME: virtio 1.0 is always little-endian */
+    if (d->features & (1ull << VIRTIO_F_VERSION_1)) {
+        return false;
+    }
     return qtest_big_endian(global_qtest);
 }
 
@@ -103,12 +122,18 @@ static inline uint32_t qvring_size(uint32_t num, uint32_t align)
         + sizeof(uint16_t) * 3 + sizeof(struct vring_used_elem) * num;
 }
 
+static inline uint32_t qvring_packed_size(uint32_t num)
+{
+    return sizeof(struct vring_packed_desc) * num +
+        sizeof(struct vring_packed_desc_event) * 2;
+}
+
 uint8_t qvirtio_config_readb(QVirtioDevice *d, uint64_t addr);
 uint16_t qvirtio_config_readw(QVirtioDevice *d, uint64_t addr);
 uint32_t qvirtio_config_readl(QVirtioDevice *d, uint64_t addr);
 uint64_t qvirtio_config_readq(QVirtioDevice *d, uint64_t addr);
-uint32_t qvirtio_get_features(QVirtioDevice *d);
-void qvirtio_set_features(QVirtioDevice *d, uint32_t features);
+uint64_t qvirtio_get_features(QVirtioDevice *d);
+void qvirtio_set_features(QVirtioDevice *d, uint64_t features);
 
 void qvirtio_reset(QVirtioDevice *d);
 void qvirtio_set_acknowledge(QVirtioDevice *d);
@@ -0,0 +1,134 @@
+/*
+ * QTest testcase and microbenchmark for memory topology updates
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "libqtest.h"
+#include "libqos/pci.h"
+#include "libqos/pci-pc.h"
+#include "hw/pci/pci_regs.h"
+
+/* pci-testdev devices present at startup, in slots 4 and up, followed
+ * by the hotplugged ones.
+ */
+#define STATIC_DEVS     8
+#define HOTPLUG_DEVS    16
+#define FIRST_SLOT      4
+
+/* Offset of the test name in the pci-testdev register header */
+#define TESTDEV_NAME    16
+
+static QPCIBus *pcibus;
+
+static void set_memory_enabled(QPCIDevice *dev, bool enable)
+{
+    uint16_t cmd = qpci_config_readw(dev, PCI_COMMAND);
+
+    if (enable) {
+        cmd |= PCI_COMMAND_MEMORY;
+    } else {
+        cmd &= ~PCI_COMMAND_MEMORY;
+    }
+    qpci_config_writew(dev, PCI_COMMAND, cmd);
+}
+
+static void test_bar_remap(void)
+{
+    QPCIDevice *dev;
+    QPCIBar bar;
+
+    dev = qpci_device_find(pcibus, QPCI_DEVFN(FIRST_SLOT, 0));
+    g_assert(dev != NULL);
+    qpci_device_enable(dev);
+    bar = qpci_iomap(dev, 0, NULL);
+
+    /* Select the first test, whose name starts with "mmio" */
+    qpci_io_writeb(dev, bar, 0, 0);
+    g_assert_cmpint(qpci_io_readb(dev, bar, TESTDEV_NAME), ==, 'm');
+
+    set_memory_enabled(dev, false);
+    g_assert_cmpint(qpci_io_readb(dev, bar, TESTDEV_NAME), !=, 'm');
+
+    set_memory_enabled(dev, true);
+    g_assert_cmpint(qpci_io_readb(dev, bar, TESTDEV_NAME), ==, 'm');
+
+    g_free(dev);
+}
+
+static void bench_bar_remap(void)
+{
+    int iterations = g_test_perf() ? 10000 : 100;
+    QPCIDevice *dev;
+    double secs;
+    int i;
+
+    dev = qpci_device_find(pcibus, QPCI_DEVFN(FIRST_SLOT + 1, 0));
+    g_assert(dev != NULL);
+    qpci_device_enable(dev);
+    qpci_iomap(dev, 0, NULL);
+
+    /* Each write to the command register commits a memory transaction */
+    g_test_timer_start();
+    for (i = 0; i < iterations; i++) {
+        set_memory_enabled(dev, false);
+        set_memory_enabled(dev, true);
+    }
+    secs = g_test_timer_elapsed();
+
+    if (g_test_perf()) {
+        g_test_message("%d BAR unmap/map cycles in %.3f s (%.1f us each)",
+                       iterations, secs, secs * 1e6 / iterations);
+    }
+    g_free(dev);
+}
+
+static void bench_hotplug(void)
+{
+    double secs;
+    int i;
+
+    g_test_timer_start();
+    for (i = 0; i < HOTPLUG_DEVS; i++) {
+        char *id = g_strdup_printf("hp%d", i);
+        char *addr = g_strdup_printf("%x.0", FIRST_SLOT + STATIC_DEVS + i);
+
+        qtest_qmp_device_add("pci-testdev", id, "{'addr': %s}", addr);
+        g_free(addr);
+        g_free(id);
+    }
+    secs = g_test_timer_elapsed();
+
+    if (g_test_perf()) {
+        g_test_message("%d devices hotplugged in %.3f s", HOTPLUG_DEVS, secs);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    GString *cmd = g_string_new("-machine pc");
+    int ret;
+    int i;
+
+    g_test_init(&argc, &argv, NULL);
+    qtest_add_func("/memory-topology/bar-remap", test_bar_remap);
+    qtest_add_func("/memory-topology/bench-bar-remap", bench_bar_remap);
+    qtest_add_func("/memory-topology/bench-hotplug", bench_hotplug);
+
+    for (i = 0; i < STATIC_DEVS; i++) {
+        g_string_append_printf(cmd, " -device pci-testdev,addr=%x.0,membar=1M",
+                               FIRST_SLOT + i);
+    }
+    qtest_start(cmd->str);
+    g_string_free(cmd, true);
+    pcibus = qpci_init_pc(global_qtest, NULL);
+
+    ret = g_test_run();
+
+    qpci_free_pc(pcibus);
+    qtest_end();
+
+    return ret;
+}
@@ -0,0 +1,66 @@
+/*
+ * QTest microbenchmark for device register access through the
+ * memory dispatch
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "libqtest.h"
+
+#define HPET_BASE 0xfed00000
+#define HPET_ID   0x000
+#define RAM_ADDR  0x100000
+
+/* A single qtest command reading this many bytes from a device performs
+ * one dispatch lookup per register access, which amortizes the cost of
+ * the qtest protocol itself.
+ */
+#define CHUNK     1024
+
+static void test_hpet_id(void)
+{
+    uint32_t id = readl(HPET_BASE + HPET_ID);
+
+    /* Vendor ID in the upper 16 bits */
+    g_assert_cmphex(id >> 16, ==, 0x8086);
+}
+
+static void bench_registers(void)
+{
+    uint8_t buf[CHUNK];
+    int iterations = g_test_perf() ? 20000 : 100;
+    double secs;
+    int i;
+
+    g_test_timer_start();
+    for (i = 0; i < iterations; i++) {
+        /* Alternate between MMIO and RAM so that both stay cached */
+        memread(HPET_BASE, buf, CHUNK);
+        memread(RAM_ADDR, buf, CHUNK);
+    }
+    secs = g_test_timer_elapsed();
+
+    if (g_test_perf()) {
+        g_test_message("%d MMIO/RAM round trips of %d bytes in %.3f s "
+                       "(%.0f register reads/s)", iterations, CHUNK, secs,
+                       iterations * (CHUNK / 4) / secs);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    int ret;
+
+    g_test_init(&argc, &argv, NULL);
+    qtest_add_func("/mmio-perf/hpet-id", test_hpet_id);
+    qtest_add_func("/mmio-perf/registers", bench_registers);
+
+    qtest_start("-machine pc");
+    ret = g_test_run();
+
+    qtest_end();
+
+    return ret;
+}
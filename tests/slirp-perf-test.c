@@ -0,0 +1,340 @@
+/*
+ * QTest throughput benchmark for user-mode networking
+ *
+ * TCP connections to a host forward of -netdev user are read by a small
+ * TCP receiver in this process, which plays the guest on the other end
+ * of a socket netdev hubbed to slirp.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "libqtest.h"
+#include "qemu/bswap.h"
+#include "qemu/iov.h"
+#include "qemu/sockets.h"
+
+#define GUEST_IP    0x0a00020f          /* 10.0.2.15 */
+#define GUEST_PORT  80
+#define GUEST_ISS   1000
+#define GUEST_WIN   65535
+#define ETH_HLEN    14
+#define IP_HLEN     20
+#define TCP_HLEN    20
+#define TH_FIN      0x01
+#define TH_SYN      0x02
+#define TH_ACK      0x10
+#define CHUNK       65536
+
+static const uint8_t guest_mac[6] = { 0x52, 0x54, 0x00, 0x12, 0x34, 0x56 };
+
+typedef struct Conn {
+    uint32_t snd_nxt;
+    uint32_t rcv_nxt;
+    uint64_t received;
+} Conn;
+
+typedef struct Guest {
+    int fd;
+    GHashTable *conns;
+    uint64_t received;
+    uint8_t buf[CHUNK * 2];
+    size_t len;
+} Guest;
+
+static uint8_t pattern[CHUNK + 256];
+
+static uint32_t csum_add(uint32_t sum, const uint8_t *buf, size_t len)
+{
+    size_t i;
+
+    for (i = 0; i + 1 < len; i += 2) {
+        sum += lduw_be_p(buf + i);
+    }
+    if (len & 1) {
+        sum += buf[len - 1] << 8;
+    }
+    return sum;
+}
+
+static uint16_t csum_fold(uint32_t sum)
+{
+    while (sum >> 16) {
+        sum = (sum & 0xffff) + (sum >> 16);
+    }
+    return ~sum;
+}
+
+static void guest_send(Guest *g, uint8_t *frame, size_t size)
+{
+    uint32_t len = cpu_to_be32(size);
+    struct iovec iov[] = {
+        { .iov_base = &len, .iov_len = sizeof(len) },
+        { .iov_base = frame, .iov_len = size },
+    };
+
+    g_assert_cmpint(iov_send(g->fd, iov, 2, 0, sizeof(len) + size), ==,
+                    sizeof(len) + size);
+}
+
+/* Let slirp know where the guest is, without waiting for an ARP request */
+static void guest_announce(Guest *g)
+{
+    uint8_t frame[ETH_HLEN + 28] = { 0 };
+    uint8_t *arp = frame + ETH_HLEN;
+
+    memset(frame, 0xff, 6);
+    memcpy(frame + 6, guest_mac, 6);
+    stw_be_p(frame + 12, 0x0806);
+    stw_be_p(arp, 1);
+    stw_be_p(arp + 2, 0x0800);
+    arp[4] = 6;
+    arp[5] = 4;
+    stw_be_p(arp + 6, 1);
+    memcpy(arp + 8, guest_mac, 6);
+    stl_be_p(arp + 14, GUEST_IP);
+    stl_be_p(arp + 24, GUEST_IP);
+    guest_send(g, frame, sizeof(frame));
+}
+
+/* Answer the segment in @in, whose headers are swapped for the reply */
+static void guest_reply(Guest *g, const uint8_t *in, Conn *c, uint8_t flags)
+{
+    uint8_t frame[ETH_HLEN + IP_HLEN + TCP_HLEN + 4] = { 0 };
+    uint8_t *ip = frame + ETH_HLEN;
+    uint8_t *tcp = ip + IP_HLEN;
+    const uint8_t *in_ip = in + ETH_HLEN;
+    const uint8_t *in_tcp = in_ip + (in_ip[0] & 0xf) * 4;
+    size_t tcp_len = TCP_HLEN;
+    uint32_t sum;
+
+    memcpy(frame, in + 6, 6);
+    memcpy(frame + 6, guest_mac, 6);
+    stw_be_p(frame + 12, 0x0800);
+
+    if (flags & TH_SYN) {
+        /* MSS option */
+        stl_be_p(tcp + TCP_HLEN, 0x020405b4);
+        tcp_len += 4;
+    }
+    stw_be_p(tcp, lduw_be_p(in_tcp + 2));
+    stw_be_p(tcp + 2, lduw_be_p(in_tcp));
+    stl_be_p(tcp + 4, c->snd_nxt);
+    stl_be_p(tcp + 8, c->rcv_nxt);
+    tcp[12] = (tcp_len / 4) << 4;
+    tcp[13] = flags | TH_ACK;
+    stw_be_p(tcp + 14, GUEST_WIN);
+
+    ip[0] = 0x45;
+    stw_be_p(ip + 2, IP_HLEN + tcp_len);
+    stw_be_p(ip + 6, 0x4000);
+    ip[8] = 64;
+    ip[9] = IPPROTO_TCP;
+    memcpy(ip + 12, in_ip + 16, 4);
+    memcpy(ip + 16, in_ip + 12, 4);
+    stw_be_p(ip + 10, csum_fold(csum_add(0, ip, IP_HLEN)));
+
+    sum = csum_add(0, ip + 12, 8) + IPPROTO_TCP + tcp_len;
+    stw_be_p(tcp + 16, csum_fold(csum_add(sum, tcp, tcp_len)));
+
+    guest_send(g, frame, ETH_HLEN + IP_HLEN + tcp_len);
+}
+
+static void guest_input(Guest *g, const uint8_t *frame, size_t size)
+{
+    const uint8_t *ip = frame + ETH_HLEN;
+    const uint8_t *tcp, *data;
+    uint16_t port;
+    uint32_t seq;
+    size_t len, i;
+    uint8_t flags;
+    Conn *c;
+
+    if (size < ETH_HLEN + IP_HLEN + TCP_HLEN ||
+        lduw_be_p(frame + 12) != 0x0800 || ip[9] != IPPROTO_TCP) {
+        return;
+    }
+    tcp = ip + (ip[0] & 0xf) * 4;
+    data = tcp + (tcp[12] >> 4) * 4;
+    len = ip + lduw_be_p(ip + 2) - data;
+    port = lduw_be_p(tcp);
+    seq = ldl_be_p(tcp + 4);
+    flags = tcp[13];
+    g_assert_cmpint(lduw_be_p(tcp + 2), ==, GUEST_PORT);
+
+    c = g_hash_table_lookup(g->conns, GUINT_TO_POINTER(port));
+    if (flags & TH_SYN) {
+        /* A retransmitted SYN gets the same answer again */
+        if (!c) {
+            c = g_new0(Conn, 1);
+            c->rcv_nxt = seq + 1;
+            g_hash_table_insert(g->conns, GUINT_TO_POINTER(port), c);
+        }
+        c->snd_nxt = GUEST_ISS;
+        guest_reply(g, frame, c, TH_SYN);
+        c->snd_nxt++;
+        return;
+    }
+    g_assert(c);
+
+    if (seq == c->rcv_nxt) {
+        for (i = 0; i < len; i++) {
+            g_assert_cmpint(data[i], ==, (uint8_t)(c->received + i));
+        }
+        c->rcv_nxt += len;
+        c->received += len;
+        g->received += len;
+        if (flags & TH_FIN) {
+            c->rcv_nxt++;
+        }
+    }
+    if (len || (flags & TH_FIN)) {
+        guest_reply(g, frame, c, 0);
+    }
+}
+
+static void guest_read(Guest *g)
+{
+    size_t off = 0, size;
+    ssize_t ret;
+
+    ret = read(g->fd, g->buf + g->len, sizeof(g->buf) - g->len);
+    g_assert_cmpint(ret, >, 0);
+    g->len += ret;
+
+    while (g->len - off >= 4) {
+        size = ldl_be_p(g->buf + off);
+        g_assert_cmpint(size, <=, sizeof(g->buf) - 4);
+        if (g->len - off - 4 < size) {
+            break;
+        }
+        guest_input(g, g->buf + off + 4, size);
+        off += 4 + size;
+    }
+    memmove(g->buf, g->buf + off, g->len - off);
+    g->len -= off;
+}
+
+static int free_port(void)
+{
+    struct sockaddr_in addr = {
+        .sin_family = AF_INET,
+        .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+    };
+    socklen_t len = sizeof(addr);
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+
+    g_assert_cmpint(fd, >=, 0);
+    g_assert_cmpint(bind(fd, (struct sockaddr *)&addr, sizeof(addr)), ==, 0);
+    g_assert_cmpint(getsockname(fd, (struct sockaddr *)&addr, &len), ==, 0);
+    close(fd);
+    return ntohs(addr.sin_port);
+}
+
+/* Push @bytes through each of @nconns connections into the guest */
+static void bench_hostfwd(int nconns, uint64_t bytes)
+{
+    struct sockaddr_in addr = {
+        .sin_family = AF_INET,
+        .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+    };
+    GPollFD *pfd = g_new0(GPollFD, nconns + 1);
+    uint64_t *sent = g_new0(uint64_t, nconns);
+    Guest *g = g_new0(Guest, 1);
+    int sv[2], port, i;
+    double secs;
+
+    g_assert_cmpint(socketpair(PF_UNIX, SOCK_STREAM, 0, sv), ==, 0);
+    port = free_port();
+    global_qtest = qtest_initf(
+        "-machine none "
+        "-netdev user,id=u0,ipv6=off,hostfwd=tcp:127.0.0.1:%d-:%d "
+        "-netdev socket,id=s0,fd=%d "
+        "-netdev hubport,id=h0,hubid=0,netdev=u0 "
+        "-netdev hubport,id=h1,hubid=0,netdev=s0", port, GUEST_PORT, sv[1]);
+    close(sv[1]);
+
+    g->fd = sv[0];
+    g->conns = g_hash_table_new_full(NULL, NULL, NULL, g_free);
+    guest_announce(g);
+
+    pfd[0].fd = g->fd;
+    pfd[0].events = G_IO_IN;
+    addr.sin_port = htons(port);
+    for (i = 1; i <= nconns; i++) {
+        pfd[i].fd = socket(AF_INET, SOCK_STREAM, 0);
+        g_assert_cmpint(connect(pfd[i].fd, (struct sockaddr *)&addr,
+                                sizeof(addr)), ==, 0);
+        qemu_set_nonblock(pfd[i].fd);
+        pfd[i].events = G_IO_OUT;
+    }
+
+    g_test_timer_start();
+    while (g->received < nconns * bytes) {
+        g_assert_cmpint(g_poll(pfd, nconns + 1, 10000), >, 0);
+        if (pfd[0].revents) {
+            guest_read(g);
+        }
+        for (i = 1; i <= nconns; i++) {
+            uint64_t *s = &sent[i - 1];
+            ssize_t ret;
+
+            if (!(pfd[i].revents & G_IO_OUT)) {
+                continue;
+            }
+            ret = send(pfd[i].fd, pattern + (*s & 0xff),
+                       MIN(CHUNK, bytes - *s), 0);
+            if (ret < 0) {
+                g_assert(errno == EAGAIN || errno == EWOULDBLOCK);
+                continue;
+            }
+            *s += ret;
+            if (*s == bytes) {
+                pfd[i].events = 0;
+            }
+        }
+    }
+    secs = g_test_timer_elapsed();
+
+    if (g_test_perf()) {
+        g_test_message("%d connection(s), %" PRIu64 " MiB in %.3f s "
+                       "(%.1f MiB/s)", nconns, nconns * bytes >> 20, secs,
+                       (nconns * bytes >> 20) / secs);
+    }
+
+    for (i = 1; i <= nconns; i++) {
+        close(pfd[i].fd);
+    }
+    qtest_end();
+    close(g->fd);
+    g_hash_table_destroy(g->conns);
+    g_free(g);
+    g_free(sent);
+    g_free(pfd);
+}
+
+static void bench_single(void)
+{
+    bench_hostfwd(1, g_test_perf() ? 256 << 20 : 4 << 20);
+}
+
+static void bench_many(void)
+{
+    bench_hostfwd(64, g_test_perf() ? 4 << 20 : 64 << 10);
+}
+
+int main(int argc, char **argv)
+{
+    int i;
+
+    for (i = 0; i < sizeof(pattern); i++) {
+        pattern[i] = i;
+    }
+
+    g_test_init(&argc, &argv, NULL);
+    qtest_add_func("/slirp-perf/hostfwd/single", bench_single);
+    qtest_add_func("/slirp-perf/hostfwd/many", bench_many);
+
+    return g_test_run();
+}
@@ -0,0 +1,93 @@
+/*
+ * QTest testcase for the sync profiler QMP commands
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "libqtest.h"
+#include "qapi/qmp/qdict.h"
+#include "qapi/qmp/qlist.h"
+
+static QDict *query_sync_profile(QTestState *qts)
+{
+    QDict *resp, *ret;
+
+    resp = qtest_qmp(qts, "{ 'execute': 'query-sync-profile' }");
+    g_assert(qdict_haskey(resp, "return"));
+    ret = qdict_get_qdict(resp, "return");
+    qobject_ref(ret);
+    qobject_unref(resp);
+    return ret;
+}
+
+static void set_state(QTestState *qts, bool enable, bool reset)
+{
+    QDict *resp;
+
+    resp = qtest_qmp(qts, "{ 'execute': 'sync-profile-set-state',"
+                     " 'arguments': { 'enable': %i, 'reset': %i } }",
+                     enable, reset);
+    g_assert(qdict_haskey(resp, "return"));
+    qobject_unref(resp);
+}
+
+static void test_bql(void)
+{
+    QTestState *qts;
+    QDict *info, *entry;
+    QList *entries;
+    QListEntry *e;
+    bool found = false;
+    int i;
+
+    qts = qtest_init("-machine none");
+
+    info = query_sync_profile(qts);
+    g_assert(!qdict_get_bool(info, "enabled"));
+    qobject_unref(info);
+
+    set_state(qts, true, false);
+
+    /* each command is dispatched from the main loop, under the BQL */
+    for (i = 0; i < 10; i++) {
+        qobject_unref(qtest_qmp(qts, "{ 'execute': 'query-status' }"));
+    }
+
+    info = query_sync_profile(qts);
+    g_assert(qdict_get_bool(info, "enabled"));
+    entries = qdict_get_qlist(info, "entries");
+    QLIST_FOREACH_ENTRY(entries, e) {
+        entry = qobject_to(QDict, qlist_entry_obj(e));
+        g_assert(qdict_haskey(entry, "callsite"));
+        g_assert_cmpint(qlist_size(qdict_get_qlist(entry, "wait-histogram")),
+                        ==, 24);
+        g_assert_cmpint(qlist_size(qdict_get_qlist(entry, "hold-histogram")),
+                        ==, 24);
+        if (!strcmp(qdict_get_str(entry, "type"), "bql-mutex")) {
+            g_assert_cmpint(qdict_get_int(entry, "acquisitions"), >, 0);
+            found = true;
+        }
+    }
+    g_assert(found);
+    qobject_unref(info);
+
+    set_state(qts, false, true);
+
+    info = query_sync_profile(qts);
+    g_assert(!qdict_get_bool(info, "enabled"));
+    g_assert(qlist_empty(qdict_get_qlist(info, "entries")));
+    qobject_unref(info);
+
+    qtest_quit(qts);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+
+    qtest_add_func("/sync-profile/bql", test_bql);
+
+    return g_test_run();
+}
@@ -0,0 +1,213 @@
+/*
+ * Check AES-NI, PCLMULQDQ and CRC32 results and time the AES rounds.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <immintrin.h>
+
+#define BENCH_BLOCKS (1 << 18)
+
+/* FIPS-197 Appendix C.1 */
+static const uint8_t key[16] = {
+    0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07,
+    0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f,
+};
+static const uint8_t plain[16] = {
+    0x00, 0x11, 0x22, 0x33, 0x44, 0x55, 0x66, 0x77,
+    0x88, 0x99, 0xaa, 0xbb, 0xcc, 0xdd, 0xee, 0xff,
+};
+static const uint8_t cipher[16] = {
+    0x69, 0xc4, 0xe0, 0xd8, 0x6a, 0x7b, 0x04, 0x30,
+    0xd8, 0xcd, 0xb7, 0x80, 0x70, 0xb4, 0xc5, 0x5a,
+};
+
+static __m128i expand_step(__m128i k, __m128i kg)
+{
+    kg = _mm_shuffle_epi32(kg, 0xff);
+    k = _mm_xor_si128(k, _mm_slli_si128(k, 4));
+    k = _mm_xor_si128(k, _mm_slli_si128(k, 4));
+    k = _mm_xor_si128(k, _mm_slli_si128(k, 4));
+    return _mm_xor_si128(k, kg);
+}
+
+#define EXPAND(i, rcon) \
+    ks[i] = expand_step(ks[i - 1], _mm_aeskeygenassist_si128(ks[i - 1], rcon))
+
+static void expand_key(__m128i *ks, __m128i *dks)
+{
+    int i;
+
+    ks[0] = _mm_loadu_si128((const __m128i *)key);
+    EXPAND(1, 0x01);
+    EXPAND(2, 0x02);
+    EXPAND(3, 0x04);
+    EXPAND(4, 0x08);
+    EXPAND(5, 0x10);
+    EXPAND(6, 0x20);
+    EXPAND(7, 0x40);
+    EXPAND(8, 0x80);
+    EXPAND(9, 0x1b);
+    EXPAND(10, 0x36);
+
+    dks[0] = ks[10];
+    for (i = 1; i < 10; i++) {
+        dks[i] = _mm_aesimc_si128(ks[10 - i]);
+    }
+    dks[10] = ks[0];
+}
+
+static __m128i encrypt(const __m128i *ks, __m128i b)
+{
+    int i;
+
+    b = _mm_xor_si128(b, ks[0]);
+    for (i = 1; i < 10; i++) {
+        b = _mm_aesenc_si128(b, ks[i]);
+    }
+    return _mm_aesenclast_si128(b, ks[10]);
+}
+
+static __m128i decrypt(const __m128i *dks, __m128i b)
+{
+    int i;
+
+    b = _mm_xor_si128(b, dks[0]);
+    for (i = 1; i < 10; i++) {
+        b = _mm_aesdec_si128(b, dks[i]);
+    }
+    return _mm_aesdeclast_si128(b, dks[10]);
+}
+
+static int test_aes(void)
+{
+    __m128i ks[11], dks[11], b;
+    uint8_t out[16];
+    int err = 0;
+
+    expand_key(ks, dks);
+
+    b = encrypt(ks, _mm_loadu_si128((const __m128i *)plain));
+    _mm_storeu_si128((__m128i *)out, b);
+    if (memcmp(out, cipher, 16)) {
+        printf("FAIL: aesenc/aesenclast\n");
+        err = 1;
+    }
+
+    b = decrypt(dks, b);
+    _mm_storeu_si128((__m128i *)out, b);
+    if (memcmp(out, plain, 16)) {
+        printf("FAIL: aesdec/aesdeclast/aesimc\n");
+        err = 1;
+    }
+    return err;
+}
+
+static void clmul_ref(uint64_t a, uint64_t b, uint64_t *lo, uint64_t *hi)
+{
+    int i;
+
+    *lo = *hi = 0;
+    for (i = 0; i < 64; i++) {
+        if (b & (1ull << i)) {
+            *lo ^= a << i;
+            *hi ^= i ? a >> (64 - i) : 0;
+        }
+    }
+}
+
+static int test_pclmul(void)
+{
+    static const uint64_t vals[] = {
+        0, 1, 0x87, 0x8000000000000001ull, 0xffffffffffffffffull,
+        0x0123456789abcdefull, 0xfedcba9876543210ull,
+    };
+    int n = sizeof(vals) / sizeof(vals[0]);
+    int i, j, err = 0;
+
+    for (i = 0; i < n; i++) {
+        for (j = 0; j < n; j++) {
+            __m128i a = _mm_set_epi64x(vals[j], vals[i]);
+            __m128i b = _mm_set_epi64x(vals[i], vals[j]);
+            uint64_t r[2], lo, hi;
+
+            /* Select the high half of a and the high half of b.  */
+            _mm_storeu_si128((__m128i *)r, _mm_clmulepi64_si128(a, b, 0x11));
+            clmul_ref(vals[j], vals[i], &lo, &hi);
+            if (r[0] != lo || r[1] != hi) {
+                printf("FAIL: pclmulqdq %016llx * %016llx\n",
+                       (unsigned long long)vals[j],
+                       (unsigned long long)vals[i]);
+                err = 1;
+            }
+        }
+    }
+    return err;
+}
+
+static int test_crc32(void)
+{
+    static const char msg[] = "123456789";
+    uint64_t q;
+    uint32_t crc;
+    int i;
+
+    crc = 0xffffffff;
+    for (i = 0; i < 9; i++) {
+        crc = _mm_crc32_u8(crc, msg[i]);
+    }
+    if ((crc ^ 0xffffffff) != 0xe3069283) {
+        printf("FAIL: crc32b\n");
+        return 1;
+    }
+
+    memcpy(&q, msg, 8);
+    crc = _mm_crc32_u64(0xffffffff, q);
+    crc = _mm_crc32_u8(crc, msg[8]);
+    if ((crc ^ 0xffffffff) != 0xe3069283) {
+        printf("FAIL: crc32q\n");
+        return 1;
+    }
+    return 0;
+}
+
+static void bench_aes(void)
+{
+    struct timespec start, end;
+    __m128i ks[11], dks[11];
+    __m128i b = _mm_setzero_si128();
+    uint8_t out[16];
+    double secs;
+    int i;
+
+    expand_key(ks, dks);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < BENCH_BLOCKS; i++) {
+        b = encrypt(ks, b);
+    }
+    /* Keep the loop from being optimized away.  */
+    _mm_storeu_si128((__m128i *)out, b);
+    asm volatile("" : : "m"(out));
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) * 1e-9;
+    printf("aes-128: %d blocks in %.3f s (%.2f MB/s)\n", BENCH_BLOCKS, secs,
+           BENCH_BLOCKS * 16 / secs / (1024 * 1024));
+}
+
+int main(int argc, char *argv[])
+{
+    int err = 0;
+
+    err |= test_aes();
+    err |= test_pclmul();
+    err |= test_crc32();
+    if (!err) {
+        bench_aes();
+    }
+    return err;
+}
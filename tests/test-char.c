@@ -4,6 +4,7 @@
 #include "qemu/config-file.h"
 #include "qemu/option.h"
 #include "qemu/sockets.h"
+#include "qemu/thread.h"
 #include "chardev/char-fe.h"
 #include "chardev/char-mux.h"
 #include "sysemu/sysemu.h"
@@ -156,6 +157,39 @@ static void char_ringbuf_test(void)
     qemu_opts_del(opts);
 }
 
+static void char_ringbuf_writev_test(void)
+{
+    struct iovec iov[3] = {
+        { .iov_base = (void *)"bu", .iov_len = 2 },
+        { .iov_base = NULL, .iov_len = 0 },
+        { .iov_base = (void *)"ff", .iov_len = 2 },
+    };
+    QemuOpts *opts;
+    Chardev *chr;
+    CharBackend be;
+    char *data;
+    int ret;
+
+    opts = qemu_opts_create(qemu_find_opts("chardev"), "ringbuf-writev",
+                            1, &error_abort);
+    qemu_opt_set(opts, "backend", "ringbuf", &error_abort);
+    qemu_opt_set(opts, "size", "8", &error_abort);
+    chr = qemu_chr_new_from_opts(opts, &error_abort);
+    g_assert_nonnull(chr);
+    qemu_opts_del(opts);
+    qemu_chr_fe_init(&be, chr, &error_abort);
+
+    /* Without chr_writev, the elements go out one by one */
+    ret = qemu_chr_fe_writev_all(&be, iov, ARRAY_SIZE(iov));
+    g_assert_cmpint(ret, ==, 4);
+
+    data = qmp_ringbuf_read("ringbuf-writev", 8, false, 0, &error_abort);
+    g_assert_cmpstr(data, ==, "buff");
+    g_free(data);
+
+    qemu_chr_fe_deinit(&be, true);
+}
+
 static void char_mux_test(void)
 {
     QemuOpts *opts;
@@ -420,6 +454,86 @@ static void char_socket_fdpass_test(void)
 }
 
 
+#ifndef _WIN32
+typedef struct SocketWritevData {
+    int fd;
+    uint8_t *buf;
+    size_t len;
+} SocketWritevData;
+
+static void *socket_writev_reader(void *opaque)
+{
+    SocketWritevData *d = opaque;
+    size_t done = 0;
+
+    while (done < d->len) {
+        ssize_t ret = read(d->fd, d->buf + done, d->len - done);
+
+        g_assert_cmpint(ret, >, 0);
+        done += ret;
+    }
+    return NULL;
+}
+
+static void char_socket_writev_test(void)
+{
+    static const size_t lens[] = { 4, 0, 65536, 1500 };
+    struct iovec iov[ARRAY_SIZE(lens)];
+    SocketWritevData d;
+    QemuThread thread;
+    QemuOpts *opts;
+    Chardev *chr;
+    CharBackend be;
+    uint8_t *data;
+    size_t total = 0;
+    int sndbuf = 4096;
+    char *optstr;
+    int sv[2];
+    int i;
+
+    g_assert_cmpint(socketpair(AF_UNIX, SOCK_STREAM, 0, sv), ==, 0);
+    /* A small send buffer forces short writes in the middle of the vector */
+    setsockopt(sv[0], SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+
+    optstr = g_strdup_printf("socket,id=cdev-writev,fd=%d", sv[0]);
+    opts = qemu_opts_parse_noisily(qemu_find_opts("chardev"),
+                                   optstr, true);
+    g_free(optstr);
+    g_assert_nonnull(opts);
+    chr = qemu_chr_new_from_opts(opts, &error_abort);
+    qemu_opts_del(opts);
+    qemu_chr_fe_init(&be, chr, &error_abort);
+
+    for (i = 0; i < ARRAY_SIZE(lens); i++) {
+        total += lens[i];
+    }
+    data = g_malloc(total);
+    for (i = 0; i < total; i++) {
+        data[i] = i * 7;
+    }
+    for (i = 0, total = 0; i < ARRAY_SIZE(lens); i++) {
+        iov[i].iov_base = data + total;
+        iov[i].iov_len = lens[i];
+        total += lens[i];
+    }
+
+    d.fd = sv[1];
+    d.buf = g_malloc0(total);
+    d.len = total;
+    qemu_thread_create(&thread, "writev-reader", socket_writev_reader, &d,
+                       QEMU_THREAD_JOINABLE);
+    g_assert_cmpint(qemu_chr_fe_writev_all(&be, iov, ARRAY_SIZE(iov)), ==,
+                    total);
+    qemu_thread_join(&thread);
+    g_assert(memcmp(d.buf, data, total) == 0);
+
+    qemu_chr_fe_deinit(&be, true);
+    close(sv[1]);
+    g_free(d.buf);
+    g_free(data);
+}
+#endif
+
 static void websock_server_read(void *opaque, const uint8_t *buf, int size)
 {
     g_assert_cmpint(size, ==, 5);
@@ -944,6 +1058,7 @@ int main(int argc, char **argv)
     g_test_add_func("/char/null", char_null_test);
     g_test_add_func("/char/invalid", char_invalid_test);
     g_test_add_func("/char/ringbuf", char_ringbuf_test);
+    g_test_add_func("/char/ringbuf/writev", char_ringbuf_writev_test);
     g_test_add_func("/char/mux", char_mux_test);
 #ifdef _WIN32
     g_test_add_func("/char/console/subprocess", char_console_test_subprocess);
@@ -961,6 +1076,9 @@ int main(int argc, char **argv)
     g_test_add_func("/char/socket/basic", char_socket_basic_test);
     g_test_add_func("/char/socket/reconnect", char_socket_reconnect_test);
     g_test_add_func("/char/socket/fdpass", char_socket_fdpass_test);
+#ifndef _WIN32
+    g_test_add_func("/char/socket/writev", char_socket_writev_test);
+#endif
     g_test_add_func("/char/udp", char_udp_test);
 #ifdef HAVE_CHARDEV_SERIAL
     g_test_add_func("/char/serial", char_serial_test);
@@ -0,0 +1,320 @@
+/*
+ * colo-compare tests
+ *
+ * The primary and secondary streams are fed over socket chardevs to a
+ * colo-compare object with several workers; the test reads back what
+ * it releases on its outdev and counts the checkpoint requests.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include <glib/gstdio.h>
+#include "qapi/error.h"
+#include "qemu/config-file.h"
+#include "qemu/main-loop.h"
+#include "qemu/sockets.h"
+#include "qemu/bswap.h"
+#include "qom/object.h"
+#include "chardev/char.h"
+#include "sysemu/sysemu.h"
+#include "sysemu/iothread.h"
+#include "migration/colo.h"
+#include "migration/migration.h"
+#include "net/net.h"
+#include "net/eth.h"
+#include "net/colo-compare.h"
+
+#define WORKERS         4
+#define CONNECTIONS     16
+#define PACKETS         8
+
+#define ETH_HLEN        14
+#define IP4_HLEN        20
+#define UDP_HLEN        8
+#define FRAME_LEN       (ETH_HLEN + IP4_HLEN + UDP_HLEN + 8)
+
+static char *tmp_dir;
+static int pri_fd, sec_fd, out_fd;
+static Object *compare;
+
+/* Output state, main loop only */
+static SocketReadState out_rs;
+static uint32_t next_seq[CONNECTIONS];
+static int received;
+
+static int checkpoint_requests;
+static bool checkpoint_done;
+
+/* Stand-ins for migration and net/net.c */
+
+MigrationState *migrate_get_current(void)
+{
+    return NULL;
+}
+
+void net_socket_rs_init(SocketReadState *rs,
+                        SocketReadStateFinalize *finalize,
+                        bool vnet_hdr)
+{
+    g_assert(!vnet_hdr);
+    memset(rs, 0, sizeof(*rs));
+    rs->finalize = finalize;
+}
+
+int net_fill_rstate(SocketReadState *rs, const uint8_t *buf, int size)
+{
+    unsigned int l;
+
+    while (size > 0) {
+        if (rs->state == 0) {
+            l = MIN(4 - rs->index, size);
+            memcpy(rs->buf + rs->index, buf, l);
+            rs->index += l;
+            if (rs->index == 4) {
+                rs->packet_len = ldl_be_p(rs->buf);
+                rs->index = 0;
+                rs->state = 2;
+                g_assert_cmpuint(rs->packet_len, <=, sizeof(rs->buf));
+            }
+        } else {
+            l = MIN(rs->packet_len - rs->index, size);
+            memcpy(rs->buf + rs->index, buf, l);
+            rs->index += l;
+            if (rs->index == rs->packet_len) {
+                rs->finalize(rs);
+                rs->index = 0;
+                rs->state = 0;
+            }
+        }
+        buf += l;
+        size -= l;
+    }
+    return 0;
+}
+
+/* UDP from port 1000 + conn, with the connection and sequence as payload */
+static void send_frame(int fd, uint32_t conn, uint32_t seq)
+{
+    uint8_t buf[4 + FRAME_LEN] = { 0 };
+    uint8_t *eth = buf + 4;
+    uint8_t *ip = eth + ETH_HLEN;
+    uint8_t *udp = ip + IP4_HLEN;
+    uint8_t *payload = udp + UDP_HLEN;
+
+    stl_be_p(buf, FRAME_LEN);
+    stw_be_p(eth + 12, ETH_P_IP);
+    ip[0] = 0x45;
+    stw_be_p(ip + 2, FRAME_LEN - ETH_HLEN);
+    ip[8] = 64;
+    ip[9] = IPPROTO_UDP;
+    stl_be_p(ip + 12, 0x0a000001);
+    stl_be_p(ip + 16, 0x0a000002);
+    stw_be_p(udp, 1000 + conn);
+    stw_be_p(udp + 2, 7);
+    stw_be_p(udp + 4, FRAME_LEN - ETH_HLEN - IP4_HLEN);
+    stl_be_p(payload, conn);
+    stl_be_p(payload + 4, seq);
+
+    g_assert_cmpint(write(fd, buf, sizeof(buf)), ==, sizeof(buf));
+}
+
+/* Only primary packets come out, in order within their connection */
+static void out_finalize(SocketReadState *rs)
+{
+    uint8_t *payload = rs->buf + ETH_HLEN + IP4_HLEN + UDP_HLEN;
+    uint32_t conn = ldl_be_p(payload);
+
+    g_assert_cmpuint(rs->packet_len, ==, FRAME_LEN);
+    g_assert_cmpuint(conn, <, CONNECTIONS);
+    g_assert_cmpuint(ldl_be_p(payload + 4), ==, next_seq[conn]);
+    next_seq[conn]++;
+    received++;
+}
+
+static void out_read(void *opaque)
+{
+    uint8_t buf[4096];
+    ssize_t ret;
+
+    ret = read(out_fd, buf, sizeof(buf));
+    g_assert_cmpint(ret, >, 0);
+    net_fill_rstate(&out_rs, buf, ret);
+}
+
+static void wait_received(int n)
+{
+    while (received < n) {
+        main_loop_wait(false);
+    }
+    g_assert_cmpint(received, ==, n);
+}
+
+/* Called from a worker thread when a shard diverges */
+static void checkpoint_notify(Notifier *notifier, void *data)
+{
+    atomic_inc(&checkpoint_requests);
+    qemu_notify_event();
+}
+
+static Notifier checkpoint_notifier = {
+    .notify = checkpoint_notify,
+};
+
+/*
+ * The event is completed by the main loop and the workers, so the
+ * checkpoint is taken from another thread, as the COLO frame does.
+ */
+static void *checkpoint_thread(void *opaque)
+{
+    colo_notify_compares_event(NULL, COLO_EVENT_CHECKPOINT, &error_abort);
+    atomic_set(&checkpoint_done, true);
+    qemu_notify_event();
+    return NULL;
+}
+
+static void checkpoint(void)
+{
+    QemuThread thread;
+
+    checkpoint_done = false;
+    qemu_thread_create(&thread, "checkpoint", checkpoint_thread, NULL,
+                       QEMU_THREAD_JOINABLE);
+    while (!atomic_read(&checkpoint_done)) {
+        main_loop_wait(false);
+    }
+    qemu_thread_join(&thread);
+}
+
+/* Matching packets of many connections are all released */
+static void test_compare_workers(void)
+{
+    uint32_t conn, seq;
+
+    for (seq = 0; seq < PACKETS; seq++) {
+        for (conn = 0; conn < CONNECTIONS; conn++) {
+            send_frame(pri_fd, conn, seq);
+        }
+        /* The secondary answers in another order every other round */
+        for (conn = 0; conn < CONNECTIONS; conn++) {
+            send_frame(sec_fd, conn ^ (seq & 1), seq);
+        }
+    }
+    wait_received(CONNECTIONS * PACKETS);
+    g_assert_cmpint(atomic_read(&checkpoint_requests), ==, 0);
+}
+
+/*
+ * Differing packets ask for one checkpoint, which releases the held
+ * primary packets; the next difference asks again.
+ */
+static void test_compare_checkpoint(void)
+{
+    int base = received;
+
+    send_frame(pri_fd, 0, next_seq[0]);
+    send_frame(sec_fd, 0, next_seq[0] + 1);
+    while (!atomic_read(&checkpoint_requests)) {
+        main_loop_wait(false);
+    }
+
+    /*
+     * Until the checkpoint, other differences do not ask again.  The
+     * late match releases the primary packet, so the difference was
+     * seen before the checkpoint is taken.
+     */
+    send_frame(pri_fd, 1, next_seq[1]);
+    send_frame(sec_fd, 1, next_seq[1] + 1);
+    send_frame(sec_fd, 1, next_seq[1]);
+    wait_received(base + 1);
+    g_assert_cmpint(atomic_read(&checkpoint_requests), ==, 1);
+
+    checkpoint();
+    wait_received(base + 2);
+    g_assert_cmpint(atomic_read(&checkpoint_requests), ==, 1);
+
+    send_frame(pri_fd, 0, next_seq[0]);
+    send_frame(sec_fd, 0, next_seq[0] + 1);
+    while (atomic_read(&checkpoint_requests) < 2) {
+        main_loop_wait(false);
+    }
+    checkpoint();
+    wait_received(base + 3);
+    g_assert_cmpint(atomic_read(&checkpoint_requests), ==, 2);
+}
+
+static int connect_chardev(const char *id)
+{
+    char *path = g_strdup_printf("%s/%s", tmp_dir, id);
+    char *backend = g_strdup_printf("unix:%s,server,nowait", path);
+    Chardev *chr = qemu_chr_new(id, backend);
+    int fd;
+
+    g_assert_nonnull(chr);
+    fd = unix_connect(path, &error_abort);
+    while (!chr->be_open) {
+        main_loop_wait(false);
+    }
+    g_free(backend);
+    g_free(path);
+    return fd;
+}
+
+static void unlink_chardev(const char *id)
+{
+    char *path = g_strdup_printf("%s/%s", tmp_dir, id);
+
+    g_unlink(path);
+    g_free(path);
+}
+
+int main(int argc, char **argv)
+{
+    Object *iothread;
+    int ret;
+
+    qemu_init_main_loop(&error_abort);
+    socket_init();
+    module_call_init(MODULE_INIT_QOM);
+    qemu_add_opts(&qemu_chardev_opts);
+
+    tmp_dir = g_dir_make_tmp("colo-compare-test-XXXXXX", NULL);
+    g_assert_nonnull(tmp_dir);
+    pri_fd = connect_chardev("pri");
+    sec_fd = connect_chardev("sec");
+    out_fd = connect_chardev("out");
+    net_socket_rs_init(&out_rs, out_finalize, false);
+    qemu_set_fd_handler(out_fd, out_read, NULL, NULL);
+
+    iothread = object_new_with_props(TYPE_IOTHREAD, object_get_objects_root(),
+                                     "iothread0", &error_abort, NULL);
+    compare = object_new_with_props("colo-compare", object_get_objects_root(),
+                                    "comp0", &error_abort,
+                                    "primary_in", "pri",
+                                    "secondary_in", "sec",
+                                    "outdev", "out",
+                                    "iothread", "iothread0",
+                                    "workers", stringify(WORKERS),
+                                    NULL);
+    colo_compare_register_notifier(&checkpoint_notifier);
+
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/colo-compare/workers", test_compare_workers);
+    g_test_add_func("/colo-compare/checkpoint", test_compare_checkpoint);
+    ret = g_test_run();
+
+    colo_compare_unregister_notifier(&checkpoint_notifier);
+    object_unparent(compare);
+    object_unparent(iothread);
+    qemu_set_fd_handler(out_fd, NULL, NULL, NULL);
+    close(pri_fd);
+    close(sec_fd);
+    close(out_fd);
+    unlink_chardev("pri");
+    unlink_chardev("sec");
+    unlink_chardev("out");
+    g_rmdir(tmp_dir);
+    g_free(tmp_dir);
+    return ret;
+}
@@ -0,0 +1,464 @@
+/*
+ * Network packet queue tests
+ *
+ * The handoff ring of a NetQueue is fed by a producer in the main loop
+ * and drained by a consumer in an IOThread, like a netdev in the main
+ * loop sending to a NIC whose queue pair runs in an IOThread.  The batch
+ * tests use the same setup, with a receiver that takes several packets
+ * per call.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qapi/error.h"
+#include "qemu/main-loop.h"
+#include "qemu/iov.h"
+#include "block/aio.h"
+#include "net/net.h"
+#include "net/queue.h"
+#include "iothread.h"
+
+#define RING_SIZE       8
+#define STRESS_PACKETS  20000
+#define MAX_PACKET      (sizeof(uint32_t) + 64)
+
+static NetClientState producer;
+static NetClientState receiver;
+
+static IOThread *iothread;
+static AioContext *consumer_ctx;
+
+/* Receiver state, only changed with the queue locked */
+static bool receiver_busy;
+static bool receiver_stopped;
+static int busy_every;
+static uint32_t next_seq;
+static int delivered;
+static int deliver_calls;
+static int batch_calls;
+static int batch_limit;
+
+/* Producer state, main loop only */
+static int sent_cb_calls;
+static ssize_t sent_cb_ret;
+static QemuThread main_thread;
+
+/* Stand-ins for net/net.c */
+
+int qemu_can_send_packet(NetClientState *nc)
+{
+    return 1;
+}
+
+int qemu_can_receive_packet(NetClientState *nc)
+{
+    g_assert(nc == &receiver);
+    return !atomic_read(&receiver_stopped);
+}
+
+void qemu_send_batch_begin(NetClientState *nc)
+{
+}
+
+void qemu_send_batch_end(NetClientState *nc)
+{
+}
+
+static size_t packet_size(uint32_t seq)
+{
+    return sizeof(seq) + seq % (MAX_PACKET - sizeof(seq) + 1);
+}
+
+static ssize_t receive_seq(const uint8_t *buf, size_t size)
+{
+    uint32_t seq;
+
+    memcpy(&seq, buf, sizeof(seq));
+    g_assert_cmpuint(seq, ==, next_seq);
+    g_assert_cmpuint(size, ==, packet_size(seq));
+    next_seq++;
+    delivered++;
+    return size;
+}
+
+static void receiver_flush_bh(void *opaque)
+{
+    NetQueue *queue = opaque;
+
+    atomic_set(&receiver_busy, false);
+    qemu_net_queue_flush(queue);
+}
+
+static ssize_t deliver(NetClientState *sender, unsigned flags,
+                       const struct iovec *iov, int iovcnt, void *opaque)
+{
+    NetQueue *queue = receiver.incoming_queue;
+    uint8_t buf[MAX_PACKET];
+    size_t size = iov_to_buf(iov, iovcnt, 0, buf, sizeof(buf));
+
+    g_assert(opaque == &receiver);
+    g_assert(sender == &producer);
+    g_assert(!atomic_read(&receiver_stopped));
+    deliver_calls++;
+
+    if (atomic_read(&receiver_busy)) {
+        return 0;
+    }
+
+    /* A busy receiver flushes the queue itself once it has room */
+    if (busy_every && deliver_calls % busy_every == 0) {
+        atomic_set(&receiver_busy, true);
+        aio_bh_schedule_oneshot(consumer_ctx, receiver_flush_bh, queue);
+        return 0;
+    }
+
+    return receive_seq(buf, size);
+}
+
+/* Takes up to batch_limit packets per call, if set */
+static int deliver_batch(NetClientState *sender, const struct iovec *packets,
+                         int count, void *opaque)
+{
+    int i;
+
+    g_assert(opaque == &receiver);
+    g_assert(sender == &producer);
+    g_assert(!atomic_read(&receiver_stopped));
+    batch_calls++;
+
+    if (atomic_read(&receiver_busy)) {
+        return 0;
+    }
+
+    if (batch_limit) {
+        count = MIN(count, batch_limit);
+    }
+    for (i = 0; i < count; i++) {
+        receive_seq(packets[i].iov_base, packets[i].iov_len);
+    }
+    return count;
+}
+
+static void sent_cb(NetClientState *sender, ssize_t ret)
+{
+    g_assert(sender == &producer);
+    g_assert(qemu_thread_is_self(&main_thread));
+    sent_cb_calls++;
+    sent_cb_ret = ret;
+}
+
+static ssize_t send_seq(uint32_t seq, NetPacketSent *cb)
+{
+    uint8_t buf[MAX_PACKET];
+
+    memset(buf, seq, sizeof(buf));
+    memcpy(buf, &seq, sizeof(seq));
+    return qemu_net_queue_send(receiver.incoming_queue, &producer, 0,
+                               buf, packet_size(seq), cb);
+}
+
+/* Returns once every bottom half scheduled so far in the IOThread ran */
+static void consumer_barrier_bh(void *opaque)
+{
+    QemuEvent *done = opaque;
+
+    qemu_event_set(done);
+}
+
+static void consumer_barrier(void)
+{
+    QemuEvent done;
+    int i;
+
+    /* Bottom halves scheduled together may run in any order, but all of
+     * them are done before the next round.
+     */
+    qemu_event_init(&done, false);
+    for (i = 0; i < 2; i++) {
+        qemu_event_reset(&done);
+        aio_bh_schedule_oneshot(consumer_ctx, consumer_barrier_bh, &done);
+        qemu_event_wait(&done);
+    }
+    qemu_event_destroy(&done);
+}
+
+static void setup(bool ring)
+{
+    receiver_busy = false;
+    receiver_stopped = false;
+    busy_every = 0;
+    next_seq = 0;
+    delivered = 0;
+    deliver_calls = 0;
+    batch_calls = 0;
+    batch_limit = 0;
+    sent_cb_calls = 0;
+    sent_cb_ret = -1;
+
+    receiver.incoming_queue = qemu_new_net_queue(deliver, &receiver);
+    qemu_net_queue_set_aio_context(receiver.incoming_queue, consumer_ctx);
+    if (ring) {
+        qemu_net_queue_start_ring(receiver.incoming_queue, &producer, NULL,
+                                  RING_SIZE);
+    }
+}
+
+static void teardown(void)
+{
+    consumer_barrier();
+    aio_context_acquire(consumer_ctx);
+    qemu_del_net_queue(receiver.incoming_queue);
+    aio_context_release(consumer_ctx);
+    receiver.incoming_queue = NULL;
+}
+
+static void wait_delivered(int n)
+{
+    while (atomic_read(&delivered) < n) {
+        aio_poll(qemu_get_aio_context(), false);
+    }
+}
+
+/* A full ring keeps one more packet and calls back once it has room */
+static void test_ring_full(void)
+{
+    int i;
+
+    setup(true);
+    atomic_set(&receiver_busy, true);
+
+    for (i = 0; i < RING_SIZE; i++) {
+        g_assert_cmpint(send_seq(i, sent_cb), ==, packet_size(i));
+    }
+    consumer_barrier();
+    g_assert_cmpint(send_seq(RING_SIZE, sent_cb), ==, 0);
+    g_assert(!qemu_net_queue_ring_has_room(receiver.incoming_queue,
+                                           &producer));
+
+    /* Without a callback the packet is dropped */
+    g_assert_cmpint(send_seq(RING_SIZE + 1, NULL), ==, 0);
+
+    aio_poll(qemu_get_aio_context(), false);
+    g_assert_cmpint(sent_cb_calls, ==, 0);
+    g_assert_cmpint(delivered, ==, 0);
+
+    /* The receiver makes room, the pending packet follows the ring */
+    atomic_set(&receiver_busy, false);
+    g_assert(qemu_net_queue_flush(receiver.incoming_queue));
+    g_assert_cmpint(delivered, ==, RING_SIZE);
+    while (!sent_cb_calls) {
+        aio_poll(qemu_get_aio_context(), true);
+    }
+    g_assert_cmpint(sent_cb_calls, ==, 1);
+    g_assert_cmpint(sent_cb_ret, ==, packet_size(RING_SIZE));
+    wait_delivered(RING_SIZE + 1);
+    g_assert(qemu_net_queue_ring_has_room(receiver.incoming_queue,
+                                          &producer));
+
+    teardown();
+}
+
+/* Packets wait in the ring while the receiver cannot take them */
+static void test_ring_receiver_stopped(void)
+{
+    int i;
+
+    setup(true);
+    atomic_set(&receiver_stopped, true);
+
+    for (i = 0; i < RING_SIZE / 2; i++) {
+        g_assert_cmpint(send_seq(i, sent_cb), ==, packet_size(i));
+    }
+    consumer_barrier();
+    g_assert(!qemu_net_queue_flush(receiver.incoming_queue));
+    g_assert_cmpint(deliver_calls, ==, 0);
+
+    atomic_set(&receiver_stopped, false);
+    g_assert(qemu_net_queue_flush(receiver.incoming_queue));
+    g_assert_cmpint(delivered, ==, RING_SIZE / 2);
+    g_assert_cmpint(sent_cb_calls, ==, 0);
+
+    teardown();
+}
+
+/* Stopping the ring moves its contents, then the pending packet, to the
+ * packet list; they are delivered in order by the next flush.
+ */
+static void test_ring_stop(void)
+{
+    int i;
+
+    setup(true);
+    atomic_set(&receiver_busy, true);
+
+    for (i = 0; i < RING_SIZE; i++) {
+        g_assert_cmpint(send_seq(i, sent_cb), ==, packet_size(i));
+    }
+    consumer_barrier();
+    g_assert_cmpint(send_seq(RING_SIZE, sent_cb), ==, 0);
+
+    aio_context_acquire(consumer_ctx);
+    qemu_net_queue_stop_ring(receiver.incoming_queue);
+    aio_context_release(consumer_ctx);
+
+    /* Without the ring, packets from the producer go on the list after
+     * the ones that were in flight.
+     */
+    g_assert_cmpint(send_seq(RING_SIZE + 1, NULL), ==, 0);
+
+    atomic_set(&receiver_busy, false);
+    g_assert(qemu_net_queue_flush(receiver.incoming_queue));
+    g_assert_cmpint(delivered, ==, RING_SIZE + 2);
+    g_assert_cmpint(sent_cb_calls, ==, 1);
+    g_assert_cmpint(sent_cb_ret, ==, packet_size(RING_SIZE));
+
+    teardown();
+}
+
+/* Purging the producer's packets empties the ring and drops the pending
+ * packet; later packets go through the ring again.
+ */
+static void test_ring_purge(void)
+{
+    int i;
+
+    setup(true);
+    atomic_set(&receiver_busy, true);
+
+    for (i = 0; i < RING_SIZE; i++) {
+        g_assert_cmpint(send_seq(i, sent_cb), ==, packet_size(i));
+    }
+    consumer_barrier();
+    g_assert_cmpint(send_seq(RING_SIZE, sent_cb), ==, 0);
+
+    qemu_net_queue_purge(receiver.incoming_queue, &producer);
+    g_assert_cmpint(sent_cb_calls, ==, 1);
+    g_assert_cmpint(sent_cb_ret, ==, 0);
+    g_assert(qemu_net_queue_ring_has_room(receiver.incoming_queue,
+                                          &producer));
+
+    atomic_set(&receiver_busy, false);
+    next_seq = RING_SIZE + 1;
+    for (i = RING_SIZE + 1; i < 2 * RING_SIZE + 1; i++) {
+        g_assert_cmpint(send_seq(i, sent_cb), ==, packet_size(i));
+    }
+    wait_delivered(RING_SIZE);
+    consumer_barrier();
+    g_assert_cmpint(delivered, ==, RING_SIZE);
+    g_assert_cmpint(sent_cb_calls, ==, 1);
+
+    teardown();
+}
+
+/* Many packets through a small ring, with a receiver that is busy now
+ * and then; nothing may be lost or reordered.
+ */
+static void test_ring_stress(void)
+{
+    uint32_t seq = 0;
+
+    setup(true);
+    busy_every = 97;
+
+    while (seq < STRESS_PACKETS) {
+        if (send_seq(seq, sent_cb) == 0) {
+            int calls = sent_cb_calls;
+
+            while (sent_cb_calls == calls) {
+                aio_poll(qemu_get_aio_context(), true);
+            }
+        }
+        seq++;
+    }
+    wait_delivered(STRESS_PACKETS);
+    g_assert_cmpuint(next_seq, ==, STRESS_PACKETS);
+
+    teardown();
+}
+
+/* The ring is drained with as few calls as the receiver allows */
+static void test_ring_batch(void)
+{
+    NetQueue *queue;
+    int i;
+
+    setup(true);
+    queue = receiver.incoming_queue;
+    qemu_net_queue_set_deliver_batch(queue, deliver_batch);
+    atomic_set(&receiver_busy, true);
+
+    for (i = 0; i < RING_SIZE; i++) {
+        g_assert_cmpint(send_seq(i, sent_cb), ==, packet_size(i));
+    }
+    consumer_barrier();
+    g_assert_cmpint(delivered, ==, 0);
+
+    atomic_set(&receiver_busy, false);
+    batch_calls = 0;
+    g_assert(qemu_net_queue_flush(queue));
+    g_assert_cmpint(batch_calls, ==, 1);
+    g_assert_cmpint(deliver_calls, ==, 0);
+    g_assert_cmpint(delivered, ==, RING_SIZE);
+
+    teardown();
+}
+
+/* Packets sent during a batch are taken at once and delivered together
+ * when it ends; those the receiver leaves stay queued, in order.
+ */
+static void test_batch(void)
+{
+    NetQueue *queue;
+    int i;
+
+    setup(false);
+    queue = receiver.incoming_queue;
+    qemu_net_queue_set_deliver_batch(queue, deliver_batch);
+    batch_limit = 5;
+
+    qemu_net_queue_begin_batch(queue);
+    for (i = 0; i < RING_SIZE; i++) {
+        g_assert_cmpint(send_seq(i, sent_cb), ==, packet_size(i));
+    }
+    g_assert_cmpint(batch_calls, ==, 0);
+    qemu_net_queue_end_batch(queue);
+    g_assert_cmpint(batch_calls, ==, 1);
+    g_assert_cmpint(delivered, ==, 5);
+
+    batch_limit = 0;
+    g_assert(qemu_net_queue_flush(queue));
+    g_assert_cmpint(batch_calls, ==, 2);
+    g_assert_cmpint(delivered, ==, RING_SIZE);
+    g_assert_cmpint(deliver_calls, ==, 0);
+
+    /* They were taken as sent already */
+    g_assert_cmpint(sent_cb_calls, ==, 0);
+
+    teardown();
+}
+
+int main(int argc, char **argv)
+{
+    int ret;
+
+    qemu_init_main_loop(&error_abort);
+    qemu_thread_get_self(&main_thread);
+    iothread = iothread_new();
+    consumer_ctx = iothread_get_aio_context(iothread);
+
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/net/queue/ring/full", test_ring_full);
+    g_test_add_func("/net/queue/ring/receiver-stopped",
+                    test_ring_receiver_stopped);
+    g_test_add_func("/net/queue/ring/stop", test_ring_stop);
+    g_test_add_func("/net/queue/ring/purge", test_ring_purge);
+    g_test_add_func("/net/queue/ring/stress", test_ring_stress);
+    g_test_add_func("/net/queue/ring/batch", test_ring_batch);
+    g_test_add_func("/net/queue/batch", test_batch);
+    ret = g_test_run();
+
+    iothread_join(iothread);
+    return ret;
+}
@@ -0,0 +1,274 @@
+/*
+ * Receive segment coalescing tests
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/bswap.h"
+#include "qemu/timer.h"
+#include "hw/net/net_rx_pkt.h"
+#include "net/checksum.h"
+
+#define MSS             1000
+#define IP4_HLEN        20
+#define IP6_HLEN        40
+#define TCP_HLEN        20
+#define TCP_FLAG_PSH    0x08
+#define TCP_FLAG_SYN    0x02
+
+typedef struct Delivered {
+    uint8_t buf[ETH_HLEN + IP6_HLEN + 0x10000];
+    size_t size;
+    NetRxRscInfo info;
+    bool merged;
+    bool busy;
+    int count;
+} Delivered;
+
+static Delivered delivered;
+
+static ssize_t deliver(void *opaque, const uint8_t *buf, size_t size,
+                       const NetRxRscInfo *info)
+{
+    Delivered *d = opaque;
+
+    if (d->busy) {
+        return 0;
+    }
+    memcpy(d->buf, buf, size);
+    d->size = size;
+    d->merged = info != NULL;
+    if (info) {
+        d->info = *info;
+    }
+    d->count++;
+    return size;
+}
+
+/* Build a segment whose payload bytes are the low bits of their sequence
+ * number, with a valid checksum.
+ */
+static size_t build_tcp(uint8_t *buf, bool ipv6, uint32_t seq,
+                        uint8_t flags, size_t data_len)
+{
+    size_t l3_len = ipv6 ? IP6_HLEN : IP4_HLEN;
+    uint8_t *ip = buf + ETH_HLEN;
+    uint8_t *tcp = ip + l3_len;
+    uint32_t csum, cso;
+    size_t i;
+
+    memset(buf, 0, ETH_HLEN + l3_len + TCP_HLEN);
+    memset(buf, 0x52, 2 * ETH_ALEN);
+    if (ipv6) {
+        stw_be_p(buf + 12, ETH_P_IPV6);
+        ip[0] = 0x60;
+        stw_be_p(ip + 4, TCP_HLEN + data_len);
+        ip[6] = IP_PROTO_TCP;
+        ip[7] = 64;
+        ip[8] = ip[24] = 0xfe;
+        ip[23] = 1;
+        ip[39] = 2;
+    } else {
+        stw_be_p(buf + 12, ETH_P_IP);
+        ip[0] = 0x45;
+        stw_be_p(ip + 2, IP4_HLEN + TCP_HLEN + data_len);
+        stw_be_p(ip + 6, IP_DF);
+        ip[8] = 64;
+        ip[9] = IP_PROTO_TCP;
+        stl_be_p(ip + 12, 0x0a000001);
+        stl_be_p(ip + 16, 0x0a000002);
+        eth_fix_ip4_checksum(ip, IP4_HLEN);
+    }
+
+    stw_be_p(tcp, 80);
+    stw_be_p(tcp + 2, 1234);
+    stl_be_p(tcp + 4, seq);
+    stl_be_p(tcp + 8, 1);
+    tcp[12] = (TCP_HLEN / 4) << 4;
+    tcp[13] = TH_ACK | flags;
+    stw_be_p(tcp + 14, 512);
+    for (i = 0; i < data_len; i++) {
+        tcp[TCP_HLEN + i] = seq + i;
+    }
+
+    if (ipv6) {
+        csum = eth_calc_ip6_pseudo_hdr_csum((struct ip6_header *)ip,
+                                            TCP_HLEN + data_len,
+                                            IP_PROTO_TCP, &cso);
+    } else {
+        csum = eth_calc_ip4_pseudo_hdr_csum((struct ip_header *)ip,
+                                            TCP_HLEN + data_len, &cso);
+    }
+    csum += net_checksum_add(TCP_HLEN + data_len, tcp);
+    stw_be_p(tcp + 16, net_checksum_finish(csum));
+    return ETH_HLEN + l3_len + TCP_HLEN + data_len;
+}
+
+static NetRxRsc *rsc_new(void)
+{
+    NetRxRsc *rsc = net_rx_rsc_new(deliver, &delivered, 300000);
+
+    memset(&delivered, 0, sizeof(delivered));
+    net_rx_rsc_set_types(rsc, true, true);
+    return rsc;
+}
+
+static void check_merged(bool ipv6, uint32_t seq, int segments)
+{
+    size_t l3_len = ipv6 ? IP6_HLEN : IP4_HLEN;
+    const uint8_t *ip = delivered.buf + ETH_HLEN;
+    const uint8_t *data = ip + l3_len + TCP_HLEN;
+    size_t i;
+
+    g_assert(delivered.merged);
+    g_assert_cmpint(delivered.info.segments, ==, segments);
+    g_assert_cmpint(delivered.info.mss, ==, MSS);
+    g_assert_cmpint(delivered.info.hdr_len, ==, ETH_HLEN + l3_len + TCP_HLEN);
+    g_assert(delivered.info.ipv6 == ipv6);
+    g_assert_cmpint(delivered.size, ==,
+                    ETH_HLEN + l3_len + TCP_HLEN + segments * MSS);
+
+    if (ipv6) {
+        g_assert_cmpint(lduw_be_p(ip + 4), ==, TCP_HLEN + segments * MSS);
+    } else {
+        g_assert_cmpint(lduw_be_p(ip + 2), ==,
+                        IP4_HLEN + TCP_HLEN + segments * MSS);
+        g_assert_cmpint(net_raw_checksum((uint8_t *)ip, IP4_HLEN), ==, 0);
+    }
+    for (i = 0; i < segments * MSS; i++) {
+        g_assert_cmpint(data[i], ==, (uint8_t)(seq + i));
+    }
+}
+
+static void test_rsc_merge(bool ipv6)
+{
+    NetRxRsc *rsc = rsc_new();
+    uint8_t buf[2048];
+    size_t size;
+    int i;
+
+    for (i = 0; i < 4; i++) {
+        size = build_tcp(buf, ipv6, 100 + i * MSS, 0, MSS);
+        g_assert_cmpint(net_rx_rsc_receive(rsc, buf, size, 0, 0), ==, size);
+    }
+    g_assert_cmpint(delivered.count, ==, 0);
+
+    net_rx_rsc_flush(rsc);
+    g_assert_cmpint(delivered.count, ==, 1);
+    check_merged(ipv6, 100, 4);
+    net_rx_rsc_free(rsc);
+}
+
+static void test_rsc_merge_ipv4(void)
+{
+    test_rsc_merge(false);
+}
+
+static void test_rsc_merge_ipv6(void)
+{
+    test_rsc_merge(true);
+}
+
+static void test_rsc_push(void)
+{
+    NetRxRsc *rsc = rsc_new();
+    uint8_t buf[2048];
+    size_t size;
+
+    size = build_tcp(buf, false, 0, 0, MSS);
+    g_assert_cmpint(net_rx_rsc_receive(rsc, buf, size, 0, 0), ==, size);
+    size = build_tcp(buf, false, MSS, TCP_FLAG_PSH, MSS);
+    g_assert_cmpint(net_rx_rsc_receive(rsc, buf, size, 0, 0), ==, size);
+
+    g_assert_cmpint(delivered.count, ==, 1);
+    check_merged(false, 0, 2);
+    g_assert(delivered.buf[ETH_HLEN + IP4_HLEN + 13] & TCP_FLAG_PSH);
+    net_rx_rsc_free(rsc);
+}
+
+static void test_rsc_out_of_order(void)
+{
+    NetRxRsc *rsc = rsc_new();
+    uint8_t buf[2048];
+    size_t size;
+
+    size = build_tcp(buf, false, 0, 0, MSS);
+    g_assert_cmpint(net_rx_rsc_receive(rsc, buf, size, 0, 0), ==, size);
+
+    /* The held segment goes first, alone, and the new one starts over */
+    size = build_tcp(buf, false, 2 * MSS, 0, MSS);
+    g_assert_cmpint(net_rx_rsc_receive(rsc, buf, size, 0, 0), ==, size);
+    g_assert_cmpint(delivered.count, ==, 1);
+    g_assert(!delivered.merged);
+    g_assert_cmpint(ldl_be_p(delivered.buf + ETH_HLEN + IP4_HLEN + 4), ==, 0);
+
+    net_rx_rsc_flush(rsc);
+    g_assert_cmpint(delivered.count, ==, 2);
+    g_assert_cmpint(ldl_be_p(delivered.buf + ETH_HLEN + IP4_HLEN + 4), ==,
+                    2 * MSS);
+    net_rx_rsc_free(rsc);
+}
+
+static void test_rsc_bypass(void)
+{
+    NetRxRsc *rsc = rsc_new();
+    uint8_t buf[2048];
+    size_t size;
+
+    /* SYNs and corrupted segments are not for the coalescer */
+    size = build_tcp(buf, false, 0, TCP_FLAG_SYN, 0);
+    g_assert_cmpint(net_rx_rsc_receive(rsc, buf, size, 0, 0), ==, -1);
+    size = build_tcp(buf, false, 0, 0, MSS);
+    buf[size - 1] ^= 1;
+    g_assert_cmpint(net_rx_rsc_receive(rsc, buf, size, 0, 0), ==, -1);
+    g_assert_cmpint(net_rx_rsc_receive(rsc, buf, size, 0,
+                                       NET_RX_RSC_CSUM_VALID), ==, size);
+
+    /* A pure ACK of a held flow flushes it first */
+    size = build_tcp(buf, false, MSS, 0, 0);
+    g_assert_cmpint(net_rx_rsc_receive(rsc, buf, size, 0, 0), ==, -1);
+    g_assert_cmpint(delivered.count, ==, 1);
+
+    /* Disabled IP version */
+    net_rx_rsc_set_types(rsc, false, true);
+    size = build_tcp(buf, false, 0, 0, MSS);
+    g_assert_cmpint(net_rx_rsc_receive(rsc, buf, size, 0, 0), ==, -1);
+    net_rx_rsc_free(rsc);
+}
+
+static void test_rsc_busy(void)
+{
+    NetRxRsc *rsc = rsc_new();
+    uint8_t buf[2048];
+    size_t size;
+
+    size = build_tcp(buf, false, 0, 0, MSS);
+    g_assert_cmpint(net_rx_rsc_receive(rsc, buf, size, 0, 0), ==, size);
+
+    /* The flow cannot be delivered, so the next frame must wait */
+    delivered.busy = true;
+    size = build_tcp(buf, false, 5 * MSS, 0, MSS);
+    g_assert_cmpint(net_rx_rsc_receive(rsc, buf, size, 0, 0), ==, 0);
+    net_rx_rsc_flush(rsc);
+    g_assert_cmpint(delivered.count, ==, 0);
+
+    delivered.busy = false;
+    g_assert_cmpint(net_rx_rsc_receive(rsc, buf, size, 0, 0), ==, size);
+    g_assert_cmpint(delivered.count, ==, 1);
+    net_rx_rsc_free(rsc);
+}
+
+int main(int argc, char **argv)
+{
+    init_clocks(NULL);
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/net/rsc/merge/ipv4", test_rsc_merge_ipv4);
+    g_test_add_func("/net/rsc/merge/ipv6", test_rsc_merge_ipv6);
+    g_test_add_func("/net/rsc/push", test_rsc_push);
+    g_test_add_func("/net/rsc/out-of-order", test_rsc_out_of_order);
+    g_test_add_func("/net/rsc/bypass", test_rsc_bypass);
+    g_test_add_func("/net/rsc/busy", test_rsc_busy);
+    return g_test_run();
+}
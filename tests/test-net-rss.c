@@ -0,0 +1,186 @@
+/*
+ * Toeplitz hash tests for the receive-side scaling of emulated NICs
+ *
+ * The expected values are those of the RSS verification suite in
+ * Microsoft's "Receive-Side Scaling" specification.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/bswap.h"
+#include "hw/net/net_rx_pkt.h"
+
+#define ETH_HLEN        14
+#define IP4_HLEN        20
+#define IP6_HLEN        40
+
+static uint8_t rss_key[40] = {
+    0x6d, 0x5a, 0x56, 0xda, 0x25, 0x5b, 0x0e, 0xc2,
+    0x41, 0x67, 0x25, 0x3d, 0x43, 0xa3, 0x8f, 0xb0,
+    0xd0, 0xca, 0x2b, 0xcb, 0xae, 0x7b, 0x30, 0xb4,
+    0x77, 0xcb, 0x2d, 0xa3, 0x80, 0x30, 0xf2, 0x0c,
+    0x6a, 0x42, 0xb7, 0x3b, 0xbe, 0xac, 0x01, 0xfa,
+};
+
+typedef struct RssTest4 {
+    uint8_t src[4], dst[4];
+    uint16_t sport, dport;
+    uint32_t hash_ip, hash_l4;
+} RssTest4;
+
+typedef struct RssTest6 {
+    uint8_t src[16], dst[16];
+    uint16_t sport, dport;
+    uint32_t hash_ip, hash_l4;
+} RssTest6;
+
+static const RssTest4 tests4[] = {
+    { { 66, 9, 149, 187 }, { 161, 142, 100, 80 }, 2794, 1766,
+      0x323e8fc2, 0x51ccc178 },
+    { { 199, 92, 111, 2 }, { 65, 69, 140, 83 }, 14230, 4739,
+      0xd718262a, 0xc626b0ea },
+    { { 24, 19, 198, 95 }, { 12, 22, 207, 184 }, 12898, 38024,
+      0xd2d0a5de, 0x5c2b394a },
+    { { 38, 27, 205, 30 }, { 209, 142, 163, 6 }, 48228, 2217,
+      0x82989176, 0xafc7327f },
+    { { 153, 39, 163, 191 }, { 202, 188, 127, 2 }, 44251, 1303,
+      0x5d1809c5, 0x10e828a2 },
+};
+
+static const RssTest6 tests6[] = {
+    /* 3ffe:2501:200:1fff::7 -> 3ffe:2501:200:3::1 */
+    { { 0x3f, 0xfe, 0x25, 0x01, 0x02, 0x00, 0x1f, 0xff,
+        0, 0, 0, 0, 0, 0, 0, 0x07 },
+      { 0x3f, 0xfe, 0x25, 0x01, 0x02, 0x00, 0x00, 0x03,
+        0, 0, 0, 0, 0, 0, 0, 0x01 },
+      2794, 1766, 0x2cc18cd5, 0x40207d3d },
+    /* 3ffe:501:8::260:97ff:fe40:efab -> ff02::1 */
+    { { 0x3f, 0xfe, 0x05, 0x01, 0x00, 0x08, 0x00, 0x00,
+        0x02, 0x60, 0x97, 0xff, 0xfe, 0x40, 0xef, 0xab },
+      { 0xff, 0x02, 0, 0, 0, 0, 0, 0,
+        0, 0, 0, 0, 0, 0, 0, 0x01 },
+      14230, 4739, 0x0f0c461c, 0xdde51bbf },
+};
+
+/* Fill in a minimal TCP or UDP header */
+static size_t build_l4(uint8_t *p, uint8_t proto, uint16_t sport,
+                       uint16_t dport)
+{
+    size_t len = proto == IP_PROTO_TCP ? 20 : 8;
+
+    memset(p, 0, len);
+    stw_be_p(p, sport);
+    stw_be_p(p + 2, dport);
+    if (proto == IP_PROTO_TCP) {
+        p[12] = 5 << 4;
+    } else {
+        stw_be_p(p + 4, len);
+    }
+    return len;
+}
+
+static size_t build_ip4(uint8_t *buf, const RssTest4 *t, uint8_t proto)
+{
+    uint8_t *ip = buf + ETH_HLEN;
+    size_t l4len;
+
+    memset(buf, 0, ETH_HLEN + IP4_HLEN);
+    stw_be_p(buf + 12, ETH_P_IP);
+    l4len = build_l4(ip + IP4_HLEN, proto, t->sport, t->dport);
+    ip[0] = 0x45;
+    stw_be_p(ip + 2, IP4_HLEN + l4len);
+    ip[8] = 64;
+    ip[9] = proto;
+    memcpy(ip + 12, t->src, 4);
+    memcpy(ip + 16, t->dst, 4);
+    return ETH_HLEN + IP4_HLEN + l4len;
+}
+
+static size_t build_ip6(uint8_t *buf, const RssTest6 *t, uint8_t proto)
+{
+    uint8_t *ip = buf + ETH_HLEN;
+    size_t l4len;
+
+    memset(buf, 0, ETH_HLEN + IP6_HLEN);
+    stw_be_p(buf + 12, ETH_P_IPV6);
+    l4len = build_l4(ip + IP6_HLEN, proto, t->sport, t->dport);
+    ip[0] = 0x60;
+    stw_be_p(ip + 4, l4len);
+    ip[6] = proto;
+    ip[7] = 64;
+    memcpy(ip + 8, t->src, 16);
+    memcpy(ip + 24, t->dst, 16);
+    return ETH_HLEN + IP6_HLEN + l4len;
+}
+
+static uint32_t calc_hash(const uint8_t *buf, size_t len,
+                          NetRxPktRssType type)
+{
+    struct NetRxPkt *pkt;
+    uint32_t hash;
+
+    net_rx_pkt_init(&pkt, false);
+    net_rx_pkt_set_protocols(pkt, buf, len);
+    hash = net_rx_pkt_calc_rss_hash(pkt, type, rss_key);
+    net_rx_pkt_uninit(pkt);
+    return hash;
+}
+
+static void test_rss_ipv4(void)
+{
+    uint8_t buf[128];
+    size_t len;
+    int i;
+
+    for (i = 0; i < ARRAY_SIZE(tests4); i++) {
+        const RssTest4 *t = &tests4[i];
+
+        len = build_ip4(buf, t, IP_PROTO_TCP);
+        g_assert_cmphex(calc_hash(buf, len, NetPktRssIpV4), ==, t->hash_ip);
+        g_assert_cmphex(calc_hash(buf, len, NetPktRssIpV4Tcp), ==,
+                        t->hash_l4);
+
+        /* The UDP 4-tuple hashes like the TCP one */
+        len = build_ip4(buf, t, IP_PROTO_UDP);
+        g_assert_cmphex(calc_hash(buf, len, NetPktRssIpV4Udp), ==,
+                        t->hash_l4);
+    }
+}
+
+static void test_rss_ipv6(void)
+{
+    uint8_t buf[128];
+    size_t len;
+    int i;
+
+    for (i = 0; i < ARRAY_SIZE(tests6); i++) {
+        const RssTest6 *t = &tests6[i];
+
+        len = build_ip6(buf, t, IP_PROTO_TCP);
+        g_assert_cmphex(calc_hash(buf, len, NetPktRssIpV6), ==, t->hash_ip);
+        g_assert_cmphex(calc_hash(buf, len, NetPktRssIpV6Tcp), ==,
+                        t->hash_l4);
+
+        /* Without extension headers, the _EX variants hash the same */
+        g_assert_cmphex(calc_hash(buf, len, NetPktRssIpV6Ex), ==,
+                        t->hash_ip);
+        g_assert_cmphex(calc_hash(buf, len, NetPktRssIpV6TcpEx), ==,
+                        t->hash_l4);
+
+        len = build_ip6(buf, t, IP_PROTO_UDP);
+        g_assert_cmphex(calc_hash(buf, len, NetPktRssIpV6Udp), ==,
+                        t->hash_l4);
+        g_assert_cmphex(calc_hash(buf, len, NetPktRssIpV6UdpEx), ==,
+                        t->hash_l4);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/net/rss/toeplitz/ipv4", test_rss_ipv4);
+    g_test_add_func("/net/rss/toeplitz/ipv6", test_rss_ipv6);
+    return g_test_run();
+}
@@ -32,6 +32,7 @@
 #define PCI_SLOT_HP             0x06
 #define PCI_SLOT                0x04
 #define PCI_FN                  0x00
+#define PACKED_QUEUE_SIZE       4
 
 #define MMIO_PAGE_SIZE          4096
 #define MMIO_DEV_BASE_ADDR      0x0A003E00
@@ -61,7 +62,8 @@ static char *drive_create(void)
     return tmp_path;
 }
 
-static QOSState *pci_test_start(void)
+/* @opts are appended to the properties of drv0 */
+static QOSState *pci_test_start_opts(const char *opts)
 {
     QOSState *qs;
     const char *arch = qtest_get_arch();
@@ -69,14 +71,14 @@ static QOSState *pci_test_start(void)
     const char *cmd = "-drive if=none,id=drive0,file=%s,format=raw "
                       "-drive if=none,id=drive1,file=null-co://,format=raw "
                       "-device virtio-blk-pci,id=drv0,drive=drive0,"
-                      "addr=%x.%x";
+                      "addr=%x.%x%s";
 
     tmp_path = drive_create();
 
     if (strcmp(arch, "i386") == 0 || strcmp(arch, "x86_64") == 0) {
-        qs = qtest_pc_boot(cmd, tmp_path, PCI_SLOT, PCI_FN);
+        qs = qtest_pc_boot(cmd, tmp_path, PCI_SLOT, PCI_FN, opts);
     } else if (strcmp(arch, "ppc64") == 0) {
-        qs = qtest_spapr_boot(cmd, tmp_path, PCI_SLOT, PCI_FN);
+        qs = qtest_spapr_boot(cmd, tmp_path, PCI_SLOT, PCI_FN, opts);
     } else {
         g_printerr("virtio-blk tests are only available on x86 or ppc64\n");
         exit(EXIT_FAILURE);
@@ -87,6 +89,11 @@ static QOSState *pci_test_start(void)
     return qs;
 }
 
+static QOSState *pci_test_start(void)
+{
+    return pci_test_start_opts("");
+}
+
 static void arm_test_start(void)
 {
     char *tmp_path;
@@ -682,6 +689,119 @@ static void pci_hotplug(void)
     qtest_shutdown(qs);
 }
 
+static void packed_request(QOSState *qs, QVirtioDevice *dev, QVirtQueue *vq,
+                           uint32_t type, uint64_t sector, char *data)
+{
+    QVirtioBlkReq req;
+    uint64_t req_addr;
+    uint32_t free_head;
+    uint32_t len;
+    uint8_t status;
+
+    req.type = type;
+    req.ioprio = 1;
+    req.sector = sector;
+    req.data = g_malloc0(512);
+    if (type == VIRTIO_BLK_T_OUT) {
+        strcpy(req.data, data);
+    }
+
+    req_addr = virtio_blk_request(qs->alloc, dev, &req, 512);
+
+    g_free(req.data);
+
+    free_head = qvirtqueue_add(vq, req_addr, 16, false, true);
+    qvirtqueue_add(vq, req_addr + 16, 512, type == VIRTIO_BLK_T_IN, true);
+    qvirtqueue_add(vq, req_addr + 528, 1, true, false);
+    qvirtqueue_kick(dev, vq, free_head);
+
+    qvirtio_wait_used_elem(dev, vq, free_head, &len, QVIRTIO_BLK_TIMEOUT_US);
+    g_assert_cmpint(len, ==, type == VIRTIO_BLK_T_IN ? 513 : 1);
+    status = readb(req_addr + 528);
+    g_assert_cmpint(status, ==, 0);
+
+    if (type == VIRTIO_BLK_T_IN) {
+        memread(req_addr + 16, data, 512);
+    }
+
+    guest_free(qs->alloc, req_addr);
+}
+
+/*
+ * Requests of three descriptors go around a packed ring of four, so that
+ * they wrap in the middle of a buffer and the wrap counters flip over and
+ * back again.
+ */
+static void pci_packed_rw(const char *opts, uint64_t features)
+{
+    QVirtioPCIDevice *dev;
+    QOSState *qs;
+    QVirtQueue *vq;
+    char data[512];
+    char *expected;
+    int i;
+
+    features |= (1ull << VIRTIO_F_VERSION_1) |
+                (1ull << VIRTIO_F_RING_PACKED);
+
+    qs = pci_test_start_opts(opts);
+    dev = qvirtio_pci_device_find_slot(qs->pcibus, VIRTIO_ID_BLOCK, PCI_SLOT);
+    g_assert(dev != NULL);
+    qvirtio_pci_device_enable_modern(dev);
+    qvirtio_reset(&dev->vdev);
+    qvirtio_set_acknowledge(&dev->vdev);
+    qvirtio_set_driver(&dev->vdev);
+
+    g_assert_cmphex(qvirtio_get_features(&dev->vdev) & features, ==, features);
+    qvirtio_set_features(&dev->vdev, features);
+
+    vq = qvirtqueue_setup(&dev->vdev, qs->alloc, 0);
+    g_assert(vq->packed);
+    g_assert_cmpint(vq->size, ==, PACKED_QUEUE_SIZE);
+    qvirtio_set_driver_ok(&dev->vdev);
+
+    for (i = 0; i < PACKED_QUEUE_SIZE * 2; i++) {
+        expected = g_strdup_printf("TEST%d", i);
+        packed_request(qs, &dev->vdev, vq, VIRTIO_BLK_T_OUT, i, expected);
+        g_free(expected);
+        if (i == 1) {
+            g_assert(!vq->avail_wrap_counter);
+            g_assert(!vq->used_wrap_counter);
+        }
+    }
+
+    for (i = 0; i < PACKED_QUEUE_SIZE * 2; i++) {
+        packed_request(qs, &dev->vdev, vq, VIRTIO_BLK_T_IN, i, data);
+        expected = g_strdup_printf("TEST%d", i);
+        g_assert_cmpstr(data, ==, expected);
+        g_free(expected);
+    }
+
+    /* 48 descriptors went through the ring */
+    g_assert(vq->avail_wrap_counter);
+    g_assert(vq->used_wrap_counter);
+    g_assert_cmpint(vq->free_head, ==, 0);
+    g_assert_cmpint(vq->last_used_idx, ==, 0);
+    g_assert_cmpint(vq->num_free, ==, PACKED_QUEUE_SIZE);
+
+    qvirtqueue_cleanup(dev->vdev.bus, vq, qs->alloc);
+    qvirtio_pci_device_disable(dev);
+    qvirtio_pci_device_free(dev);
+    qtest_shutdown(qs);
+}
+
+static void pci_packed(void)
+{
+    pci_packed_rw(",packed=on,queue-size=" stringify(PACKED_QUEUE_SIZE), 0);
+}
+
+static void pci_packed_in_order(void)
+{
+    pci_packed_rw(",packed=on,in_order=on,"
+                  "queue-size=" stringify(PACKED_QUEUE_SIZE),
+                  1ull << VIRTIO_F_IN_ORDER);
+}
+
 /*
  * Check that setting the vring addr on a non-existent virtqueue does
  * not crash.
@@ -760,6 +880,9 @@ int main(int argc, char **argv)
         if (strcmp(arch, "i386") == 0 || strcmp(arch, "x86_64") == 0) {
             qtest_add_func("/virtio/blk/pci/msix", pci_msix);
             qtest_add_func("/virtio/blk/pci/idx", pci_idx);
+            qtest_add_func("/virtio/blk/pci/packed", pci_packed);
+            qtest_add_func("/virtio/blk/pci/packed/in-order",
+                           pci_packed_in_order);
         }
         qtest_add_func("/virtio/blk/pci/hotplug", pci_hotplug);
     } else if (strcmp(arch, "arm") == 0) {
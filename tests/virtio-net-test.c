@@ -19,6 +19,7 @@
 #include "qapi/qmp/qdict.h"
 #include "qemu/bswap.h"
 #include "hw/virtio/virtio-net.h"
+#include "net/eth.h"
 #include "standard-headers/linux/virtio_ids.h"
 #include "standard-headers/linux/virtio_ring.h"
 
@@ -52,17 +53,17 @@ static QVirtioPCIDevice *virtio_net_pci_init(QPCIBus *bus, int slot)
     return dev;
 }
 
-static QOSState *pci_test_start(int socket)
+static QOSState *pci_test_start(int socket, const char *extra_args)
 {
     QOSState *qs;
     const char *arch = qtest_get_arch();
     const char *cmd = "-netdev socket,fd=%d,id=hs0 -device "
-                      "virtio-net-pci,netdev=hs0";
+                      "virtio-net-pci,netdev=hs0,id=net0%s";
 
     if (strcmp(arch, "i386") == 0 || strcmp(arch, "x86_64") == 0) {
-        qs = qtest_pc_boot(cmd, socket);
+        qs = qtest_pc_boot(cmd, socket, extra_args);
     } else if (strcmp(arch, "ppc64") == 0) {
-        qs = qtest_spapr_boot(cmd, socket);
+        qs = qtest_spapr_boot(cmd, socket, extra_args);
     } else {
         g_printerr("virtio-net tests are only available on x86 or ppc64\n");
         exit(EXIT_FAILURE);
@@ -193,6 +194,58 @@ static void rx_stop_cont_test(QVirtioDevice *dev,
     guest_free(alloc, req_addr);
 }
 
+static void rx_coalesce_test(QVirtioDevice *dev,
+                             QGuestAllocator *alloc, QVirtQueue *vq,
+                             int socket)
+{
+    uint64_t req_addr;
+    uint32_t free_head, desc_idx;
+    char test[] = "TEST";
+    char buffer[64];
+    int len = htonl(sizeof(test));
+    QDict *rsp;
+    struct iovec iov[] = {
+        {
+            .iov_base = &len,
+            .iov_len = sizeof(len),
+        }, {
+            .iov_base = test,
+            .iov_len = sizeof(test),
+        },
+    };
+    gint64 start_time;
+    int ret;
+
+    rsp = qmp("{ 'execute': 'qom-set', 'arguments': { 'path': 'net0', "
+              "'property': 'rx-coalesce-usecs', 'value': 1000 } }");
+    g_assert(!qdict_haskey(rsp, "error"));
+    qobject_unref(rsp);
+
+    req_addr = guest_alloc(alloc, 64);
+
+    free_head = qvirtqueue_add(vq, req_addr, 64, true, false);
+    qvirtqueue_kick(dev, vq, free_head);
+
+    ret = iov_send(socket, iov, 2, 0, sizeof(len) + sizeof(test));
+    g_assert_cmpint(ret, ==, sizeof(test) + sizeof(len));
+
+    /* The buffer is used without the clock moving, but not notified */
+    start_time = g_get_monotonic_time();
+    while (!qvirtqueue_get_buf(vq, &desc_idx, NULL)) {
+        g_assert(g_get_monotonic_time() - start_time <=
+                 QVIRTIO_NET_TIMEOUT_US);
+    }
+    g_assert_cmpint(desc_idx, ==, free_head);
+    g_assert(!dev->bus->get_queue_isr_status(dev, vq));
+
+    clock_step(1000 * 1000);
+    g_assert(dev->bus->get_queue_isr_status(dev, vq));
+    memread(req_addr + VNET_HDR_SIZE, buffer, sizeof(test));
+    g_assert_cmpstr(buffer, ==, "TEST");
+
+    guest_free(alloc, req_addr);
+}
+
 static void send_recv_test(QVirtioDevice *dev,
                            QGuestAllocator *alloc, QVirtQueue *rvq,
                            QVirtQueue *tvq, int socket)
@@ -208,7 +261,53 @@ static void stop_cont_test(QVirtioDevice *dev,
     rx_stop_cont_test(dev, alloc, rvq, socket);
 }
 
-static void pci_basic(gconstpointer data)
+static void coalesce_test(QVirtioDevice *dev,
+                          QGuestAllocator *alloc, QVirtQueue *rvq,
+                          QVirtQueue *tvq, int socket)
+{
+    rx_coalesce_test(dev, alloc, rvq, socket);
+}
+
+static void iothread_test(QVirtioDevice *dev,
+                          QGuestAllocator *alloc, QVirtQueue *rvq,
+                          QVirtQueue *tvq, int socket)
+{
+    QDict *rsp;
+
+    send_recv_test(dev, alloc, rvq, tvq, socket);
+
+    /* Filters need the main loop */
+    rsp = qmp("{ 'execute': 'object-add', 'arguments': { "
+              "'qom-type': 'filter-buffer', 'id': 'fb0', "
+              "'props': { 'netdev': 'hs0', 'interval': 1000 } } }");
+    g_assert(qdict_haskey(rsp, "error"));
+    qobject_unref(rsp);
+
+    send_recv_test(dev, alloc, rvq, tvq, socket);
+}
+
+static void iothread_filter_test(QVirtioDevice *dev,
+                                 QGuestAllocator *alloc, QVirtQueue *rvq,
+                                 QVirtQueue *tvq, int socket)
+{
+    QDict *rsp;
+
+    /* The filtered netdev keeps the queue pair in the main loop */
+    send_recv_test(dev, alloc, rvq, tvq, socket);
+
+    rsp = qmp("{ 'execute': 'object-add', 'arguments': { "
+              "'qom-type': 'filter-buffer', 'id': 'fb0', "
+              "'props': { 'netdev': 'hs0', 'interval': 1000 } } }");
+    g_assert(!qdict_haskey(rsp, "error"));
+    qobject_unref(rsp);
+    rsp = qmp("{ 'execute': 'object-del', 'arguments': { 'id': 'fb0' } }");
+    g_assert(!qdict_haskey(rsp, "error"));
+    qobject_unref(rsp);
+
+    send_recv_test(dev, alloc, rvq, tvq, socket);
+}
+
+static void pci_test_run(gconstpointer data, const char *extra_args)
 {
     QVirtioPCIDevice *dev;
     QOSState *qs;
@@ -223,7 +322,7 @@ static void pci_basic(gconstpointer data)
     ret = socketpair(PF_UNIX, SOCK_STREAM, 0, sv);
     g_assert_cmpint(ret, !=, -1);
 
-    qs = pci_test_start(sv[1]);
+    qs = pci_test_start(sv[1], extra_args);
     dev = virtio_net_pci_init(qs->pcibus, PCI_SLOT);
 
     rx = (QVirtQueuePCI *)qvirtqueue_setup(&dev->vdev, qs->alloc, 0);
@@ -241,6 +340,395 @@ static void pci_basic(gconstpointer data)
     g_free(dev);
     qtest_shutdown(qs);
 }
+
+static void pci_basic(gconstpointer data)
+{
+    pci_test_run(data, "");
+}
+
+static void pci_iothread(gconstpointer data)
+{
+    pci_test_run(data, ",iothread=io0 -object iothread,id=io0");
+}
+
+static void pci_iothread_filter(gconstpointer data)
+{
+    pci_test_run(data, ",iothread=io0 -object iothread,id=io0 "
+                 "-object filter-dump,id=fd0,netdev=hs0,file=/dev/null");
+}
+
+/* RSS and the hash report need feature bits above 31, and so virtio 1.0 */
+
+#define RSS_HDR_SIZE sizeof(struct virtio_net_hdr_v1_hash)
+
+/* First vector of the verification suite of the Microsoft RSS spec */
+static const uint8_t rss_key[40] = {
+    0x6d, 0x5a, 0x56, 0xda, 0x25, 0x5b, 0x0e, 0xc2,
+    0x41, 0x67, 0x25, 0x3d, 0x43, 0xa3, 0x8f, 0xb0,
+    0xd0, 0xca, 0x2b, 0xcb, 0xae, 0x7b, 0x30, 0xb4,
+    0x77, 0xcb, 0x2d, 0xa3, 0x80, 0x30, 0xf2, 0x0c,
+    0x6a, 0x42, 0xb7, 0x3b, 0xbe, 0xac, 0x01, 0xfa,
+};
+static const uint8_t rss_src[4] = { 66, 9, 149, 187 };
+static const uint8_t rss_dst[4] = { 161, 142, 100, 80 };
+#define RSS_SPORT       2794
+#define RSS_DPORT       1766
+#define RSS_HASH_UDP4   0x51ccc178
+
+typedef struct RssTest {
+    QOSState *qs;
+    QVirtioPCIDevice *dev;
+    QVirtQueue *rx[2], *tx[2], *ctrl;
+    int queues;
+    int socket;
+} RssTest;
+
+static void rss_test_start(RssTest *t, int queues, uint64_t features,
+                           const char *extra_args)
+{
+    uint64_t want = (1ull << VIRTIO_F_VERSION_1) |
+                    (1ull << VIRTIO_NET_F_CTRL_VQ) | features;
+    int sv[2], ret, i;
+
+    ret = socketpair(PF_UNIX, SOCK_STREAM, 0, sv);
+    g_assert_cmpint(ret, !=, -1);
+    t->socket = sv[0];
+    t->queues = queues;
+
+    t->qs = pci_test_start(sv[1], extra_args);
+    t->dev = qvirtio_pci_device_find(t->qs->pcibus, VIRTIO_ID_NET);
+    g_assert(t->dev != NULL);
+    qvirtio_pci_device_enable_modern(t->dev);
+    qvirtio_reset(&t->dev->vdev);
+    qvirtio_set_acknowledge(&t->dev->vdev);
+    qvirtio_set_driver(&t->dev->vdev);
+
+    g_assert_cmphex(qvirtio_get_features(&t->dev->vdev) & want, ==, want);
+    qvirtio_set_features(&t->dev->vdev, want);
+
+    for (i = 0; i < queues; i++) {
+        t->rx[i] = qvirtqueue_setup(&t->dev->vdev, t->qs->alloc, i * 2);
+        t->tx[i] = qvirtqueue_setup(&t->dev->vdev, t->qs->alloc, i * 2 + 1);
+    }
+    t->ctrl = qvirtqueue_setup(&t->dev->vdev, t->qs->alloc, queues * 2);
+    qvirtio_set_driver_ok(&t->dev->vdev);
+}
+
+static void rss_test_end(RssTest *t)
+{
+    int i;
+
+    close(t->socket);
+    qvirtqueue_cleanup(t->dev->vdev.bus, t->ctrl, t->qs->alloc);
+    for (i = 0; i < t->queues; i++) {
+        qvirtqueue_cleanup(t->dev->vdev.bus, t->tx[i], t->qs->alloc);
+        qvirtqueue_cleanup(t->dev->vdev.bus, t->rx[i], t->qs->alloc);
+    }
+    qvirtio_pci_device_disable(t->dev);
+    qvirtio_pci_device_free(t->dev);
+    qtest_shutdown(t->qs);
+}
+
+/* Send a VIRTIO_NET_CTRL_MQ command whose payload has the layout of
+ * struct virtio_net_rss_config, and return the ack of the device.
+ */
+static uint8_t rss_config(RssTest *t, uint8_t cmd, uint16_t table_queue,
+                          uint16_t max_tx_vq)
+{
+    QGuestAllocator *alloc = t->qs->alloc;
+    uint8_t buf[2 + 13 + sizeof(rss_key)];
+    uint64_t req_addr, ack_addr;
+    uint32_t free_head;
+    uint8_t ack;
+
+    buf[0] = VIRTIO_NET_CTRL_MQ;
+    buf[1] = cmd;
+    stl_le_p(buf + 2, VIRTIO_NET_RSS_HASH_TYPE_IPv4 |
+                      VIRTIO_NET_RSS_HASH_TYPE_TCPv4 |
+                      VIRTIO_NET_RSS_HASH_TYPE_UDPv4);
+    stw_le_p(buf + 6, 0);                   /* indirection_table_mask */
+    stw_le_p(buf + 8, table_queue);         /* unclassified_queue */
+    stw_le_p(buf + 10, table_queue);        /* indirection_table[0] */
+    stw_le_p(buf + 12, max_tx_vq);
+    buf[14] = sizeof(rss_key);
+    memcpy(buf + 15, rss_key, sizeof(rss_key));
+
+    req_addr = guest_alloc(alloc, sizeof(buf));
+    ack_addr = guest_alloc(alloc, 1);
+    memwrite(req_addr, buf, sizeof(buf));
+    writeb(ack_addr, 0xff);
+
+    free_head = qvirtqueue_add(t->ctrl, req_addr, sizeof(buf), false, true);
+    qvirtqueue_add(t->ctrl, ack_addr, 1, true, false);
+    qvirtqueue_kick(&t->dev->vdev, t->ctrl, free_head);
+    qvirtio_wait_used_elem(&t->dev->vdev, t->ctrl, free_head, NULL,
+                           QVIRTIO_NET_TIMEOUT_US);
+    ack = readb(ack_addr);
+
+    guest_free(alloc, ack_addr);
+    guest_free(alloc, req_addr);
+    return ack;
+}
+
+/* Build the UDP version of the test vector */
+static size_t rss_build_udp4(uint8_t *buf)
+{
+    uint8_t *ip = buf + 14, *udp = ip + 20;
+
+    memset(buf, 0, 14 + 20 + 8);
+    memset(buf, 0xff, 6);
+    stw_be_p(buf + 12, 0x0800);
+    ip[0] = 0x45;
+    stw_be_p(ip + 2, 20 + 8);
+    ip[8] = 64;
+    ip[9] = 17;
+    memcpy(ip + 12, rss_src, sizeof(rss_src));
+    memcpy(ip + 16, rss_dst, sizeof(rss_dst));
+    stw_be_p(udp, RSS_SPORT);
+    stw_be_p(udp + 2, RSS_DPORT);
+    stw_be_p(udp + 4, 8);
+    return 14 + 20 + 8;
+}
+
+/* Inject the test vector and check that it is received on @queue, with
+ * its hash in the header if @hash_report.
+ */
+static void rss_rx(RssTest *t, int queue, bool hash_report)
+{
+    QGuestAllocator *alloc = t->qs->alloc;
+    uint8_t pkt[64], buffer[64];
+    uint64_t req_addr;
+    uint32_t free_head, plen;
+    size_t size;
+    int ret;
+
+    size = rss_build_udp4(pkt);
+    plen = htonl(size);
+
+    req_addr = guest_alloc(alloc, 256);
+    free_head = qvirtqueue_add(t->rx[queue], req_addr, 256, true, false);
+    qvirtqueue_kick(&t->dev->vdev, t->rx[queue], free_head);
+
+    ret = send(t->socket, &plen, sizeof(plen), 0);
+    g_assert_cmpint(ret, ==, sizeof(plen));
+    ret = send(t->socket, pkt, size, 0);
+    g_assert_cmpint(ret, ==, size);
+
+    qvirtio_wait_used_elem(&t->dev->vdev, t->rx[queue], free_head, NULL,
+                           QVIRTIO_NET_TIMEOUT_US);
+    memread(req_addr + RSS_HDR_SIZE, buffer, size);
+    g_assert(!memcmp(buffer, pkt, size));
+    if (hash_report) {
+        g_assert_cmphex(readl(req_addr + offsetof(struct virtio_net_hdr_v1_hash,
+                                                  hash_value)),
+                        ==, RSS_HASH_UDP4);
+        g_assert_cmpint(readw(req_addr + offsetof(struct virtio_net_hdr_v1_hash,
+                                                  hash_report)),
+                        ==, VIRTIO_NET_HASH_REPORT_UDPv4);
+    }
+
+    guest_free(alloc, req_addr);
+}
+
+/* Send a frame on @queue and check that the netdev gets it */
+static void rss_tx(RssTest *t, int queue)
+{
+    QGuestAllocator *alloc = t->qs->alloc;
+    uint64_t req_addr;
+    uint32_t free_head, len;
+    char buffer[64];
+    int ret;
+
+    req_addr = guest_alloc(alloc, 64);
+    memset(buffer, 0, RSS_HDR_SIZE);
+    memwrite(req_addr, buffer, RSS_HDR_SIZE);
+    memwrite(req_addr + RSS_HDR_SIZE, "TEST", 4);
+
+    free_head = qvirtqueue_add(t->tx[queue], req_addr, RSS_HDR_SIZE + 4,
+                               false, false);
+    qvirtqueue_kick(&t->dev->vdev, t->tx[queue], free_head);
+    qvirtio_wait_used_elem(&t->dev->vdev, t->tx[queue], free_head, NULL,
+                           QVIRTIO_NET_TIMEOUT_US);
+    guest_free(alloc, req_addr);
+
+    ret = qemu_recv(t->socket, &len, sizeof(len), 0);
+    g_assert_cmpint(ret, ==, sizeof(len));
+    len = ntohl(len);
+    g_assert_cmpint(len, ==, 4);
+    ret = qemu_recv(t->socket, buffer, len, 0);
+    g_assert_cmpint(ret, ==, 4);
+    g_assert(!memcmp(buffer, "TEST", 4));
+}
+
+static void pci_hash_report(void)
+{
+    RssTest t;
+
+    rss_test_start(&t, 1, 1ull << VIRTIO_NET_F_HASH_REPORT, ",hash=on");
+    g_assert_cmpint(rss_config(&t, VIRTIO_NET_CTRL_MQ_HASH_CONFIG, 0, 0),
+                    ==, VIRTIO_NET_OK);
+    rss_rx(&t, 0, true);
+    rss_tx(&t, 0);
+    rss_test_end(&t);
+}
+
+/* The single queue netdev feeds two queue pairs; the second one has no
+ * netdev queue of its own but receives what RSS steers to it.
+ */
+static void pci_rss_queues(void)
+{
+    RssTest t;
+
+    rss_test_start(&t, 2, (1ull << VIRTIO_NET_F_MQ) |
+                          (1ull << VIRTIO_NET_F_RSS) |
+                          (1ull << VIRTIO_NET_F_HASH_REPORT),
+                   ",mq=on,rss=on,hash=on,queues=2");
+    g_assert_cmpint(qvirtio_config_readw(&t.dev->vdev,
+                        offsetof(struct virtio_net_config,
+                                 max_virtqueue_pairs)), ==, 2);
+
+    /* Queue pair 2 does not exist */
+    g_assert_cmpint(rss_config(&t, VIRTIO_NET_CTRL_MQ_RSS_CONFIG, 2, 2),
+                    ==, VIRTIO_NET_ERR);
+
+    g_assert_cmpint(rss_config(&t, VIRTIO_NET_CTRL_MQ_RSS_CONFIG, 1, 2),
+                    ==, VIRTIO_NET_OK);
+    rss_rx(&t, 1, true);
+    rss_tx(&t, 1);
+
+    g_assert_cmpint(rss_config(&t, VIRTIO_NET_CTRL_MQ_RSS_CONFIG, 0, 2),
+                    ==, VIRTIO_NET_OK);
+    rss_rx(&t, 0, true);
+    rss_tx(&t, 0);
+    rss_test_end(&t);
+}
+
+#define RSC_MSS         100
+#define RSC_SEQ         1000
+#define RSC_FRAME_LEN   (14 + 20 + 20)
+
+static uint16_t rsc_csum(uint32_t sum, const uint8_t *buf, size_t len)
+{
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        sum += i & 1 ? buf[i] : buf[i] << 8;
+    }
+    while (sum >> 16) {
+        sum = (sum & 0xffff) + (sum >> 16);
+    }
+    return ~sum;
+}
+
+/* Build a TCP segment of the RSS test flow with @len bytes of payload */
+static size_t rsc_build_tcp4(uint8_t *buf, uint32_t seq, uint8_t flags,
+                             size_t len)
+{
+    uint8_t *ip = buf + 14, *tcp = ip + 20;
+    uint32_t sum;
+    size_t i;
+
+    memset(buf, 0, RSC_FRAME_LEN);
+    memset(buf, 0xff, 6);
+    stw_be_p(buf + 12, 0x0800);
+    ip[0] = 0x45;
+    stw_be_p(ip + 2, 20 + 20 + len);
+    ip[8] = 64;
+    ip[9] = 6;
+    memcpy(ip + 12, rss_src, sizeof(rss_src));
+    memcpy(ip + 16, rss_dst, sizeof(rss_dst));
+    stw_be_p(ip + 10, rsc_csum(0, ip, 20));
+
+    stw_be_p(tcp, RSS_SPORT);
+    stw_be_p(tcp + 2, RSS_DPORT);
+    stl_be_p(tcp + 4, seq);
+    stl_be_p(tcp + 8, 1);
+    tcp[12] = 5 << 4;
+    tcp[13] = flags;
+    stw_be_p(tcp + 14, 0xffff);
+    for (i = 0; i < len; i++) {
+        tcp[20 + i] = seq + i;
+    }
+
+    /* Pseudo header: addresses, protocol and TCP length */
+    sum = lduw_be_p(ip + 12) + lduw_be_p(ip + 14) +
+          lduw_be_p(ip + 16) + lduw_be_p(ip + 18) + 6 + 20 + len;
+    stw_be_p(tcp + 16, rsc_csum(sum, tcp, 20 + len));
+    return RSC_FRAME_LEN + len;
+}
+
+static void rsc_send(RssTest *t, const uint8_t *pkt, size_t size)
+{
+    uint32_t plen = htonl(size);
+    int ret;
+
+    ret = send(t->socket, &plen, sizeof(plen), 0);
+    g_assert_cmpint(ret, ==, sizeof(plen));
+    ret = send(t->socket, pkt, size, 0);
+    g_assert_cmpint(ret, ==, size);
+}
+
+/* Two in-order segments from a netdev without vnet header reach the guest
+ * as one frame, with the RSC_INFO header of VIRTIO_NET_F_RSC_EXT.
+ */
+static void pci_rsc(void)
+{
+    QGuestAllocator *alloc;
+    RssTest t;
+    uint8_t seg[RSC_FRAME_LEN + RSC_MSS], pkt[RSC_FRAME_LEN + 2 * RSC_MSS];
+    uint8_t buffer[sizeof(pkt)];
+    struct virtio_net_hdr_mrg_rxbuf hdr;
+    uint64_t req_addr[2];
+    uint32_t free_head[2], desc, len;
+    size_t size;
+    int i;
+
+    rss_test_start(&t, 1, (1ull << VIRTIO_NET_F_GUEST_CSUM) |
+                          (1ull << VIRTIO_NET_F_GUEST_TSO4) |
+                          (1ull << VIRTIO_NET_F_RSC_EXT),
+                   ",guest_rsc_ext=on");
+    alloc = t.qs->alloc;
+
+    for (i = 0; i < 2; i++) {
+        req_addr[i] = guest_alloc(alloc, 1024);
+        free_head[i] = qvirtqueue_add(t.rx[0], req_addr[i], 1024, true, false);
+        qvirtqueue_kick(&t.dev->vdev, t.rx[0], free_head[i]);
+    }
+
+    /* The first segment is held, the second one ends the burst with PSH */
+    size = rsc_build_tcp4(seg, RSC_SEQ, TH_ACK, RSC_MSS);
+    rsc_send(&t, seg, size);
+    size = rsc_build_tcp4(seg, RSC_SEQ + RSC_MSS, TH_ACK | TH_PUSH, RSC_MSS);
+    rsc_send(&t, seg, size);
+
+    qvirtio_wait_used_elem(&t.dev->vdev, t.rx[0], free_head[0], &len,
+                           QVIRTIO_NET_TIMEOUT_US);
+    size = rsc_build_tcp4(pkt, RSC_SEQ, TH_ACK | TH_PUSH, 2 * RSC_MSS);
+    g_assert_cmpint(len, ==, VNET_HDR_SIZE + size);
+    g_assert(!qvirtqueue_get_buf(t.rx[0], &desc, NULL));
+
+    memread(req_addr[0], &hdr, sizeof(hdr));
+    g_assert_cmpint(hdr.hdr.flags, ==, VIRTIO_NET_HDR_F_DATA_VALID |
+                                       VIRTIO_NET_HDR_F_RSC_INFO);
+    g_assert_cmpint(hdr.hdr.gso_type, ==, VIRTIO_NET_HDR_GSO_TCPV4);
+    g_assert_cmpint(le16_to_cpu(hdr.hdr.hdr_len), ==, RSC_FRAME_LEN);
+    g_assert_cmpint(le16_to_cpu(hdr.hdr.gso_size), ==, RSC_MSS);
+    /* rsc.segments and rsc.dup_acks */
+    g_assert_cmpint(le16_to_cpu(hdr.hdr.csum_start), ==, 2);
+    g_assert_cmpint(le16_to_cpu(hdr.hdr.csum_offset), ==, 0);
+
+    /* Same as a single segment with all the data, except for the TCP
+     * checksum that DATA_VALID tells the guest to ignore.
+     */
+    memread(req_addr[0] + VNET_HDR_SIZE, buffer, size);
+    memcpy(pkt + 14 + 20 + 16, buffer + 14 + 20 + 16, 2);
+    g_assert(!memcmp(buffer, pkt, size));
+
+    for (i = 0; i < 2; i++) {
+        guest_free(alloc, req_addr[i]);
+    }
+    rss_test_end(&t);
+}
 #endif
 
 static void hotplug(void)
@@ -266,6 +754,17 @@ int main(int argc, char **argv)
     qtest_add_data_func("/virtio/net/pci/basic", send_recv_test, pci_basic);
     qtest_add_data_func("/virtio/net/pci/rx_stop_cont",
                         stop_cont_test, pci_basic);
+    qtest_add_data_func("/virtio/net/pci/rx_coalesce",
+                        coalesce_test, pci_basic);
+    qtest_add_data_func("/virtio/net/pci/iothread",
+                        iothread_test, pci_iothread);
+    qtest_add_data_func("/virtio/net/pci/iothread/rx_stop_cont",
+                        stop_cont_test, pci_iothread);
+    qtest_add_data_func("/virtio/net/pci/iothread/filter",
+                        iothread_filter_test, pci_iothread_filter);
+    qtest_add_func("/virtio/net/pci/hash_report", pci_hash_report);
+    qtest_add_func("/virtio/net/pci/rss/queues", pci_rss_queues);
+    qtest_add_func("/virtio/net/pci/rsc", pci_rsc);
 #endif
     qtest_add_func("/virtio/net/pci/hotplug", hotplug);
 
@@ -9,33 +9,118 @@
 
 #include "qemu/osdep.h"
 #include "libqtest.h"
+#include "libqos/libqos-pc.h"
 #include "libqos/virtio.h"
+#include "libqos/virtio-pci.h"
+#include "standard-headers/linux/virtio_ids.h"
+#include <sys/un.h>
+
+#define PCI_SLOT                0x04
+#define PORT1_OUT_VQ            5
+#define THROTTLED_BUF_SIZE      (4 * 1024 * 1024)
+
+static void serial_start(void)
+{
+    global_qtest = qtest_initf("-device virtio-serial-%s",
+                               qvirtio_get_dev_type());
+}
 
 /* Tests only initialization so far. TODO: Replace with functional tests */
 static void virtio_serial_nop(void)
 {
+    serial_start();
+    qtest_end();
 }
 
 static void hotplug(void)
 {
+    serial_start();
     qtest_qmp_device_add("virtserialport", "hp-port", "{}");
 
     qtest_qmp_device_del("hp-port");
+    qtest_end();
+}
+
+/*
+ * Unplugging a port drops the buffer that it could only write in part to
+ * a chardev that is not read.  With VIRTIO_F_IN_ORDER the buffers queued
+ * after it must still come back.
+ */
+static void pci_in_order_unplug_throttled(void)
+{
+    char *sock = g_strdup_printf("/tmp/qtest-serial-%d.sock", getpid());
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    uint64_t features = (1ull << VIRTIO_F_VERSION_1) |
+                        (1ull << VIRTIO_F_IN_ORDER);
+    QOSState *qs;
+    QVirtioPCIDevice *dev;
+    QVirtQueue *vq;
+    uint64_t big, small;
+    uint32_t head[2], desc_idx, len;
+    int fd, i;
+
+    qs = qtest_pc_boot("-chardev socket,id=cs0,path=%s,server,nowait "
+                       "-device virtio-serial-pci,in_order=on,addr=%x.0 "
+                       "-device virtserialport,id=port1,nr=1,chardev=cs0",
+                       sock, PCI_SLOT);
+    global_qtest = qs->qts;
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    g_assert_cmpint(fd, >=, 0);
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", sock);
+    g_assert_cmpint(connect(fd, (struct sockaddr *)&addr, sizeof(addr)),
+                    ==, 0);
+
+    dev = qvirtio_pci_device_find_slot(qs->pcibus, VIRTIO_ID_CONSOLE,
+                                       PCI_SLOT);
+    g_assert(dev != NULL);
+    qvirtio_pci_device_enable_modern(dev);
+    qvirtio_reset(&dev->vdev);
+    qvirtio_set_acknowledge(&dev->vdev);
+    qvirtio_set_driver(&dev->vdev);
+    g_assert_cmphex(qvirtio_get_features(&dev->vdev) & features, ==, features);
+    qvirtio_set_features(&dev->vdev, features);
+    vq = qvirtqueue_setup(&dev->vdev, qs->alloc, PORT1_OUT_VQ);
+    qvirtio_set_driver_ok(&dev->vdev);
+
+    /* More than the socket takes, the port stays throttled on it */
+    big = guest_alloc(qs->alloc, THROTTLED_BUF_SIZE);
+    head[0] = qvirtqueue_add(vq, big, THROTTLED_BUF_SIZE, false, false);
+    qvirtqueue_kick(&dev->vdev, vq, head[0]);
+    small = guest_alloc(qs->alloc, 16);
+    head[1] = qvirtqueue_add(vq, small, 16, false, false);
+    qvirtqueue_kick(&dev->vdev, vq, head[1]);
+    g_assert(!qvirtqueue_get_buf(vq, &desc_idx, &len));
+
+    qtest_qmp_device_del("port1");
+
+    for (i = 0; i < 2; i++) {
+        g_assert(qvirtqueue_get_buf(vq, &desc_idx, &len));
+        g_assert_cmpint(desc_idx, ==, head[i]);
+        g_assert_cmpint(len, ==, 0);
+    }
+
+    guest_free(qs->alloc, small);
+    guest_free(qs->alloc, big);
+    qvirtqueue_cleanup(dev->vdev.bus, vq, qs->alloc);
+    qvirtio_pci_device_disable(dev);
+    qvirtio_pci_device_free(dev);
+    close(fd);
+    qtest_shutdown(qs);
+    unlink(sock);
+    g_free(sock);
 }
 
 int main(int argc, char **argv)
 {
-    int ret;
+    const char *arch = qtest_get_arch();
 
     g_test_init(&argc, &argv, NULL);
     qtest_add_func("/virtio/serial/nop", virtio_serial_nop);
     qtest_add_func("/virtio/serial/hotplug", hotplug);
+    if (strcmp(arch, "i386") == 0 || strcmp(arch, "x86_64") == 0) {
+        qtest_add_func("/virtio/serial/pci/in-order/unplug-throttled",
+                       pci_in_order_unplug_throttled);
+    }
 
-    global_qtest = qtest_initf("-device virtio-serial-%s",
-                               qvirtio_get_dev_type());
-    ret = g_test_run();
-
-    qtest_end();
-
-    return ret;
+    return g_test_run();
 }
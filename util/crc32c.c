@@ -28,6 +28,7 @@
 #include "qemu/osdep.h"
 #include "qemu-common.h"
 #include "qemu/crc32c.h"
+#include "qemu/bswap.h"
 
 /*
  * This is the CRC-32C table
@@ -106,11 +107,62 @@ static const uint32_t crc32c_table[256] = {
 };
 
 
-uint32_t crc32c(uint32_t crc, const uint8_t *data, unsigned int length)
+static uint32_t crc32c_int(uint32_t crc, const uint8_t *data,
+                           unsigned int length)
 {
     while (length--) {
         crc = crc32c_table[(crc ^ *data++) & 0xFFL] ^ (crc >> 8);
     }
-    return crc^0xffffffff;
+    return crc;
+}
+
+#ifdef CONFIG_HOST_CRYPTO_OPT
+#include "qemu/cpuid.h"
+
+#pragma GCC push_options
+#pragma GCC target("sse4.2")
+#include <smmintrin.h>
+
+/* The SSE4.2 CRC32 instruction implements exactly this polynomial.  */
+static uint32_t crc32c_sse42(uint32_t crc, const uint8_t *data,
+                             unsigned int length)
+{
+#ifdef __x86_64__
+    uint64_t crc64 = crc;
+
+    for (; length >= 8; length -= 8, data += 8) {
+        crc64 = _mm_crc32_u64(crc64, ldq_le_p(data));
+    }
+    crc = crc64;
+#endif
+    for (; length >= 4; length -= 4, data += 4) {
+        crc = _mm_crc32_u32(crc, ldl_le_p(data));
+    }
+    while (length--) {
+        crc = _mm_crc32_u8(crc, *data++);
+    }
+    return crc;
+}
+
+#pragma GCC pop_options
+
+static uint32_t (*crc32c_accel)(uint32_t, const uint8_t *,
+                                unsigned int) = crc32c_int;
+
+static void __attribute__((constructor)) init_crc32c_accel(void)
+{
+    unsigned a, b, c, d;
+
+    if (__get_cpuid(1, &a, &b, &c, &d) && (c & bit_SSE4_2)) {
+        crc32c_accel = crc32c_sse42;
+    }
+}
+#else
+#define crc32c_accel crc32c_int
+#endif /* CONFIG_HOST_CRYPTO_OPT */
+
+uint32_t crc32c(uint32_t crc, const uint8_t *data, unsigned int length)
+{
+    return crc32c_accel(crc, data, length) ^ 0xffffffff;
 }
 
@@ -225,3 +225,60 @@ void ulshift(uint64_t *plow, uint64_t *phigh, int32_t shift, bool *overflow)
         *plow = *plow << shift;
     }
 }
+
+static void clmul64_int(uint64_t *plow, uint64_t *phigh,
+                        uint64_t a, uint64_t b)
+{
+    uint64_t low = 0, high = 0;
+    int i;
+
+    for (i = 0; b; i++, b >>= 1) {
+        if (b & 1) {
+            low ^= a << i;
+            high ^= i ? a >> (64 - i) : 0;
+        }
+    }
+    *plow = low;
+    *phigh = high;
+}
+
+#ifdef CONFIG_HOST_CRYPTO_OPT
+#include "qemu/cpuid.h"
+
+#pragma GCC push_options
+#pragma GCC target("sse2,pclmul")
+#include <wmmintrin.h>
+
+static void clmul64_pclmul(uint64_t *plow, uint64_t *phigh,
+                           uint64_t a, uint64_t b)
+{
+    __m128i r = _mm_clmulepi64_si128(_mm_set_epi64x(0, a),
+                                     _mm_set_epi64x(0, b), 0);
+    uint64_t res[2];
+
+    _mm_storeu_si128((__m128i *)res, r);
+    *plow = res[0];
+    *phigh = res[1];
+}
+
+#pragma GCC pop_options
+
+static void (*clmul64_accel)(uint64_t *, uint64_t *,
+                             uint64_t, uint64_t) = clmul64_int;
+
+static void __attribute__((constructor)) init_clmul64(void)
+{
+    unsigned a, b, c, d;
+
+    if (__get_cpuid(1, &a, &b, &c, &d) && (c & bit_PCLMUL)) {
+        clmul64_accel = clmul64_pclmul;
+    }
+}
+#else
+#define clmul64_accel clmul64_int
+#endif /* CONFIG_HOST_CRYPTO_OPT */
+
+void clmul64(uint64_t *plow, uint64_t *phigh, uint64_t a, uint64_t b)
+{
+    clmul64_accel(plow, phigh, a, b);
+}
@@ -31,6 +31,11 @@
  * of the same type can be coalesced, which can be particularly useful when
  * profiling dynamically-allocated objects.
  *
+ * Besides the total wait time, each call site keeps a log2 histogram of its
+ * wait times. For the BQL and recursive mutexes (i.e. AioContext locks) we
+ * also track for how long the lock is held after being acquired at the call
+ * site, which tells who is keeping everybody else waiting.
+ *
  * Alternative designs considered:
  *
  * - Use an off-the-shelf profiler such as mutrace. This is not a viable option
@@ -62,6 +67,7 @@
 #include "qemu/qht.h"
 #include "qemu/rcu.h"
 #include "exec/tb-hash-xx.h"
+#include "qapi/qapi-types-misc.h"
 
 enum QSPType {
     QSP_MUTEX,
@@ -78,11 +84,24 @@ struct QSPCallSite {
 };
 typedef struct QSPCallSite QSPCallSite;
 
+/*
+ * Histogram bucket 0 counts times below 1 << QSP_HIST_SHIFT ns, bucket i
+ * those below 1 << (QSP_HIST_SHIFT + i) ns, and the last bucket everything
+ * else.
+ */
+#define QSP_HIST_SHIFT   10
+#define QSP_HIST_BUCKETS 24
+
 struct QSPEntry {
     void *thread_ptr;
     const QSPCallSite *callsite;
     uint64_t n_acqs;
     uint64_t ns;
+    uint64_t wait_hist[QSP_HIST_BUCKETS];
+    /* only updated for the types whose hold time we track */
+    uint64_t n_holds;
+    uint64_t hold_ns;
+    uint64_t hold_hist[QSP_HIST_BUCKETS];
     unsigned int n_objs; /* count of coalesced objs; only used for reporting */
 };
 typedef struct QSPEntry QSPEntry;
@@ -105,6 +124,30 @@ static size_t qsp_qemu_path_len;
 /* the address of qsp_thread gives us a unique 'thread ID' */
 static __thread int qsp_thread;
 
+/*
+ * Locks whose hold time is being measured, per thread. Recursive mutexes
+ * are accounted for on the outermost acquisition only.
+ */
+#define QSP_MAX_HELD 8
+
+struct QSPHeld {
+    const void *obj;
+    QSPEntry *e;
+    int64_t t0;
+    unsigned int depth;
+};
+typedef struct QSPHeld QSPHeld;
+
+static __thread QSPHeld qsp_held[QSP_MAX_HELD];
+static __thread unsigned int qsp_n_held;
+static __thread unsigned int qsp_held_gen;
+
+/*
+ * Bumped whenever profiling is enabled, so that threads forget about the
+ * locks they took while it was disabled.
+ */
+static unsigned int qsp_gen;
+
 /*
  * Call sites are the same for all threads, so we track them in a separate hash
  * table to save memory.
@@ -123,11 +166,13 @@ static const char * const qsp_typenames[] = {
 };
 
 QemuMutexLockFunc qemu_bql_mutex_lock_func = qemu_mutex_lock_impl;
+QemuMutexUnlockFunc qemu_bql_mutex_unlock_func = qemu_mutex_unlock_impl;
 QemuMutexLockFunc qemu_mutex_lock_func = qemu_mutex_lock_impl;
 QemuMutexTrylockFunc qemu_mutex_trylock_func = qemu_mutex_trylock_impl;
 QemuRecMutexLockFunc qemu_rec_mutex_lock_func = qemu_rec_mutex_lock_impl;
 QemuRecMutexTrylockFunc qemu_rec_mutex_trylock_func =
     qemu_rec_mutex_trylock_impl;
+QemuRecMutexUnlockFunc qemu_rec_mutex_unlock_func = qemu_rec_mutex_unlock_impl;
 QemuCondWaitFunc qemu_cond_wait_func = qemu_cond_wait_impl;
 
 /*
@@ -337,15 +382,30 @@ static QSPEntry *qsp_entry_get(const void *obj, const char *file, int line,
     return qsp_entry_find(&qsp_ht, &orig, hash);
 }
 
+static inline unsigned int qsp_hist_bucket(uint64_t ns)
+{
+    unsigned int b = 64 - clz64(ns >> QSP_HIST_SHIFT);
+
+    return MIN(b, QSP_HIST_BUCKETS - 1);
+}
+
 /*
  * @e is in the global hash table; it is only written to by the current thread,
  * so we write to it atomically (as in "write once") to prevent torn reads.
  */
+static inline void qsp_hist_record(uint64_t *hist, int64_t delta)
+{
+    uint64_t *p = &hist[qsp_hist_bucket(delta)];
+
+    atomic_set_u64(p, *p + 1);
+}
+
 static inline void do_qsp_entry_record(QSPEntry *e, int64_t delta, bool acq)
 {
     atomic_set_u64(&e->ns, e->ns + delta);
     if (acq) {
         atomic_set_u64(&e->n_acqs, e->n_acqs + 1);
+        qsp_hist_record(e->wait_hist, delta);
     }
 }
 
@@ -354,7 +414,69 @@ static inline void qsp_entry_record(QSPEntry *e, int64_t delta)
     do_qsp_entry_record(e, delta, true);
 }
 
-#define QSP_GEN_VOID(type_, qsp_t_, func_, impl_)                       \
+static QSPHeld *qsp_held_find(const void *obj)
+{
+    unsigned int i;
+
+    for (i = 0; i < qsp_n_held; i++) {
+        if (qsp_held[i].obj == obj) {
+            return &qsp_held[i];
+        }
+    }
+    return NULL;
+}
+
+/* @obj has just been acquired at the call site of @e */
+static void qsp_hold_begin(const void *obj, QSPEntry *e, int64_t t0)
+{
+    unsigned int gen = atomic_read(&qsp_gen);
+    QSPHeld *h;
+
+    if (unlikely(qsp_held_gen != gen)) {
+        qsp_held_gen = gen;
+        qsp_n_held = 0;
+    }
+    h = qsp_held_find(obj);
+    if (h) {
+        h->depth++;
+        return;
+    }
+    if (unlikely(qsp_n_held == QSP_MAX_HELD)) {
+        return;
+    }
+    h = &qsp_held[qsp_n_held++];
+    h->obj = obj;
+    h->e = e;
+    h->t0 = t0;
+    h->depth = 1;
+}
+
+/* Returns true if @obj is no longer held by this thread */
+static bool qsp_hold_end(const void *obj, int64_t t1)
+{
+    QSPHeld *h;
+    QSPEntry *e;
+    int64_t delta;
+
+    if (unlikely(qsp_held_gen != atomic_read(&qsp_gen))) {
+        return false;
+    }
+    h = qsp_held_find(obj);
+    if (h == NULL || --h->depth) {
+        return false;
+    }
+
+    e = h->e;
+    delta = t1 - h->t0;
+    atomic_set_u64(&e->hold_ns, e->hold_ns + delta);
+    atomic_set_u64(&e->n_holds, e->n_holds + 1);
+    qsp_hist_record(e->hold_hist, delta);
+
+    *h = qsp_held[--qsp_n_held];
+    return true;
+}
+
+#define QSP_GEN_VOID(type_, qsp_t_, func_, impl_, hold_)                \
     static void func_(type_ *obj, const char *file, int line)           \
     {                                                                   \
         QSPEntry *e;                                                    \
@@ -366,9 +488,12 @@ static inline void qsp_entry_record(QSPEntry *e, int64_t delta)
                                                                         \
         e = qsp_entry_get(obj, file, line, qsp_t_);                     \
         qsp_entry_record(e, t1 - t0);                                   \
+        if (hold_) {                                                    \
+            qsp_hold_begin(obj, e, t1);                                 \
+        }                                                               \
     }
 
-#define QSP_GEN_RET1(type_, qsp_t_, func_, impl_)                       \
+#define QSP_GEN_RET1(type_, qsp_t_, func_, impl_, hold_)                \
     static int func_(type_ *obj, const char *file, int line)            \
     {                                                                   \
         QSPEntry *e;                                                    \
@@ -381,18 +506,33 @@ static inline void qsp_entry_record(QSPEntry *e, int64_t delta)
                                                                         \
         e = qsp_entry_get(obj, file, line, qsp_t_);                     \
         do_qsp_entry_record(e, t1 - t0, !err);                          \
+        if (hold_ && !err) {                                            \
+            qsp_hold_begin(obj, e, t1);                                 \
+        }                                                               \
         return err;                                                     \
     }
 
-QSP_GEN_VOID(QemuMutex, QSP_BQL_MUTEX, qsp_bql_mutex_lock, qemu_mutex_lock_impl)
-QSP_GEN_VOID(QemuMutex, QSP_MUTEX, qsp_mutex_lock, qemu_mutex_lock_impl)
-QSP_GEN_RET1(QemuMutex, QSP_MUTEX, qsp_mutex_trylock, qemu_mutex_trylock_impl)
+#define QSP_GEN_UNLOCK(type_, func_, impl_)                             \
+    static void func_(type_ *obj, const char *file, int line)           \
+    {                                                                   \
+        qsp_hold_end(obj, get_clock());                                 \
+        impl_(obj, file, line);                                         \
+    }
+
+QSP_GEN_VOID(QemuMutex, QSP_BQL_MUTEX, qsp_bql_mutex_lock, qemu_mutex_lock_impl,
+             true)
+QSP_GEN_UNLOCK(QemuMutex, qsp_bql_mutex_unlock, qemu_mutex_unlock_impl)
+QSP_GEN_VOID(QemuMutex, QSP_MUTEX, qsp_mutex_lock, qemu_mutex_lock_impl, false)
+QSP_GEN_RET1(QemuMutex, QSP_MUTEX, qsp_mutex_trylock, qemu_mutex_trylock_impl,
+             false)
 
 QSP_GEN_VOID(QemuRecMutex, QSP_REC_MUTEX, qsp_rec_mutex_lock,
-             qemu_rec_mutex_lock_impl)
+             qemu_rec_mutex_lock_impl, true)
 QSP_GEN_RET1(QemuRecMutex, QSP_REC_MUTEX, qsp_rec_mutex_trylock,
-             qemu_rec_mutex_trylock_impl)
+             qemu_rec_mutex_trylock_impl, true)
+QSP_GEN_UNLOCK(QemuRecMutex, qsp_rec_mutex_unlock, qemu_rec_mutex_unlock_impl)
 
+#undef QSP_GEN_UNLOCK
 #undef QSP_GEN_RET1
 #undef QSP_GEN_VOID
 
@@ -401,13 +541,20 @@ qsp_cond_wait(QemuCond *cond, QemuMutex *mutex, const char *file, int line)
 {
     QSPEntry *e;
     int64_t t0, t1;
+    bool held;
 
     t0 = get_clock();
+    /* the mutex is released while waiting; this ends a BQL hold, if any */
+    held = qsp_hold_end(mutex, t0);
     qemu_cond_wait_impl(cond, mutex, file, line);
     t1 = get_clock();
 
     e = qsp_entry_get(cond, file, line, QSP_CONDVAR);
     qsp_entry_record(e, t1 - t0);
+    if (held) {
+        e = qsp_entry_get(mutex, file, line, QSP_BQL_MUTEX);
+        qsp_hold_begin(mutex, e, t1);
+    }
 }
 
 bool qsp_is_enabled(void)
@@ -417,11 +564,14 @@ bool qsp_is_enabled(void)
 
 void qsp_enable(void)
 {
+    atomic_inc(&qsp_gen);
     atomic_set(&qemu_mutex_lock_func, qsp_mutex_lock);
     atomic_set(&qemu_mutex_trylock_func, qsp_mutex_trylock);
     atomic_set(&qemu_bql_mutex_lock_func, qsp_bql_mutex_lock);
+    atomic_set(&qemu_bql_mutex_unlock_func, qsp_bql_mutex_unlock);
     atomic_set(&qemu_rec_mutex_lock_func, qsp_rec_mutex_lock);
     atomic_set(&qemu_rec_mutex_trylock_func, qsp_rec_mutex_trylock);
+    atomic_set(&qemu_rec_mutex_unlock_func, qsp_rec_mutex_unlock);
     atomic_set(&qemu_cond_wait_func, qsp_cond_wait);
 }
 
@@ -430,8 +580,10 @@ void qsp_disable(void)
     atomic_set(&qemu_mutex_lock_func, qemu_mutex_lock_impl);
     atomic_set(&qemu_mutex_trylock_func, qemu_mutex_trylock_impl);
     atomic_set(&qemu_bql_mutex_lock_func, qemu_mutex_lock_impl);
+    atomic_set(&qemu_bql_mutex_unlock_func, qemu_mutex_unlock_impl);
     atomic_set(&qemu_rec_mutex_lock_func, qemu_rec_mutex_lock_impl);
     atomic_set(&qemu_rec_mutex_trylock_func, qemu_rec_mutex_trylock_impl);
+    atomic_set(&qemu_rec_mutex_unlock_func, qemu_rec_mutex_unlock_impl);
     atomic_set(&qemu_cond_wait_func, qemu_cond_wait_impl);
 }
 
@@ -463,6 +615,13 @@ static gint qsp_tree_cmp(gconstpointer ap, gconstpointer bp, gpointer up)
         }
         break;
     }
+    case QSP_SORT_BY_TOTAL_HOLD_TIME:
+        if (a->hold_ns > b->hold_ns) {
+            return -1;
+        } else if (a->hold_ns < b->hold_ns) {
+            return 1;
+        }
+        break;
     default:
         g_assert_not_reached();
     }
@@ -503,6 +662,24 @@ static void qsp_sort(void *p, uint32_t h, void *userp)
     g_tree_insert(tree, e, NULL);
 }
 
+/*
+ * @from might be in the global hash table; read from it atomically (as in
+ * "read once").
+ */
+static void qsp_entry_add(QSPEntry *to, const QSPEntry *from)
+{
+    int i;
+
+    to->ns += atomic_read_u64(&from->ns);
+    to->n_acqs += atomic_read_u64(&from->n_acqs);
+    to->hold_ns += atomic_read_u64(&from->hold_ns);
+    to->n_holds += atomic_read_u64(&from->n_holds);
+    for (i = 0; i < QSP_HIST_BUCKETS; i++) {
+        to->wait_hist[i] += atomic_read_u64(&from->wait_hist[i]);
+        to->hold_hist[i] += atomic_read_u64(&from->hold_hist[i]);
+    }
+}
+
 static void qsp_aggregate(void *p, uint32_t h, void *up)
 {
     struct qht *ht = up;
@@ -512,12 +689,7 @@ static void qsp_aggregate(void *p, uint32_t h, void *up)
 
     hash = qsp_entry_no_thread_hash(e);
     agg = qsp_entry_find(ht, e, hash);
-    /*
-     * The entry is in the global hash table; read from it atomically (as in
-     * "read once").
-     */
-    agg->ns += atomic_read_u64(&e->ns);
-    agg->n_acqs += atomic_read_u64(&e->n_acqs);
+    qsp_entry_add(agg, e);
 }
 
 static void qsp_iter_diff(void *p, uint32_t hash, void *htp)
@@ -525,6 +697,7 @@ static void qsp_iter_diff(void *p, uint32_t hash, void *htp)
     struct qht *ht = htp;
     QSPEntry *old = p;
     QSPEntry *new;
+    int i;
 
     new = qht_lookup(ht, old, hash);
     /* entries are never deleted, so we must have this one */
@@ -532,12 +705,21 @@ static void qsp_iter_diff(void *p, uint32_t hash, void *htp)
     /* our reading of the stats happened after the snapshot was taken */
     g_assert(new->n_acqs >= old->n_acqs);
     g_assert(new->ns >= old->ns);
+    g_assert(new->n_holds >= old->n_holds);
+    g_assert(new->hold_ns >= old->hold_ns);
 
     new->n_acqs -= old->n_acqs;
     new->ns -= old->ns;
+    new->n_holds -= old->n_holds;
+    new->hold_ns -= old->hold_ns;
+    for (i = 0; i < QSP_HIST_BUCKETS; i++) {
+        new->wait_hist[i] -= old->wait_hist[i];
+        new->hold_hist[i] -= old->hold_hist[i];
+    }
 
     /* No point in reporting an empty entry */
-    if (new->n_acqs == 0 && new->ns == 0) {
+    if (new->n_acqs == 0 && new->ns == 0 &&
+        new->n_holds == 0 && new->hold_ns == 0) {
         bool removed = qht_remove(ht, new, hash);
 
         g_assert(removed);
@@ -565,8 +747,7 @@ static void qsp_iter_callsite_coalesce(void *p, uint32_t h, void *htp)
     } else if (e->callsite->obj != old->callsite->obj) {
         e->n_objs++;
     }
-    e->ns += old->ns;
-    e->n_acqs += old->n_acqs;
+    qsp_entry_add(e, old);
 }
 
 static void qsp_ht_delete(void *p, uint32_t h, void *htp)
@@ -644,6 +825,7 @@ struct QSPReportEntry {
     const char *typename;
     double time_s;
     double ns_avg;
+    double hold_s;
     uint64_t n_acqs;
     unsigned int n_objs;
 };
@@ -675,6 +857,7 @@ static gboolean qsp_tree_report(gpointer key, gpointer value, gpointer udata)
     entry->time_s = e->ns * 1e-9;
     entry->n_acqs = e->n_acqs;
     entry->ns_avg = e->n_acqs ? e->ns / e->n_acqs : 0;
+    entry->hold_s = e->hold_ns * 1e-9;
     return FALSE;
 }
 
@@ -703,10 +886,10 @@ pr_report(const QSPReport *rep, FILE *f, fprintf_function pr)
     callsite_rspace = callsite_len - strlen("Call site");
 
     pr(f, "Type               Object  Call site%*s  Wait Time (s)  "
-       "       Count  Average (us)\n", callsite_rspace, "");
+       "       Count  Average (us)  Hold Time (s)\n", callsite_rspace, "");
 
     /* build a horizontal rule with dashes */
-    n_dashes = 79 + callsite_rspace;
+    n_dashes = 94 + callsite_rspace;
     dashes = g_malloc(n_dashes + 1);
     memset(dashes, '-', n_dashes);
     dashes[n_dashes] = '\0';
@@ -722,10 +905,12 @@ pr_report(const QSPReport *rep, FILE *f, fprintf_function pr)
         } else {
             g_string_append_printf(s, "%14p", e->obj);
         }
-        g_string_append_printf(s, "  %s%*s  %13.5f  %12" PRIu64 "  %12.2f\n",
+        g_string_append_printf(s, "  %s%*s  %13.5f  %12" PRIu64 "  %12.2f"
+                               "  %13.5f\n",
                                e->callsite_at,
                                callsite_len - (int)strlen(e->callsite_at), "",
-                               e->time_s, e->n_acqs, e->ns_avg * 1e-3);
+                               e->time_s, e->n_acqs, e->ns_avg * 1e-3,
+                               e->hold_s);
         pr(f, "%s", s->str);
         g_string_free(s, TRUE);
     }
@@ -766,6 +951,91 @@ void qsp_report(FILE *f, fprintf_function cpu_fprintf, size_t max,
     report_destroy(&rep);
 }
 
+static const SyncProfileType qsp_qapi_types[] = {
+    [QSP_MUTEX]     = SYNC_PROFILE_TYPE_MUTEX,
+    [QSP_BQL_MUTEX] = SYNC_PROFILE_TYPE_BQL_MUTEX,
+    [QSP_REC_MUTEX] = SYNC_PROFILE_TYPE_REC_MUTEX,
+    [QSP_CONDVAR]   = SYNC_PROFILE_TYPE_CONDVAR,
+};
+
+struct QSPQuery {
+    SyncProfileEntryList *head;
+    SyncProfileEntryList **tail;
+    size_t n_entries;
+    size_t max_n_entries;
+};
+typedef struct QSPQuery QSPQuery;
+
+static intList *qsp_hist_list(const uint64_t *hist)
+{
+    intList *head = NULL;
+    int i;
+
+    for (i = QSP_HIST_BUCKETS - 1; i >= 0; i--) {
+        intList *elem = g_new0(intList, 1);
+
+        elem->value = hist[i];
+        elem->next = head;
+        head = elem;
+    }
+    return head;
+}
+
+static gboolean qsp_tree_query(gpointer key, gpointer value, gpointer udata)
+{
+    const QSPEntry *e = key;
+    QSPQuery *query = udata;
+    SyncProfileEntry *info;
+    SyncProfileEntryList *elem;
+
+    if (query->n_entries == query->max_n_entries) {
+        return TRUE;
+    }
+    query->n_entries++;
+
+    info = g_new0(SyncProfileEntry, 1);
+    info->type = qsp_qapi_types[e->callsite->type];
+    info->callsite = qsp_at(e->callsite);
+    if (e->n_objs > 1) {
+        info->objects = e->n_objs;
+    } else {
+        info->has_object = true;
+        info->object = (uintptr_t)e->callsite->obj;
+        info->objects = 1;
+    }
+    info->acquisitions = e->n_acqs;
+    info->wait_ns = e->ns;
+    info->wait_histogram = qsp_hist_list(e->wait_hist);
+    info->holds = e->n_holds;
+    info->hold_ns = e->hold_ns;
+    info->hold_histogram = qsp_hist_list(e->hold_hist);
+
+    elem = g_new0(SyncProfileEntryList, 1);
+    elem->value = info;
+    *query->tail = elem;
+    query->tail = &elem->next;
+    return FALSE;
+}
+
+SyncProfileEntryList *qsp_query(size_t max, enum QSPSortBy sort_by,
+                                bool callsite_coalesce)
+{
+    GTree *tree = g_tree_new_full(qsp_tree_cmp, &sort_by, g_free, NULL);
+    QSPQuery query = {
+        .head = NULL,
+        .tail = &query.head,
+        .max_n_entries = max,
+    };
+
+    qsp_init();
+
+    qsp_mktree(tree, callsite_coalesce);
+    g_tree_foreach(tree, qsp_tree_query, &query);
+    g_tree_destroy(tree);
+
+    return query.head;
+}
+
 static void qsp_snapshot_destroy(QSPSnapshot *snap)
 {
     qht_iter(&snap->ht, qsp_ht_delete, NULL);